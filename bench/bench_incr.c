@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+/*
+
+INCR BENCHMARK
+
+Increments a counter of a document N times, first the way a client had to do it (read
+the document, change the number, write the whole document back), then with
+incr_document_field(), and prints the throughput of both. The same is then done for a
+small counter document (no padding), where a full rewrite is at its cheapest and the delta
+log has the least to win.
+
+usage: bench_incr [increments] [document size]
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/db_manager.h"
+#include "../src/patch.h"
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static char *make_document(int size, long long counter) {
+    char *content = malloc(size + 64);
+    int written = sprintf(content, "{\"counter\": %lld, \"pad\": \"", counter);
+    memset(content + written, 'x', size);
+    strcpy(content + written + size, "\"}");
+    return content;
+}
+
+// increments the counter of a document of `size` bytes of padding with both methods
+static void run(int increments, int size) {
+    // one document per method, update_document() doesn't go through the collection
+    Collection *collection = create_collection();
+    char *content = make_document(size, 0);
+    Document *doc = create_document(content);
+    Document *counter = create_document(content);
+    insert_document(collection, doc);
+    insert_document(collection, counter);
+    printf("document of %zu bytes\n", strlen(content));
+    free(content);
+
+    // read, parse the counter, rewrite the whole document
+    double start = now_us();
+    for (int i = 0; i < increments; i++) {
+        char *current = read_document(doc->id);
+        long long counter = strtoll(strstr(current, ":") + 1, NULL, 10);
+        char *updated = make_document(size, counter + 1);
+        update_document(doc->id, updated);
+        free(updated);
+        free(current);
+    }
+    double elapsed = now_us() - start;
+    printf("  read + update_document: %d increments in %.0f ms (%.0f/s)\n", increments, elapsed / 1000,
+           increments / (elapsed / 1e6));
+
+    start = now_us();
+    long long value = 0;
+    for (int i = 0; i < increments; i++) incr_document_field(collection, counter->id, "counter", 1, &value);
+    elapsed = now_us() - start;
+    printf("  incr_document_field:    %d increments in %.0f ms (%.0f/s), counter %lld\n", increments,
+           elapsed / 1000, increments / (elapsed / 1e6), value);
+
+    delete_document(doc->id);
+    delete_document(counter->id);
+    free_collection(collection);
+}
+
+int main(int argc, char *argv[]) {
+    int increments = argc > 1 ? atoi(argv[1]) : 20000;
+    int size = argc > 2 ? atoi(argv[2]) : 4096;
+    if (increments <= 0 || size < 0) {
+        fprintf(stderr, "usage %s [increments] [document size]\n", argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/fada_bench_XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) {
+        fprintf(stderr, "ERROR creating the benchmark directory\n");
+        return 1;
+    }
+
+    run(increments, size);
+    if (size > 0) run(increments, 0); // the small counter
+
+    if (chdir("/") == 0) rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+/*
+
+LOCAL TRANSPORT BENCHMARK
+
+Starts the server binary with one worker, listening on TCP and on a Unix domain socket
+(-u), and measures the round trip of `requests` small commands sent one at a time (each
+waits for the reply of the previous one) over a loopback TCP connection, over the Unix
+socket and over a shared memory channel attached through it (binary PING frames there).
+Prints the mean, median and 99th percentile latency of each transport.
+
+The channel client polls the response ring before it sleeps, which pays off only when the
+server has a core of its own: with a single CPU it sleeps at once, and every round trip
+costs two eventfd wakeups.
+
+usage: bench_local <server binary> [requests]
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../src/protocol.h"
+#include "../src/shm_ring.h"
+
+#define REQUEST "TTL bench\n" // a lookup of a missing document, answered ":-2\n"
+#define SOCKET_NAME "fada.sock"
+#define SPINS 20000           // polls of the response ring before sleeping
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int connect_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return fd;
+}
+
+static int connect_unix(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// round trips of one request at a time, their latencies sorted in `samples`
+static void measure(int fd, int requests, double *samples) {
+    char buffer[64];
+    size_t request_length = strlen(REQUEST);
+
+    for (int i = 0; i < requests; i++) {
+        double start = now_us();
+        if (write(fd, REQUEST, request_length) != (ssize_t)request_length) exit(1);
+
+        // the reply is one line
+        size_t received = 0;
+        while (received == 0 || buffer[received - 1] != '\n') {
+            ssize_t n = read(fd, buffer + received, sizeof(buffer) - received);
+            if (n <= 0) {
+                fprintf(stderr, "ERROR: the server closed the connection\n");
+                exit(1);
+            }
+            received += n;
+        }
+        samples[i] = now_us() - start;
+    }
+    qsort(samples, requests, sizeof(double), compare_doubles);
+}
+
+typedef struct {
+    ShmChannel *channel;
+    int wake_fd;       // written by the server
+    int notify_fd;     // written by us
+} Channel;
+
+static void wait_server(Channel *channel) {
+    struct pollfd fd = {.fd = channel->wake_fd, .events = POLLIN};
+    uint64_t count;
+    if (poll(&fd, 1, 1000) <= 0 || read(channel->wake_fd, &count, sizeof(count)) < 0) {
+        fprintf(stderr, "ERROR: no response on the channel\n");
+        exit(1);
+    }
+}
+
+// reads one response header (PING and ATTACH have no body), polling before sleeping
+static void read_response(Channel *channel, int spins) {
+    char header[PROTOCOL_HEADER_SIZE];
+    size_t received = 0;
+    for (int spin = 0; received < sizeof(header); spin++) {
+        size_t n = shm_ring_read(&channel->channel->responses, header + received, sizeof(header) - received);
+        received += n;
+        if (n == 0 && spin >= spins && shm_ring_arm_readable(&channel->channel->responses)) wait_server(channel);
+    }
+}
+
+// the same setup as the client's -s: OP_ATTACH with the region and the eventfds
+static bool attach(int fd, Channel *channel) {
+    channel->channel = create_shm_channel(0);
+    channel->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!channel->channel || channel->wake_fd < 0 || channel->notify_fd < 0) return false;
+
+    char frame[PROTOCOL_HEADER_SIZE + 2];
+    size_t size = encode_request(frame, sizeof(frame), OP_ATTACH, 0, "", 0, "", 0, 0);
+    int fds[3] = {channel->channel->fd, channel->notify_fd, channel->wake_fd};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {frame, size};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &message, 0) != (ssize_t)size) return false;
+
+    read_response(channel, 0);
+    return true;
+}
+
+static void measure_channel(Channel *channel, int requests, double *samples, int spins) {
+    char frame[PROTOCOL_HEADER_SIZE + 2];
+    size_t size = encode_request(frame, sizeof(frame), OP_PING, 1, "", 0, "", 0, 0);
+    ShmRing *ring = &channel->channel->requests;
+    uint64_t one = 1;
+
+    for (int i = 0; i < requests; i++) {
+        double start = now_us();
+        shm_ring_write(ring, frame, size);
+        if (shm_ring_wake_consumer(ring) && write(channel->notify_fd, &one, sizeof(one)) < 0) exit(1);
+        read_response(channel, spins);
+        samples[i] = now_us() - start;
+    }
+    qsort(samples, requests, sizeof(double), compare_doubles);
+}
+
+static void report(const char *name, const double *samples, int requests) {
+    double sum = 0;
+    for (int i = 0; i < requests; i++) sum += samples[i];
+    printf("%-6s %10.1f %10.1f %10.1f\n", name, sum / requests, samples[requests / 2],
+           samples[(int)(requests * 0.99)]);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage %s <server binary> [requests]\n", argv[0]);
+        return 1;
+    }
+    char binary[4096];
+    if (!realpath(argv[1], binary)) {
+        perror("ERROR finding the server binary");
+        return 1;
+    }
+    int requests = argc > 2 ? atoi(argv[2]) : 100000;
+    if (requests <= 0) {
+        fprintf(stderr, "usage %s <server binary> [requests]\n", argv[0]);
+        return 1;
+    }
+
+    // the server recovers the documents of its working directory, it gets an empty one
+    char dir[] = "/tmp/fada_bench_XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) {
+        fprintf(stderr, "ERROR creating the benchmark directory\n");
+        return 1;
+    }
+
+    int port = 20000 + getpid() % 20000;
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(binary, binary, port_arg, "-t", "1", "-u", SOCKET_NAME, (char *)NULL);
+        perror("ERROR starting the server");
+        _exit(1);
+    }
+
+    // ready once it accepts connections on both
+    int tcp = -1, local = -1;
+    for (int i = 0; i < 200 && (tcp < 0 || local < 0); i++) {
+        if (tcp < 0) tcp = connect_tcp(port);
+        if (local < 0) local = connect_unix(SOCKET_NAME);
+        if (tcp < 0 || local < 0) usleep(10000);
+    }
+    if (tcp < 0 || local < 0) {
+        fprintf(stderr, "ERROR: the server didn't start\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+
+    double *samples = malloc(sizeof(double) * requests);
+    if (!samples) return 1;
+
+    printf("%d requests, one at a time, latency in microseconds\n", requests);
+    printf("%-6s %10s %10s %10s\n", "", "mean", "median", "p99");
+    measure(tcp, requests, samples);
+    report("tcp", samples, requests);
+    measure(local, requests, samples);
+    report("unix", samples, requests);
+
+    // a session speaks one protocol, the channel gets a binary one of its own
+    Channel channel;
+    int session = connect_unix(SOCKET_NAME);
+    if (session < 0 || !attach(session, &channel)) {
+        fprintf(stderr, "ERROR attaching the shared memory channel\n");
+        return 1;
+    }
+    measure_channel(&channel, requests, samples, sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPINS : 0);
+    report("shm", samples, requests);
+
+    close(tcp);
+    close(local);
+    close(session);
+    free_shm_channel(channel.channel);
+    close(channel.wake_fd);
+    close(channel.notify_fd);
+    free(samples);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(SOCKET_NAME);
+    rmdir(dir);
+    return 0;
+}
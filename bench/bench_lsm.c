@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+/*
+
+LSM BENCHMARK
+
+Runs the same collection API (add_document, set_document, get_document, remove_document)
+on a collection of each storage mode: one file per document, then an LSMTree. Only a tenth
+of the bodies fit in maxmemory, so most finds reload a body from the storage. For each
+mode it prints the throughput of creates, updates and removes, the write amplification
+(bytes the storage wrote for each byte of user data, file system blocks included for the
+file mode) and the latency percentiles of finds. The tree syncs its write-ahead log on
+every write and the files aren't synced, the write rates compare with that in mind.
+
+usage: bench_lsm [documents] [value size]
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../src/db_manager.h"
+#include "../src/eviction.h"
+#include "../src/lsm.h"
+
+#define READS 20000
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latencies(const char *label, double *samples, int count) {
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("  %-22s p50 %7.2f us   p99 %7.2f us   max %8.2f us\n", label,
+           samples[count / 2], samples[count * 99 / 100], samples[count - 1]);
+}
+
+static void make_value(char *value, int size, int n) {
+    int written = snprintf(value, size, "{\"n\": %d, \"pad\": \"", n);
+    memset(value + written, 'x', size - written - 2);
+    strcpy(value + size - 2, "\"}");
+}
+
+static void report_rate(const char *label, int count, double elapsed) {
+    printf("  %-22s %d in %.0f ms (%.0f/s)\n", label, count, elapsed / 1000, count / (elapsed / 1e6));
+}
+
+// waits for the background compactions of the tree to settle
+static LSMStats settled_stats(LSMTree *tree) {
+    lsm_flush(tree);
+    LSMStats stats = lsm_stats(tree);
+    for (int i = 0; i < 100; i++) {
+        usleep(100000);
+        LSMStats later = lsm_stats(tree);
+        if (later.compactions == stats.compactions) break;
+        stats = later;
+    }
+    return lsm_stats(tree);
+}
+
+// `tree` NULL runs the file per document mode in the current directory
+static void bench_collection(const char *label, LSMTree *tree, int documents, int value_size,
+                             double *samples) {
+    char *value = malloc(value_size + 1);
+    char **ids = malloc(sizeof(char *) * documents);
+    Collection *collection = create_collection();
+    if (!value || !ids || !collection || !set_collection_storage(collection, tree)) {
+        fprintf(stderr, "ERROR preparing the %s collection\n", label);
+        exit(1);
+    }
+    set_collection_maxmemory(collection, (size_t)documents * value_size / 10, EVICT_LRU);
+    printf("%s\n", label);
+
+    double start = now_us();
+    for (int i = 0; i < documents; i++) {
+        make_value(value, value_size, i);
+        Document *doc = add_document(collection, value);
+        ids[i] = doc ? strdup(doc->id) : NULL;
+        if (!ids[i]) {
+            fprintf(stderr, "ERROR adding document %d\n", i);
+            exit(1);
+        }
+    }
+    report_rate("add_document", documents, now_us() - start);
+
+    start = now_us();
+    for (int i = 0; i < READS; i++) {
+        make_value(value, value_size, -i);
+        set_document(collection, ids[rand() % documents], value);
+    }
+    report_rate("set_document", READS, now_us() - start);
+
+    for (int i = 0; i < READS; i++) {
+        const char *id = ids[rand() % documents];
+        double t = now_us();
+        free(get_document(collection, id));
+        samples[i] = now_us() - t;
+    }
+    print_latencies("get_document", samples, READS);
+
+    if (tree) {
+        LSMStats stats = settled_stats(tree);
+        printf("  write amplification    %.2f (wal %lu, flush %lu, compaction %lu bytes for %lu user bytes)\n",
+               stats.write_amplification, stats.wal_bytes, stats.flush_bytes, stats.compaction_bytes,
+               stats.user_bytes);
+        printf("  files per level       ");
+        for (int level = 0; level < LSM_MAX_LEVELS; level++) printf(" %d", stats.files[level]);
+        printf("\n");
+    } else {
+        // what the file system allocated for the documents, not just their bytes
+        unsigned long allocated = 0;
+        for (int i = 0; i < documents; i++) {
+            char filename[300];
+            struct stat st;
+            snprintf(filename, sizeof(filename), "%s.json", ids[i]);
+            if (stat(filename, &st) == 0) allocated += st.st_blocks * 512;
+        }
+        unsigned long user_bytes = (unsigned long)documents * (value_size + 12);
+        printf("  write amplification    %.2f (%lu allocated bytes for %lu user bytes)\n",
+               (double)allocated / user_bytes, allocated, user_bytes);
+    }
+
+    start = now_us();
+    for (int i = 0; i < documents; i++) {
+        remove_document(collection, ids[i]);
+        free(ids[i]);
+    }
+    report_rate("remove_document", documents, now_us() - start);
+
+    free_collection(collection);
+    free(ids);
+    free(value);
+}
+
+static void remove_dir(const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char file[512];
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    if (dir) closedir(dir);
+    rmdir(path);
+}
+
+int main(int argc, char *argv[]) {
+    int documents = argc > 1 ? atoi(argv[1]) : 100000;
+    int value_size = argc > 2 ? atoi(argv[2]) : 200;
+    if (documents <= 0 || value_size < 32) {
+        fprintf(stderr, "usage %s [documents] [value size >= 32]\n", argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/fada_bench_XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) {
+        fprintf(stderr, "ERROR creating the benchmark directory\n");
+        return 1;
+    }
+
+    double *samples = malloc(sizeof(double) * READS);
+    srand(42);
+
+    if (mkdir("files", 0755) < 0 || chdir("files") < 0) {
+        fprintf(stderr, "ERROR preparing the files directory\n");
+        return 1;
+    }
+    bench_collection("file per document", NULL, documents, value_size, samples);
+    if (chdir("..") < 0) return 1;
+    rmdir("files");
+
+    LSMTree *tree = lsm_open("lsm");
+    if (!tree) {
+        fprintf(stderr, "ERROR opening the LSM tree\n");
+        return 1;
+    }
+    bench_collection("lsm", tree, documents, value_size, samples);
+    lsm_close(tree);
+
+    remove_dir("lsm");
+    if (chdir("/") == 0) rmdir(dir);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+/*
+
+SERVER SCALING BENCHMARK
+
+Starts the server binary with 1, 2, 4, ... worker threads up to the number of CPUs (pinned,
+-p), opens `connections` connections to it and keeps `depth` small commands in flight on
+each of them for `seconds` (pipelining: a client sends the next commands before the replies
+of the previous ones arrive), then prints the requests per second of every run and its
+speedup over a single worker.
+
+Every run is made twice, with the epoll backend and with the io_uring one (-b uring), on
+the same workload; for io_uring it also prints the requests served per io_uring_enter()
+call, from the server's STATS, which is how well a worker batches its system calls.
+
+Each connection asks for a key of its own, so with more than one worker the requests are
+spread over the shards like the keys of a real workload are: most are forwarded to the
+worker owning the key (see SHARDS in server.c), about one in `workers` runs where it
+arrived.
+
+The load comes from as many client threads as there are CPUs, each driving its share of
+the connections from its own epoll instance, so the clients compete with the server for
+the same cores: on a machine with few of them the speedup is understated.
+
+usage: bench_server <server binary> [connections] [seconds] [depth]
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define REQUEST "TTL bench%06u\n" // a lookup of a missing document, answered ":-2\n"
+#define REQUEST_LENGTH 16           // every request has the same length
+
+typedef struct {
+    int port;
+    int connections;
+    int first;          // number of the first of its connections, for their keys
+    int depth;          // requests in flight per connection
+    double seconds;
+    unsigned long replies;
+    pthread_t thread;
+} Client;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return fd;
+}
+
+// keeps `depth` requests in flight on each of its connections until the time is up
+static void *client_thread(void *arg) {
+    Client *client = arg;
+    int epfd = epoll_create1(0);
+    int *fds = malloc(sizeof(int) * client->connections);
+
+    // for each connection `depth` requests back to back, a prefix of them replaces the requests answered
+    size_t batch_length = REQUEST_LENGTH * client->depth;
+    char *batches = malloc(batch_length * client->connections + 1);
+
+    for (int i = 0; i < client->connections; i++) {
+        char *batch = batches + i * batch_length;
+        for (int j = 0; j < client->depth; j++) {
+            snprintf(batch + j * REQUEST_LENGTH, REQUEST_LENGTH + 1, REQUEST, (unsigned)(client->first + i) % 1000000);
+        }
+
+        fds[i] = connect_to(client->port);
+        if (fds[i] < 0) {
+            perror("ERROR connecting");
+            exit(1);
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = i};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event);
+        if (write(fds[i], batch, batch_length) < 0) exit(1);
+    }
+
+    struct epoll_event events[256];
+    char buffer[4096];
+    double end = now_s() + client->seconds;
+
+    while (now_s() < end) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            int connection = events[i].data.u32, fd = fds[connection];
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                fprintf(stderr, "ERROR: the server closed a connection\n");
+                exit(1);
+            }
+            // every reply ends with a newline, each one answered is replaced by a new request
+            int answered = 0;
+            for (ssize_t j = 0; j < length; j++) answered += buffer[j] == '\n';
+            client->replies += answered;
+            if (answered > 0 && write(fd, batches + connection * batch_length, REQUEST_LENGTH * answered) < 0) exit(1);
+        }
+    }
+
+    for (int i = 0; i < client->connections; i++) close(fds[i]);
+    free(fds);
+    free(batches);
+    close(epfd);
+    return NULL;
+}
+
+static pid_t start_server(const char *binary, const char *backend, int port, int threads) {
+    char port_arg[16], threads_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(binary, binary, port_arg, "-t", threads_arg, "-p", "-b", backend, (char *)NULL);
+        perror("ERROR starting the server");
+        _exit(1);
+    }
+
+    // ready once it accepts connections
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_to(port);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+// the io_uring_enter() calls of the server so far, from its STATS
+static unsigned long ring_enters(int port) {
+    int fd = connect_to(port);
+    char reply[1024];
+    ssize_t length = 0, n;
+    if (fd < 0 || write(fd, "STATS\n", 6) != 6) exit(1);
+    while (length < (ssize_t)sizeof(reply) - 1 && (n = read(fd, reply + length, sizeof(reply) - 1 - length)) > 0) {
+        length += n;
+        if (reply[length - 1] == '\n') break;
+    }
+    close(fd);
+    reply[length] = '\0';
+
+    char *field = strstr(reply, "ring_enters:");
+    return field ? strtoul(field + strlen("ring_enters:"), NULL, 10) : 0;
+}
+
+// requests per second, -1 if the server didn't start with this backend
+static double run(const char *binary, const char *backend, int port, int threads, int clients, int connections,
+                  int depth, double seconds, double *per_enter) {
+    pid_t pid = start_server(binary, backend, port, threads);
+    if (pid < 0) return -1;
+
+    Client *load = calloc(clients, sizeof(Client));
+    for (int i = 0, first = 0; i < clients; i++) {
+        load[i].port = port;
+        load[i].connections = connections / clients + (i < connections % clients);
+        load[i].first = first;
+        first += load[i].connections;
+        load[i].depth = depth;
+        load[i].seconds = seconds;
+        pthread_create(&load[i].thread, NULL, client_thread, &load[i]);
+    }
+
+    unsigned long replies = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(load[i].thread, NULL);
+        replies += load[i].replies;
+    }
+    free(load);
+
+    unsigned long enters = ring_enters(port);
+    *per_enter = enters > 0 ? (double)replies / enters : 0;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return replies / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage %s <server binary> [connections] [seconds] [depth]\n", argv[0]);
+        return 1;
+    }
+    char binary[4096];
+    if (!realpath(argv[1], binary)) {
+        perror("ERROR finding the server binary");
+        return 1;
+    }
+    int connections = argc > 2 ? atoi(argv[2]) : 256;
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+    int depth = argc > 4 ? atoi(argv[4]) : 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (connections <= 0 || seconds <= 0 || depth <= 0 || cpus <= 0) {
+        fprintf(stderr, "usage %s <server binary> [connections] [seconds] [depth]\n", argv[0]);
+        return 1;
+    }
+
+    // the server recovers the documents of its working directory, it gets an empty one
+    char dir[] = "/tmp/fada_bench_XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) {
+        fprintf(stderr, "ERROR creating the benchmark directory\n");
+        return 1;
+    }
+
+    int clients = connections < cpus ? connections : (int)cpus;
+    int port = 20000 + getpid() % 20000;
+    double single = 0, single_ring = 0, per_enter;
+
+    printf("%d connections, %d in flight each, %d client threads, %ld CPUs, %.0f s per run\n", connections, depth,
+           clients, cpus, seconds);
+    printf("%8s %14s %8s %14s %8s %14s\n", "workers", "epoll req/s", "speedup", "io_uring req/s", "speedup",
+           "req/enter");
+
+    for (int threads = 1; threads <= cpus; threads = threads * 2 > cpus && threads < cpus ? cpus : threads * 2) {
+        double rate = run(binary, "epoll", port++, threads, clients, connections, depth, seconds, &per_enter);
+        if (rate < 0) {
+            fprintf(stderr, "ERROR: the server didn't start\n");
+            return 1;
+        }
+        if (threads == 1) single = rate;
+        printf("%8d %14.0f %7.2fx", threads, rate, rate / single);
+
+        // a kernel without io_uring (or one filtering it) leaves the epoll figures alone
+        double ring_rate = run(binary, "uring", port++, threads, clients, connections, depth, seconds, &per_enter);
+        if (ring_rate < 0) {
+            printf(" %14s %8s %14s\n", "-", "-", "-");
+            continue;
+        }
+        if (threads == 1) single_ring = ring_rate;
+        printf(" %14.0f %7.2fx %14.1f\n", ring_rate, ring_rate / single_ring, per_enter);
+    }
+
+    rmdir(dir);
+    return 0;
+}
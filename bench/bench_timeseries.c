@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+/*
+
+TIME SERIES BENCHMARK
+
+Stores N metric samples (10 hosts, one sample every 10 s, a cpu gauge and a memory counter)
+once as Documents of a Collection and once in a time series collection, and prints the heap
+taken by each and the time of an hourly average over the whole range.
+
+usage: bench_timeseries [samples]
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+
+#include "../src/db_manager.h"
+#include "../src/timeseries.h"
+
+#define HOSTS 10
+#define START 1700000000000LL
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static size_t heap_used() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static int sample(char *content, long i) {
+    long step = i / HOSTS;
+    double cpu = 20 + (step % 600) / 10.0;
+    return sprintf(content, "{\"ts\": %lld, \"host\": \"host-%ld\", \"cpu\": %.1f, \"mem\": %ld}",
+                   START + step * 10000, i % HOSTS, cpu, 4096 + step / 100);
+}
+
+static void add_window(int64_t start, double value, size_t count, void *arg) {
+    (void)start;
+    (void)value;
+    (void)count;
+    (*(size_t *)arg)++;
+}
+
+int main(int argc, char *argv[]) {
+    long samples = argc > 1 ? atol(argv[1]) : 1000000;
+    char content[256], id[32];
+
+    size_t before = heap_used();
+    Collection *collection = create_collection();
+    for (long i = 0; i < samples; i++) {
+        sample(content, i);
+        sprintf(id, "sample-%ld", i);
+        insert_document(collection, load_document(strdup(id), strdup(content)));
+    }
+    size_t documents = heap_used() - before;
+
+    before = heap_used();
+    TimeSeriesCollection *tsc = open_timeseries_collection(NULL, "ts", "host", 0);
+    double start = now_us();
+    for (long i = 0; i < samples; i++) {
+        int length = sample(content, i);
+        ts_insert(tsc, content, length);
+    }
+    double insert_time = now_us() - start;
+    size_t series = heap_used() - before;
+
+    size_t windows = 0;
+    start = now_us();
+    for (int h = 0; h < HOSTS; h++) {
+        sprintf(id, "host-%d", h);
+        ts_downsample(tsc, id, "cpu", START, START + samples / HOSTS * 10000LL + 1, 3600000, TS_AVG,
+                      add_window, &windows);
+    }
+    double query_time = now_us() - start;
+
+    printf("%ld samples\n", samples);
+    printf("documents:   %8.1f bytes/sample\n", (double)documents / samples);
+    printf("time series: %8.1f bytes/sample (%.0fx less), %.0f inserts/s\n", (double)series / samples,
+           (double)documents / series, samples / (insert_time / 1e6));
+    printf("hourly cpu average of every host: %zu windows in %.2f ms\n", windows, query_time / 1e3);
+
+    free_timeseries_collection(tsc);
+    free_collection(collection);
+    return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db_manager.h"
+#include "buffer_pool.h"
+
+/*
+
+BUFFER POOL
+
+Disk-resident documents are cached in a fixed number of page-sized frames allocated once
+when the pool is created, so the memory used by the cache never changes at runtime.
+A page is identified by the path of its file and its page number; a page table (chained
+hash of frame indexes) maps it to its frame, so a hot page is served without any syscall.
+
+Victims are chosen with the clock-sweep algorithm: each frame has a reference bit set on
+every access, and the clock hand goes around the frames clearing the bits until it finds
+a frame that is unpinned and wasn't referenced since the last pass. It approximates LRU
+with a single bit per frame and no list to update on hits.
+
+A frame is pinned while someone reads its data (buffer_pool_pin) and can't be evicted
+until it is unpinned. With O_DIRECT the pages bypass the kernel page cache, so the pool
+is the only copy in memory; filesystems that don't support it fall back to buffered I/O.
+
+*/
+
+typedef struct {
+    char *path;          // file the page belongs to, NULL for free frames
+    unsigned long hash;  // hash of (path, page), kept for the page table
+    long page;           // page number inside the file
+    size_t length;       // valid bytes in the frame
+    int pins;
+    bool referenced;     // clock bit
+    int next;            // next frame in the same page table bucket, -1 at the end
+} BufferFrame;
+
+struct BufferPool {
+    BufferFrame *frames;
+    char *data;          // frame_count * BUFFER_PAGE_SIZE bytes, page aligned
+    int frame_count;
+    int *buckets;        // page table: first frame of each bucket, -1 if empty
+    int bucket_count;
+    int clock_hand;
+    long *extents;       // by path hash: pages of the biggest file seen with it, bounds invalidations
+    bool direct_io;
+    pthread_mutex_t lock;
+    unsigned long hits, misses, evictions;
+};
+
+// `path_hash` is hash_function() of the path, computed once for all its pages
+static unsigned long page_hash(unsigned long path_hash, long page) {
+    return path_hash * 31 + (unsigned long)page;
+}
+
+static long *path_extent(BufferPool *pool, unsigned long path_hash) {
+    return &pool->extents[path_hash & (pool->bucket_count - 1)];
+}
+
+static char *frame_data(BufferPool *pool, int frame) {
+    return pool->data + (size_t)frame * BUFFER_PAGE_SIZE;
+}
+
+BufferPool *create_buffer_pool(size_t memory, bool direct_io) {
+    int frame_count = memory / BUFFER_PAGE_SIZE;
+    if (frame_count < 1) return NULL;
+
+    BufferPool *pool = calloc(1, sizeof(BufferPool));
+    if (!pool) return NULL;
+
+    pool->frame_count = frame_count;
+    pool->bucket_count = 1;
+    while (pool->bucket_count < frame_count) pool->bucket_count <<= 1;
+
+    pool->frames = calloc(frame_count, sizeof(BufferFrame));
+    pool->buckets = malloc(sizeof(int) * pool->bucket_count);
+    pool->extents = calloc(pool->bucket_count, sizeof(long));
+    if (!pool->frames || !pool->buckets || !pool->extents ||
+        posix_memalign((void **)&pool->data, BUFFER_PAGE_SIZE, (size_t)frame_count * BUFFER_PAGE_SIZE) != 0) {
+        free(pool->frames);
+        free(pool->buckets);
+        free(pool->extents);
+        free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < pool->bucket_count; i++) pool->buckets[i] = -1;
+    for (int i = 0; i < frame_count; i++) pool->frames[i].next = -1;
+
+    pool->direct_io = direct_io;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+static int lookup_frame(BufferPool *pool, const char *path, long page, unsigned long hash) {
+    int frame = pool->buckets[hash & (pool->bucket_count - 1)];
+    while (frame >= 0) {
+        BufferFrame *f = &pool->frames[frame];
+        if (f->hash == hash && f->page == page && strcmp(f->path, path) == 0) return frame;
+        frame = f->next;
+    }
+    return -1;
+}
+
+static void unlink_frame(BufferPool *pool, int frame) {
+    BufferFrame *f = &pool->frames[frame];
+    int *link = &pool->buckets[f->hash & (pool->bucket_count - 1)];
+
+    while (*link != frame) link = &pool->frames[*link].next;
+    *link = f->next;
+
+    free(f->path);
+    f->path = NULL;
+    f->next = -1;
+    f->referenced = false;
+}
+
+// clock sweep, -1 when every frame is pinned
+static int find_victim(BufferPool *pool) {
+    for (int step = 0; step < pool->frame_count * 2; step++) {
+        int frame = pool->clock_hand;
+        BufferFrame *f = &pool->frames[frame];
+        pool->clock_hand = (pool->clock_hand + 1) % pool->frame_count;
+
+        if (f->pins > 0) continue;
+        if (f->referenced) {
+            f->referenced = false;
+            continue;
+        }
+
+        if (f->path) {
+            unlink_frame(pool, frame);
+            pool->evictions++;
+        }
+        return frame;
+    }
+    return -1;
+}
+
+static int open_page_file(BufferPool *pool, const char *path) {
+    if (pool->direct_io) {
+        int fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+        if (fd >= 0 || errno != EINVAL) return fd;
+    }
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// reads a page from an open file into a free frame and makes it visible, -1 on failure
+static int load_page(BufferPool *pool, int fd, const char *path, long page, unsigned long path_hash) {
+    unsigned long hash = page_hash(path_hash, page);
+    int frame = find_victim(pool);
+    if (frame < 0) return -1;
+
+    ssize_t n = pread(fd, frame_data(pool, frame), BUFFER_PAGE_SIZE, (off_t)page * BUFFER_PAGE_SIZE);
+    if (n < 0) return -1;
+
+    BufferFrame *f = &pool->frames[frame];
+    f->path = strdup(path);
+    if (!f->path) return -1;
+
+    f->hash = hash;
+    f->page = page;
+    f->length = n;
+    f->pins = 0;
+    f->referenced = true;
+
+    int bucket = hash & (pool->bucket_count - 1);
+    f->next = pool->buckets[bucket];
+    pool->buckets[bucket] = frame;
+
+    // paths sharing a slot share its bound, which can only be too high
+    long *extent = path_extent(pool, path_hash);
+    if (page + 1 > *extent) *extent = page + 1;
+    pool->misses++;
+    return frame;
+}
+
+// finds or loads a page, opening the file lazily through *fd; call with the lock held
+static int get_page(BufferPool *pool, const char *path, unsigned long path_hash, long page, int *fd) {
+    unsigned long hash = page_hash(path_hash, page);
+
+    int frame = lookup_frame(pool, path, page, hash);
+    if (frame >= 0) {
+        pool->frames[frame].referenced = true;
+        pool->hits++;
+        return frame;
+    }
+
+    if (*fd < 0) {
+        *fd = open_page_file(pool, path);
+        if (*fd < 0) return -1;
+    }
+    return load_page(pool, *fd, path, page, path_hash);
+}
+
+/*
+ * Returns a copy of the whole file, served from the frames for the pages already cached.
+ * The file is opened only if at least one page is missing. NULL if the file doesn't exist.
+ */
+char *buffer_pool_read(BufferPool *pool, const char *path, size_t *length) {
+    int fd = -1;
+    char *content = NULL;
+    size_t size = 0, capacity = 0;
+    unsigned long path_hash = hash_function(path);
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (long page = 0;; page++) {
+        int frame = get_page(pool, path, path_hash, page, &fd);
+        if (frame < 0) {
+            free(content);
+            content = NULL;
+            break;
+        }
+
+        BufferFrame *f = &pool->frames[frame];
+        if (size + f->length + 1 > capacity) {
+            capacity = capacity ? capacity * 2 : BUFFER_PAGE_SIZE + 1;
+            while (size + f->length + 1 > capacity) capacity *= 2;
+            char *bigger = realloc(content, capacity);
+            if (!bigger) {
+                free(content);
+                content = NULL;
+                break;
+            }
+            content = bigger;
+        }
+
+        memcpy(content + size, frame_data(pool, frame), f->length);
+        size += f->length;
+
+        // a short page is the last one of the file
+        if (f->length < BUFFER_PAGE_SIZE) break;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    if (fd >= 0) close(fd);
+
+    if (content) {
+        content[size] = '\0';
+        if (length) *length = size;
+    }
+    return content;
+}
+
+/*
+ * Pins a single page and exposes its frame: the data stays valid and in place until
+ * buffer_pool_unpin() is called with the returned frame. -1 if the page can't be loaded.
+ */
+int buffer_pool_pin(BufferPool *pool, const char *path, long page, const char **data, size_t *length) {
+    int fd = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    int frame = get_page(pool, path, hash_function(path), page, &fd);
+    if (frame >= 0) {
+        pool->frames[frame].pins++;
+        *data = frame_data(pool, frame);
+        *length = pool->frames[frame].length;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (fd >= 0) close(fd);
+    return frame;
+}
+
+void buffer_pool_unpin(BufferPool *pool, int frame) {
+    if (frame < 0 || frame >= pool->frame_count) return;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->frames[frame].pins > 0) pool->frames[frame].pins--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// drops every cached page of a file, to be called whenever the file is rewritten or removed
+void buffer_pool_invalidate(BufferPool *pool, const char *path) {
+    pthread_mutex_lock(&pool->lock);
+
+    unsigned long path_hash = hash_function(path);
+    long pages = *path_extent(pool, path_hash);
+    for (long page = 0; page < pages; page++) {
+        int frame = lookup_frame(pool, path, page, page_hash(path_hash, page));
+        if (frame < 0) continue;
+
+        // a pinned page keeps its data for the reader, it just stops being found
+        unlink_frame(pool, frame);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+BufferPoolStats buffer_pool_stats(BufferPool *pool) {
+    BufferPoolStats stats;
+
+    pthread_mutex_lock(&pool->lock);
+    stats.hits = pool->hits;
+    stats.misses = pool->misses;
+    stats.evictions = pool->evictions;
+    stats.frames = pool->frame_count;
+    stats.pinned = 0;
+    for (int i = 0; i < pool->frame_count; i++) {
+        if (pool->frames[i].pins > 0) stats.pinned++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    unsigned long total = stats.hits + stats.misses;
+    stats.hit_ratio = total ? (double)stats.hits / total : 0.0;
+    return stats;
+}
+
+void free_buffer_pool(BufferPool *pool) {
+    if (pool == NULL) return;
+
+    for (int i = 0; i < pool->frame_count; i++) {
+        free(pool->frames[i].path);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->frames);
+    free(pool->buckets);
+    free(pool->extents);
+    free(pool->data);
+    free(pool);
+}
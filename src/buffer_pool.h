@@ -0,0 +1,32 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BUFFER_PAGE_SIZE 4096
+
+/* Data Structures */
+
+typedef struct BufferPool BufferPool;
+
+typedef struct {
+    unsigned long hits;      // pages served from a frame
+    unsigned long misses;    // pages read from disk
+    unsigned long evictions; // valid pages dropped to make room
+    double hit_ratio;
+    int frames;
+    int pinned;              // frames currently pinned
+} BufferPoolStats;
+
+/* Functions */
+
+BufferPool *create_buffer_pool(size_t memory, bool direct_io);
+char *buffer_pool_read(BufferPool *pool, const char *path, size_t *length);
+int buffer_pool_pin(BufferPool *pool, const char *path, long page, const char **data, size_t *length);
+void buffer_pool_unpin(BufferPool *pool, int frame);
+void buffer_pool_invalidate(BufferPool *pool, const char *path);
+BufferPoolStats buffer_pool_stats(BufferPool *pool);
+void free_buffer_pool(BufferPool *pool);
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "db_manager.h"
+#include "capped.h"
+
+/*
+
+CAPPED COLLECTIONS
+
+Logs and feeds of recent events only need their last N documents (or last N bytes), in the
+order they were inserted. A capped collection stores them in a ring of fixed size, allocated
+once: an insert writes the document after the newest one and, when there's no room left,
+overwrites the oldest ones. Nothing is allocated or freed per document, no file is created
+or deleted, and a scan is a walk of the ring from the oldest record to the newest.
+
+The ring lives in <id>.capped, preallocated at creation and mapped in memory: inserts are
+memory copies, the kernel writes the pages back (capped_sync() forces it). The first page
+holds the ring state, so a collection is found as it was when it's opened again. With a
+NULL ID the ring is anonymous memory, nothing reaches the disk.
+
+Records are 8 byte aligned and never split: when the end of the ring is too short for the
+next one, a wrap mark is left there and the record goes at offset 0. Documents are
+identified by their sequence number; a fixed index of `slots` offsets, by seq % slots, finds
+any live one in O(1) without a hash table. The index also caps the number of documents: it
+holds max_documents entries, or one per CAPPED_SLOT_BYTES bytes of ring when only the bytes
+are capped.
+
+*/
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+#define WRAP_MARK UINT32_MAX // length of the record that sends readers back to offset 0
+
+static uint64_t record_size(size_t length) {
+    return ALIGN8(sizeof(CappedRecord) + length + 1);
+}
+
+static CappedRecord *record_at(CappedCollection *capped, uint64_t offset) {
+    return (CappedRecord *)(capped->ring + offset);
+}
+
+// offset of the record starting at or wrapping from `offset`
+static uint64_t follow_wrap(CappedCollection *capped, uint64_t offset) {
+    if (offset + sizeof(CappedRecord) > capped->header->capacity) return 0;
+    return record_at(capped, offset)->length == WRAP_MARK ? 0 : offset;
+}
+
+static void evict_oldest(CappedCollection *capped) {
+    CappedHeader *header = capped->header;
+    uint64_t size = record_size(record_at(capped, header->head)->length);
+
+    header->used -= size;
+    header->count--;
+    header->head = header->count ? follow_wrap(capped, header->head + size) : header->tail;
+}
+
+// rebuilds the index from the ring, records that don't check out end it (interrupted insert)
+static void rebuild_index(CappedCollection *capped) {
+    CappedHeader *header = capped->header;
+    uint64_t offset = header->head, used = 0;
+
+    for (uint64_t i = 0; i < header->count; i++) {
+        uint64_t seq = header->next_seq - header->count + i;
+        CappedRecord *record = record_at(capped, offset);
+        if (offset + sizeof(CappedRecord) > header->capacity || record->seq != seq ||
+            offset + record_size(record->length) > header->capacity) {
+            header->next_seq = seq;
+            header->count = i;
+            header->tail = offset;
+            break;
+        }
+        capped->offsets[seq % capped->slots] = offset;
+        used += record_size(record->length);
+        offset = follow_wrap(capped, offset + record_size(record->length));
+    }
+    header->used = used;
+    if (header->count == 0) header->head = header->tail;
+}
+
+/*
+ * Opens the capped collection `id`, creating it with a ring of `max_bytes` bytes and at
+ * most `max_documents` documents (0: as many as fit) if it doesn't exist. An existing
+ * collection keeps the caps it was created with.
+ */
+CappedCollection *open_capped_collection(const char *id, size_t max_bytes, size_t max_documents) {
+    CappedCollection *capped = calloc(1, sizeof(CappedCollection));
+    if (!capped) return NULL;
+    capped->fd = -1;
+    pthread_mutex_init(&capped->lock, NULL);
+
+    uint64_t capacity = ALIGN8(max_bytes);
+    capped->mapped = CAPPED_HEADER_SIZE + capacity;
+    void *map = MAP_FAILED;
+
+    if (id) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s" CAPPED_SUFFIX, id);
+        capped->id = strdup(id);
+        capped->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        struct stat st;
+        if (capped->id && capped->fd >= 0 && fstat(capped->fd, &st) == 0) {
+            if (st.st_size >= CAPPED_HEADER_SIZE) {
+                capped->mapped = st.st_size;
+            } else if (posix_fallocate(capped->fd, 0, capped->mapped) != 0 &&
+                       ftruncate(capped->fd, capped->mapped) < 0) {
+                capped->mapped = 0;
+            }
+            if (capped->mapped) {
+                map = mmap(NULL, capped->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, capped->fd, 0);
+            }
+        }
+    } else {
+        map = mmap(NULL, capped->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (map == MAP_FAILED) {
+        pthread_mutex_destroy(&capped->lock);
+        if (capped->fd >= 0) close(capped->fd);
+        free(capped->id);
+        free(capped);
+        return NULL;
+    }
+
+    capped->header = map;
+    capped->ring = (char *)map + CAPPED_HEADER_SIZE;
+    CappedHeader *header = capped->header;
+
+    if (header->magic != CAPPED_MAGIC) {
+        memset(header, 0, sizeof(CappedHeader));
+        header->capacity = capped->mapped - CAPPED_HEADER_SIZE;
+        header->max_documents = max_documents;
+        header->next_seq = 1;
+        header->magic = CAPPED_MAGIC;
+    }
+
+    capped->slots = header->max_documents ? header->max_documents : header->capacity / CAPPED_SLOT_BYTES;
+    if (capped->slots == 0) capped->slots = 1;
+    capped->offsets = malloc(sizeof(uint64_t) * capped->slots);
+
+    if (!capped->offsets || header->capacity != capped->mapped - CAPPED_HEADER_SIZE ||
+        header->head > header->capacity || header->tail > header->capacity || header->count > capped->slots) {
+        free_capped_collection(capped);
+        return NULL;
+    }
+
+    rebuild_index(capped);
+    return capped;
+}
+
+/*
+ * Appends a document, overwriting the oldest ones as needed. Returns its sequence number,
+ * 0 if it isn't valid JSON or is larger than the whole ring.
+ */
+uint64_t capped_insert(CappedCollection *capped, const char *content, size_t length) {
+    CappedHeader *header = capped->header;
+    uint64_t size = record_size(length);
+    if (size > header->capacity || length >= WRAP_MARK || !validate_json(content, length)) return 0;
+
+    pthread_mutex_lock(&capped->lock);
+
+    while (header->count >= capped->slots) evict_oldest(capped);
+    if (header->count == 0) header->head = header->tail = 0;
+
+    // the end of the ring is too short: what's left there goes, the record starts over at 0
+    if (header->tail + size > header->capacity) {
+        while (header->count > 0 && header->head >= header->tail) evict_oldest(capped);
+        if (header->tail + sizeof(CappedRecord) <= header->capacity) {
+            record_at(capped, header->tail)->length = WRAP_MARK;
+        }
+        header->tail = 0;
+        if (header->count == 0) header->head = 0;
+    }
+
+    // the oldest records in the way are overwritten
+    while (header->count > 0 && header->head >= header->tail && header->head < header->tail + size) {
+        evict_oldest(capped);
+    }
+
+    uint64_t seq = header->next_seq;
+    CappedRecord *record = record_at(capped, header->tail);
+    memcpy(record + 1, content, length);
+    ((char *)(record + 1))[length] = '\0';
+    record->seq = seq;
+    record->length = length;
+    record->reserved = 0;
+
+    // the state is updated once the record is complete
+    capped->offsets[seq % capped->slots] = header->tail;
+    if (header->count == 0) header->head = header->tail;
+    header->tail += size;
+    header->used += size;
+    header->count++;
+    header->next_seq++;
+
+    pthread_mutex_unlock(&capped->lock);
+    return seq;
+}
+
+// copy of a live document, NULL if it was overwritten or never existed
+char *capped_find(CappedCollection *capped, uint64_t seq, size_t *length) {
+    char *content = NULL;
+
+    pthread_mutex_lock(&capped->lock);
+    CappedHeader *header = capped->header;
+    if (seq >= header->next_seq - header->count && seq < header->next_seq) {
+        CappedRecord *record = record_at(capped, capped->offsets[seq % capped->slots]);
+        content = malloc(record->length + 1);
+        if (content) {
+            memcpy(content, record + 1, record->length + 1);
+            if (length) *length = record->length;
+        }
+    }
+    pthread_mutex_unlock(&capped->lock);
+
+    return content;
+}
+
+/*
+ * Calls `callback` on the documents from `from_seq` (or the oldest one still live) to the
+ * newest, in insertion order. The content points in the ring: inserts wait until the scan
+ * is over. Returns the number of documents visited.
+ */
+size_t capped_scan(CappedCollection *capped, uint64_t from_seq, CappedScanCallback callback, void *arg) {
+    size_t visited = 0;
+
+    pthread_mutex_lock(&capped->lock);
+    CappedHeader *header = capped->header;
+    uint64_t seq = header->next_seq - header->count;
+    if (from_seq > seq) seq = from_seq;
+
+    for (; seq < header->next_seq; seq++) {
+        CappedRecord *record = record_at(capped, capped->offsets[seq % capped->slots]);
+        visited++;
+        if (!callback(seq, (const char *)(record + 1), record->length, arg)) break;
+    }
+    pthread_mutex_unlock(&capped->lock);
+
+    return visited;
+}
+
+size_t capped_count(CappedCollection *capped) {
+    pthread_mutex_lock(&capped->lock);
+    size_t count = capped->header->count;
+    pthread_mutex_unlock(&capped->lock);
+    return count;
+}
+
+// writes the ring back to disk now
+bool capped_sync(CappedCollection *capped) {
+    if (capped->fd < 0) return true;
+    return msync(capped->header, capped->mapped, MS_SYNC) == 0;
+}
+
+void free_capped_collection(CappedCollection *capped) {
+    if (capped == NULL) return;
+
+    pthread_mutex_destroy(&capped->lock);
+    munmap(capped->header, capped->mapped);
+    if (capped->fd >= 0) close(capped->fd);
+    free(capped->offsets);
+    free(capped->id);
+    free(capped);
+}
+
+// deletes the file of a capped collection, which must not be open
+bool drop_capped_collection(const char *id) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" CAPPED_SUFFIX, id);
+    return unlink(filename) == 0;
+}
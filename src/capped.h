@@ -0,0 +1,61 @@
+#ifndef CAPPED_H
+#define CAPPED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define CAPPED_SUFFIX ".capped"
+#define CAPPED_MAGIC 0x44505043 // "CPPD"
+#define CAPPED_HEADER_SIZE 4096 // the ring starts one page into the file
+#define CAPPED_SLOT_BYTES 32    // without a document cap, one slot of the index per 32 bytes of ring
+
+/* Data Structures */
+
+// first page of the file, the ring state survives restarts
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t capacity;      // bytes of the ring
+    uint64_t max_documents; // 0 when only the bytes are capped
+    uint64_t head;          // offset of the oldest record
+    uint64_t tail;          // offset of the next record
+    uint64_t next_seq;      // sequence number of the next record, the oldest is next_seq - count
+    uint64_t count;         // records in the ring
+    uint64_t used;          // bytes taken by them
+} CappedHeader;
+
+// each record is 8 byte aligned, the content follows with a NUL terminator
+typedef struct {
+    uint64_t seq;
+    uint32_t length;
+    uint32_t reserved;
+} CappedRecord;
+
+typedef struct {
+    char *id;               // collection ID, NULL for a memory only collection
+    int fd;
+    CappedHeader *header;   // mapping of the whole file
+    size_t mapped;
+    char *ring;
+    uint64_t *offsets;      // ring offset of each live sequence number, by seq % slots
+    size_t slots;
+    pthread_mutex_t lock;
+} CappedCollection;
+
+// called for each document of a scan, returning false stops it
+typedef bool (*CappedScanCallback)(uint64_t seq, const char *content, size_t length, void *arg);
+
+/* Functions */
+
+CappedCollection *open_capped_collection(const char *id, size_t max_bytes, size_t max_documents);
+uint64_t capped_insert(CappedCollection *capped, const char *content, size_t length);
+char *capped_find(CappedCollection *capped, uint64_t seq, size_t *length);
+size_t capped_scan(CappedCollection *capped, uint64_t from_seq, CappedScanCallback callback, void *arg);
+size_t capped_count(CappedCollection *capped);
+bool capped_sync(CappedCollection *capped);
+void free_capped_collection(CappedCollection *capped);
+bool drop_capped_collection(const char *id);
+
+#endif // CAPPED_H
@@ -3,36 +3,146 @@
  * All rights reserved.
  */
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <netdb.h>
+#include <poll.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
+#include "protocol.h"
+#include "shm_ring.h"
+
+#define CLIENT_MAX_FRAME (PROTOCOL_HEADER_SIZE + 2 * 256 + 2) // largest frame build_request() makes
+#define CLIENT_SPINS 20000  // polls of the response ring before sleeping on the eventfd, with 2+ CPUs
+
+// with -s requests and responses go through shared memory, the socket only keeps the session
+static ShmChannel *channel;
+static int wake_fd = -1;    // written by the server: responses, or room for requests
+static int notify_fd = -1;  // written by us: requests, or room for responses
+static int spins_limit;     // on a single CPU spinning only delays the server
+
 void error(const char *msg){
     perror(msg);
     exit(0);
 }
 
-int main(int argc, char *argv[]){
-    int sockfd, portno, n;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
+static void notify_server(void){
+    uint64_t one = 1;
+    if (write(notify_fd, &one, sizeof(one)) < 0) error("ERROR notifying the server");
+}
 
-    char buffer[256];
-    if (argc < 3){
-        fprintf(stderr, "usage %s hostname port\n", argv[0]);
+// sleeps until the server writes wake_fd, exits if it closes the connection meanwhile
+static void wait_for_server(int sockfd){
+    struct pollfd fds[2] = {{.fd = wake_fd, .events = POLLIN}, {.fd = sockfd, .events = POLLIN}};
+    if (poll(fds, 2, -1) < 0) error("ERROR waiting for the server");
+
+    // its last responses (e.g. to QUIT) are still read after it closed
+    if (fds[1].revents && shm_ring_readable(&channel->responses) == 0) {
+        fprintf(stderr, "ERROR, connection closed by the server\n");
         exit(0);
     }
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) < 0) error("ERROR waiting for the server");
+}
+
+// writes a whole frame
+static void send_all(int sockfd, const char *buffer, size_t length){
+    while (length > 0) {
+        if (channel) {
+            size_t n = shm_ring_write(&channel->requests, buffer, length);
+            if (n > 0 && shm_ring_wake_consumer(&channel->requests)) notify_server();
+            if (n == 0 && shm_ring_arm_writable(&channel->requests)) wait_for_server(sockfd);
+            buffer += n;
+            length -= n;
+            continue;
+        }
+        ssize_t n = write(sockfd, buffer, length);
+        if (n < 0) error("ERROR writing to socket");
+        buffer += n;
+        length -= n;
+    }
+}
+
+// reads what the server sent, from the socket or the response ring
+static ssize_t receive(int sockfd, char *buffer, size_t length){
+    if (!channel) return read(sockfd, buffer, length);
 
-    portno = atoi(argv[2]);
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    for (int spins = 0; ; spins++) {
+        size_t n = shm_ring_read(&channel->responses, buffer, length);
+        if (n > 0) {
+            if (shm_ring_wake_producer(&channel->responses)) notify_server();
+            return n;
+        }
+        // a response on its way arrives without a system call, a late one wakes us
+        if (spins >= spins_limit && shm_ring_arm_readable(&channel->responses)) {
+            wait_for_server(sockfd);
+            spins = 0;
+        }
+    }
+}
+
+/*
+ * Turns a command typed by the user ("GET <id>", "INCR <id> <field> [n]", "DEL <id>",
+ * "EXPIRE <id> <seconds>", "TTL <id>", "TRUNCATE", "STATS", "PING", "exit") into a request frame.
+ * Returns the size of the frame, 0 if the command isn't valid.
+ */
+static size_t build_request(char *frame, size_t size, const char *line, uint32_t id, uint8_t *opcode){
+    char command[16] = "", key[PROTOCOL_MAX_KEY + 1] = "", field[PROTOCOL_MAX_FIELD + 1] = "";
+    long long argument = 0;
+    int fields = sscanf(line, "%15s %255s %255s %lld", command, key, field, &argument);
+    if (fields < 1) return 0;
+
+    if (strcmp(command, "GET") == 0 && fields >= 2) *opcode = OP_GET;
+    else if (strcmp(command, "DEL") == 0 && fields >= 2) *opcode = OP_DEL;
+    else if (strcmp(command, "TTL") == 0 && fields >= 2) *opcode = OP_TTL;
+    else if (strcmp(command, "TRUNCATE") == 0) *opcode = OP_TRUNCATE;
+    else if (strcmp(command, "STATS") == 0) *opcode = OP_STATS;
+    else if (strcmp(command, "PING") == 0) *opcode = OP_PING;
+    else if (strcmp(command, "exit") == 0 || strcmp(command, "QUIT") == 0) *opcode = OP_QUIT;
+    else if (strcmp(command, "INCR") == 0 && fields >= 3) {
+        *opcode = OP_INCR;
+        if (fields < 4) argument = 1;
+    } else if (strcmp(command, "EXPIRE") == 0 && fields >= 3) {
+        // the TTL travels in milliseconds
+        *opcode = OP_EXPIRE;
+        argument = strtoll(field, NULL, 10) * 1000;
+        field[0] = '\0';
+    } else {
+        return 0;
+    }
+
+    return encode_request(frame, size, *opcode, id, key, strlen(key), field, strlen(field), argument);
+}
+
+static void print_response(uint8_t opcode, const ProtocolResponse *response){
+    if (response->status == STATUS_NOT_FOUND) printf("Server: ERR not found\n");
+    else if (response->status == STATUS_ERROR) printf("Server: ERR refused\n");
+    else if (response->status == STATUS_UNKNOWN) printf("Server: ERR unknown command\n");
+    else if (opcode == OP_GET || opcode == OP_STATS)
+        printf("Server: %.*s\n", (int)response->body_length, response->body);
+    else if (opcode == OP_TTL) printf("Server: :%lld\n", response->value < 0 ? (long long)response->value :
+                                                           (long long)(response->value + 999) / 1000);
+    else if (opcode == OP_INCR || opcode == OP_EXPIRE || opcode == OP_TRUNCATE)
+        printf("Server: :%lld\n", (long long)response->value);
+    else if (opcode == OP_QUIT) printf("Server: exit\n");
+    else printf("Server: OK\n");
+}
+
+static int connect_tcp(const char *hostname, int portno){
+    struct sockaddr_in serv_addr;
+    struct hostent *server;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) error("ERROR opening socket");
 
-    server = gethostbyname(argv[1]);
+    server = gethostbyname(hostname);
     if(server == NULL){
         fprintf(stderr, "ERROR, no such host\n");
         exit(0);
@@ -47,26 +157,173 @@ int main(int argc, char *argv[]){
 
     if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
         error("ERROR connecting");
+    return sockfd;
+}
+
+// a server on this host started with -u <path>, no TCP in between
+static int connect_unix(const char *path){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR, socket path too long\n");
+        exit(0);
+    }
+    strcpy(addr.sun_path, path);
 
-    while (1) {
-        printf("client> ");
-        bzero(buffer, 256);
-        fgets(buffer, 255, stdin);
-        n = write(sockfd, buffer, strlen(buffer));
-        if (n < 0)
-            error("ERROR writing to socket");
-        
-        bzero(buffer, 256);
-        n = read(sockfd, buffer, 255);
-        if (n < 0)
-            error("ERROR reading from socket");
-        
-        printf("Server: %s\n", buffer);
-
-        if (strncmp("exit", buffer, 4) == 0) break;
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) error("ERROR opening socket");
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) error("ERROR connecting");
+    return sockfd;
+}
+
+/*
+ * Switches a Unix socket connection to a shared memory channel: the region and the two
+ * eventfds go to the server with an OP_ATTACH frame, its response comes back through the
+ * region if it took them, on the socket if it didn't.
+ */
+static void attach_channel(int sockfd){
+    spins_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CLIENT_SPINS : 0;
+    channel = create_shm_channel(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!channel || wake_fd < 0 || notify_fd < 0) error("ERROR creating the shared memory channel");
+
+    // notify_fd is the one the server waits on, wake_fd the one it writes
+    char frame[PROTOCOL_HEADER_SIZE + 2];
+    size_t size = encode_request(frame, sizeof(frame), OP_ATTACH, 0, "", 0, "", 0, 0);
+    int fds[3] = {channel->fd, notify_fd, wake_fd};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {frame, size};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sockfd, &message, 0) != (ssize_t)size) error("ERROR attaching the shared memory channel");
+
+    struct pollfd wait[2] = {{.fd = wake_fd, .events = POLLIN}, {.fd = sockfd, .events = POLLIN}};
+    while (shm_ring_arm_readable(&channel->responses)) {
+        if (poll(wait, 2, -1) < 0) error("ERROR attaching the shared memory channel");
+        if (wait[1].revents) {
+            fprintf(stderr, "ERROR, the server refused the shared memory channel\n");
+            exit(0);
+        }
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0) error("ERROR attaching the shared memory channel");
+    }
+
+    char response[PROTOCOL_HEADER_SIZE];
+    size_t received = 0;
+    while (received < sizeof(response)) received += receive(sockfd, response + received, sizeof(response) - received);
+    ProtocolResponse parsed;
+    if (parse_response(response, received, &parsed) <= 0 || parsed.status != STATUS_OK) {
+        fprintf(stderr, "ERROR, the server refused the shared memory channel\n");
+        exit(0);
+    }
+}
+
+int main(int argc, char *argv[]){
+    int sockfd, depth;
+
+    char buffer[256];
+    uint32_t request_id = 0;
+
+    if (argc < 3){
+        fprintf(stderr, "usage %s hostname port [depth]\n      %s -u|-s path [depth]\n", argv[0], argv[0]);
+        exit(0);
+    }
+
+    // with a depth > 1 commands are sent in batches of `depth`, then their responses are read
+    depth = argc > 3 ? atoi(argv[3]) : 1;
+    if (depth < 1){
+        fprintf(stderr, "usage %s hostname port [depth]\n      %s -u|-s path [depth]\n", argv[0], argv[0]);
+        exit(0);
+    }
+
+    // responses can carry whole documents, the buffer grows to fit them
+    size_t capacity = 4096, received = 0;
+    char *input = malloc(capacity);
+    char *frames = malloc((size_t)depth * CLIENT_MAX_FRAME);
+    uint8_t *opcodes = malloc(depth);
+    if (!input || !frames || !opcodes) error("ERROR allocating the buffers");
+
+    // -u: the Unix socket of a server on this host, -s: a shared memory channel set up through it
+    if (strcmp(argv[1], "-u") == 0 || strcmp(argv[1], "-s") == 0) sockfd = connect_unix(argv[2]);
+    else sockfd = connect_tcp(argv[1], atoi(argv[2]));
+    if (strcmp(argv[1], "-s") == 0) attach_channel(sockfd);
+
+    bool quit = false;
+    while (!quit) {
+        // the batch: up to `depth` frames written with a single write
+        size_t length = 0;
+        int pending = 0;
+        uint32_t first = request_id + 1;
+
+        while (pending < depth) {
+            if (depth == 1) printf("client> ");
+            bzero(buffer, 256);
+            if (fgets(buffer, 255, stdin) == NULL) {
+                quit = true;
+                break;
+            }
+
+            size_t size = build_request(frames + length, CLIENT_MAX_FRAME, buffer, request_id + 1, &opcodes[pending]);
+            if (size == 0) {
+                printf("usage: GET <id> | INCR <id> <field> [n] | DEL <id> | EXPIRE <id> <seconds> | TTL <id> | "
+                       "TRUNCATE | STATS | PING | exit\n");
+                continue;
+            }
+            request_id++;
+            length += size;
+            if (opcodes[pending++] == OP_QUIT) {
+                quit = true;
+                break;
+            }
+        }
+        if (pending == 0) break;
+        send_all(sockfd, frames, length);
+
+        for (int i = 0; i < pending; i++) {
+            // reads until the whole response is in the buffer
+            ProtocolResponse response;
+            ssize_t size;
+            while ((size = parse_response(input, received, &response)) == 0) {
+                if (received == capacity) {
+                    capacity *= 2;
+                    input = realloc(input, capacity);
+                    if (!input) error("ERROR allocating the receive buffer");
+                }
+                ssize_t n = receive(sockfd, input + received, capacity - received);
+                if (n < 0) error("ERROR reading from socket");
+                if (n == 0) {
+                    fprintf(stderr, "ERROR, connection closed by the server\n");
+                    exit(0);
+                }
+                received += n;
+            }
+
+            // responses come back in the order of the requests
+            if (size < 0 || response.id != first + i) {
+                fprintf(stderr, "ERROR, invalid response\n");
+                exit(0);
+            }
+
+            print_response(opcodes[i], &response);
+            memmove(input, input + size, received - size);
+            received -= size;
+        }
     }
 
     close(sockfd);
+    if (channel) {
+        free_shm_channel(channel);
+        close(wake_fd);
+        close(notify_fd);
+    }
+    free(input);
+    free(frames);
+    free(opcodes);
 
     return 0;
 }
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db_manager.h"
+#include "cuckoo_filter.h"
+
+/*
+
+CUCKOO FILTER
+
+Reads for IDs that don't exist should cost nothing: no index walk and, above all, no
+failing open() on disk. A cuckoo filter answers "definitely absent" or "maybe present"
+using 2 bytes per key, and unlike a Bloom filter it supports deletions, so removing a
+document from a collection removes its key from the filter too.
+
+Each key is reduced to a 16 bit fingerprint that can live in one of two buckets of 4 slots:
+i1 = hash(key) and i2 = i1 xor hash(fingerprint). The second bucket can be computed from the
+first and the fingerprint alone, which is what lets an insert into a full bucket "kick"
+an existing fingerprint to its alternate bucket, like cuckoo hashing does with keys.
+
+With 16 bit fingerprints and buckets of 4 the false positive rate is bounded by
+2 * 4 / 2^16 ~ 0.012% at full load.
+
+*/
+
+// murmur3 finalizer, spreads the bits of the djb2 hash over the whole word
+static unsigned long mix(unsigned long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint16_t fingerprint_of(unsigned long hash) {
+    uint16_t fp = (uint16_t)(hash >> 48);
+    return fp ? fp : 1; // 0 marks an empty slot
+}
+
+static size_t alternate_bucket(CuckooFilter *filter, size_t bucket, uint16_t fp) {
+    return (bucket ^ (size_t)mix(fp)) & (filter->bucket_count - 1);
+}
+
+CuckooFilter *create_cuckoo_filter(size_t capacity) {
+    CuckooFilter *filter = calloc(1, sizeof(CuckooFilter));
+    if (!filter) return NULL;
+
+    if (capacity < CUCKOO_MIN_CAPACITY) capacity = CUCKOO_MIN_CAPACITY;
+
+    filter->bucket_count = 1;
+    while (filter->bucket_count * CUCKOO_BUCKET_SIZE * CUCKOO_MAX_LOAD < capacity) {
+        filter->bucket_count <<= 1;
+    }
+
+    filter->slots = calloc(filter->bucket_count * CUCKOO_BUCKET_SIZE, sizeof(uint16_t));
+    if (!filter->slots) {
+        free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+// keys the filter can hold before its load goes beyond CUCKOO_MAX_LOAD
+size_t cuckoo_filter_capacity(CuckooFilter *filter) {
+    return filter->bucket_count * CUCKOO_BUCKET_SIZE * CUCKOO_MAX_LOAD;
+}
+
+static bool bucket_insert(CuckooFilter *filter, size_t bucket, uint16_t fp) {
+    uint16_t *slots = &filter->slots[bucket * CUCKOO_BUCKET_SIZE];
+    for (int i = 0; i < CUCKOO_BUCKET_SIZE; i++) {
+        if (slots[i] == 0) {
+            slots[i] = fp;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool bucket_contains(CuckooFilter *filter, size_t bucket, uint16_t fp) {
+    uint16_t *slots = &filter->slots[bucket * CUCKOO_BUCKET_SIZE];
+    for (int i = 0; i < CUCKOO_BUCKET_SIZE; i++) {
+        if (slots[i] == fp) return true;
+    }
+    return false;
+}
+
+static bool bucket_remove(CuckooFilter *filter, size_t bucket, uint16_t fp) {
+    uint16_t *slots = &filter->slots[bucket * CUCKOO_BUCKET_SIZE];
+    for (int i = 0; i < CUCKOO_BUCKET_SIZE; i++) {
+        if (slots[i] == fp) {
+            slots[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Returns false when the filter is too full to place the key: the caller is expected to
+ * rebuild a bigger filter. The filter is left unchanged in that case.
+ */
+bool cuckoo_filter_insert(CuckooFilter *filter, const char *key) {
+    unsigned long hash = mix(hash_function(key));
+    uint16_t fp = fingerprint_of(hash);
+    size_t i1 = hash & (filter->bucket_count - 1);
+    size_t i2 = alternate_bucket(filter, i1, fp);
+
+    if (bucket_insert(filter, i1, fp) || bucket_insert(filter, i2, fp)) {
+        filter->count++;
+        return true;
+    }
+
+    // kicks fingerprints around, remembering them to undo everything on failure
+    uint16_t kicked[CUCKOO_MAX_KICKS];
+    size_t positions[CUCKOO_MAX_KICKS];
+    size_t bucket = (hash >> 32) & 1 ? i1 : i2;
+
+    for (int kick = 0; kick < CUCKOO_MAX_KICKS; kick++) {
+        size_t slot = bucket * CUCKOO_BUCKET_SIZE + (rand() % CUCKOO_BUCKET_SIZE);
+        kicked[kick] = filter->slots[slot];
+        positions[kick] = slot;
+        filter->slots[slot] = fp;
+
+        fp = kicked[kick];
+        bucket = alternate_bucket(filter, bucket, fp);
+        if (bucket_insert(filter, bucket, fp)) {
+            filter->count++;
+            return true;
+        }
+    }
+
+    for (int kick = CUCKOO_MAX_KICKS - 1; kick >= 0; kick--) {
+        filter->slots[positions[kick]] = kicked[kick];
+    }
+    return false;
+}
+
+bool cuckoo_filter_contains(CuckooFilter *filter, const char *key) {
+    unsigned long hash = mix(hash_function(key));
+    uint16_t fp = fingerprint_of(hash);
+    size_t i1 = hash & (filter->bucket_count - 1);
+
+    filter->lookups++;
+    if (bucket_contains(filter, i1, fp) || bucket_contains(filter, alternate_bucket(filter, i1, fp), fp)) {
+        return true;
+    }
+    filter->negatives++;
+    return false;
+}
+
+// only keys that were inserted can be removed, or another key's fingerprint may go away
+bool cuckoo_filter_remove(CuckooFilter *filter, const char *key) {
+    unsigned long hash = mix(hash_function(key));
+    uint16_t fp = fingerprint_of(hash);
+    size_t i1 = hash & (filter->bucket_count - 1);
+
+    if (bucket_remove(filter, i1, fp) || bucket_remove(filter, alternate_bucket(filter, i1, fp), fp)) {
+        filter->count--;
+        return true;
+    }
+    return false;
+}
+
+// expected false positive rate at the current load
+double cuckoo_filter_fpr(CuckooFilter *filter) {
+    double load = (double)filter->count / (filter->bucket_count * CUCKOO_BUCKET_SIZE);
+    return 2.0 * CUCKOO_BUCKET_SIZE * load / 65536.0; // 2^16 fingerprints, see above
+}
+
+// fraction of lookups for absent keys that the filter failed to reject
+double cuckoo_filter_observed_fpr(CuckooFilter *filter) {
+    unsigned long absent = filter->negatives + filter->false_positives;
+    return absent ? (double)filter->false_positives / absent : 0.0;
+}
+
+void free_cuckoo_filter(CuckooFilter *filter) {
+    if (filter == NULL) return;
+
+    free(filter->slots);
+    free(filter);
+}
@@ -0,0 +1,35 @@
+#ifndef CUCKOO_FILTER_H
+#define CUCKOO_FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CUCKOO_BUCKET_SIZE 4      // fingerprints per bucket
+#define CUCKOO_MAX_KICKS 500      // relocations before an insert gives up
+#define CUCKOO_MAX_LOAD 0.90      // load factor that triggers a resize
+#define CUCKOO_MIN_CAPACITY 1024
+
+/* Data Structures */
+
+typedef struct {
+    uint16_t *slots;        // bucket_count * CUCKOO_BUCKET_SIZE fingerprints, 0 is empty
+    size_t bucket_count;    // power of two
+    size_t count;           // fingerprints stored
+    unsigned long lookups;
+    unsigned long negatives;       // lookups answered "definitely absent"
+    unsigned long false_positives; // "maybe present" answers that turned out wrong
+} CuckooFilter;
+
+/* Functions */
+
+CuckooFilter *create_cuckoo_filter(size_t capacity);
+bool cuckoo_filter_insert(CuckooFilter *filter, const char *key);
+bool cuckoo_filter_contains(CuckooFilter *filter, const char *key);
+bool cuckoo_filter_remove(CuckooFilter *filter, const char *key);
+size_t cuckoo_filter_capacity(CuckooFilter *filter);
+double cuckoo_filter_fpr(CuckooFilter *filter);
+double cuckoo_filter_observed_fpr(CuckooFilter *filter);
+void free_cuckoo_filter(CuckooFilter *filter);
+
+#endif // CUCKOO_FILTER_H
@@ -7,41 +7,20 @@
 #include <stdlib.h> 
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <jsmn.h>
 
-#define INITIAL_HASH_TABLE_SIZE 16
-#define MAX_TOKENS 160000
-
-/* Data Structures */
-typedef struct HashEntry HashEntry;
-
-typedef struct {
-    char *id;       // document ID
-    HashEntry *hash_id; // hash ID generated from the original ID
-    char *content;  // json
-} Document;
-
-typedef struct HashEntry {
-    char *key; // original document _id
-    unsigned long hash; // hash value calculated from the ID
-    Document *value; // doc reference
-    struct HashEntry *next; // to manage collisions with chaining
-} HashEntry;
-
-typedef struct {
-    char *id;
-    int size;
-    HashEntry **buckets; // array of pointers to HashEntry
-} HashTable;
-
-typedef struct {
-    Document **documents; // dynamic array of documents
-    HashTable *hashTable; // HashTable for the collection
-    char *id; // collection ID
-    int size;            // number of documents currently stored
-    int capacity;        // current capacity of the array
-} Collection;
+#include "db_manager.h"
+#include "eviction.h"
+#include "field_index.h"
+#include "patch.h"
+#include "write_buffer.h"
+#include "lazy_free.h"
+#include "expiry.h"
 
 /* Collection functions */
 
@@ -51,7 +30,9 @@ HashTable *create_hash_table(){
         return NULL;
     }
 
+    table->id = NULL;
     table->size = INITIAL_HASH_TABLE_SIZE;
+    table->count = 0;
     table->buckets = malloc(sizeof(HashEntry*) * table->size);
 
     if(!table->buckets){
@@ -88,6 +69,19 @@ unsigned long hash_function(const char *str){
     return hash;
 }
 
+/*
+ * Shard of `shards` owning the document `id`. The hash is mixed first: its low bits also
+ * pick the bucket inside the shard, and a shard taking every key with the same low bits
+ * would fill only a fraction of its buckets.
+ */
+int document_shard(const char *id, int shards) {
+    unsigned long long hash = hash_function(id);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (int)(hash % (unsigned)shards);
+}
+
 /*
 
 HASH ENTRY
@@ -121,6 +115,58 @@ void insert_into_hash_table(HashTable *table, HashEntry *entry) {
         entry->next = table->buckets[index];
     }
     table->buckets[index] = entry;
+    table->count++;
+}
+
+/*
+
+HASH TABLE RESIZE
+
+Buckets are chained lists, so lookups degrade linearly once the number of entries
+exceeds the number of buckets. When the load factor goes above 1 we rehash every
+entry into a table twice as big: entries keep their cached hash, so no key is hashed again.
+
+*/
+
+bool resize_hash_table(HashTable *table, int new_size) {
+    if (table == NULL || new_size <= 0) return false;
+
+    HashEntry **buckets = calloc(new_size, sizeof(HashEntry*));
+    if (!buckets) return false;
+
+    for (int i = 0; i < table->size; i++) {
+        HashEntry *entry = table->buckets[i];
+        while (entry != NULL) {
+            HashEntry *next = entry->next;
+            int index = entry->hash % new_size;
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = new_size;
+    return true;
+}
+
+// unlinks an entry from its bucket, the entry itself is not freed
+bool remove_from_hash_table(HashTable *table, HashEntry *entry) {
+    if (table == NULL || entry == NULL) return false;
+
+    HashEntry **link = &table->buckets[entry->hash % table->size];
+    while (*link != NULL) {
+        if (*link == entry) {
+            *link = entry->next;
+            entry->next = NULL;
+            table->count--;
+            return true;
+        }
+        link = &(*link)->next;
+    }
+
+    return false;
 }
 
 Collection *create_collection(){
@@ -136,15 +182,217 @@ Collection *create_collection(){
         return NULL;
     }
 
+    // Creates the negative lookup filter, resized as the collection grows
+    collection->filter = create_cuckoo_filter(CUCKOO_MIN_CAPACITY);
+    if(!collection->filter){
+        free_hash_table(collection->hashTable);
+        free(collection);
+        return NULL;
+    }
+
+    pthread_mutex_init(&collection->write_lock, NULL);
+    collection->expiry = NULL;
+    collection->lsm = NULL;
+
     // Initializes the documents array
+    collection->id = NULL;
     collection->documents = NULL;
     collection->size = 0;
     collection->capacity = 0;
+    collection->used_memory = 0;
+    collection->maxmemory = 0;
+    collection->policy = EVICT_LRU;
     return collection;
 }
 
+// replaces the cuckoo filter with one sized for `capacity` keys holding every document
+static bool rebuild_filter(Collection *collection, size_t capacity) {
+    while (1) {
+        CuckooFilter *filter = create_cuckoo_filter(capacity);
+        if (!filter) return false;
+
+        int i = 0;
+        while (i < collection->size && cuckoo_filter_insert(filter, collection->documents[i]->id)) i++;
+
+        if (i == collection->size) {
+            // the counters describe the collection, not a particular filter
+            if (collection->filter) {
+                filter->lookups = collection->filter->lookups;
+                filter->negatives = collection->filter->negatives;
+                filter->false_positives = collection->filter->false_positives;
+            }
+            free_cuckoo_filter(collection->filter);
+            collection->filter = filter;
+            return true;
+        }
+
+        free_cuckoo_filter(filter);
+        capacity *= 2;
+    }
+}
+
+// grows the documents array and the hash table so that at least `capacity`
+// documents fit without further reallocations (used by bulk loads)
+bool reserve_collection(Collection *collection, int capacity) {
+    if (collection == NULL) return false;
+
+    if (capacity > collection->capacity) {
+        Document **documents = realloc(collection->documents, sizeof(Document*) * capacity);
+        if (!documents) return false;
+
+        collection->documents = documents;
+        collection->capacity = capacity;
+    }
+
+    if (capacity > collection->hashTable->size) {
+        int new_size = collection->hashTable->size;
+        while (new_size < capacity) new_size *= 2;
+        if (!resize_hash_table(collection->hashTable, new_size)) return false;
+    }
+
+    if ((size_t)capacity > cuckoo_filter_capacity(collection->filter)) {
+        if (!rebuild_filter(collection, capacity)) return false;
+    }
+
+    return true;
+}
+
+bool insert_document(Collection *collection, Document *doc) {
+    if (collection == NULL || doc == NULL || doc->hash_id == NULL) return false;
+
+    if (collection->size == collection->capacity) {
+        int capacity = collection->capacity ? collection->capacity * 2 : INITIAL_HASH_TABLE_SIZE;
+        if (!reserve_collection(collection, capacity)) return false;
+    }
+
+    doc->slot = collection->size;
+    collection->documents[collection->size++] = doc;
+    insert_into_hash_table(collection->hashTable, doc->hash_id);
+
+    if ((size_t)collection->size > cuckoo_filter_capacity(collection->filter) ||
+        !cuckoo_filter_insert(collection->filter, doc->id)) {
+        rebuild_filter(collection, collection->size * 2);
+    }
+
+    // keeps the load factor below 1
+    if (collection->hashTable->count > collection->hashTable->size) {
+        resize_hash_table(collection->hashTable, collection->hashTable->size * 2);
+    }
+
+    if (doc->content) {
+        collection->used_memory += doc->length + 1;
+        touch_document(doc);
+        enforce_maxmemory(collection, doc);
+    }
+
+    return true;
+}
+
+Document *find_document(Collection *collection, const char *id) {
+    if (collection == NULL || id == NULL) return NULL;
+
+    // most lookups for missing IDs stop here, without walking the index
+    if (!cuckoo_filter_contains(collection->filter, id)) return NULL;
+
+    unsigned long hash = hash_function(id);
+    HashEntry *entry = collection->hashTable->buckets[hash % collection->hashTable->size];
+
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->key, id) == 0) {
+            // a document past its TTL is deleted by the first lookup that finds it
+            return expire_if_needed(collection, entry->value) ? NULL : entry->value;
+        }
+        entry = entry->next;
+    }
+
+    collection->filter->false_positives++;
+    return NULL;
+}
+
+/*
+ * Returns a copy of a document's content (to be freed by the caller), reloading it from
+ * disk if its body was evicted. IDs that aren't in the collection never reach the disk.
+ */
+char *get_document(Collection *collection, const char *id) {
+    const char *content = get_document_content(collection, find_document(collection, id));
+    return content ? strdup(content) : NULL;
+}
+
+// removes a document from the collection, its filter and its index, and deletes its file
+bool remove_document(Collection *collection, const char *id) {
+    Document *doc = find_document(collection, id);
+    if (doc == NULL) return false;
+
+    return discard_document(collection, doc);
+}
+
+// the same, for a document already found in the collection
+bool discard_document(Collection *collection, Document *doc) {
+    cancel_document_expiry(collection, doc);
+    cuckoo_filter_remove(collection->filter, doc->id);
+    remove_from_hash_table(collection->hashTable, doc->hash_id);
+
+    // the last document takes the free slot
+    Document *last = collection->documents[--collection->size];
+    collection->documents[doc->slot] = last;
+    last->slot = doc->slot;
+
+    if (doc->content) collection->used_memory -= doc->length + 1;
+
+    bool deleted = collection->lsm ? lsm_delete(collection->lsm, doc->id) : delete_document(doc->id);
+    free_hash_entry(doc->hash_id);
+    free_document(doc);
+    return deleted;
+}
+
 /* Document CRUD functions */
 
+// when set, disk reads go through the buffer pool (see use_buffer_pool)
+static BufferPool *page_cache = NULL;
+
+void use_buffer_pool(BufferPool *pool) {
+    page_cache = pool;
+}
+
+// updates are buffered and coalesced in memory until the next flush, NULL to write them directly
+static WriteBuffer *write_back = NULL;
+
+void use_write_buffer(WriteBuffer *buffer) {
+    write_back = buffer;
+}
+
+// deletes and big frees run on its thread, NULL to do them on the calling thread
+static LazyFree *reclaimer = NULL;
+
+void use_lazy_free(LazyFree *lazy) {
+    reclaimer = lazy;
+}
+
+// replaces the whole content of a file with a single write in the common case
+static bool write_file(const char *filename, const char *content, size_t length, bool sync) {
+    if (page_cache) buffer_pool_invalidate(page_cache, filename);
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, content + done, length - done);
+        if (n < 0) {
+            close(fd);
+            return false;
+        }
+        done += n;
+    }
+
+    // durable writes wait for the data to reach the device
+    if (sync && fdatasync(fd) < 0) {
+        close(fd);
+        return false;
+    }
+    return close(fd) == 0;
+}
+
 char *generate_unique_id() {
     static int counter = 0;
     time_t now = time(NULL);
@@ -157,35 +405,54 @@ char *generate_unique_id() {
     return id; // who calls this function will have to free the memory
 }
 
-Document *create_document(const char *content) {
-    // JSON parsing and syntax check
+/*
+
+JSON VALIDATION
+
+jsmn is first run in counting mode to know how many tokens the document needs, then
+a second time on a token array of exactly that size: only the second pass detects
+truncated documents (JSMN_ERROR_PART), which is what a crash in the middle of a write leaves.
+The root of a document must be an object or an array.
+
+*/
+
+bool validate_json(const char *content, size_t length) {
     jsmn_parser parser;
-    jsmntok_t tokens[MAX_TOKENS];
     jsmn_init(&parser);
 
-    int num_tokens = jsmn_parse(&parser, content, strlen(content), NULL, 0);
-    
-    // checks if parsing succeeded
-    if(num_tokens < 0){
-        printf("Failed to parse JSON: %d\n", num_tokens);
-        return NULL;
-    }
+    int num_tokens = jsmn_parse(&parser, content, length, NULL, 0);
+    if (num_tokens <= 0) return false;
 
-    // checks if the first token is an object or a JSON array
-    if (tokens[0].type != JSMN_OBJECT && tokens[0].type != JSMN_ARRAY){
+    jsmntok_t *tokens = malloc(sizeof(jsmntok_t) * num_tokens);
+    if (!tokens) return false;
+
+    jsmn_init(&parser);
+    int parsed = jsmn_parse(&parser, content, length, tokens, num_tokens);
+    bool valid = parsed > 0 && (tokens[0].type == JSMN_OBJECT || tokens[0].type == JSMN_ARRAY);
+
+    free(tokens);
+    return valid;
+}
+
+
+// a document with a new ID, not stored anywhere yet
+static Document *new_document(const char *content) {
+    // JSON parsing and syntax check
+    if (!validate_json(content, strlen(content))) {
         printf("Invalid JSON structure\n");
         return NULL;
     }
 
-    Document *doc = malloc(sizeof(Document));
+    Document *doc = calloc(1, sizeof(Document));
     if (!doc) return NULL; // malloc fail
 
-    doc->id = strdup(generate_unique_id());
+    doc->id = generate_unique_id();
     if(!doc->id) {
         free(doc); // clean in case of error
         return NULL;
     }
 
+    doc->length = strlen(content);
     doc->content = strdup(content);
     if (!doc->content) {
         free(doc->id); // clean in case of error
@@ -202,85 +469,534 @@ Document *create_document(const char *content) {
         return NULL;
     }
 
+    return doc;
+}
+
+Document *create_document(const char *content) {
+    Document *doc = new_document(content);
+    if (!doc) return NULL;
+
     // Saving the document on disk
     char filename[256];
     snprintf(filename, sizeof(filename), "%s.json", doc->id);
-    FILE *file = fopen(filename, "w");
-    if(file) {
-        fprintf(file, "%s", doc->content);
-        fclose(file);
-    } else {
+    if (!write_file(filename, doc->content, doc->length, false)) {
         // if we arrived here, then we have an error while opening the file
         // we handle it
+        free_hash_entry(doc->hash_id);
         free(doc->content);
         free(doc->id);
         free(doc);
         return NULL;
     }
+    write_field_index(doc->id, doc->content, doc->length);
 
     return doc;
 }
 
+// builds a document around an ID and a content that are already on disk (e.g. during
+// recovery), without writing anything. Takes ownership of both strings.
+Document *load_document(char *id, char *content) {
+    Document *doc = calloc(1, sizeof(Document));
+    if (!doc) return NULL;
+
+    doc->id = id;
+    doc->content = content;
+    doc->length = content ? strlen(content) : 0;
+    doc->hash_id = create_hash_entry(id, hash_function(id), doc);
+    if (!doc->hash_id) {
+        free(doc);
+        return NULL;
+    }
+
+    return doc;
+}
+
+/*
+
+COLLECTION STORAGE
+
+By default the body of every document is a <id>.json file. A collection given an LSMTree
+(set_collection_storage()) stores its bodies in the tree instead: add_document() and
+set_document() put them, evicted bodies are reloaded with lsm_get() and removals become
+tombstones. The index, the filter and the resident bodies stay the same in both modes,
+so the collection API doesn't change; partial updates put the whole patched body, a
+delta log buys nothing when every write is an append anyway.
+
+The tree belongs to the caller, who closes it after the collection is freed. The index of
+an LSM collection isn't rebuilt by recover_collection(), which only scans <id>.json files.
+
+*/
+
+// switches an empty collection to the tree, NULL goes back to one file per document
+bool set_collection_storage(Collection *collection, LSMTree *tree) {
+    if (collection == NULL || collection->size > 0) return false;
+
+    collection->lsm = tree;
+    return true;
+}
+
+// creates a document with a new ID, stores it and inserts it in the collection
+Document *add_document(Collection *collection, const char *content) {
+    if (collection == NULL || content == NULL) return NULL;
+
+    Document *doc = collection->lsm ? new_document(content) : create_document(content);
+    if (!doc) return NULL;
+
+    bool stored = collection->lsm == NULL || lsm_put(collection->lsm, doc->id, doc->content, doc->length);
+    if (stored && insert_document(collection, doc)) return doc;
+
+    if (collection->lsm == NULL) delete_document(doc->id);
+    else if (stored) lsm_delete(collection->lsm, doc->id);
+    free_hash_entry(doc->hash_id);
+    free_document(doc);
+    return NULL;
+}
+
+// replaces the body of a document of the collection, in memory and in its storage
+bool set_document(Collection *collection, const char *id, const char *content) {
+    if (collection == NULL || content == NULL || !validate_json(content, strlen(content))) return false;
+
+    char *copy = strdup(content);
+    if (!copy) return false;
+    size_t length = strlen(copy);
+
+    pthread_mutex_lock(&collection->write_lock);
+    Document *doc = find_document(collection, id);
+    bool stored = doc && (collection->lsm ? lsm_put(collection->lsm, id, copy, length) : update_document(id, copy));
+    if (!stored) {
+        pthread_mutex_unlock(&collection->write_lock);
+        free(copy);
+        return false;
+    }
+
+    if (doc->content) collection->used_memory -= doc->length + 1;
+    free(doc->content);
+    doc->content = copy;
+    doc->length = length;
+    collection->used_memory += length + 1;
+
+    // the new image has no delta log
+    doc->deltas = 0;
+    doc->log_open = false;
+    doc->log_bytes = 0;
+
+    touch_document(doc);
+    enforce_maxmemory(collection, doc);
+    pthread_mutex_unlock(&collection->write_lock);
+    return true;
+}
+
 char *read_document(const char* id){
 
+    // an image waiting in the write buffer is newer than the file
+    if (write_back) {
+        char *pending = write_buffer_get(write_back, id, NULL);
+        if (pending) return pending;
+    }
+
     char filename[256];
     snprintf(filename, sizeof(filename), "%s.json", id);
 
-    FILE *file = fopen(filename, "r");
+    // hot pages are served from user space, without any syscall
+    if (page_cache) {
+        size_t length = 0;
+        char *content = buffer_pool_read(page_cache, filename, &length);
+        if (content) replay_document_log(AT_FDCWD, id, &content, &length);
+        return content;
+    }
+
+    // open, fstat, read and close: stdio would add a seek and a tell per read
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
 
     // We should manage the case when the file doesn't exist
-    if (file == NULL){
+    if (fd < 0){
         return NULL;
     }
 
     // Find the file dimensions
-    fseek(file, 0, SEEK_END);
-    long length = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        close(fd);
+        return NULL;
+    }
+    size_t length = st.st_size;
 
     // Allocate the memory for the file's contents
     char *content = malloc(length + 1);
     if (content == NULL){
         // Handle the error of memory allocation
-        fclose(file);
+        close(fd);
         return NULL;
     }
 
     // Read the file contents
-    fread(content, 1, length, file);
-    content[length] = '\0'; // We make sure that the string correctly reach its end
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, content + done, length - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    content[done] = '\0'; // We make sure that the string correctly reach its end
 
-    fclose(file);
+    close(fd);
+
+    // partial updates not consolidated yet live in the document's delta log
+    replay_document_log(AT_FDCWD, id, &content, &done);
     return content; // Who calls the function will be responsible of freeing this memory
 
 }
 
-bool update_document(const char *id, const char *new_content){
+/*
+ * Reads `length` bytes of a document starting at `offset`, without loading the rest of
+ * the file. The range is cut at the end of the document, *read is set to the bytes
+ * actually returned. NULL if the document doesn't exist.
+ */
+char *read_document_range(const char *id, size_t offset, size_t length, size_t *read) {
+    // an image in the write buffer, or partial updates in the log, are newer than the file
+    // and the range is taken from them, like read_document() would
+    size_t pending_length = 0;
+    char *pending = write_back ? write_buffer_get(write_back, id, &pending_length) : NULL;
+    if (!pending && has_document_log(id)) {
+        pending = read_document(id);
+        if (pending) pending_length = strlen(pending);
+    }
+    if (pending) {
+        size_t start = offset < pending_length ? offset : pending_length;
+        size_t n = pending_length - start < length ? pending_length - start : length;
+        memmove(pending, pending + start, n);
+        pending[n] = '\0';
+        if (read) *read = n;
+        return pending;
+    }
+
     char filename[256];
-    // snprintf(filename, sizeof(filename), "%s.json", id);
+    snprintf(filename, sizeof(filename), "%s.json", id);
 
-    FILE *file = fopen(filename, "w");
-    if (file == NULL){
-        return false;
+    char *content = malloc(length + 1);
+    if (!content) return NULL;
+    size_t done = 0;
+
+    if (page_cache) {
+        // only the pages covering the range are loaded, each one copied while pinned
+        while (done < length) {
+            size_t position = offset + done;
+            const char *data;
+            size_t page_length;
+            int frame = buffer_pool_pin(page_cache, filename, position / BUFFER_PAGE_SIZE, &data, &page_length);
+            if (frame < 0) break;
+
+            size_t start = position % BUFFER_PAGE_SIZE;
+            size_t n = start < page_length ? page_length - start : 0;
+            if (n > length - done) n = length - done;
+            memcpy(content + done, data + start, n);
+            buffer_pool_unpin(page_cache, frame);
+
+            done += n;
+            if (page_length < BUFFER_PAGE_SIZE) break; // last page of the file
+        }
+        if (done == 0 && access(filename, F_OK) < 0) {
+            free(content);
+            return NULL;
+        }
+    } else {
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            free(content);
+            return NULL;
+        }
+        while (done < length) {
+            ssize_t n = pread(fd, content + done, length - done, offset + done);
+            if (n <= 0) break;
+            done += n;
+        }
+        close(fd);
     }
 
-    fprintf(file, "%s", new_content);
-    fclose(file);
+    content[done] = '\0';
+    if (read) *read = done;
+    return content;
+}
+
+// writes a new image of a document to disk, bypassing the write buffer
+bool store_document(const char *id, const char *content, size_t length, bool sync) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+
+    if (!write_file(filename, content, length, sync)) return false;
 
+    // the new image supersedes any partial update
+    remove_document_log(id);
+    write_field_index(id, content, length);
     return true;
 }
 
-bool delete_document(const char *id){
+// with a write buffer in use the image reaches the disk within the flush window
+bool update_document(const char *id, const char *new_content){
+    if (write_back) return write_buffer_put(write_back, id, new_content, strlen(new_content));
+
+    return store_document(id, new_content, strlen(new_content), false);
+}
+
+// the image is on the device when this returns, whatever is pending for the document is dropped
+bool update_document_durable(const char *id, const char *new_content) {
+    if (write_back) return write_buffer_write_through(write_back, id, new_content, strlen(new_content));
+
+    return store_document(id, new_content, strlen(new_content), true);
+}
+
+// writes the pending image of a document, if any, before something else changes it on disk
+bool flush_pending_update(const char *id) {
+    return write_back == NULL || write_buffer_flush_document(write_back, id);
+}
+
+bool has_pending_update(const char *id) {
+    return write_back != NULL && write_buffer_contains(write_back, id);
+}
+
+/*
+ * Writes a new image of a document next to the old one and renames it over it: readers
+ * see either the old or the new file, never a truncated one. The new file has a new inode,
+ * which marks the delta log of the old image as stale.
+ */
+bool replace_document(const char *id, const char *content, size_t length) {
+    char filename[256], temporary[272];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+
+    if (!write_file(temporary, content, length, false) || rename(temporary, filename) < 0) {
+        unlink(temporary);
+        return false;
+    }
+
+    if (page_cache) buffer_pool_invalidate(page_cache, filename);
+    write_field_index(id, content, length);
+    return true;
+}
+
+// removes the file of a document and its sidecars on the calling thread
+static bool remove_document_files(const char *id) {
     char filename[256];
     snprintf(filename, sizeof(filename), "%s.json", id);
 
-    if (remove(filename) == 0) {
-        printf("Deleted successfully\n");
-        return true;
+    if (write_back) write_buffer_discard(write_back, id);
+    if (page_cache) buffer_pool_invalidate(page_cache, filename);
+    remove_field_index(id);
+    remove_document_log(id);
+    return remove(filename) == 0;
+}
+
+// the same ID may be deleted again before its first tombstone is gone, each deletion
+// (or collection drop) names its tombstones after a new generation
+static unsigned long tombstones = 0;
+
+static void tombstone_path(char *path, size_t size, const char *id, unsigned long generation) {
+    snprintf(path, size, "%s.json.%lu" DOCUMENT_TOMBSTONE_SUFFIX, id, generation);
+}
+
+// renames the file of a document to a tombstone and drops its sidecars
+static bool bury_document(const char *id, unsigned long generation) {
+    char filename[256], tombstone[300];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+
+    if (write_back) write_buffer_discard(write_back, id);
+    if (page_cache) buffer_pool_invalidate(page_cache, filename);
+    remove_field_index(id);
+    remove_document_log(id);
+
+    tombstone_path(tombstone, sizeof(tombstone), id, generation);
+    return rename(filename, tombstone) == 0;
+}
+
+/*
+ * Deletes a document. With a LazyFree in use (use_lazy_free()) the file is renamed to a
+ * tombstone, which makes the document invisible at once, and its space is reclaimed by the
+ * background thread. Tombstones left by a crash are removed by recover_collection().
+ */
+bool delete_document(const char *id){
+    if (!reclaimer) return remove_document_files(id);
+
+    unsigned long generation = __atomic_fetch_add(&tombstones, 1, __ATOMIC_RELAXED);
+    if (!bury_document(id, generation)) return false;
+
+    char tombstone[300];
+    tombstone_path(tombstone, sizeof(tombstone), id, generation);
+    lazy_free_unlink(reclaimer, tombstone);
+    return true;
+}
+
+/*
+
+ASYNCHRONOUS DOCUMENT I/O
+
+The same operations as read_document() and update_document(), split in steps driven by
+an IOEngine: open, fstat once the file is open (the inode is hot, no disk access), then
+read or write until done, and finally close in the background after the callback ran.
+The calling thread only queues requests; callbacks run inside io_engine_poll().
+
+Appends to log files don't need a helper: an IO_OP_WRITE with offset -1 on a file opened
+with O_APPEND writes at its end with both backends.
+
+*/
+
+typedef struct {
+    IORequest request; // reused for every step of the operation
+    IOEngine *engine;
+    char filename[256];
+    char *id;
+    char *content;
+    size_t length;
+    size_t done;
+    int fd;
+    bool writing;
+    DocumentCallback callback;
+    void *arg;
+} DocumentIO;
+
+static void document_io_step(IORequest *request, int result, void *arg);
+
+static void document_io_submit(DocumentIO *op, IOOpcode opcode) {
+    IORequest *request = &op->request;
+    request->opcode = opcode;
+    request->fd = op->fd;
+    request->buffer = op->content + op->done;
+    request->length = op->length - op->done;
+    request->offset = op->done;
+    io_engine_submit(op->engine, request);
+}
+
+// the file read through op->fd is no longer the image of the document
+static bool image_replaced(DocumentIO *op) {
+    struct stat opened, current;
+    return fstat(op->fd, &opened) == 0 && stat(op->filename, &current) == 0 && opened.st_ino != current.st_ino;
+}
+
+static void document_io_finish(DocumentIO *op, int error) {
+    if (op->writing && page_cache) buffer_pool_invalidate(page_cache, op->filename);
+
+    if (error < 0 && !op->writing) {
+        free(op->content);
+        op->content = NULL;
+        op->done = 0;
+    } else if (op->writing) {
+        remove_document_log(op->id);
+        // same as store_document(): the offset table follows the new image, or goes away
+        if (error < 0 || !write_field_index(op->id, op->content, op->length)) remove_field_index(op->id);
+    } else if (image_replaced(op)) {
+        // consolidated while it was read: the log there is the one of the new image
+        free(op->content);
+        op->content = read_document(op->id);
+        op->done = op->content ? strlen(op->content) : 0;
+        if (!op->content) error = -ENOENT;
+    } else {
+        replay_document_log(AT_FDCWD, op->id, &op->content, &op->done);
+    }
+
+    op->callback(op->id, op->content, op->done, error, op->arg);
+    free(op->id);
+
+    if (op->fd >= 0) {
+        document_io_submit(op, IO_OP_CLOSE); // op is released when the close completes
     } else {
-        printf("Unable to delete the file\n");
+        free(op);
+    }
+}
+
+static void document_io_step(IORequest *request, int result, void *arg) {
+    DocumentIO *op = arg;
+
+    if (request->opcode == IO_OP_CLOSE) {
+        free(op);
+        return;
+    }
+
+    if (result < 0) {
+        document_io_finish(op, result);
+        return;
+    }
+
+    switch (request->opcode) {
+        case IO_OP_OPEN:
+            op->fd = result;
+            if (!op->writing) {
+                struct stat st;
+                if (fstat(op->fd, &st) < 0 || !(op->content = malloc(st.st_size + 1))) {
+                    document_io_finish(op, -ENOMEM);
+                    return;
+                }
+                op->length = st.st_size;
+            }
+            break;
+        case IO_OP_READ:
+            if (result == 0) op->length = op->done; // the file shrank meanwhile
+            op->done += result;
+            break;
+        case IO_OP_WRITE:
+            op->done += result;
+            break;
+        default:
+            break;
+    }
+
+    if (op->done < op->length) {
+        document_io_submit(op, op->writing ? IO_OP_WRITE : IO_OP_READ);
+        return;
+    }
+
+    if (!op->writing) op->content[op->done] = '\0';
+    document_io_finish(op, 0);
+}
+
+static bool document_io_start(IOEngine *engine, const char *id, char *content, size_t length,
+                              bool writing, DocumentCallback callback, void *arg) {
+    if (engine == NULL || id == NULL || callback == NULL) return false;
+
+    DocumentIO *op = calloc(1, sizeof(DocumentIO));
+    if (!op) return false;
+
+    op->id = strdup(id);
+    if (!op->id) {
+        free(op);
         return false;
     }
+
+    snprintf(op->filename, sizeof(op->filename), "%s.json", id);
+    op->engine = engine;
+    op->content = content;
+    op->length = length;
+    op->fd = -1;
+    op->writing = writing;
+    op->callback = callback;
+    op->arg = arg;
+
+    op->request.path = op->filename;
+    op->request.open_flags = writing ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+    op->request.mode = 0644;
+    op->request.callback = document_io_step;
+    op->request.arg = op;
+    document_io_submit(op, IO_OP_OPEN);
+
+    return true;
+}
+
+// the callback receives the content (to be freed by it) or NULL and a negative errno
+bool read_document_async(IOEngine *engine, const char *id, DocumentCallback callback, void *arg) {
+    // a pending image in the write buffer is newer than the file, no I/O is needed
+    size_t length = 0;
+    char *pending = write_back ? write_buffer_get(write_back, id, &length) : NULL;
+    if (pending) {
+        callback(id, pending, length, 0, arg);
+        return true;
+    }
+
+    return document_io_start(engine, id, NULL, 0, false, callback, arg);
+}
+
+// `content` must stay valid until the callback, which receives it back
+bool write_document_async(IOEngine *engine, const char *id, char *content, size_t length,
+                          DocumentCallback callback, void *arg) {
+    // the pending image is older, it must not overwrite this one when it's flushed
+    if (write_back) write_buffer_discard(write_back, id);
+    return document_io_start(engine, id, content, length, true, callback, arg);
 }
 
 /* Free Memory Functions */
@@ -297,6 +1013,7 @@ void free_document(Document *doc) {
 
     free(doc->id);
     free(doc->content);
+    free(doc->expiry);
     free(doc);
 }
 
@@ -316,13 +1033,115 @@ void free_hash_table(HashTable *table) {
     free(table);
 }
 
-void free_collection(Collection *collection) {
-    if (collection == NULL) return;
-
+// frees a collection and its documents, deleting their files first if asked
+static void release_collection(Collection *collection, bool delete_files) {
     for (int i = 0; i < collection->size; i++) {
+        if (delete_files) remove_document_files(collection->documents[i]->id);
         free_document(collection->documents[i]);
     }
 
+    // hash entries (each document's hash_id) are released with the table
+    free_hash_table(collection->hashTable);
+    free_cuckoo_filter(collection->filter);
+    free_expiry(collection->expiry);
+    pthread_mutex_destroy(&collection->write_lock);
     free(collection->documents);
+    free(collection->id);
     free(collection);
-}
\ No newline at end of file
+}
+
+static void free_collection_job(void *arg) {
+    release_collection(arg, false);
+}
+
+// a dropped collection whose files are already tombstones
+typedef struct {
+    Collection *collection;
+    unsigned long generation;
+} BuriedCollection;
+
+static void drop_collection_job(void *arg) {
+    BuriedCollection *buried = arg;
+    Collection *collection = buried->collection;
+
+    char tombstone[300];
+    for (int i = 0; i < collection->size; i++) {
+        tombstone_path(tombstone, sizeof(tombstone), collection->documents[i]->id, buried->generation);
+        unlink(tombstone);
+    }
+    release_collection(collection, false);
+    free(buried);
+}
+
+// big collections are freed in the background when a LazyFree is in use
+void free_collection(Collection *collection) {
+    if (collection == NULL) return;
+
+    if (reclaimer && collection->size >= LAZY_FREE_THRESHOLD &&
+        lazy_free_submit(reclaimer, free_collection_job, collection)) return;
+    release_collection(collection, false);
+}
+
+/*
+ * DROP COLLECTION: deletes the files of every document and frees the collection. With a
+ * LazyFree in use the files are renamed to tombstones, as by delete_document(), before this
+ * returns: no reader finds them and a crash can't bring them back. Unlinking them and
+ * freeing the collection are left to the background thread.
+ */
+void drop_collection(Collection *collection) {
+    if (collection == NULL) return;
+
+    // tombstones in the tree are as cheap as renames, the bodies are gone once they're written
+    if (collection->lsm) {
+        for (int i = 0; i < collection->size; i++) lsm_delete(collection->lsm, collection->documents[i]->id);
+        free_collection(collection);
+        return;
+    }
+
+    BuriedCollection *buried = reclaimer ? malloc(sizeof(BuriedCollection)) : NULL;
+    if (buried == NULL) {
+        release_collection(collection, true);
+        return;
+    }
+
+    buried->collection = collection;
+    buried->generation = __atomic_fetch_add(&tombstones, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < collection->size; i++) bury_document(collection->documents[i]->id, buried->generation);
+
+    if (!lazy_free_submit(reclaimer, drop_collection_job, buried)) drop_collection_job(buried);
+}
+
+/*
+ * TRUNCATE: empties a collection in place. Its documents are moved to a detached collection,
+ * which is dropped as by drop_collection(). Returns the number of documents removed, -1 if
+ * the collection couldn't be emptied.
+ */
+int truncate_collection(Collection *collection) {
+    Collection *old = create_collection();
+    if (!old) return -1;
+
+    // the fresh, empty index and filter of `old` go to the collection and vice versa
+    pthread_mutex_lock(&collection->write_lock);
+    HashTable *table = old->hashTable;
+    CuckooFilter *filter = old->filter;
+    old->hashTable = collection->hashTable;
+    old->filter = collection->filter;
+    old->documents = collection->documents;
+    old->size = collection->size;
+    old->capacity = collection->capacity;
+    old->expiry = collection->expiry;
+    old->lsm = collection->lsm;
+
+    collection->hashTable = table;
+    collection->filter = filter;
+    collection->documents = NULL;
+    collection->size = 0;
+    collection->capacity = 0;
+    collection->used_memory = 0;
+    collection->expiry = NULL;
+    pthread_mutex_unlock(&collection->write_lock);
+
+    int count = old->size;
+    drop_collection(old);
+    return count;
+}
@@ -3,8 +3,19 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "io_engine.h"
+#include "buffer_pool.h"
+#include "cuckoo_filter.h"
+#include "write_buffer.h"
+#include "lazy_free.h"
+#include "timing_wheel.h"
+#include "lsm.h"
 
 #define INITIAL_HASH_TABLE_SIZE 16
+#define DOCUMENT_TOMBSTONE_SUFFIX ".dead" // deleted files waiting to be unlinked
 
 /* Data Structures */
 
@@ -13,7 +24,16 @@ typedef struct HashEntry HashEntry;
 typedef struct {
     char *id;       // document ID
     HashEntry *hash_id; // hash ID generated from the original ID
-    char *content;  // json
+    char *content;  // json, NULL while the body is evicted to disk
+    size_t length;  // content length, known even when the body is evicted
+    unsigned int lru; // LRU clock of the last access, in seconds
+    unsigned char lfu; // logarithmic access frequency counter
+    int slot;       // position in the collection's documents array
+    unsigned int deltas; // records in the delta log since the last full image
+    bool log_open;       // the delta log of the current image was started by this process
+    size_t log_bytes;    // size of the records in the delta log
+    unsigned int appending; // increments on their way to the log through an IOEngine
+    TimerNode *expiry;   // TTL timer, NULL for documents that don't expire
 } Document;
 
 typedef struct HashEntry {
@@ -26,30 +46,78 @@ typedef struct HashEntry {
 typedef struct {
     char *id;
     int size;
+    int count; // number of entries currently linked in the buckets
     HashEntry **buckets; // array of pointers to HashEntry
 } HashTable;
 
+typedef enum {
+    EVICT_LRU, // evicts the bodies idle for the longest time
+    EVICT_LFU  // evicts the least frequently accessed bodies
+} EvictionPolicy;
+
 typedef struct {
-    Document *documents; // dynamic array of documents
+    Document **documents; // dynamic array of documents
     HashTable *hashTable; // HashTable for the collection
+    CuckooFilter *filter; // answers "definitely absent" before the index is walked
     char *id; // collection ID
     int size;            // number of documents currently stored
     int capacity;        // current capacity of the array
+    size_t used_memory;  // bytes of document bodies resident in memory
+    size_t maxmemory;    // cap on used_memory, 0 means unlimited
+    EvictionPolicy policy;
+    pthread_mutex_t write_lock; // serializes partial updates, they read and modify in place
+    struct Expiry *expiry; // TTL timers, NULL until a document gets one
+    LSMTree *lsm;        // where the bodies are stored, NULL for one <id>.json file per document
 } Collection;
 
+// completion of an asynchronous document operation, error is 0 or a negative errno
+typedef void (*DocumentCallback)(const char *id, char *content, size_t length, int error, void *arg);
+
 /* Functions */
 
 HashTable *create_hash_table();
 unsigned long hash_function(const char *str);
+int document_shard(const char *id, int shards);
 HashEntry *create_hash_entry(char *key, unsigned long hash, Document *value);
 Collection *create_collection();
 char *generate_unique_id();
+bool validate_json(const char *content, size_t length);
 Document *create_document(const char *content);
+Document *load_document(char *id, char *content);
 void insert_into_hash_table(HashTable *table, HashEntry *entry);
+bool resize_hash_table(HashTable *table, int new_size);
+bool reserve_collection(Collection *collection, int capacity);
+bool insert_document(Collection *collection, Document *doc);
+bool remove_from_hash_table(HashTable *table, HashEntry *entry);
+Document *find_document(Collection *collection, const char *id);
+char *get_document(Collection *collection, const char *id);
+bool remove_document(Collection *collection, const char *id);
+bool discard_document(Collection *collection, Document *doc);
+bool set_collection_storage(Collection *collection, LSMTree *tree);
+Document *add_document(Collection *collection, const char *content);
+bool set_document(Collection *collection, const char *id, const char *content);
+
+void use_buffer_pool(BufferPool *pool);
+void use_write_buffer(WriteBuffer *buffer);
+void use_lazy_free(LazyFree *lazy);
+char *read_document(const char *id);
+char *read_document_range(const char *id, size_t offset, size_t length, size_t *read);
+bool replace_document(const char *id, const char *content, size_t length);
+bool store_document(const char *id, const char *content, size_t length, bool sync);
+bool update_document(const char *id, const char *new_content);
+bool update_document_durable(const char *id, const char *new_content);
+bool flush_pending_update(const char *id);
+bool has_pending_update(const char *id);
+bool delete_document(const char *id);
+bool read_document_async(IOEngine *engine, const char *id, DocumentCallback callback, void *arg);
+bool write_document_async(IOEngine *engine, const char *id, char *content, size_t length,
+                          DocumentCallback callback, void *arg);
 
 void free_hash_table(HashTable *table);
 void free_hash_entry(HashEntry *entry);
 void free_collection(Collection *collection);
+void drop_collection(Collection *collection);
+int truncate_collection(Collection *collection);
 void free_document(Document *doc);
 
-#endif // DB_MANAGER_H
\ No newline at end of file
+#endif // DB_MANAGER_H
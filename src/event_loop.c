@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "event_loop.h"
+
+/*
+
+EVENT LOOP
+
+One thread, thousands of connections: every socket is non blocking and registered with
+epoll, the loop waits for any of them to become readable or writable and calls its handler.
+A handler never blocks, it does what the socket allows and keeps its state for the next
+event (a read state machine for partial requests, a write one for partial replies).
+
+Sockets are registered edge-triggered (EPOLLET): epoll reports a socket when it becomes
+readable or writable, not as long as it is. A fd is registered once for both directions and
+never modified on the hot path, but a handler must read (or write) until EAGAIN, otherwise
+the rest of the data would wait for the next edge, which may never come.
+
+Timers (idle timeouts and the like) live in a timing wheel with one tick per millisecond,
+adding, moving and cancelling one is O(1). The loop wakes up at least every
+EVENT_LOOP_TICK_MS while timers are pending or a tick handler is set, which bounds their
+lateness; the tick handler runs at that period for incremental background work.
+
+Disk requests don't fit the readiness model, a regular file is always "ready". An IOEngine
+attached to the loop brings them in: its eventfd is watched like a socket and the handler
+runs the callbacks of the completed requests, and before each wait the loop hands the
+requests queued by the handlers to the backend, so a batch of events costs one submission.
+
+*/
+
+uint64_t event_loop_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+EventLoop *create_event_loop(void) {
+    EventLoop *loop = calloc(1, sizeof(EventLoop));
+    if (!loop) return NULL;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timers = create_timing_wheel(event_loop_now());
+    if (loop->epfd < 0 || !loop->timers) {
+        free_event_loop(loop);
+        return NULL;
+    }
+    loop->last_tick = loop->timers->now;
+    return loop;
+}
+
+static uint32_t epoll_mask(int mask) {
+    uint32_t events = EPOLLET | EPOLLRDHUP;
+    if (mask & EVENT_READABLE) events |= EPOLLIN;
+    if (mask & EVENT_WRITABLE) events |= EPOLLOUT;
+    return events;
+}
+
+// registers a non blocking fd, `handler` is called with the events it gets
+bool event_loop_add(EventLoop *loop, int fd, int mask, FileEventHandler handler, void *arg) {
+    if (fd >= loop->size) {
+        int size = loop->size ? loop->size : 1024;
+        while (size <= fd) size *= 2;
+        FileEvent *files = realloc(loop->files, sizeof(FileEvent) * size);
+        if (!files) return false;
+        memset(files + loop->size, 0, sizeof(FileEvent) * (size - loop->size));
+        loop->files = files;
+        loop->size = size;
+    }
+
+    struct epoll_event event = {.events = epoll_mask(mask), .data.fd = fd};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) < 0) return false;
+
+    loop->files[fd] = (FileEvent){handler, arg, mask};
+    return true;
+}
+
+bool event_loop_modify(EventLoop *loop, int fd, int mask) {
+    if (fd >= loop->size || !loop->files[fd].handler) return false;
+
+    struct epoll_event event = {.events = epoll_mask(mask), .data.fd = fd};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &event) < 0) return false;
+
+    loop->files[fd].mask = mask;
+    return true;
+}
+
+// to be called before the fd is closed, pending events for it are dropped
+void event_loop_remove(EventLoop *loop, int fd) {
+    if (fd >= loop->size || !loop->files[fd].handler) return;
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    loop->files[fd] = (FileEvent){NULL, NULL, 0};
+}
+
+// (re)schedules a timer, it fires once
+void event_loop_schedule(EventLoop *loop, EventTimer *timer, uint64_t delay_ms, TimerHandler handler, void *arg) {
+    timer->handler = handler;
+    timer->arg = arg;
+    timer->node.data = timer;
+    timing_wheel_add(loop->timers, &timer->node, event_loop_now() + delay_ms);
+}
+
+void event_loop_cancel(EventLoop *loop, EventTimer *timer) {
+    timing_wheel_cancel(loop->timers, &timer->node);
+}
+
+void event_loop_set_tick(EventLoop *loop, TimerHandler handler, void *arg) {
+    loop->tick = handler;
+    loop->tick_arg = arg;
+}
+
+static void engine_event(EventLoop *loop, int fd, int events, void *arg) {
+    (void)loop;
+    (void)fd;
+    (void)events;
+    io_engine_poll(arg, 0);
+}
+
+// the callbacks of the engine's requests run on the loop's thread, between file events
+bool event_loop_attach_engine(EventLoop *loop, IOEngine *engine) {
+    if (loop->engine || !event_loop_add(loop, io_engine_event_fd(engine), EVENT_READABLE, engine_event, engine))
+        return false;
+
+    loop->engine = engine;
+    return true;
+}
+
+static void run_timers(EventLoop *loop) {
+    uint64_t now = event_loop_now();
+    timing_wheel_advance(loop->timers, now);
+
+    // a handler may cancel or reschedule any timer, including those not popped yet
+    TimerNode *node;
+    while ((node = timing_wheel_pop(loop->timers)) != NULL) {
+        EventTimer *timer = node->data;
+        timer->handler(loop, timer->arg);
+    }
+
+    if (loop->tick && now - loop->last_tick >= EVENT_LOOP_TICK_MS) {
+        loop->last_tick = now;
+        loop->tick(loop, loop->tick_arg);
+    }
+}
+
+/*
+ * Waits up to `timeout_ms` (-1: until something happens) for events, and handles them and
+ * the timers due. Returns the number of file events handled, -1 on error.
+ */
+int event_loop_process(EventLoop *loop, int timeout_ms) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    bool periodic = loop->tick || loop->timers->count > 0 || loop->timers->due > 0;
+    if (periodic && (timeout_ms < 0 || timeout_ms > EVENT_LOOP_TICK_MS)) timeout_ms = EVENT_LOOP_TICK_MS;
+
+    // the disk requests of the last batch leave together
+    if (loop->engine) io_engine_flush(loop->engine);
+
+    int n = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) return -1;
+
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        uint32_t ready = events[i].events;
+
+        // a handler earlier in this batch may have removed this fd
+        if (fd >= loop->size || !loop->files[fd].handler) continue;
+
+        int mask = 0;
+        if (ready & EPOLLIN) mask |= EVENT_READABLE;
+        if (ready & EPOLLOUT) mask |= EVENT_WRITABLE;
+        if (ready & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) mask |= EVENT_HANGUP | EVENT_READABLE;
+
+        FileEvent *file = &loop->files[fd];
+        file->handler(loop, fd, mask, file->arg);
+    }
+
+    run_timers(loop);
+    loop->iterations++;
+    return n < 0 ? 0 : n;
+}
+
+// runs the timers due and the tick, for an owner that waits for its events elsewhere (io_uring)
+void event_loop_expire(EventLoop *loop) {
+    run_timers(loop);
+    loop->iterations++;
+}
+
+void event_loop_run(EventLoop *loop) {
+    loop->stop = false;
+    while (!loop->stop) {
+        if (event_loop_process(loop, -1) < 0) break;
+    }
+}
+
+// the loop returns after the current iteration, may be called from a handler
+void event_loop_stop(EventLoop *loop) {
+    loop->stop = true;
+}
+
+// registered fds aren't closed, they belong to their handlers, nor is the engine
+void free_event_loop(EventLoop *loop) {
+    if (loop == NULL) return;
+
+    if (loop->epfd >= 0) close(loop->epfd);
+    free_timing_wheel(loop->timers);
+    free(loop->files);
+    free(loop);
+}
@@ -0,0 +1,67 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "io_engine.h"
+#include "timing_wheel.h"
+
+#define EVENT_LOOP_MAX_EVENTS 1024 // events fetched by one epoll_wait
+#define EVENT_LOOP_TICK_MS 10      // timer resolution, and period of the tick handler
+
+#define EVENT_READABLE (1 << 0)
+#define EVENT_WRITABLE (1 << 1)
+#define EVENT_HANGUP   (1 << 2)    // error or peer closed, the handler finds out reading
+
+/* Data Structures */
+
+typedef struct EventLoop EventLoop;
+
+typedef void (*FileEventHandler)(EventLoop *loop, int fd, int events, void *arg);
+typedef void (*TimerHandler)(EventLoop *loop, void *arg);
+
+// embedded in the structure it belongs to, the loop only links it
+typedef struct {
+    TimerNode node;
+    TimerHandler handler;
+    void *arg;
+} EventTimer;
+
+typedef struct {
+    FileEventHandler handler;
+    void *arg;
+    int mask;
+} FileEvent;
+
+struct EventLoop {
+    int epfd;
+    FileEvent *files;    // indexed by fd
+    int size;            // fds the files array covers
+    TimingWheel *timers; // one tick per millisecond of CLOCK_MONOTONIC
+    TimerHandler tick;   // called every EVENT_LOOP_TICK_MS, e.g. for background work
+    void *tick_arg;
+    uint64_t last_tick;
+    IOEngine *engine;    // disk requests completed by the loop, NULL for none
+    bool stop;
+    unsigned long iterations;
+};
+
+/* Functions */
+
+EventLoop *create_event_loop(void);
+bool event_loop_add(EventLoop *loop, int fd, int mask, FileEventHandler handler, void *arg);
+bool event_loop_modify(EventLoop *loop, int fd, int mask);
+void event_loop_remove(EventLoop *loop, int fd);
+void event_loop_schedule(EventLoop *loop, EventTimer *timer, uint64_t delay_ms, TimerHandler handler, void *arg);
+void event_loop_cancel(EventLoop *loop, EventTimer *timer);
+void event_loop_set_tick(EventLoop *loop, TimerHandler handler, void *arg);
+bool event_loop_attach_engine(EventLoop *loop, IOEngine *engine);
+uint64_t event_loop_now(void);
+int event_loop_process(EventLoop *loop, int timeout_ms);
+void event_loop_expire(EventLoop *loop);
+void event_loop_run(EventLoop *loop);
+void event_loop_stop(EventLoop *loop);
+void free_event_loop(EventLoop *loop);
+
+#endif // EVENT_LOOP_H
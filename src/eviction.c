@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "eviction.h"
+
+/*
+
+TIERED STORAGE
+
+Every document is always on disk, so its body in memory is just a cache. When a collection
+has a maxmemory, bodies beyond the cap are released and only the Document (ID, hash entry,
+length, access metadata) stays in memory; get_document_content() reloads an evicted body
+from disk (or from the collection's LSMTree) on the next access.
+
+Victims are chosen like Redis does: instead of maintaining an exact LRU list (two pointers
+per document and a list update on every read), a few random documents are sampled and the
+best candidates are kept in a small pool across sampling rounds. With 5 samples and a pool
+of 16 the result is very close to true LRU at a fraction of the cost.
+
+With the LFU policy the access counter is logarithmic: the more hits a document already
+has, the less likely a new hit is to increment it, so 8 bits are enough to tell cold
+documents from documents read millions of times. Counters decay with idle time, so
+documents that were popular long ago eventually become candidates too.
+
+*/
+
+typedef struct {
+    Document *doc;
+    unsigned long score; // higher is a better victim
+} EvictionCandidate;
+
+static unsigned int lru_clock() {
+    return (unsigned int)time(NULL);
+}
+
+static unsigned char lfu_decayed(Document *doc, unsigned int now) {
+    unsigned int periods = now > doc->lru ? (now - doc->lru) / LFU_DECAY_TIME : 0;
+    return periods > doc->lfu ? 0 : doc->lfu - periods;
+}
+
+void touch_document(Document *doc) {
+    unsigned int now = lru_clock();
+
+    // a document touched for the first time starts from LFU_INIT_VAL
+    unsigned char counter = doc->lru ? lfu_decayed(doc, now) : LFU_INIT_VAL;
+
+    if (counter < 255) {
+        double base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+        double p = 1.0 / (base * LFU_LOG_FACTOR + 1);
+        if ((double)rand() / RAND_MAX < p) counter++;
+    }
+
+    doc->lfu = counter;
+    doc->lru = now;
+}
+
+void set_collection_maxmemory(Collection *collection, size_t maxmemory, EvictionPolicy policy) {
+    collection->maxmemory = maxmemory;
+    collection->policy = policy;
+    enforce_maxmemory(collection, NULL);
+}
+
+// releases the body of a document, which stays reachable through the index
+bool evict_document(Collection *collection, Document *doc) {
+    if (doc->content == NULL) return false;
+
+    free(doc->content);
+    doc->content = NULL;
+    collection->used_memory -= doc->length + 1;
+    return true;
+}
+
+static unsigned long eviction_score(Collection *collection, Document *doc, unsigned int now) {
+    if (collection->policy == EVICT_LFU) {
+        return 255 - lfu_decayed(doc, now);
+    }
+    return now > doc->lru ? now - doc->lru : 0;
+}
+
+// adds a sampled document to the pool, which stays sorted by descending score
+static void pool_insert(EvictionCandidate *pool, int *count, Document *doc, unsigned long score) {
+    for (int i = 0; i < *count; i++) {
+        if (pool[i].doc == doc) return;
+    }
+
+    int pos = *count;
+    while (pos > 0 && pool[pos - 1].score < score) pos--;
+
+    if (pos == EVICTION_POOL_SIZE) return; // worse than every candidate in a full pool
+
+    int last = *count < EVICTION_POOL_SIZE ? *count : EVICTION_POOL_SIZE - 1;
+    memmove(&pool[pos + 1], &pool[pos], sizeof(EvictionCandidate) * (last - pos));
+    pool[pos].doc = doc;
+    pool[pos].score = score;
+    if (*count < EVICTION_POOL_SIZE) (*count)++;
+}
+
+/*
+ * Evicts bodies until the collection fits in its maxmemory. `keep` (the document being
+ * accessed, may be NULL) is never evicted. Returns the number of bodies released.
+ */
+int enforce_maxmemory(Collection *collection, Document *keep) {
+    if (collection->maxmemory == 0 || collection->size == 0) return 0;
+
+    EvictionCandidate pool[EVICTION_POOL_SIZE];
+    int pool_count = 0;
+    int evicted = 0;
+    unsigned int now = lru_clock();
+
+    while (collection->used_memory > collection->maxmemory) {
+        // resident documents may be rare, so a round tries a few times more than it samples
+        int sampled = 0;
+        for (int tries = 0; sampled < EVICTION_SAMPLES && tries < EVICTION_SAMPLES * 4; tries++) {
+            Document *doc = collection->documents[rand() % collection->size];
+            if (doc->content == NULL || doc == keep) continue;
+
+            pool_insert(pool, &pool_count, doc, eviction_score(collection, doc, now));
+            sampled++;
+        }
+
+        if (pool_count == 0) break; // nothing left to evict
+
+        Document *victim = pool[0].doc;
+        memmove(&pool[0], &pool[1], sizeof(EvictionCandidate) * (pool_count - 1));
+        pool_count--;
+
+        if (evict_document(collection, victim)) evicted++;
+    }
+
+    return evicted;
+}
+
+/*
+ * Returns the body of a document, reloading it from disk if it was evicted.
+ * The pointer stays valid until the next access that may evict it.
+ */
+const char *get_document_content(Collection *collection, Document *doc) {
+    if (doc == NULL) return NULL;
+
+    if (doc->content == NULL) {
+        char *content = collection->lsm ? lsm_get(collection->lsm, doc->id, NULL) : read_document(doc->id);
+        if (content == NULL) return NULL;
+
+        doc->content = content;
+        doc->length = strlen(content);
+        collection->used_memory += doc->length + 1;
+        touch_document(doc);
+        enforce_maxmemory(collection, doc);
+        return doc->content;
+    }
+
+    touch_document(doc);
+    return doc->content;
+}
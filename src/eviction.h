@@ -0,0 +1,20 @@
+#ifndef EVICTION_H
+#define EVICTION_H
+
+#include "db_manager.h"
+
+#define EVICTION_SAMPLES 5     // documents sampled for each eviction round
+#define EVICTION_POOL_SIZE 16  // best candidates kept across rounds
+#define LFU_INIT_VAL 5         // counter of new documents, so they aren't evicted at once
+#define LFU_LOG_FACTOR 10      // higher values need more hits to grow the counter
+#define LFU_DECAY_TIME 60      // seconds of idle time that decrement the counter by one
+
+/* Functions */
+
+void set_collection_maxmemory(Collection *collection, size_t maxmemory, EvictionPolicy policy);
+void touch_document(Document *doc);
+const char *get_document_content(Collection *collection, Document *doc);
+bool evict_document(Collection *collection, Document *doc);
+int enforce_maxmemory(Collection *collection, Document *keep);
+
+#endif // EVICTION_H
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db_manager.h"
+#include "expiry.h"
+
+/*
+
+DOCUMENT EXPIRY
+
+A document with a time to live is deleted when its time is up. Its expiry time is kept in
+a timer linked to the document in the collection index, and the timers of a collection live
+in a hierarchical timing wheel (see timing_wheel.c): setting, changing or removing a TTL is
+O(1) whatever the number of documents that have one.
+
+Documents are removed in two ways:
+
+1. Lazily: find_document() checks the expiry time of the document it found, an expired
+   document is deleted there and reported as absent. Reads never see an expired document,
+   even if the active cycle is late.
+2. Actively: active_expire_cycle(), called once per event loop tick, advances the wheel
+   and deletes the documents whose timer fired, so documents nobody reads go away too.
+
+A cycle stops when its CPU time budget is spent, the rest stays in the wheel's expired list
+for the next one. The budget adapts: a cycle that ran out of time with a backlog left doubles
+the budget of the next one (up to EXPIRY_CYCLE_MAX_BUDGET_US), a cycle that finished early
+halves it back towards EXPIRY_CYCLE_BUDGET_US. A mass expiry is absorbed in a few ticks
+without a single tick stalling the loop.
+
+Like insert_document() and remove_document(), these functions are called by the thread that
+owns the collection.
+
+Every TTL set or removed is also appended to EXPIRY_JOURNAL, a single record of a dozen
+bytes per command, in the same write for every collection of the process. The recovery
+re-arms the last TTL recorded for each document it loaded, so a restart neither revives
+expired documents nor makes the others immortal, then rewrites the journal with the TTLs
+still armed. The TTLs of documents it didn't load but whose file is still there (another
+collection of the same directory) are carried over, those of deleted documents are dropped.
+The journal lives in the directory recovered last, the working one until then.
+
+*/
+
+// a record: expiry time in milliseconds (0 once removed), ID length, then the ID and a '\0'
+#define EXPIRY_RECORD_HEADER 12
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_dirfd = AT_FDCWD; // directory of the journal, see recover_expiries()
+static int journal_fd = -1;          // opened by the first record
+
+uint64_t expiry_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t cpu_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// the expiry state of a collection is created with its first TTL
+static Expiry *collection_expiry(Collection *collection) {
+    if (collection->expiry) return collection->expiry;
+
+    Expiry *expiry = calloc(1, sizeof(Expiry));
+    if (!expiry) return NULL;
+
+    expiry->wheel = create_timing_wheel(expiry_now_ms());
+    if (!expiry->wheel) {
+        free(expiry);
+        return NULL;
+    }
+    expiry->budget_us = EXPIRY_CYCLE_BUDGET_US;
+    collection->expiry = expiry;
+    return expiry;
+}
+
+// appends a record in a single write, a crash can only leave the last one incomplete
+static bool journal_append(const char *id, uint64_t when_ms) {
+    char record[EXPIRY_RECORD_HEADER + 256];
+    uint32_t id_length = strlen(id);
+    size_t size = EXPIRY_RECORD_HEADER + id_length + 1;
+    if (size > sizeof(record)) return false;
+
+    memcpy(record, &when_ms, 8);
+    memcpy(record + 8, &id_length, 4);
+    memcpy(record + EXPIRY_RECORD_HEADER, id, id_length + 1);
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd < 0) journal_fd = openat(journal_dirfd, EXPIRY_JOURNAL, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    bool written = journal_fd >= 0 && write(journal_fd, record, size) == (ssize_t)size;
+    pthread_mutex_unlock(&journal_lock);
+    return written;
+}
+
+// links the timer of a document to the wheel of its collection
+static bool arm_expiry(Collection *collection, Document *doc, uint64_t when_ms) {
+    Expiry *expiry = collection_expiry(collection);
+    if (!expiry) return false;
+
+    if (!doc->expiry) {
+        doc->expiry = calloc(1, sizeof(TimerNode));
+        if (!doc->expiry) return false;
+        doc->expiry->data = doc;
+    }
+
+    timing_wheel_add(expiry->wheel, doc->expiry, when_ms);
+    return true;
+}
+
+// sets the absolute expiry time of a document, in milliseconds since the epoch
+bool expire_document_at(Collection *collection, const char *id, uint64_t when_ms) {
+    Document *doc = find_document(collection, id);
+    if (doc == NULL) return false;
+
+    // recorded first: a TTL the next recovery wouldn't know about is never reported as set
+    return journal_append(doc->id, when_ms) && arm_expiry(collection, doc, when_ms);
+}
+
+bool expire_document(Collection *collection, const char *id, uint64_t ttl_ms) {
+    return expire_document_at(collection, id, expiry_now_ms() + ttl_ms);
+}
+
+// removes the TTL of a document, false if it doesn't exist or had none
+bool persist_document(Collection *collection, const char *id) {
+    Document *doc = find_document(collection, id);
+    if (doc == NULL || doc->expiry == NULL || !journal_append(doc->id, 0)) return false;
+
+    cancel_document_expiry(collection, doc);
+    return true;
+}
+
+// milliseconds left to live, -1 if the document has no TTL, -2 if it doesn't exist
+long long document_ttl(Collection *collection, const char *id) {
+    Document *doc = find_document(collection, id);
+    if (doc == NULL) return -2;
+    if (doc->expiry == NULL) return -1;
+
+    uint64_t now = expiry_now_ms();
+    return doc->expiry->expires > now ? (long long)(doc->expiry->expires - now) : 0;
+}
+
+void cancel_document_expiry(Collection *collection, Document *doc) {
+    if (doc->expiry == NULL) return;
+
+    if (collection->expiry) timing_wheel_cancel(collection->expiry->wheel, doc->expiry);
+    free(doc->expiry);
+    doc->expiry = NULL;
+}
+
+// lazy expiry, true if the document was expired and has been deleted
+bool expire_if_needed(Collection *collection, Document *doc) {
+    if (doc->expiry == NULL || doc->expiry->expires > expiry_now_ms()) return false;
+
+    collection->expiry->expired_lazy++;
+    discard_document(collection, doc);
+    return true;
+}
+
+/*
+ * Deletes the documents whose TTL ran out, within the CPU time budget of the collection.
+ * Returns the number of documents deleted.
+ */
+size_t active_expire_cycle(Collection *collection) {
+    Expiry *expiry = collection->expiry;
+    if (expiry == NULL) return 0;
+
+    uint64_t start = cpu_time_us();
+    timing_wheel_advance(expiry->wheel, expiry_now_ms());
+
+    size_t removed = 0;
+    bool over_budget = false;
+    TimerNode *timer;
+    while ((timer = timing_wheel_pop(expiry->wheel)) != NULL) {
+        discard_document(collection, timer->data);
+        removed++;
+
+        if (removed % EXPIRY_CLOCK_CHECK == 0 && cpu_time_us() - start >= expiry->budget_us) {
+            over_budget = expiry->wheel->due > 0;
+            break;
+        }
+    }
+
+    if (over_budget) {
+        expiry->cycles_over_budget++;
+        expiry->budget_us *= 2;
+        if (expiry->budget_us > EXPIRY_CYCLE_MAX_BUDGET_US) expiry->budget_us = EXPIRY_CYCLE_MAX_BUDGET_US;
+    } else if (expiry->budget_us > EXPIRY_CYCLE_BUDGET_US) {
+        expiry->budget_us /= 2;
+        if (expiry->budget_us < EXPIRY_CYCLE_BUDGET_US) expiry->budget_us = EXPIRY_CYCLE_BUDGET_US;
+    }
+
+    expiry->expired_active += removed;
+    return removed;
+}
+
+typedef struct {
+    const char *id;
+    uint64_t when_ms;
+    size_t order; // position in the journal, the last record of an ID wins
+} JournalEntry;
+
+static int compare_entries(const void *a, const void *b) {
+    const JournalEntry *x = a, *y = b;
+    int order = strcmp(x->id, y->id);
+    return order ? order : (x->order > y->order) - (x->order < y->order);
+}
+
+// reads the whole journal under `dirfd`, NULL if there is none
+static char *read_journal(int dirfd, size_t *length) {
+    int fd = openat(dirfd, EXPIRY_JOURNAL, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    char *data = fstat(fd, &st) == 0 ? malloc(st.st_size + 1) : NULL;
+    size_t done = 0;
+    while (data && done < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + done, st.st_size - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    close(fd);
+
+    *length = done;
+    return data;
+}
+
+static bool write_record(int fd, const char *id, uint64_t when_ms) {
+    uint32_t id_length = strlen(id);
+    return write(fd, &when_ms, 8) == 8 && write(fd, &id_length, 4) == 4 &&
+           write(fd, id, id_length + 1) == (ssize_t)id_length + 1;
+}
+
+// the records that follow go to the journal under `dirfd`
+static void bind_journal(int dirfd) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) close(journal_fd);
+    journal_fd = -1;
+    if (journal_dirfd >= 0) close(journal_dirfd);
+    journal_dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+    if (journal_dirfd < 0) journal_dirfd = AT_FDCWD;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// replaces the journal with one record per document that still has a TTL, plus the
+// `carried` records of documents that belong to other collections
+static bool rewrite_journal(Collection **shards, int count, int dirfd, const JournalEntry *carried,
+                            size_t carried_count) {
+    int fd = openat(dirfd, EXPIRY_JOURNAL ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+
+    bool written = true;
+    for (size_t i = 0; written && i < carried_count; i++) {
+        written = write_record(fd, carried[i].id, carried[i].when_ms);
+    }
+    for (int i = 0; written && i < count; i++) {
+        for (int j = 0; written && j < shards[i]->size; j++) {
+            Document *doc = shards[i]->documents[j];
+            if (doc->expiry == NULL) continue;
+
+            written = write_record(fd, doc->id, doc->expiry->expires);
+        }
+    }
+    if (close(fd) < 0) written = false;
+
+    // appends wait, the records that follow go to the new file
+    pthread_mutex_lock(&journal_lock);
+    written = written && renameat(dirfd, EXPIRY_JOURNAL ".tmp", dirfd, EXPIRY_JOURNAL) == 0;
+    if (journal_fd >= 0) close(journal_fd);
+    journal_fd = -1;
+    pthread_mutex_unlock(&journal_lock);
+
+    if (!written) unlinkat(dirfd, EXPIRY_JOURNAL ".tmp", 0);
+    return written;
+}
+
+/*
+ * Re-arms the TTLs recorded in the journal under `dirfd` for the documents just recovered
+ * in the `count` shards of a collection, then compacts the journal, which stays in that
+ * directory. Expired documents are deleted by the next access or active cycle. False if
+ * the journal can't be read back.
+ */
+bool recover_expiries(Collection **shards, int count, int dirfd) {
+    bind_journal(dirfd);
+
+    size_t length = 0;
+    char *data = read_journal(dirfd, &length);
+    if (data == NULL) return errno == ENOENT;
+
+    size_t records = 0;
+    for (size_t pos = 0; pos + EXPIRY_RECORD_HEADER <= length; records++) {
+        uint32_t id_length;
+        memcpy(&id_length, data + pos + 8, 4);
+        pos += EXPIRY_RECORD_HEADER + id_length + 1;
+    }
+
+    JournalEntry *entries = malloc(sizeof(JournalEntry) * (records + 1));
+    if (entries == NULL) {
+        free(data);
+        return false;
+    }
+
+    // a torn record at the end (crash during the append) is ignored
+    size_t count_entries = 0;
+    for (size_t pos = 0; pos + EXPIRY_RECORD_HEADER <= length;) {
+        JournalEntry *entry = &entries[count_entries];
+        uint32_t id_length;
+        memcpy(&entry->when_ms, data + pos, 8);
+        memcpy(&id_length, data + pos + 8, 4);
+        size_t size = EXPIRY_RECORD_HEADER + id_length + 1;
+        if (pos + size > length || data[pos + size - 1] != '\0') break;
+
+        entry->id = data + pos + EXPIRY_RECORD_HEADER;
+        entry->order = count_entries++;
+        pos += size;
+    }
+    qsort(entries, count_entries, sizeof(JournalEntry), compare_entries);
+
+    // the TTLs of other collections are moved to the front of the array
+    size_t carried = 0;
+    char filename[272];
+    for (size_t i = 0; i < count_entries; i++) {
+        if (i + 1 < count_entries && strcmp(entries[i].id, entries[i + 1].id) == 0) continue;
+        if (entries[i].when_ms == 0) continue;
+
+        // documents already in memory keep the TTL they have
+        Collection *collection = shards[document_shard(entries[i].id, count)];
+        Document *doc = find_document(collection, entries[i].id);
+        if (doc) {
+            if (doc->expiry == NULL) arm_expiry(collection, doc, entries[i].when_ms);
+            continue;
+        }
+
+        snprintf(filename, sizeof(filename), "%s.json", entries[i].id);
+        if (faccessat(dirfd, filename, F_OK, 0) == 0) entries[carried++] = entries[i];
+    }
+
+    bool rewritten = rewrite_journal(shards, count, dirfd, entries, carried);
+    free(entries);
+    free(data);
+    return rewritten;
+}
+
+// the timers belong to the documents, they are freed with them
+void free_expiry(Expiry *expiry) {
+    if (expiry == NULL) return;
+
+    free_timing_wheel(expiry->wheel);
+    free(expiry);
+}
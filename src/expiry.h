@@ -0,0 +1,38 @@
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "db_manager.h"
+#include "timing_wheel.h"
+
+#define EXPIRY_CYCLE_BUDGET_US 1000      // CPU time of an active cycle without backlog
+#define EXPIRY_CYCLE_MAX_BUDGET_US 25000 // ceiling while expired documents keep piling up
+#define EXPIRY_CLOCK_CHECK 16            // documents removed between two looks at the clock
+#define EXPIRY_JOURNAL "expiry.journal" // expiry times set and removed, next to the documents
+
+/* Data Structures */
+
+typedef struct Expiry {
+    TimingWheel *wheel;    // one tick per millisecond of CLOCK_REALTIME
+    unsigned budget_us;    // budget of the next active cycle
+    unsigned long expired_lazy;   // removed by an access that found them expired
+    unsigned long expired_active; // removed by active_expire_cycle()
+    unsigned long cycles_over_budget;
+} Expiry;
+
+/* Functions */
+
+uint64_t expiry_now_ms(void);
+bool expire_document(Collection *collection, const char *id, uint64_t ttl_ms);
+bool expire_document_at(Collection *collection, const char *id, uint64_t when_ms);
+bool persist_document(Collection *collection, const char *id);
+long long document_ttl(Collection *collection, const char *id);
+bool expire_if_needed(Collection *collection, Document *doc);
+void cancel_document_expiry(Collection *collection, Document *doc);
+bool recover_expiries(Collection **shards, int count, int dirfd);
+size_t active_expire_cycle(Collection *collection);
+void free_expiry(Expiry *expiry);
+
+#endif // EXPIRY_H
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db_manager.h"
+#include "field_index.h"
+#include "json_util.h"
+#include "patch.h"
+
+/*
+
+FIELD OFFSET TABLE
+
+Reading one field of a big document shouldn't cost a read of the whole file. When a
+document of at least FIELD_INDEX_MIN_SIZE bytes is written, the byte range of each of its
+top level fields is stored in a small <id>.idx sidecar, so a projected read is one read
+of the sidecar and one pread() of the value.
+
+The sidecar records the inode, size and mtime of the document it was built from, so a
+file renamed over the document is caught even when size and mtime happen to match. The
+write paths of db_manager refresh it; documents written by other means (an external tool)
+just make it stale: it is rebuilt from a full read the first time a field is asked for,
+and used from then on.
+
+Smaller documents are parsed whole, a single read costs about the same as a pread().
+
+*/
+
+enum { FIELD_FOUND, FIELD_ABSENT, FIELD_STALE };
+
+static void index_filename(char *filename, size_t size, const char *id) {
+    snprintf(filename, size, "%s" FIELD_INDEX_SUFFIX, id);
+}
+
+// tokenizes a document, only objects have fields to index
+static jsmntok_t *tokenize_object(const char *content, size_t length, int *count) {
+    jsmntok_t *tokens = json_tokenize(content, length, count);
+    if (tokens && tokens[0].type != JSMN_OBJECT) {
+        free(tokens);
+        return NULL;
+    }
+    return tokens;
+}
+
+static bool find_in_content(const char *content, size_t length, const char *field,
+                            size_t *offset, size_t *value_length) {
+    int count = 0;
+    jsmntok_t *tokens = tokenize_object(content, length, &count);
+    if (!tokens) return false;
+
+    size_t field_length = strlen(field);
+    bool found = false;
+
+    for (int i = 1; i + 1 < count; i = json_skip_subtree(tokens, count, i + 1)) {
+        if ((size_t)(tokens[i].end - tokens[i].start) == field_length &&
+            memcmp(content + tokens[i].start, field, field_length) == 0) {
+            json_value_range(&tokens[i + 1], offset, value_length);
+            found = true;
+            break;
+        }
+    }
+
+    free(tokens);
+    return found;
+}
+
+/*
+ * Stores the offset table of a freshly written document. Documents below
+ * FIELD_INDEX_MIN_SIZE and documents that aren't objects don't get one.
+ */
+bool write_field_index(const char *id, const char *content, size_t length) {
+    if (length < FIELD_INDEX_MIN_SIZE) return true;
+
+    char filename[256], temporary[272];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+
+    struct stat st;
+    if (stat(filename, &st) < 0 || (size_t)st.st_size != length) return false;
+
+    int count = 0;
+    jsmntok_t *tokens = tokenize_object(content, length, &count);
+    if (!tokens) return false;
+
+    // header + entries + keys never take more than the document itself plus the entries
+    size_t capacity = sizeof(FieldIndexHeader) + length + (count / 2 + 1) * sizeof(FieldIndexEntry);
+    char *buffer = malloc(capacity);
+    if (!buffer) {
+        free(tokens);
+        return false;
+    }
+
+    FieldIndexHeader header = {FIELD_INDEX_MAGIC, 0, st.st_ino, st.st_size, st.st_mtim.tv_sec,
+                               st.st_mtim.tv_nsec};
+    size_t used = sizeof(FieldIndexHeader);
+
+    for (int i = 1; i + 1 < count; i = json_skip_subtree(tokens, count, i + 1)) {
+        size_t offset, value_length;
+        json_value_range(&tokens[i + 1], &offset, &value_length);
+
+        FieldIndexEntry entry = {offset, value_length, tokens[i].end - tokens[i].start};
+        memcpy(buffer + used, &entry, sizeof(entry));
+        memcpy(buffer + used + sizeof(entry), content + tokens[i].start, entry.key_length);
+        used += sizeof(entry) + entry.key_length;
+        header.count++;
+    }
+    memcpy(buffer, &header, sizeof(header));
+    free(tokens);
+
+    // written aside and renamed, a reader never sees a half written table
+    index_filename(filename, sizeof(filename), id);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool written = fd >= 0;
+    size_t done = 0;
+    while (written && done < used) {
+        ssize_t n = write(fd, buffer + done, used - done);
+        if (n < 0) written = false;
+        else done += n;
+    }
+    if (fd >= 0 && close(fd) < 0) written = false;
+    free(buffer);
+
+    if (written && rename(temporary, filename) == 0) return true;
+    unlink(temporary);
+    return false;
+}
+
+static int search_index(const char *id, const struct stat *document, const char *field,
+                        size_t *offset, size_t *length) {
+    char filename[256];
+    index_filename(filename, sizeof(filename), id);
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FIELD_STALE;
+
+    struct stat st;
+    char *table = NULL;
+    ssize_t size = -1;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FieldIndexHeader) &&
+        (table = malloc(st.st_size)) != NULL) {
+        size = pread(fd, table, st.st_size, 0);
+    }
+    close(fd);
+
+    FieldIndexHeader header;
+    if (size < (ssize_t)sizeof(header)) {
+        free(table);
+        return FIELD_STALE;
+    }
+    memcpy(&header, table, sizeof(header));
+
+    if (header.magic != FIELD_INDEX_MAGIC || header.document_inode != (uint64_t)document->st_ino ||
+        header.document_size != (uint64_t)document->st_size ||
+        header.document_mtime_s != document->st_mtim.tv_sec ||
+        header.document_mtime_ns != document->st_mtim.tv_nsec) {
+        free(table);
+        return FIELD_STALE;
+    }
+
+    size_t field_length = strlen(field);
+    size_t position = sizeof(header);
+    int result = FIELD_ABSENT;
+
+    for (uint32_t i = 0; i < header.count && position + sizeof(FieldIndexEntry) <= (size_t)size; i++) {
+        FieldIndexEntry entry;
+        memcpy(&entry, table + position, sizeof(entry));
+        position += sizeof(entry);
+        if (position + entry.key_length > (size_t)size) break;
+
+        if (entry.key_length == field_length && memcmp(table + position, field, field_length) == 0) {
+            *offset = entry.offset;
+            *length = entry.length;
+            result = FIELD_FOUND;
+            break;
+        }
+        position += entry.key_length;
+    }
+
+    free(table);
+    return result;
+}
+
+/*
+ * Finds the byte range of a top level field. If the whole document had to be read to
+ * find it (small document or stale table), it is handed back in *content.
+ */
+static bool locate_field(const char *id, const char *field, size_t *offset, size_t *length,
+                         char **content) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+    *content = NULL;
+
+    // with pending partial or buffered updates the file doesn't describe the document
+    if (has_document_log(id) || has_pending_update(id)) {
+        *content = read_document(id);
+        return *content && find_in_content(*content, strlen(*content), field, offset, length);
+    }
+
+    struct stat st;
+    if (stat(filename, &st) < 0) return false;
+
+    if (st.st_size >= FIELD_INDEX_MIN_SIZE) {
+        int result = search_index(id, &st, field, offset, length);
+        if (result != FIELD_STALE) return result == FIELD_FOUND;
+    }
+
+    size_t size = 0;
+    *content = read_document_range(id, 0, st.st_size, &size);
+    if (!*content) return false;
+
+    if (size >= FIELD_INDEX_MIN_SIZE) write_field_index(id, *content, size);
+    return find_in_content(*content, size, field, offset, length);
+}
+
+bool lookup_field(const char *id, const char *field, size_t *offset, size_t *length) {
+    char *content;
+    bool found = locate_field(id, field, offset, length, &content);
+    free(content);
+    return found;
+}
+
+/*
+ * Returns the JSON text of a top level field of a document, or NULL if the document or the
+ * field don't exist. The caller frees it.
+ */
+char *read_document_field(const char *id, const char *field, size_t *length) {
+    size_t offset = 0, value_length = 0;
+    char *content;
+
+    if (!locate_field(id, field, &offset, &value_length, &content)) {
+        free(content);
+        return NULL;
+    }
+
+    // the document was read anyway, the value is cut out of it
+    if (content) {
+        memmove(content, content + offset, value_length);
+        content[value_length] = '\0';
+        if (length) *length = value_length;
+        return content;
+    }
+
+    return read_document_range(id, offset, value_length, length);
+}
+
+void remove_field_index(const char *id) {
+    char filename[256];
+    index_filename(filename, sizeof(filename), id);
+    unlink(filename);
+}
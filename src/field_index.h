@@ -0,0 +1,37 @@
+#ifndef FIELD_INDEX_H
+#define FIELD_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FIELD_INDEX_SUFFIX ".idx"
+#define FIELD_INDEX_MAGIC 0x32444946 // "FID2", "FIDX" tables had no inode
+#define FIELD_INDEX_MIN_SIZE (64 << 10) // smaller documents are read whole, one I/O anyway
+
+/* Data Structures */
+
+// on disk: a header followed by `count` entries, each one followed by its key bytes
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t document_inode;  // inode, size and mtime of the <id>.json the table was built
+    uint64_t document_size;   // from, a mismatch means the document was rewritten since
+    int64_t document_mtime_s;
+    int64_t document_mtime_ns;
+} FieldIndexHeader;
+
+typedef struct {
+    uint64_t offset; // first byte of the value, quotes included for strings
+    uint64_t length;
+    uint32_t key_length;
+} FieldIndexEntry;
+
+/* Functions */
+
+bool write_field_index(const char *id, const char *content, size_t length);
+bool lookup_field(const char *id, const char *field, size_t *offset, size_t *length);
+char *read_document_field(const char *id, const char *field, size_t *length);
+void remove_field_index(const char *id);
+
+#endif // FIELD_INDEX_H
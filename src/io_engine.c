@@ -0,0 +1,567 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io_engine.h"
+
+/*
+
+IO ENGINE
+
+A disk operation can go through an IOEngine instead of blocking the calling thread.
+Requests are queued with io_engine_submit(), handed to the backend in batches by
+io_engine_flush() and completed by io_engine_poll(), which runs the callbacks on the
+polling thread: whatever the backend, callbacks never run concurrently with the owner of
+the engine, so they can touch its data structures without locks.
+
+There are two backends:
+
+- io_uring: requests are written straight in the submission ring shared with the kernel and
+  a whole batch costs a single io_uring_enter (none at all with SQPOLL, where a kernel thread
+  consumes the ring). Files and buffers can be registered once to skip the per-request
+  fd lookup and page pinning. liburing isn't required, the rings are mapped by hand.
+
+- threads: a classic pool of workers doing the blocking syscalls, used when io_uring is not
+  available (old kernels, seccomp filters in containers).
+
+Both backends signal completions on an eventfd, so an event loop can wait on it with the
+rest of its file descriptors.
+
+read_document_async() and write_document_async() are built on it, and through them the
+server: each worker has an engine, attached to its event loop (event_loop_attach_engine())
+or polled on its ring, which reads the documents of its GETs (start_document_transfer_async())
+and appends the deltas of its INCRs (incr_document_field_async()).
+
+*/
+
+struct IOEngine {
+    IOBackend backend;
+    int event_fd;
+    int pending;   // submitted requests whose callback didn't run yet
+    IORequest *queue_head, *queue_tail; // not yet handed to the backend
+
+    // io_uring backend
+    int ring_fd;
+    bool sqpoll;
+    unsigned sq_entries, cq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit; // entries in the ring not yet passed to io_uring_enter
+    unsigned inflight;  // entries owned by the kernel
+
+    // thread pool backend
+    pthread_t *workers;
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    IORequest *work_head, *work_tail;
+    IORequest *done_head, *done_tail;
+    int *files; // registered files, resolved by the workers
+    unsigned files_count;
+    bool stopping;
+};
+
+static void push_request(IORequest **head, IORequest **tail, IORequest *request) {
+    request->next = NULL;
+    if (*tail) {
+        (*tail)->next = request;
+    } else {
+        *head = request;
+    }
+    *tail = request;
+}
+
+static IORequest *pop_request(IORequest **head, IORequest **tail) {
+    IORequest *request = *head;
+    if (request) {
+        *head = request->next;
+        if (*head == NULL) *tail = NULL;
+        request->next = NULL;
+    }
+    return request;
+}
+
+static void complete_request(IOEngine *engine, IORequest *request, int result) {
+    request->result = result;
+    engine->pending--;
+    if (request->callback) request->callback(request, result, request->arg);
+}
+
+/* io_uring backend */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(IOEngine *engine) {
+    if (engine->sqes) munmap(engine->sqes, engine->sqes_size);
+    if (engine->cq_ring && engine->cq_ring != engine->sq_ring) munmap(engine->cq_ring, engine->cq_ring_size);
+    if (engine->sq_ring) munmap(engine->sq_ring, engine->sq_ring_size);
+}
+
+static bool uring_init(IOEngine *engine, const IOConfig *config) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    if (config->sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = config->sqpoll_idle ? config->sqpoll_idle : 1000;
+    }
+
+    engine->ring_fd = sys_io_uring_setup(config->queue_depth, &params);
+    if (engine->ring_fd < 0 && config->sqpoll) {
+        // SQPOLL needs privileges on older kernels, fall back to a normal ring
+        memset(&params, 0, sizeof(params));
+        engine->ring_fd = sys_io_uring_setup(config->queue_depth, &params);
+    }
+    if (engine->ring_fd < 0) return false;
+
+    // IORING_OP_READ/WRITE and offset -1 appeared together in 5.6
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) goto fail;
+
+    engine->sqpoll = params.flags & IORING_SETUP_SQPOLL;
+    engine->sq_entries = params.sq_entries;
+    engine->cq_entries = params.cq_entries;
+
+    engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (engine->cq_ring_size > engine->sq_ring_size) engine->sq_ring_size = engine->cq_ring_size;
+        engine->cq_ring_size = engine->sq_ring_size;
+    }
+
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQ_RING);
+    if (engine->sq_ring == MAP_FAILED) {
+        engine->sq_ring = NULL;
+        goto fail;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        engine->cq_ring = engine->sq_ring;
+    } else {
+        engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_CQ_RING);
+        if (engine->cq_ring == MAP_FAILED) {
+            engine->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQES);
+    if (engine->sqes == MAP_FAILED) {
+        engine->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = engine->sq_ring, *cq = engine->cq_ring;
+    engine->sq_head = (unsigned *)(sq + params.sq_off.head);
+    engine->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    engine->sq_flags = (unsigned *)(sq + params.sq_off.flags);
+    engine->sq_array = (unsigned *)(sq + params.sq_off.array);
+    engine->cq_head = (unsigned *)(cq + params.cq_off.head);
+    engine->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (sys_io_uring_register(engine->ring_fd, IORING_REGISTER_EVENTFD, &engine->event_fd, 1) < 0) goto fail;
+
+    return true;
+
+fail:
+    uring_unmap(engine);
+    close(engine->ring_fd);
+    engine->ring_fd = -1;
+    return false;
+}
+
+static void uring_prepare(struct io_uring_sqe *sqe, IORequest *request) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = request->fd;
+    sqe->user_data = (unsigned long long)(uintptr_t)request;
+    if (request->flags & IO_FIXED_FILE) sqe->flags |= IOSQE_FIXED_FILE;
+
+    unsigned length = request->length > 0xffffffffu ? 0xffffffffu : (unsigned)request->length;
+
+    switch (request->opcode) {
+        case IO_OP_OPEN:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long long)(uintptr_t)request->path;
+            sqe->len = request->mode;
+            sqe->open_flags = request->open_flags;
+            break;
+        case IO_OP_READ:
+        case IO_OP_WRITE:
+            if (request->flags & IO_FIXED_BUFFER) {
+                sqe->opcode = request->opcode == IO_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe->buf_index = request->buf_index;
+            } else {
+                sqe->opcode = request->opcode == IO_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+            }
+            sqe->addr = (unsigned long long)(uintptr_t)request->buffer;
+            sqe->len = length;
+            sqe->off = request->offset < 0 ? (unsigned long long)-1 : (unsigned long long)request->offset;
+            break;
+        case IO_OP_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            break;
+        case IO_OP_CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            break;
+    }
+}
+
+static int uring_flush(IOEngine *engine) {
+    unsigned tail = *engine->sq_tail;
+    unsigned head = __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+    int queued = 0;
+
+    // never put more requests in flight than the completion queue can hold
+    while (engine->queue_head && tail - head < engine->sq_entries &&
+           engine->inflight < engine->cq_entries) {
+        IORequest *request = pop_request(&engine->queue_head, &engine->queue_tail);
+        unsigned index = tail & *engine->sq_mask;
+
+        uring_prepare(&engine->sqes[index], request);
+        engine->sq_array[index] = index;
+        tail++;
+        engine->inflight++;
+        queued++;
+    }
+
+    if (queued) {
+        __atomic_store_n(engine->sq_tail, tail, __ATOMIC_RELEASE);
+        engine->to_submit += queued;
+    }
+
+    if (engine->sqpoll) {
+        engine->to_submit = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(engine->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            sys_io_uring_enter(engine->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return queued;
+    }
+
+    if (engine->to_submit) {
+        int submitted = sys_io_uring_enter(engine->ring_fd, engine->to_submit, 0, 0);
+        if (submitted > 0) engine->to_submit -= submitted;
+    }
+    return queued;
+}
+
+static int uring_reap(IOEngine *engine) {
+    unsigned head = *engine->cq_head;
+    unsigned tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+    int reaped = 0;
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &engine->cqes[head & *engine->cq_mask];
+        IORequest *request = (IORequest *)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+
+        head++;
+        // releases the slot before running the callback, which may submit more requests
+        __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+        engine->inflight--;
+        complete_request(engine, request, result);
+        reaped++;
+
+        tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    return reaped;
+}
+
+/* thread pool backend */
+
+static int execute_request(IOEngine *engine, IORequest *request) {
+    int fd = request->fd;
+    if ((request->flags & IO_FIXED_FILE) && fd >= 0 && (unsigned)fd < engine->files_count) {
+        fd = engine->files[fd];
+    }
+
+    ssize_t result = -1;
+    switch (request->opcode) {
+        case IO_OP_OPEN:
+            result = open(request->path, request->open_flags, request->mode);
+            break;
+        case IO_OP_READ:
+            result = request->offset < 0 ? read(fd, request->buffer, request->length)
+                                         : pread(fd, request->buffer, request->length, request->offset);
+            break;
+        case IO_OP_WRITE:
+            result = request->offset < 0 ? write(fd, request->buffer, request->length)
+                                         : pwrite(fd, request->buffer, request->length, request->offset);
+            break;
+        case IO_OP_FSYNC:
+            result = fsync(fd);
+            break;
+        case IO_OP_CLOSE:
+            result = close(fd);
+            break;
+    }
+
+    return result < 0 ? -errno : (int)result;
+}
+
+static void *io_worker(void *arg) {
+    IOEngine *engine = arg;
+
+    pthread_mutex_lock(&engine->lock);
+    while (1) {
+        while (!engine->work_head && !engine->stopping) {
+            pthread_cond_wait(&engine->work_ready, &engine->lock);
+        }
+        if (!engine->work_head) break;
+
+        IORequest *request = pop_request(&engine->work_head, &engine->work_tail);
+        pthread_mutex_unlock(&engine->lock);
+
+        request->result = execute_request(engine, request);
+
+        pthread_mutex_lock(&engine->lock);
+        push_request(&engine->done_head, &engine->done_tail, request);
+
+        uint64_t one = 1;
+        if (write(engine->event_fd, &one, sizeof(one)) < 0) {
+            // the counter can only overflow after 2^64 completions, nothing to do
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return NULL;
+}
+
+static bool threads_init(IOEngine *engine, const IOConfig *config) {
+    engine->threads = config->threads > 0 ? config->threads : IO_DEFAULT_THREADS;
+    engine->workers = malloc(sizeof(pthread_t) * engine->threads);
+    if (!engine->workers) return false;
+
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->work_ready, NULL);
+
+    for (int i = 0; i < engine->threads; i++) {
+        if (pthread_create(&engine->workers[i], NULL, io_worker, engine) != 0) {
+            engine->threads = i;
+            return i > 0;
+        }
+    }
+    return true;
+}
+
+static int threads_flush(IOEngine *engine) {
+    int queued = 0;
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->queue_head) {
+        push_request(&engine->work_head, &engine->work_tail,
+                     pop_request(&engine->queue_head, &engine->queue_tail));
+        queued++;
+    }
+    if (queued) pthread_cond_broadcast(&engine->work_ready);
+    pthread_mutex_unlock(&engine->lock);
+
+    return queued;
+}
+
+static int threads_reap(IOEngine *engine) {
+    pthread_mutex_lock(&engine->lock);
+    IORequest *done = engine->done_head;
+    engine->done_head = engine->done_tail = NULL;
+    pthread_mutex_unlock(&engine->lock);
+
+    int reaped = 0;
+    while (done) {
+        IORequest *next = done->next;
+        complete_request(engine, done, done->result);
+        done = next;
+        reaped++;
+    }
+    return reaped;
+}
+
+/* Engine functions */
+
+IOEngine *io_engine_create(const IOConfig *config) {
+    IOConfig defaults = { IO_BACKEND_AUTO, IO_DEFAULT_QUEUE_DEPTH, IO_DEFAULT_THREADS, false, 0 };
+    if (config == NULL) config = &defaults;
+
+    IOEngine *engine = calloc(1, sizeof(IOEngine));
+    if (!engine) return NULL;
+
+    engine->ring_fd = -1;
+    engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (engine->event_fd < 0) {
+        free(engine);
+        return NULL;
+    }
+
+    IOConfig effective = *config;
+    if (effective.queue_depth == 0) effective.queue_depth = IO_DEFAULT_QUEUE_DEPTH;
+
+    if (effective.backend != IO_BACKEND_THREADS && uring_init(engine, &effective)) {
+        engine->backend = IO_BACKEND_URING;
+        return engine;
+    }
+
+    if (effective.backend == IO_BACKEND_URING || !threads_init(engine, &effective)) {
+        close(engine->event_fd);
+        free(engine->workers);
+        free(engine);
+        return NULL;
+    }
+
+    engine->backend = IO_BACKEND_THREADS;
+    return engine;
+}
+
+IOBackend io_engine_backend(IOEngine *engine) {
+    return engine->backend;
+}
+
+// becomes readable when completions are ready to be polled
+int io_engine_event_fd(IOEngine *engine) {
+    return engine->event_fd;
+}
+
+int io_engine_pending(IOEngine *engine) {
+    return engine->pending;
+}
+
+// queues a request, nothing reaches the kernel before the next flush or poll
+bool io_engine_submit(IOEngine *engine, IORequest *request) {
+    if (engine == NULL || request == NULL) return false;
+
+    request->result = 0;
+    push_request(&engine->queue_head, &engine->queue_tail, request);
+    engine->pending++;
+    return true;
+}
+
+int io_engine_flush(IOEngine *engine) {
+    return engine->backend == IO_BACKEND_URING ? uring_flush(engine) : threads_flush(engine);
+}
+
+/*
+ * Submits the queued requests and runs the callbacks of the completed ones, waiting until
+ * at least `min_complete` completions (or all the pending requests) have been processed.
+ * Returns the number of callbacks run.
+ */
+int io_engine_poll(IOEngine *engine, int min_complete) {
+    int completed = 0;
+
+    while (1) {
+        uint64_t counter;
+        if (read(engine->event_fd, &counter, sizeof(counter)) < 0) {
+            // EAGAIN: no completion signalled since the last poll
+        }
+
+        io_engine_flush(engine);
+        completed += engine->backend == IO_BACKEND_URING ? uring_reap(engine) : threads_reap(engine);
+
+        if (completed >= min_complete || engine->pending == 0) break;
+
+        if (engine->backend == IO_BACKEND_URING) {
+            if (engine->inflight == 0) continue; // the ring was full, queued requests go next
+            int ret = sys_io_uring_enter(engine->ring_fd, engine->to_submit, 1, IORING_ENTER_GETEVENTS);
+            if (ret > 0 && !engine->sqpoll) engine->to_submit -= ret;
+            if (ret < 0 && errno != EINTR) break;
+        } else {
+            pthread_mutex_lock(&engine->lock);
+            bool idle = engine->done_head == NULL;
+            pthread_mutex_unlock(&engine->lock);
+
+            // blocks on the eventfd until a worker signals a completion
+            struct pollfd pfd = { engine->event_fd, POLLIN, 0 };
+            if (idle) poll(&pfd, 1, -1);
+        }
+    }
+
+    return completed;
+}
+
+bool io_engine_register_files(IOEngine *engine, const int *fds, unsigned count) {
+    if (engine->backend == IO_BACKEND_URING) {
+        return sys_io_uring_register(engine->ring_fd, IORING_REGISTER_FILES, fds, count) == 0;
+    }
+
+    int *files = malloc(sizeof(int) * count);
+    if (!files) return false;
+    memcpy(files, fds, sizeof(int) * count);
+    free(engine->files);
+    engine->files = files;
+    engine->files_count = count;
+    return true;
+}
+
+// pins the buffers once, READ/WRITE with IO_FIXED_BUFFER then skip the per-request mapping
+bool io_engine_register_buffers(IOEngine *engine, const struct iovec *buffers, unsigned count) {
+    if (engine->backend == IO_BACKEND_URING) {
+        return sys_io_uring_register(engine->ring_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+    }
+    return true; // workers use the buffer pointers directly
+}
+
+void io_engine_destroy(IOEngine *engine) {
+    if (engine == NULL) return;
+
+    // completes whatever is still in flight, the callbacks may own the requests
+    while (engine->pending > 0) {
+        if (io_engine_poll(engine, engine->pending) <= 0 && engine->backend == IO_BACKEND_URING &&
+            engine->inflight == 0 && engine->queue_head == NULL) break;
+    }
+
+    if (engine->backend == IO_BACKEND_URING) {
+        uring_unmap(engine);
+        close(engine->ring_fd);
+    } else {
+        pthread_mutex_lock(&engine->lock);
+        engine->stopping = true;
+        pthread_cond_broadcast(&engine->work_ready);
+        pthread_mutex_unlock(&engine->lock);
+
+        for (int i = 0; i < engine->threads; i++) {
+            pthread_join(engine->workers[i], NULL);
+        }
+        pthread_mutex_destroy(&engine->lock);
+        pthread_cond_destroy(&engine->work_ready);
+        free(engine->workers);
+        free(engine->files);
+    }
+
+    close(engine->event_fd);
+    free(engine);
+}
@@ -0,0 +1,81 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define IO_DEFAULT_QUEUE_DEPTH 256
+#define IO_DEFAULT_THREADS 4
+
+/* Data Structures */
+
+typedef enum {
+    IO_BACKEND_AUTO,    // io_uring when the kernel allows it, threads otherwise
+    IO_BACKEND_URING,
+    IO_BACKEND_THREADS
+} IOBackend;
+
+typedef enum {
+    IO_OP_OPEN,   // path, open_flags, mode -> result is the new fd
+    IO_OP_READ,
+    IO_OP_WRITE,  // offset -1 writes at the current position (appends on O_APPEND fds)
+    IO_OP_FSYNC,
+    IO_OP_CLOSE
+} IOOpcode;
+
+// request flags
+#define IO_FIXED_FILE   (1 << 0) // fd is an index in the registered files
+#define IO_FIXED_BUFFER (1 << 1) // buffer lives in the registered buffer buf_index
+
+typedef struct IORequest IORequest;
+
+// result is the syscall return value, or -errno on failure
+typedef void (*IOCallback)(IORequest *request, int result, void *arg);
+
+struct IORequest {
+    IOOpcode opcode;
+    int flags;
+    int fd;
+    const char *path;  // IO_OP_OPEN only
+    int open_flags;
+    mode_t mode;
+    void *buffer;
+    size_t length;
+    off_t offset;
+    int buf_index;
+    IOCallback callback;
+    void *arg;
+
+    int result;              // filled by the engine
+    struct IORequest *next;  // engine internal queues
+};
+
+typedef struct {
+    IOBackend backend;
+    unsigned queue_depth; // ring entries / max requests in flight
+    int threads;          // workers of the thread pool backend
+    bool sqpoll;          // let a kernel thread poll the submission queue
+    unsigned sqpoll_idle; // ms of inactivity before the SQPOLL thread sleeps
+} IOConfig;
+
+typedef struct IOEngine IOEngine;
+
+/* Functions */
+
+IOEngine *io_engine_create(const IOConfig *config);
+IOBackend io_engine_backend(IOEngine *engine);
+int io_engine_event_fd(IOEngine *engine);
+
+bool io_engine_submit(IOEngine *engine, IORequest *request);
+int io_engine_flush(IOEngine *engine);
+int io_engine_poll(IOEngine *engine, int min_complete);
+int io_engine_pending(IOEngine *engine);
+
+bool io_engine_register_files(IOEngine *engine, const int *fds, unsigned count);
+bool io_engine_register_buffers(IOEngine *engine, const struct iovec *buffers, unsigned count);
+
+void io_engine_destroy(IOEngine *engine);
+
+#endif // IO_ENGINE_H
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdlib.h>
+
+#include "json_util.h"
+
+/*
+ * Tokenizes a JSON text, jsmn is run once to count the tokens and once to fill
+ * them. Returns a malloc'd array the caller frees, NULL on malformed input.
+ */
+jsmntok_t *json_tokenize(const char *content, size_t length, int *count) {
+    jsmn_parser parser;
+    jsmn_init(&parser);
+
+    int num_tokens = jsmn_parse(&parser, content, length, NULL, 0);
+    if (num_tokens <= 0) return NULL;
+
+    jsmntok_t *tokens = malloc(sizeof(jsmntok_t) * num_tokens);
+    if (!tokens) return NULL;
+
+    jsmn_init(&parser);
+    *count = jsmn_parse(&parser, content, length, tokens, num_tokens);
+    if (*count <= 0) {
+        free(tokens);
+        return NULL;
+    }
+    return tokens;
+}
+
+// index of the token following the subtree rooted at `token`
+int json_skip_subtree(const jsmntok_t *tokens, int count, int token) {
+    int next = token + 1;
+    while (next < count && tokens[next].start < tokens[token].end) next++;
+    return next;
+}
+
+// byte range of a value, string values keep their quotes so the range is valid JSON
+void json_value_range(const jsmntok_t *value, size_t *offset, size_t *length) {
+    if (value->type == JSMN_STRING) {
+        *offset = value->start - 1;
+        *length = value->end - value->start + 2;
+    } else {
+        *offset = value->start;
+        *length = value->end - value->start;
+    }
+}
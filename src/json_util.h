@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#ifndef JSON_UTIL_H
+#define JSON_UTIL_H
+
+#include <stddef.h>
+
+#define JSMN_HEADER
+#include <jsmn.h>
+
+/* Functions */
+
+jsmntok_t *json_tokenize(const char *content, size_t length, int *count);
+int json_skip_subtree(const jsmntok_t *tokens, int count, int token);
+void json_value_range(const jsmntok_t *value, size_t *offset, size_t *length);
+
+#endif // JSON_UTIL_H
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lazy_free.h"
+
+/*
+
+LAZY FREE
+
+Unlinking a big file gives its blocks back to the file system, and freeing a collection of
+millions of documents means millions of free() calls: work whose result nobody waits for.
+A LazyFree runs it on a background thread instead, the caller only queues a job and goes on.
+
+Jobs run one at a time in submission order. Deletes are made invisible before their job is
+queued (the file is renamed to a tombstone, the collection is detached), so running late is
+never observable, only the space comes back later. lazy_free_drain() waits for the queue to
+empty, free_lazy_free() drains it before stopping the thread, no job is ever lost.
+
+*/
+
+typedef struct LazyFreeTask {
+    LazyFreeJob job;
+    void *arg;
+    struct LazyFreeTask *next;
+} LazyFreeTask;
+
+struct LazyFree {
+    LazyFreeTask *head;
+    LazyFreeTask *tail;
+    LazyFreeStats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // signaled when a job is queued or the thread must stop
+    pthread_cond_t idle;  // signaled when the queue is empty and no job is running
+    pthread_t thread;
+    bool stop;
+};
+
+static void *lazy_free_thread(void *arg) {
+    LazyFree *lazy = arg;
+
+    pthread_mutex_lock(&lazy->lock);
+    while (1) {
+        while (!lazy->head && !lazy->stop) pthread_cond_wait(&lazy->work, &lazy->lock);
+        if (!lazy->head) break; // stopping and nothing left
+
+        LazyFreeTask *task = lazy->head;
+        lazy->head = task->next;
+        if (!lazy->head) lazy->tail = NULL;
+        pthread_mutex_unlock(&lazy->lock);
+
+        task->job(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&lazy->lock);
+        lazy->stats.completed++;
+        lazy->stats.pending--;
+        if (lazy->stats.pending == 0) pthread_cond_broadcast(&lazy->idle);
+    }
+    pthread_mutex_unlock(&lazy->lock);
+    return NULL;
+}
+
+LazyFree *create_lazy_free(void) {
+    LazyFree *lazy = calloc(1, sizeof(LazyFree));
+    if (!lazy) return NULL;
+
+    pthread_mutex_init(&lazy->lock, NULL);
+    pthread_cond_init(&lazy->work, NULL);
+    pthread_cond_init(&lazy->idle, NULL);
+
+    if (pthread_create(&lazy->thread, NULL, lazy_free_thread, lazy) != 0) {
+        pthread_cond_destroy(&lazy->idle);
+        pthread_cond_destroy(&lazy->work);
+        pthread_mutex_destroy(&lazy->lock);
+        free(lazy);
+        return NULL;
+    }
+    return lazy;
+}
+
+// queues a job, false if it couldn't be queued (the caller still owns `arg`)
+bool lazy_free_submit(LazyFree *lazy, LazyFreeJob job, void *arg) {
+    LazyFreeTask *task = malloc(sizeof(LazyFreeTask));
+    if (!task) return false;
+    task->job = job;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&lazy->lock);
+    if (lazy->tail) lazy->tail->next = task;
+    else lazy->head = task;
+    lazy->tail = task;
+    lazy->stats.submitted++;
+    lazy->stats.pending++;
+    pthread_cond_signal(&lazy->work);
+    pthread_mutex_unlock(&lazy->lock);
+    return true;
+}
+
+static void unlink_job(void *arg) {
+    unlink(arg);
+    free(arg);
+}
+
+// removes a file in the background, it's unlinked on the spot if the job can't be queued
+bool lazy_free_unlink(LazyFree *lazy, const char *path) {
+    char *copy = strdup(path);
+    if (copy && lazy_free_submit(lazy, unlink_job, copy)) return true;
+
+    free(copy);
+    return unlink(path) == 0;
+}
+
+// waits until every job queued so far has run
+void lazy_free_drain(LazyFree *lazy) {
+    pthread_mutex_lock(&lazy->lock);
+    while (lazy->stats.pending > 0) pthread_cond_wait(&lazy->idle, &lazy->lock);
+    pthread_mutex_unlock(&lazy->lock);
+}
+
+LazyFreeStats lazy_free_stats(LazyFree *lazy) {
+    pthread_mutex_lock(&lazy->lock);
+    LazyFreeStats stats = lazy->stats;
+    pthread_mutex_unlock(&lazy->lock);
+    return stats;
+}
+
+// runs what is queued and stops the thread
+void free_lazy_free(LazyFree *lazy) {
+    if (lazy == NULL) return;
+
+    pthread_mutex_lock(&lazy->lock);
+    lazy->stop = true;
+    pthread_cond_signal(&lazy->work);
+    pthread_mutex_unlock(&lazy->lock);
+    pthread_join(lazy->thread, NULL);
+
+    pthread_cond_destroy(&lazy->idle);
+    pthread_cond_destroy(&lazy->work);
+    pthread_mutex_destroy(&lazy->lock);
+    free(lazy);
+}
@@ -0,0 +1,31 @@
+#ifndef LAZY_FREE_H
+#define LAZY_FREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LAZY_FREE_THRESHOLD 64 // collections with fewer documents are freed on the spot
+
+/* Data Structures */
+
+typedef struct LazyFree LazyFree;
+
+// a unit of background work, it owns `arg`
+typedef void (*LazyFreeJob)(void *arg);
+
+typedef struct {
+    unsigned long submitted;
+    unsigned long completed;
+    size_t pending; // jobs queued or running
+} LazyFreeStats;
+
+/* Functions */
+
+LazyFree *create_lazy_free(void);
+bool lazy_free_submit(LazyFree *lazy, LazyFreeJob job, void *arg);
+bool lazy_free_unlink(LazyFree *lazy, const char *path);
+void lazy_free_drain(LazyFree *lazy);
+LazyFreeStats lazy_free_stats(LazyFree *lazy);
+void free_lazy_free(LazyFree *lazy);
+
+#endif // LAZY_FREE_H
@@ -0,0 +1,1272 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lsm.h"
+
+/*
+
+LSM STORAGE
+
+For write-heavy collections that don't fit in memory, keeping one file per document and a
+hash entry per key in RAM is not affordable. The LSM mode turns every write into a
+sequential append and keeps in memory only a few KB of metadata per data file:
+
+- writes are appended to a write-ahead log and inserted in a memtable, a skiplist that
+  keeps the keys sorted. When the memtable reaches LSM_MEMTABLE_SIZE it becomes immutable,
+  a new one takes its place and a background thread flushes the old one to an SST file.
+
+- an SST (sorted string table) is immutable: data blocks of ~4KB with sorted records, an
+  index with the last key of every block, a Bloom filter of all its keys and a footer.
+  Only the index and the Bloom filter are kept in memory.
+
+- SSTs are organised in levels. L0 receives the flushed memtables, so its files overlap;
+  from L1 on, each level is a sorted run of non-overlapping files and is
+  LSM_LEVEL_MULTIPLIER times bigger than the previous one. When L0 has too many files or
+  a level grows beyond its budget, the background thread merges files into the next level.
+  Deletes are tombstones, dropped once they reach the bottom level.
+
+A point read looks at the memtables, then at L0 files from the newest, then at the single
+file of each level whose key range contains the key. The Bloom filter answers "not here"
+for almost every file that doesn't contain the key, so a read costs about one block read.
+
+A collection uses a tree as its storage once set_collection_storage() gives it one: its
+bodies are put, reloaded and deleted here instead of living in <id>.json files.
+
+*/
+
+#define LSM_TOMBSTONE 0xffffffffu
+#define LSM_MAGIC 0x3154535341444146ULL // "FADASST1"
+#define LSM_FOOTER_SIZE 48
+
+/* Skiplist memtable */
+
+typedef struct SkipNode {
+    char *key;
+    char *value;     // NULL for tombstones
+    uint32_t length;
+    struct SkipNode *next[]; // one pointer per level of the node
+} SkipNode;
+
+typedef struct {
+    SkipNode *head;
+    int level;
+    size_t bytes;
+    size_t count;
+    int wal_fd;
+    unsigned long wal_id;
+} MemTable;
+
+/* SST files */
+
+typedef struct {
+    unsigned long id;
+    int fd;
+    size_t file_size;
+    int block_count;
+    char **last_keys;   // last key of each data block
+    uint64_t *offsets;
+    uint32_t *sizes;
+    uint8_t *bloom;
+    uint32_t bloom_bits;
+    uint32_t bloom_hashes;
+    char *smallest;
+    uint64_t entries;
+    int refs;           // the version holds one, readers take one while searching
+    bool obsolete;      // replaced by a compaction, deleted with the last reference
+    char path[];
+} SSTable;
+
+typedef struct {
+    int fd;
+    unsigned long id;
+    char path[512];
+    char *block;
+    size_t block_size, block_capacity;
+    uint64_t offset;
+    char **last_keys;
+    uint64_t *offsets;
+    uint32_t *sizes;
+    int blocks, blocks_capacity;
+    uint64_t *hashes;   // key hashes, turned into the Bloom filter when the file is finished
+    size_t keys, keys_capacity;
+    char *smallest;
+    char *last_key;
+} SSTWriter;
+
+typedef struct {
+    SSTable *sst;
+    int block;
+    char *data;
+    size_t size, pos;
+    const char *key;
+    uint32_t key_length;
+    const char *value;
+    uint32_t value_length;
+    bool valid;
+} SSTIterator;
+
+struct LSMTree {
+    char *dir;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // wakes the background thread
+    pthread_cond_t done;    // wakes writers waiting for the immutable memtable to be flushed
+    pthread_t background;
+    bool stopping;
+
+    MemTable *mem;
+    MemTable *imm;
+    SSTable **levels[LSM_MAX_LEVELS];
+    int counts[LSM_MAX_LEVELS];
+    int capacities[LSM_MAX_LEVELS];
+    int compact_cursor[LSM_MAX_LEVELS];
+    unsigned long next_file;
+
+    LSMStats stats;
+};
+
+static int compare_keys(const char *a, size_t a_length, const char *b, size_t b_length) {
+    size_t n = a_length < b_length ? a_length : b_length;
+    int c = memcmp(a, b, n);
+    if (c != 0) return c;
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+// 64 bit FNV-1a, the Bloom filters derive all their probes from it
+static uint64_t key_hash(const char *key, size_t length) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool write_all(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t length, off_t offset) {
+    char *p = data;
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/* Memtable functions */
+
+static int random_level() {
+    int level = 1;
+    while (level < LSM_SKIPLIST_MAX_LEVEL && (rand() & 3) == 0) level++;
+    return level;
+}
+
+static MemTable *create_memtable() {
+    MemTable *mem = calloc(1, sizeof(MemTable));
+    if (!mem) return NULL;
+
+    mem->head = calloc(1, sizeof(SkipNode) + sizeof(SkipNode*) * LSM_SKIPLIST_MAX_LEVEL);
+    if (!mem->head) {
+        free(mem);
+        return NULL;
+    }
+    mem->level = 1;
+    mem->wal_fd = -1;
+    return mem;
+}
+
+static SkipNode *memtable_find(MemTable *mem, const char *key, SkipNode **update) {
+    SkipNode *node = mem->head;
+    size_t key_length = strlen(key);
+
+    for (int i = mem->level - 1; i >= 0; i--) {
+        while (node->next[i] && compare_keys(node->next[i]->key, strlen(node->next[i]->key), key, key_length) < 0) {
+            node = node->next[i];
+        }
+        if (update) update[i] = node;
+    }
+
+    node = node->next[0];
+    return node && strcmp(node->key, key) == 0 ? node : NULL;
+}
+
+static bool memtable_put(MemTable *mem, const char *key, const char *value, uint32_t length, bool tombstone) {
+    SkipNode *update[LSM_SKIPLIST_MAX_LEVEL];
+    SkipNode *node = memtable_find(mem, key, update);
+
+    char *copy = NULL;
+    if (!tombstone) {
+        copy = malloc(length + 1);
+        if (!copy) return false;
+        memcpy(copy, value, length);
+        copy[length] = '\0';
+    }
+
+    if (node) {
+        mem->bytes -= node->value ? node->length : 0;
+        free(node->value);
+        node->value = copy;
+        node->length = tombstone ? 0 : length;
+        mem->bytes += node->length;
+        return true;
+    }
+
+    int level = random_level();
+    node = malloc(sizeof(SkipNode) + sizeof(SkipNode*) * level);
+    if (!node || !(node->key = strdup(key))) {
+        free(node);
+        free(copy);
+        return false;
+    }
+    node->value = copy;
+    node->length = tombstone ? 0 : length;
+
+    if (level > mem->level) {
+        for (int i = mem->level; i < level; i++) update[i] = mem->head;
+        mem->level = level;
+    }
+    for (int i = 0; i < level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+
+    mem->bytes += strlen(key) + node->length + 8;
+    mem->count++;
+    return true;
+}
+
+// `flushed`: the content is safe in an SST, otherwise the log stays for the next recovery
+static void free_memtable(MemTable *mem, const char *dir, bool flushed) {
+    if (mem == NULL) return;
+
+    SkipNode *node = mem->head->next[0];
+    while (node) {
+        SkipNode *next = node->next[0];
+        free(node->key);
+        free(node->value);
+        free(node);
+        node = next;
+    }
+    free(mem->head);
+
+    if (mem->wal_fd >= 0) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%06lu.wal", dir, mem->wal_id);
+        close(mem->wal_fd);
+        if (flushed) unlink(path);
+    }
+    free(mem);
+}
+
+/* SST functions */
+
+static void sst_path(char *path, size_t size, const char *dir, unsigned long id) {
+    snprintf(path, size, "%s/%06lu.sst", dir, id);
+}
+
+static bool bloom_may_contain(SSTable *sst, const char *key, size_t length) {
+    if (sst->bloom_bits == 0) return true;
+
+    uint64_t hash = key_hash(key, length);
+    uint64_t delta = (hash >> 33) | (hash << 31);
+    for (uint32_t i = 0; i < sst->bloom_hashes; i++) {
+        uint64_t bit = hash % sst->bloom_bits;
+        if (!(sst->bloom[bit / 8] & (1 << (bit % 8)))) return false;
+        hash += delta;
+    }
+    return true;
+}
+
+static void free_sst(SSTable *sst) {
+    if (sst == NULL) return;
+
+    if (sst->fd >= 0) close(sst->fd);
+    if (sst->obsolete) unlink(sst->path);
+
+    for (int i = 0; i < sst->block_count; i++) free(sst->last_keys[i]);
+    free(sst->last_keys);
+    free(sst->offsets);
+    free(sst->sizes);
+    free(sst->bloom);
+    free(sst->smallest);
+    free(sst);
+}
+
+// loads the footer, the index and the Bloom filter of an SST file
+static SSTable *open_sst(const char *dir, unsigned long id) {
+    char path[512];
+    sst_path(path, sizeof(path), dir, id);
+
+    SSTable *sst = calloc(1, sizeof(SSTable) + strlen(path) + 1);
+    if (!sst) return NULL;
+    strcpy(sst->path, path);
+    sst->id = id;
+    sst->refs = 1;
+
+    sst->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (sst->fd < 0 || fstat(sst->fd, &st) < 0 || st.st_size < LSM_FOOTER_SIZE) goto fail;
+    sst->file_size = st.st_size;
+
+    uint64_t footer[6];
+    if (!read_all(sst->fd, footer, sizeof(footer), st.st_size - LSM_FOOTER_SIZE) || footer[5] != LSM_MAGIC) goto fail;
+
+    uint64_t index_offset = footer[0], index_size = footer[1];
+    uint64_t bloom_offset = footer[2], bloom_size = footer[3];
+    sst->entries = footer[4];
+
+    char *index = malloc(index_size);
+    if (!index || !read_all(sst->fd, index, index_size, index_offset)) {
+        free(index);
+        goto fail;
+    }
+
+    // index: u32 blocks, then (u32 key length, key, u64 offset, u32 size) per block,
+    // then u32 length and the smallest key of the file
+    char *p = index;
+    uint32_t blocks;
+    memcpy(&blocks, p, 4);
+    p += 4;
+    sst->last_keys = calloc(blocks ? blocks : 1, sizeof(char*));
+    sst->offsets = malloc(sizeof(uint64_t) * (blocks ? blocks : 1));
+    sst->sizes = malloc(sizeof(uint32_t) * (blocks ? blocks : 1));
+    if (!sst->last_keys || !sst->offsets || !sst->sizes) {
+        free(index);
+        goto fail;
+    }
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint32_t length;
+        memcpy(&length, p, 4);
+        p += 4;
+        sst->last_keys[i] = strndup(p, length);
+        p += length;
+        memcpy(&sst->offsets[i], p, 8);
+        p += 8;
+        memcpy(&sst->sizes[i], p, 4);
+        p += 4;
+        sst->block_count++;
+    }
+    uint32_t smallest_length;
+    memcpy(&smallest_length, p, 4);
+    sst->smallest = strndup(p + 4, smallest_length);
+    free(index);
+
+    char *bloom = malloc(bloom_size);
+    if (!bloom || bloom_size < 8 || !read_all(sst->fd, bloom, bloom_size, bloom_offset)) {
+        free(bloom);
+        goto fail;
+    }
+    memcpy(&sst->bloom_hashes, bloom, 4);
+    memcpy(&sst->bloom_bits, bloom + 4, 4);
+    sst->bloom = malloc(bloom_size - 8 + 1);
+    if (!sst->bloom) {
+        free(bloom);
+        goto fail;
+    }
+    memcpy(sst->bloom, bloom + 8, bloom_size - 8);
+    free(bloom);
+
+    return sst;
+
+fail:
+    free_sst(sst);
+    return NULL;
+}
+
+static const char *sst_largest(SSTable *sst) {
+    return sst->block_count ? sst->last_keys[sst->block_count - 1] : "";
+}
+
+static bool sst_may_contain(SSTable *sst, const char *key) {
+    return sst->block_count > 0 && strcmp(key, sst->smallest) >= 0 && strcmp(key, sst_largest(sst)) <= 0;
+}
+
+/*
+ * Looks a key up in an SST: 1 if found (value NULL for a tombstone), 0 if absent, -1 on error.
+ */
+static int sst_get(SSTable *sst, const char *key, char **value, size_t *length, LSMStats *stats) {
+    size_t key_length = strlen(key);
+    if (!sst_may_contain(sst, key)) return 0;
+    if (!bloom_may_contain(sst, key, key_length)) {
+        __atomic_fetch_add(&stats->bloom_negatives, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // first block whose last key is >= key
+    int lo = 0, hi = sst->block_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(sst->last_keys[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    char *block = malloc(sst->sizes[lo]);
+    if (!block) return -1;
+    if (!read_all(sst->fd, block, sst->sizes[lo], sst->offsets[lo])) {
+        free(block);
+        return -1;
+    }
+
+    int found = 0;
+    for (size_t pos = 0; pos + 8 <= sst->sizes[lo];) {
+        uint32_t klen, vlen;
+        memcpy(&klen, block + pos, 4);
+        memcpy(&vlen, block + pos + 4, 4);
+        const char *k = block + pos + 8;
+        const char *v = k + klen;
+        pos += 8 + klen + (vlen == LSM_TOMBSTONE ? 0 : vlen);
+
+        int c = compare_keys(k, klen, key, key_length);
+        if (c < 0) continue;
+        if (c > 0) break;
+
+        found = 1;
+        *value = NULL;
+        if (vlen != LSM_TOMBSTONE) {
+            *value = malloc(vlen + 1);
+            if (!*value) {
+                found = -1;
+                break;
+            }
+            memcpy(*value, v, vlen);
+            (*value)[vlen] = '\0';
+            if (length) *length = vlen;
+        }
+        break;
+    }
+
+    free(block);
+    return found;
+}
+
+static bool sst_iterator_next(SSTIterator *it) {
+    while (it->pos + 8 > it->size) {
+        it->block++;
+        free(it->data);
+        it->data = NULL;
+        it->pos = it->size = 0;
+
+        if (it->block >= it->sst->block_count) {
+            it->valid = false;
+            return false;
+        }
+
+        it->size = it->sst->sizes[it->block];
+        it->data = malloc(it->size);
+        if (!it->data || !read_all(it->sst->fd, it->data, it->size, it->sst->offsets[it->block])) {
+            it->valid = false;
+            return false;
+        }
+    }
+
+    memcpy(&it->key_length, it->data + it->pos, 4);
+    memcpy(&it->value_length, it->data + it->pos + 4, 4);
+    it->key = it->data + it->pos + 8;
+    it->value = it->key + it->key_length;
+    it->pos += 8 + it->key_length + (it->value_length == LSM_TOMBSTONE ? 0 : it->value_length);
+    it->valid = true;
+    return true;
+}
+
+static void sst_iterator_init(SSTIterator *it, SSTable *sst) {
+    memset(it, 0, sizeof(*it));
+    it->sst = sst;
+    it->block = -1;
+    sst_iterator_next(it);
+}
+
+static bool writer_open(SSTWriter *w, const char *dir, unsigned long id) {
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    sst_path(w->path, sizeof(w->path), dir, id);
+    w->fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return w->fd >= 0;
+}
+
+static bool writer_flush_block(SSTWriter *w) {
+    if (w->block_size == 0) return true;
+    if (!write_all(w->fd, w->block, w->block_size)) return false;
+
+    if (w->blocks == w->blocks_capacity) {
+        w->blocks_capacity = w->blocks_capacity ? w->blocks_capacity * 2 : 64;
+        char **keys = realloc(w->last_keys, sizeof(char*) * w->blocks_capacity);
+        uint64_t *offsets = realloc(w->offsets, sizeof(uint64_t) * w->blocks_capacity);
+        uint32_t *sizes = realloc(w->sizes, sizeof(uint32_t) * w->blocks_capacity);
+        if (keys) w->last_keys = keys;
+        if (offsets) w->offsets = offsets;
+        if (sizes) w->sizes = sizes;
+        if (!keys || !offsets || !sizes) return false;
+    }
+
+    w->last_keys[w->blocks] = strdup(w->last_key);
+    w->offsets[w->blocks] = w->offset;
+    w->sizes[w->blocks] = w->block_size;
+    w->blocks++;
+
+    w->offset += w->block_size;
+    w->block_size = 0;
+    return true;
+}
+
+static bool writer_add(SSTWriter *w, const char *key, uint32_t key_length, const char *value, uint32_t value_length) {
+    size_t record = 8 + key_length + (value_length == LSM_TOMBSTONE ? 0 : value_length);
+
+    if (w->block_size + record > w->block_capacity) {
+        size_t capacity = w->block_capacity ? w->block_capacity : LSM_BLOCK_SIZE * 2;
+        while (w->block_size + record > capacity) capacity *= 2;
+        char *block = realloc(w->block, capacity);
+        if (!block) return false;
+        w->block = block;
+        w->block_capacity = capacity;
+    }
+
+    memcpy(w->block + w->block_size, &key_length, 4);
+    memcpy(w->block + w->block_size + 4, &value_length, 4);
+    memcpy(w->block + w->block_size + 8, key, key_length);
+    if (value_length != LSM_TOMBSTONE) memcpy(w->block + w->block_size + 8 + key_length, value, value_length);
+    w->block_size += record;
+
+    if (w->keys == w->keys_capacity) {
+        w->keys_capacity = w->keys_capacity ? w->keys_capacity * 2 : 1024;
+        uint64_t *hashes = realloc(w->hashes, sizeof(uint64_t) * w->keys_capacity);
+        if (!hashes) return false;
+        w->hashes = hashes;
+    }
+    w->hashes[w->keys++] = key_hash(key, key_length);
+
+    free(w->last_key);
+    w->last_key = strndup(key, key_length);
+    if (!w->smallest) w->smallest = strndup(key, key_length);
+
+    if (w->block_size >= LSM_BLOCK_SIZE) return writer_flush_block(w);
+    return true;
+}
+
+static void writer_release(SSTWriter *w) {
+    for (int i = 0; i < w->blocks; i++) free(w->last_keys[i]);
+    free(w->last_keys);
+    free(w->offsets);
+    free(w->sizes);
+    free(w->block);
+    free(w->hashes);
+    free(w->smallest);
+    free(w->last_key);
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+}
+
+// writes index, Bloom filter and footer, then reopens the file as an SSTable
+static SSTable *writer_finish(SSTWriter *w, const char *dir) {
+    bool ok = writer_flush_block(w);
+
+    // index
+    uint64_t index_offset = w->offset;
+    uint64_t index_size = 4;
+    uint32_t blocks = w->blocks;
+    ok = ok && write_all(w->fd, &blocks, 4);
+    for (int i = 0; ok && i < w->blocks; i++) {
+        uint32_t length = strlen(w->last_keys[i]);
+        ok = write_all(w->fd, &length, 4) && write_all(w->fd, w->last_keys[i], length) &&
+             write_all(w->fd, &w->offsets[i], 8) && write_all(w->fd, &w->sizes[i], 4);
+        index_size += 16 + length;
+    }
+    uint32_t smallest_length = w->smallest ? strlen(w->smallest) : 0;
+    ok = ok && write_all(w->fd, &smallest_length, 4) && write_all(w->fd, w->smallest ? w->smallest : "", smallest_length);
+    index_size += 4 + smallest_length;
+
+    // Bloom filter, k = bits per key * ln(2)
+    uint32_t hashes = LSM_BLOOM_BITS_PER_KEY * 69 / 100;
+    uint32_t bits = w->keys * LSM_BLOOM_BITS_PER_KEY;
+    if (bits < 64) bits = 64;
+    uint8_t *bloom = calloc((bits + 7) / 8, 1);
+    ok = ok && bloom;
+    for (size_t i = 0; ok && i < w->keys; i++) {
+        uint64_t hash = w->hashes[i];
+        uint64_t delta = (hash >> 33) | (hash << 31);
+        for (uint32_t j = 0; j < hashes; j++) {
+            uint64_t bit = hash % bits;
+            bloom[bit / 8] |= 1 << (bit % 8);
+            hash += delta;
+        }
+    }
+    uint64_t bloom_offset = index_offset + index_size;
+    uint64_t bloom_size = 8 + (bits + 7) / 8;
+    ok = ok && write_all(w->fd, &hashes, 4) && write_all(w->fd, &bits, 4) && write_all(w->fd, bloom, (bits + 7) / 8);
+    free(bloom);
+
+    uint64_t footer[6] = { index_offset, index_size, bloom_offset, bloom_size, w->keys, LSM_MAGIC };
+    ok = ok && write_all(w->fd, footer, sizeof(footer)) && fsync(w->fd) == 0;
+
+    writer_release(w);
+    if (!ok) {
+        unlink(w->path);
+        return NULL;
+    }
+    return open_sst(dir, w->id);
+}
+
+/* Version management, called with the tree lock held */
+
+static void unref_sst(SSTable *sst) {
+    if (--sst->refs == 0) free_sst(sst);
+}
+
+static bool level_add(LSMTree *tree, int level, SSTable *sst) {
+    if (tree->counts[level] == tree->capacities[level]) {
+        int capacity = tree->capacities[level] ? tree->capacities[level] * 2 : 16;
+        SSTable **files = realloc(tree->levels[level], sizeof(SSTable*) * capacity);
+        if (!files) return false;
+        tree->levels[level] = files;
+        tree->capacities[level] = capacity;
+    }
+
+    // L0 keeps the flush order, the other levels are sorted by key range
+    int pos = tree->counts[level];
+    if (level > 0) {
+        while (pos > 0 && strcmp(tree->levels[level][pos - 1]->smallest, sst->smallest) > 0) {
+            tree->levels[level][pos] = tree->levels[level][pos - 1];
+            pos--;
+        }
+    }
+    tree->levels[level][pos] = sst;
+    tree->counts[level]++;
+    return true;
+}
+
+static void level_remove(LSMTree *tree, int level, SSTable *sst) {
+    for (int i = 0; i < tree->counts[level]; i++) {
+        if (tree->levels[level][i] == sst) {
+            memmove(&tree->levels[level][i], &tree->levels[level][i + 1],
+                    sizeof(SSTable*) * (tree->counts[level] - i - 1));
+            tree->counts[level]--;
+            return;
+        }
+    }
+}
+
+static size_t level_bytes(LSMTree *tree, int level) {
+    size_t bytes = 0;
+    for (int i = 0; i < tree->counts[level]; i++) bytes += tree->levels[level][i]->file_size;
+    return bytes;
+}
+
+// the MANIFEST lists the live SST files of each level, rewritten atomically on every change
+static bool write_manifest(LSMTree *tree) {
+    char path[512], tmp[512];
+    snprintf(path, sizeof(path), "%s/MANIFEST", tree->dir);
+    snprintf(tmp, sizeof(tmp), "%s/MANIFEST.tmp", tree->dir);
+
+    FILE *file = fopen(tmp, "w");
+    if (!file) return false;
+
+    fprintf(file, "next %lu\n", tree->next_file);
+    for (int level = 0; level < LSM_MAX_LEVELS; level++) {
+        for (int i = 0; i < tree->counts[level]; i++) {
+            fprintf(file, "%d %lu\n", level, tree->levels[level][i]->id);
+        }
+    }
+
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    return ok && rename(tmp, path) == 0;
+}
+
+/* Flush and compaction */
+
+static SSTable *flush_memtable(LSMTree *tree, MemTable *mem, unsigned long id) {
+    SSTWriter w;
+    if (!writer_open(&w, tree->dir, id)) return NULL;
+
+    for (SkipNode *node = mem->head->next[0]; node; node = node->next[0]) {
+        uint32_t length = node->value ? node->length : LSM_TOMBSTONE;
+        if (!writer_add(&w, node->key, strlen(node->key), node->value, length)) {
+            writer_release(&w);
+            unlink(w.path);
+            return NULL;
+        }
+    }
+
+    return writer_finish(&w, tree->dir);
+}
+
+typedef struct {
+    int level;          // inputs come from level and level + 1
+    SSTable **inputs;   // ordered from the newest to the oldest data
+    int count;
+    bool bottom;        // no data below the output level: tombstones can go
+} Compaction;
+
+static bool ranges_overlap(SSTable *sst, const char *smallest, const char *largest) {
+    return strcmp(sst->smallest, largest) <= 0 && strcmp(sst_largest(sst), smallest) >= 0;
+}
+
+static bool pick_compaction(LSMTree *tree, Compaction *c) {
+    int level = -1;
+    if (tree->counts[0] >= LSM_L0_COMPACTION_TRIGGER) {
+        level = 0;
+    } else {
+        size_t budget = LSM_L1_MAX_BYTES;
+        for (int i = 1; i < LSM_MAX_LEVELS - 1; i++, budget *= LSM_LEVEL_MULTIPLIER) {
+            if (level_bytes(tree, i) > budget) {
+                level = i;
+                break;
+            }
+        }
+    }
+    if (level < 0) return false;
+
+    int upper_count = tree->counts[level];
+    c->inputs = malloc(sizeof(SSTable*) * (upper_count + tree->counts[level + 1]));
+    if (!c->inputs) return false;
+    c->level = level;
+    c->count = 0;
+
+    const char *smallest = NULL, *largest = NULL;
+    if (level == 0) {
+        // every L0 file, newest first
+        for (int i = upper_count - 1; i >= 0; i--) {
+            SSTable *sst = tree->levels[0][i];
+            c->inputs[c->count++] = sst;
+            if (!smallest || strcmp(sst->smallest, smallest) < 0) smallest = sst->smallest;
+            if (!largest || strcmp(sst_largest(sst), largest) > 0) largest = sst_largest(sst);
+        }
+    } else {
+        // one file at a time, going round the key space
+        SSTable *sst = tree->levels[level][tree->compact_cursor[level]++ % upper_count];
+        c->inputs[c->count++] = sst;
+        smallest = sst->smallest;
+        largest = sst_largest(sst);
+    }
+
+    for (int i = 0; i < tree->counts[level + 1]; i++) {
+        SSTable *sst = tree->levels[level + 1][i];
+        if (ranges_overlap(sst, smallest, largest)) c->inputs[c->count++] = sst;
+    }
+
+    c->bottom = true;
+    for (int i = level + 2; i < LSM_MAX_LEVELS; i++) {
+        if (tree->counts[i] > 0) c->bottom = false;
+    }
+    return true;
+}
+
+// merges the inputs into new files of level + 1, newer inputs win on equal keys
+static int run_compaction(LSMTree *tree, Compaction *c, SSTable ***outputs, unsigned long first_id, int max_outputs) {
+    SSTIterator *its = malloc(sizeof(SSTIterator) * c->count);
+    *outputs = malloc(sizeof(SSTable*) * max_outputs);
+    if (!its || !*outputs) {
+        free(its);
+        free(*outputs);
+        return -1;
+    }
+    for (int i = 0; i < c->count; i++) sst_iterator_init(&its[i], c->inputs[i]);
+
+    int produced = 0;
+    bool writing = false, ok = true;
+    SSTWriter w;
+
+    while (ok) {
+        int best = -1;
+        for (int i = 0; i < c->count; i++) {
+            if (!its[i].valid) continue;
+            if (best < 0 || compare_keys(its[i].key, its[i].key_length, its[best].key, its[best].key_length) < 0) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+
+        char *key = strndup(its[best].key, its[best].key_length);
+        uint32_t key_length = its[best].key_length;
+        bool keep = !(c->bottom && its[best].value_length == LSM_TOMBSTONE);
+
+        if (keep) {
+            if (!writing) {
+                if (produced == max_outputs || !writer_open(&w, tree->dir, first_id + produced)) {
+                    ok = false;
+                } else {
+                    writing = true;
+                }
+            }
+            ok = ok && writer_add(&w, key, key_length, its[best].value, its[best].value_length);
+
+            if (ok && w.offset + w.block_size >= LSM_SST_TARGET_SIZE) {
+                SSTable *sst = writer_finish(&w, tree->dir);
+                writing = false;
+                if (sst) (*outputs)[produced++] = sst;
+                else ok = false;
+            }
+        }
+
+        // older versions of the same key are shadowed
+        for (int i = 0; i < c->count; i++) {
+            while (its[i].valid && compare_keys(its[i].key, its[i].key_length, key, key_length) == 0) {
+                sst_iterator_next(&its[i]);
+            }
+        }
+        free(key);
+    }
+
+    if (writing) {
+        if (ok) {
+            SSTable *sst = writer_finish(&w, tree->dir);
+            if (sst) (*outputs)[produced++] = sst;
+            else ok = false;
+        } else {
+            writer_release(&w);
+            unlink(w.path);
+        }
+    }
+
+    for (int i = 0; i < c->count; i++) free(its[i].data);
+    free(its);
+
+    if (!ok) {
+        for (int i = 0; i < produced; i++) {
+            (*outputs)[i]->obsolete = true;
+            free_sst((*outputs)[i]);
+        }
+        free(*outputs);
+        return -1;
+    }
+    return produced;
+}
+
+static void *background_worker(void *arg) {
+    LSMTree *tree = arg;
+
+    pthread_mutex_lock(&tree->lock);
+    while (1) {
+        if (tree->imm) {
+            MemTable *imm = tree->imm;
+            unsigned long id = tree->next_file++;
+            pthread_mutex_unlock(&tree->lock);
+
+            SSTable *sst = flush_memtable(tree, imm, id);
+
+            pthread_mutex_lock(&tree->lock);
+            if (sst && level_add(tree, 0, sst)) {
+                tree->stats.flushes++;
+                tree->stats.flush_bytes += sst->file_size;
+                write_manifest(tree);
+                free_memtable(imm, tree->dir, true);
+                tree->imm = NULL;
+            } else {
+                // keeps the memtable (and its log) and retries later
+                free_sst(sst);
+                pthread_mutex_unlock(&tree->lock);
+                sleep(1);
+                pthread_mutex_lock(&tree->lock);
+            }
+            pthread_cond_broadcast(&tree->done);
+            continue;
+        }
+
+        Compaction c;
+        if (!tree->stopping && pick_compaction(tree, &c)) {
+            // each output file holds up to LSM_SST_TARGET_SIZE, reserve enough IDs for all of them
+            size_t input_bytes = 0;
+            for (int i = 0; i < c.count; i++) input_bytes += c.inputs[i]->file_size;
+            int max_outputs = input_bytes / LSM_SST_TARGET_SIZE + c.count + 1;
+            unsigned long first_id = tree->next_file;
+            tree->next_file += max_outputs;
+            pthread_mutex_unlock(&tree->lock);
+
+            SSTable **outputs;
+            int produced = run_compaction(tree, &c, &outputs, first_id, max_outputs);
+
+            pthread_mutex_lock(&tree->lock);
+            if (produced >= 0) {
+                for (int i = 0; i < c.count; i++) {
+                    SSTable *sst = c.inputs[i];
+                    level_remove(tree, c.level, sst);
+                    level_remove(tree, c.level + 1, sst);
+                    sst->obsolete = true;
+                }
+                for (int i = 0; i < produced; i++) {
+                    level_add(tree, c.level + 1, outputs[i]);
+                    tree->stats.compaction_bytes += outputs[i]->file_size;
+                }
+                tree->stats.compactions++;
+                write_manifest(tree);
+
+                // readers still searching an input keep it alive until they're done
+                for (int i = 0; i < c.count; i++) unref_sst(c.inputs[i]);
+                free(outputs);
+            }
+            free(c.inputs);
+            continue;
+        }
+
+        if (tree->stopping) break;
+        pthread_cond_wait(&tree->work, &tree->lock);
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    return NULL;
+}
+
+/* Write-ahead log */
+
+static bool wal_open(LSMTree *tree, MemTable *mem) {
+    char path[512];
+    mem->wal_id = tree->next_file++;
+    snprintf(path, sizeof(path), "%s/%06lu.wal", tree->dir, mem->wal_id);
+    mem->wal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    return mem->wal_fd >= 0;
+}
+
+static bool wal_append(LSMTree *tree, MemTable *mem, const char *key, const char *value, uint32_t length) {
+    uint32_t key_length = strlen(key);
+    size_t size = 8 + key_length + (length == LSM_TOMBSTONE ? 0 : length);
+    char *record = malloc(size);
+    if (!record) return false;
+
+    // same record layout as the SST data blocks
+    memcpy(record, &key_length, 4);
+    memcpy(record + 4, &length, 4);
+    memcpy(record + 8, key, key_length);
+    if (length != LSM_TOMBSTONE) memcpy(record + 8 + key_length, value, length);
+
+    // a put is acknowledged only once it would survive a crash
+    bool ok = write_all(mem->wal_fd, record, size) && fdatasync(mem->wal_fd) == 0;
+    free(record);
+    if (ok) tree->stats.wal_bytes += size;
+    return ok;
+}
+
+static bool wal_replay(const char *path, MemTable *mem) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) < 0 || !(data = malloc(st.st_size + 1)) || !read_all(fd, data, st.st_size, 0)) {
+        free(data);
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    // a torn record at the end (crash during the append) is ignored
+    for (size_t pos = 0; pos + 8 <= (size_t)st.st_size;) {
+        uint32_t key_length, length;
+        memcpy(&key_length, data + pos, 4);
+        memcpy(&length, data + pos + 4, 4);
+        size_t record = 8 + key_length + (length == LSM_TOMBSTONE ? 0 : length);
+        if (pos + record > (size_t)st.st_size) break;
+
+        char *key = strndup(data + pos + 8, key_length);
+        if (key) memtable_put(mem, key, data + pos + 8 + key_length, length, length == LSM_TOMBSTONE);
+        free(key);
+        pos += record;
+    }
+
+    free(data);
+    return true;
+}
+
+/* Tree functions */
+
+static int compare_ids(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+// loads the MANIFEST, removes the files it doesn't reference and replays the logs
+static bool recover_tree(LSMTree *tree) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/MANIFEST", tree->dir);
+
+    FILE *manifest = fopen(path, "r");
+    if (manifest) {
+        int level;
+        unsigned long id;
+        if (fscanf(manifest, "next %lu\n", &tree->next_file) != 1) tree->next_file = 1;
+        while (fscanf(manifest, "%d %lu\n", &level, &id) == 2) {
+            if (level < 0 || level >= LSM_MAX_LEVELS) continue;
+            SSTable *sst = open_sst(tree->dir, id);
+            if (!sst || !level_add(tree, level, sst)) {
+                free_sst(sst);
+                fclose(manifest);
+                return false;
+            }
+        }
+        fclose(manifest);
+    }
+
+    DIR *dir = opendir(tree->dir);
+    if (!dir) return false;
+
+    unsigned long *wals = NULL;
+    size_t wal_count = 0, wal_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long id;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%lu.%7s", &id, suffix) != 2) continue;
+        if (id >= tree->next_file) tree->next_file = id + 1;
+
+        if (strcmp(suffix, "sst") == 0) {
+            bool live = false;
+            for (int level = 0; level < LSM_MAX_LEVELS && !live; level++) {
+                for (int i = 0; i < tree->counts[level]; i++) {
+                    if (tree->levels[level][i]->id == id) live = true;
+                }
+            }
+            if (!live) {
+                // output of a flush or compaction that didn't reach the MANIFEST
+                snprintf(path, sizeof(path), "%s/%s", tree->dir, entry->d_name);
+                unlink(path);
+            }
+        } else if (strcmp(suffix, "wal") == 0) {
+            if (wal_count == wal_capacity) {
+                wal_capacity = wal_capacity ? wal_capacity * 2 : 8;
+                unsigned long *bigger = realloc(wals, sizeof(unsigned long) * wal_capacity);
+                if (!bigger) break;
+                wals = bigger;
+            }
+            wals[wal_count++] = id;
+        }
+    }
+    closedir(dir);
+
+    if (wal_count == 0) {
+        free(wals);
+        return true;
+    }
+
+    // logs are replayed oldest first into a memtable that is flushed straight away
+    qsort(wals, wal_count, sizeof(unsigned long), compare_ids);
+    MemTable *mem = create_memtable();
+    bool ok = mem != NULL;
+    for (size_t i = 0; ok && i < wal_count; i++) {
+        snprintf(path, sizeof(path), "%s/%06lu.wal", tree->dir, wals[i]);
+        wal_replay(path, mem);
+    }
+
+    if (ok && mem->count > 0) {
+        SSTable *sst = flush_memtable(tree, mem, tree->next_file++);
+        ok = sst && level_add(tree, 0, sst) && write_manifest(tree);
+    }
+    if (ok) {
+        for (size_t i = 0; i < wal_count; i++) {
+            snprintf(path, sizeof(path), "%s/%06lu.wal", tree->dir, wals[i]);
+            unlink(path);
+        }
+    }
+
+    free_memtable(mem, tree->dir, true);
+    free(wals);
+    return ok;
+}
+
+LSMTree *lsm_open(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return NULL;
+
+    LSMTree *tree = calloc(1, sizeof(LSMTree));
+    if (!tree) return NULL;
+
+    tree->dir = strdup(dir);
+    tree->next_file = 1;
+    pthread_mutex_init(&tree->lock, NULL);
+    pthread_cond_init(&tree->work, NULL);
+    pthread_cond_init(&tree->done, NULL);
+
+    if (!tree->dir || !recover_tree(tree) || !(tree->mem = create_memtable()) || !wal_open(tree, tree->mem) ||
+        pthread_create(&tree->background, NULL, background_worker, tree) != 0) {
+        free_memtable(tree->mem, dir, true);
+        for (int level = 0; level < LSM_MAX_LEVELS; level++) {
+            for (int i = 0; i < tree->counts[level]; i++) free_sst(tree->levels[level][i]);
+            free(tree->levels[level]);
+        }
+        free(tree->dir);
+        free(tree);
+        return NULL;
+    }
+
+    return tree;
+}
+
+// turns the memtable into the immutable one, waiting if the previous one isn't flushed yet
+static bool rotate_memtable(LSMTree *tree) {
+    while (tree->imm) pthread_cond_wait(&tree->done, &tree->lock);
+
+    MemTable *mem = create_memtable();
+    if (!mem || !wal_open(tree, mem)) {
+        free_memtable(mem, tree->dir, true);
+        return false;
+    }
+
+    tree->imm = tree->mem;
+    tree->mem = mem;
+    pthread_cond_signal(&tree->work);
+    return true;
+}
+
+static bool lsm_write(LSMTree *tree, const char *key, const char *value, uint32_t length) {
+    bool tombstone = length == LSM_TOMBSTONE;
+    if (!key || strlen(key) == 0) return false;
+
+    pthread_mutex_lock(&tree->lock);
+
+    if (tree->mem->bytes >= LSM_MEMTABLE_SIZE && !rotate_memtable(tree)) {
+        pthread_mutex_unlock(&tree->lock);
+        return false;
+    }
+
+    bool ok = wal_append(tree, tree->mem, key, value, length) &&
+              memtable_put(tree->mem, key, value, tombstone ? 0 : length, tombstone);
+    if (ok) {
+        if (tombstone) tree->stats.deletes++;
+        else tree->stats.puts++;
+        tree->stats.user_bytes += strlen(key) + (tombstone ? 0 : length);
+    }
+
+    pthread_mutex_unlock(&tree->lock);
+    return ok;
+}
+
+bool lsm_put(LSMTree *tree, const char *key, const char *value, size_t length) {
+    if (length >= LSM_TOMBSTONE) return false;
+    return lsm_write(tree, key, value, (uint32_t)length);
+}
+
+bool lsm_delete(LSMTree *tree, const char *key) {
+    return lsm_write(tree, key, NULL, LSM_TOMBSTONE);
+}
+
+// returns a copy of the value (to be freed) or NULL if the key doesn't exist
+char *lsm_get(LSMTree *tree, const char *key, size_t *length) {
+    pthread_mutex_lock(&tree->lock);
+    tree->stats.gets++;
+
+    MemTable *memtables[2] = { tree->mem, tree->imm };
+    for (int i = 0; i < 2; i++) {
+        SkipNode *node = memtables[i] ? memtable_find(memtables[i], key, NULL) : NULL;
+        if (node) {
+            char *value = node->value ? strndup(node->value, node->length) : NULL;
+            if (value && length) *length = node->length;
+            pthread_mutex_unlock(&tree->lock);
+            return value;
+        }
+    }
+
+    // candidate files from the newest to the oldest, referenced so compactions can't free them
+    int max = tree->counts[0] + LSM_MAX_LEVELS;
+    SSTable **candidates = malloc(sizeof(SSTable*) * max);
+    int count = 0;
+    if (candidates) {
+        for (int i = tree->counts[0] - 1; i >= 0; i--) {
+            candidates[count++] = tree->levels[0][i];
+        }
+        for (int level = 1; level < LSM_MAX_LEVELS; level++) {
+            // files are sorted and disjoint: the last one starting before the key
+            int lo = 0, hi = tree->counts[level] - 1, found = -1;
+            while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+                if (strcmp(tree->levels[level][mid]->smallest, key) <= 0) {
+                    found = mid;
+                    lo = mid + 1;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            if (found >= 0) candidates[count++] = tree->levels[level][found];
+        }
+        for (int i = 0; i < count; i++) candidates[i]->refs++;
+    }
+    pthread_mutex_unlock(&tree->lock);
+
+    char *value = NULL;
+    for (int i = 0; i < count; i++) {
+        if (sst_get(candidates[i], key, &value, length, &tree->stats) != 0) break;
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    for (int i = 0; i < count; i++) unref_sst(candidates[i]);
+    pthread_mutex_unlock(&tree->lock);
+
+    free(candidates);
+    return value;
+}
+
+// writes the memtable to L0 and waits for the flush to complete
+bool lsm_flush(LSMTree *tree) {
+    pthread_mutex_lock(&tree->lock);
+
+    bool ok = true;
+    if (tree->mem->count > 0) ok = rotate_memtable(tree);
+    while (ok && tree->imm) pthread_cond_wait(&tree->done, &tree->lock);
+
+    pthread_mutex_unlock(&tree->lock);
+    return ok;
+}
+
+LSMStats lsm_stats(LSMTree *tree) {
+    pthread_mutex_lock(&tree->lock);
+    LSMStats stats = tree->stats;
+    for (int level = 0; level < LSM_MAX_LEVELS; level++) stats.files[level] = tree->counts[level];
+    pthread_mutex_unlock(&tree->lock);
+
+    unsigned long written = stats.wal_bytes + stats.flush_bytes + stats.compaction_bytes;
+    stats.write_amplification = stats.user_bytes ? (double)written / stats.user_bytes : 0.0;
+    return stats;
+}
+
+void lsm_close(LSMTree *tree) {
+    if (tree == NULL) return;
+
+    // if the memtable can't reach an SST its log is kept, the next lsm_open() replays it
+    bool flushed = lsm_flush(tree);
+
+    pthread_mutex_lock(&tree->lock);
+    tree->stopping = true;
+    pthread_cond_signal(&tree->work);
+    pthread_mutex_unlock(&tree->lock);
+    pthread_join(tree->background, NULL);
+
+    free_memtable(tree->imm, tree->dir, false);
+    free_memtable(tree->mem, tree->dir, flushed && tree->mem->count == 0);
+    for (int level = 0; level < LSM_MAX_LEVELS; level++) {
+        for (int i = 0; i < tree->counts[level]; i++) free_sst(tree->levels[level][i]);
+        free(tree->levels[level]);
+    }
+
+    pthread_mutex_destroy(&tree->lock);
+    pthread_cond_destroy(&tree->work);
+    pthread_cond_destroy(&tree->done);
+    free(tree->dir);
+    free(tree);
+}
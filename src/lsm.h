@@ -0,0 +1,46 @@
+#ifndef LSM_H
+#define LSM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LSM_MEMTABLE_SIZE (4 << 20)      // bytes buffered in memory before a flush
+#define LSM_BLOCK_SIZE 4096              // target size of an SST data block
+#define LSM_SST_TARGET_SIZE (2 << 20)    // compactions split their output at this size
+#define LSM_BLOOM_BITS_PER_KEY 10        // ~1% false positives
+#define LSM_L0_COMPACTION_TRIGGER 4      // L0 files that start a compaction into L1
+#define LSM_L1_MAX_BYTES (10 << 20)
+#define LSM_LEVEL_MULTIPLIER 10          // each level is 10 times bigger than the previous one
+#define LSM_MAX_LEVELS 7
+#define LSM_SKIPLIST_MAX_LEVEL 16
+
+/* Data Structures */
+
+typedef struct LSMTree LSMTree;
+
+typedef struct {
+    unsigned long puts;
+    unsigned long deletes;
+    unsigned long gets;
+    unsigned long bloom_negatives;  // SST lookups skipped thanks to the Bloom filters
+    unsigned long user_bytes;       // key + value bytes written by the callers
+    unsigned long wal_bytes;        // bytes appended to the write-ahead logs
+    unsigned long flush_bytes;      // bytes of SST files written by memtable flushes
+    unsigned long compaction_bytes; // bytes of SST files written by compactions
+    unsigned long flushes;
+    unsigned long compactions;
+    int files[LSM_MAX_LEVELS];      // SST files per level
+    double write_amplification;     // (wal + flush + compaction bytes) / user bytes
+} LSMStats;
+
+/* Functions */
+
+LSMTree *lsm_open(const char *dir);
+bool lsm_put(LSMTree *tree, const char *key, const char *value, size_t length);
+bool lsm_delete(LSMTree *tree, const char *key);
+char *lsm_get(LSMTree *tree, const char *key, size_t *length);
+bool lsm_flush(LSMTree *tree);
+LSMStats lsm_stats(LSMTree *tree);
+void lsm_close(LSMTree *tree);
+
+#endif // LSM_H
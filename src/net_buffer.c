@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "net_buffer.h"
+
+/*
+
+CONNECTION BUFFERS
+
+Most connections are idle most of the time, and an idle connection has nothing to keep:
+no partial request, no response waiting for the socket. Connection buffers therefore hold
+memory only while they hold bytes. A buffer takes a block when data arrives (or a response
+is queued) and gives it back as soon as it is empty, so ten thousand idle connections cost
+their Connection structures and nothing more.
+
+Blocks come from a pool shared by all the workers, in power of two size classes from 1 KB
+to 1 MB. A buffer starts with the smallest class that fits and moves to the next one when
+it fills up (a big document, a long pipeline), so growth is geometric and a released block
+of any size is reused by the next buffer of its class. Each class keeps its free blocks in
+a list threaded through the blocks themselves, up to `limit` bytes; above that, and for
+blocks beyond the biggest class, memory goes back to malloc.
+
+Bytes are consumed from the front and appended at the back. The frame parser hands out
+pointers into the buffer, so data is never wrapped around the end: when the back is full
+the unconsumed bytes are moved to the front if that makes room, and the buffer grows
+otherwise. Each class has its own lock, held for a push or a pop.
+
+*/
+
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+typedef struct {
+    FreeBlock *free;
+    size_t pooled;         // bytes on the free list
+    pthread_mutex_t lock;
+} SizeClass;
+
+struct NetBufferPool {
+    SizeClass classes[NET_BUFFER_CLASSES];
+    size_t limit;          // free bytes kept per class
+    pthread_mutex_t stats_lock;
+    NetBufferPoolStats stats;
+};
+
+static size_t class_size(int index) {
+    return (size_t)1 << (NET_BUFFER_MIN_SHIFT + index);
+}
+
+// smallest class holding `size` bytes, NET_BUFFER_CLASSES if none does
+static int class_index(size_t size) {
+    int index = 0;
+    while (index < NET_BUFFER_CLASSES && class_size(index) < size) index++;
+    return index;
+}
+
+NetBufferPool *create_net_buffer_pool(size_t limit) {
+    NetBufferPool *pool = calloc(1, sizeof(NetBufferPool));
+    if (!pool) return NULL;
+
+    pool->limit = limit ? limit : NET_BUFFER_POOL_LIMIT;
+    for (int i = 0; i < NET_BUFFER_CLASSES; i++) pthread_mutex_init(&pool->classes[i].lock, NULL);
+    pthread_mutex_init(&pool->stats_lock, NULL);
+    return pool;
+}
+
+// a block of at least `size` bytes, its actual size in *capacity
+char *net_buffer_pool_get(NetBufferPool *pool, size_t size, size_t *capacity) {
+    int index = class_index(size);
+    char *block = NULL;
+
+    if (index < NET_BUFFER_CLASSES) {
+        SizeClass *class = &pool->classes[index];
+        *capacity = class_size(index);
+
+        pthread_mutex_lock(&class->lock);
+        FreeBlock *free_block = class->free;
+        if (free_block) {
+            class->free = free_block->next;
+            class->pooled -= *capacity;
+        }
+        pthread_mutex_unlock(&class->lock);
+
+        block = (char *)free_block;
+    } else {
+        *capacity = size;
+    }
+
+    bool hit = block != NULL;
+    if (!block) block = malloc(*capacity);
+    if (!block) return NULL;
+
+    pthread_mutex_lock(&pool->stats_lock);
+    if (hit) pool->stats.hits++;
+    else pool->stats.misses++;
+    if (index == NET_BUFFER_CLASSES) pool->stats.oversized++;
+    pool->stats.in_use += *capacity;
+    pthread_mutex_unlock(&pool->stats_lock);
+    return block;
+}
+
+// gives a block back, `capacity` is the one net_buffer_pool_get() returned
+void net_buffer_pool_put(NetBufferPool *pool, char *block, size_t capacity) {
+    if (block == NULL) return;
+
+    pthread_mutex_lock(&pool->stats_lock);
+    pool->stats.in_use -= capacity;
+    pthread_mutex_unlock(&pool->stats_lock);
+
+    int index = class_index(capacity);
+    if (index < NET_BUFFER_CLASSES && class_size(index) == capacity) {
+        SizeClass *class = &pool->classes[index];
+        pthread_mutex_lock(&class->lock);
+        if (class->pooled + capacity <= pool->limit) {
+            FreeBlock *free_block = (FreeBlock *)block;
+            free_block->next = class->free;
+            class->free = free_block;
+            class->pooled += capacity;
+            block = NULL;
+        }
+        pthread_mutex_unlock(&class->lock);
+    }
+    free(block);
+}
+
+NetBufferPoolStats net_buffer_pool_stats(NetBufferPool *pool) {
+    pthread_mutex_lock(&pool->stats_lock);
+    NetBufferPoolStats stats = pool->stats;
+    pthread_mutex_unlock(&pool->stats_lock);
+
+    for (int i = 0; i < NET_BUFFER_CLASSES; i++) {
+        pthread_mutex_lock(&pool->classes[i].lock);
+        stats.pooled += pool->classes[i].pooled;
+        pthread_mutex_unlock(&pool->classes[i].lock);
+    }
+    return stats;
+}
+
+// blocks still handed out aren't tracked, their buffers must be released first
+void free_net_buffer_pool(NetBufferPool *pool) {
+    if (pool == NULL) return;
+
+    for (int i = 0; i < NET_BUFFER_CLASSES; i++) {
+        FreeBlock *block = pool->classes[i].free;
+        while (block) {
+            FreeBlock *next = block->next;
+            free(block);
+            block = next;
+        }
+        pthread_mutex_destroy(&pool->classes[i].lock);
+    }
+    pthread_mutex_destroy(&pool->stats_lock);
+    free(pool);
+}
+
+size_t net_buffer_length(const NetBuffer *buffer) {
+    return buffer->end - buffer->start;
+}
+
+// makes room for `size` more bytes after buffer->end, moving or growing the buffer
+bool net_buffer_reserve(NetBufferPool *pool, NetBuffer *buffer, size_t size) {
+    if (buffer->data && buffer->capacity - buffer->end >= size) return true;
+
+    size_t length = net_buffer_length(buffer);
+    if (buffer->data && buffer->capacity - length >= size) {
+        memmove(buffer->data, buffer->data + buffer->start, length);
+        buffer->start = 0;
+        buffer->end = length;
+        return true;
+    }
+
+    size_t capacity;
+    char *data = net_buffer_pool_get(pool, length + size, &capacity);
+    if (!data) return false;
+
+    if (length > 0) memcpy(data, buffer->data + buffer->start, length);
+    net_buffer_pool_put(pool, buffer->data, buffer->capacity);
+    *buffer = (NetBuffer){data, 0, length, capacity};
+    return true;
+}
+
+void net_buffer_consume(NetBuffer *buffer, size_t length) {
+    buffer->start += length;
+    if (buffer->start == buffer->end) buffer->start = buffer->end = 0;
+}
+
+// gives the memory of a buffer back to the pool, whatever it holds is dropped
+void net_buffer_release(NetBufferPool *pool, NetBuffer *buffer) {
+    net_buffer_pool_put(pool, buffer->data, buffer->capacity);
+    *buffer = (NetBuffer){NULL, 0, 0, 0};
+}
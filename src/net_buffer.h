@@ -0,0 +1,44 @@
+#ifndef NET_BUFFER_H
+#define NET_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define NET_BUFFER_MIN_SHIFT 10            // smallest class: 1 KB
+#define NET_BUFFER_CLASSES 11              // 1 KB ... 1 MB, bigger buffers aren't pooled
+#define NET_BUFFER_POOL_LIMIT (4 << 20)    // default free bytes kept per class
+
+/* Data Structures */
+
+typedef struct NetBufferPool NetBufferPool;
+
+// bytes in [start, end) of data, the memory comes from a pool
+typedef struct {
+    char *data;         // NULL while the buffer holds no memory
+    size_t start;       // first byte not consumed
+    size_t end;         // first free byte
+    size_t capacity;
+} NetBuffer;
+
+typedef struct {
+    unsigned long hits;       // buffers served from a free list
+    unsigned long misses;     // buffers allocated
+    unsigned long oversized;  // buffers beyond the biggest class
+    size_t in_use;            // bytes handed out
+    size_t pooled;            // bytes kept on the free lists
+} NetBufferPoolStats;
+
+/* Functions */
+
+NetBufferPool *create_net_buffer_pool(size_t limit);
+char *net_buffer_pool_get(NetBufferPool *pool, size_t size, size_t *capacity);
+void net_buffer_pool_put(NetBufferPool *pool, char *block, size_t capacity);
+NetBufferPoolStats net_buffer_pool_stats(NetBufferPool *pool);
+void free_net_buffer_pool(NetBufferPool *pool);
+
+bool net_buffer_reserve(NetBufferPool *pool, NetBuffer *buffer, size_t size);
+void net_buffer_consume(NetBuffer *buffer, size_t length);
+void net_buffer_release(NetBufferPool *pool, NetBuffer *buffer);
+size_t net_buffer_length(const NetBuffer *buffer);
+
+#endif // NET_BUFFER_H
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "net_ring.h"
+
+/*
+
+NETWORK RING
+
+The sockets of a worker can be driven through io_uring instead of epoll: rather than
+being told a socket is ready and then calling recv() or sendmsg() on it, the worker queues
+the operations themselves in the submission ring and collects their results from the
+completion ring. Three kinds of requests cover a server:
+
+    multishot accept: armed once per listening socket, completes once per connection
+    multishot recv:   armed once per connection, completes every time data arrives, in a
+                      buffer the kernel picks from the ones we provided (see below)
+    sendmsg:          one per batch of responses, gathered like flush_output() does
+
+A multishot request stays armed as long as its completions carry IORING_CQE_F_MORE; the
+last one (an error, end of file, or no buffer left for a recv) has to be armed again.
+
+Receive buffers are provided with a buffer ring (IORING_REGISTER_PBUF_RING): a ring of
+NET_RING_BUFFER_SIZE blocks shared with the kernel, which takes one per completion. The
+caller copies the data out and gives the buffer back with net_ring_recycle(), a store in
+shared memory. Idle connections hold no buffer at all, whatever their number.
+
+Requests are only written in the ring until net_ring_wait(), which submits all of them
+and waits for completions in the same io_uring_enter(); the completions are then read
+with no system call. A busy worker goes around its loop with one enter for every batch of
+completions, however many connections and requests the batch covers.
+
+The rings are mapped by hand like in io_engine.c, liburing isn't required. Everything but
+the setup needs Linux 6.0 (multishot recv); the ring belongs to one thread, created by
+it, and is flagged so (IORING_SETUP_SINGLE_ISSUER) when the kernel knows the flag.
+
+*/
+
+struct NetRing {
+    int fd;
+    unsigned sq_entries, cq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned tail;         // entries written, published to the kernel by enter()
+    unsigned to_submit;    // entries written and not submitted yet
+
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffer_memory;
+    unsigned buffer_count, buffer_size;
+    uint16_t buffer_tail;  // buffers given to the kernel, it wraps like the kernel's index
+
+    NetRingStats stats;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool map_rings(NetRing *ring, const struct io_uring_params *params) {
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        return false;
+    }
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            return false;
+        }
+    }
+
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return false;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params->sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params->sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+    ring->sq_entries = params->sq_entries;
+    ring->cq_entries = params->cq_entries;
+    ring->tail = *ring->sq_tail;
+    return true;
+}
+
+// registers buffer group 0 and hands all of its buffers to the kernel
+static bool provide_buffers(NetRing *ring, unsigned count, unsigned size) {
+    ring->buffer_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffer_ring == MAP_FAILED) {
+        ring->buffer_ring = NULL;
+        return false;
+    }
+    ring->buffer_memory = malloc((size_t)count * size);
+    if (!ring->buffer_memory) return false;
+    ring->buffer_count = count;
+    ring->buffer_size = size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)ring->buffer_ring;
+    reg.ring_entries = count;
+    reg.bgid = 0;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+
+    for (unsigned i = 0; i < count; i++) net_ring_recycle(ring, i);
+    return true;
+}
+
+/*
+ * Creates a ring of `entries` submission entries with `buffers` receive buffers (a power
+ * of two) of `buffer_size` bytes, 0 for the defaults. The calling thread is the only one
+ * that may use it. Returns NULL if the kernel can't provide one.
+ */
+NetRing *create_net_ring(unsigned entries, unsigned buffers, unsigned buffer_size) {
+    if (entries == 0) entries = NET_RING_ENTRIES;
+    if (buffers == 0) buffers = NET_RING_BUFFERS;
+    if (buffer_size == 0) buffer_size = NET_RING_BUFFER_SIZE;
+    if ((buffers & (buffers - 1)) != 0 || buffers > 32768) return NULL;
+
+    NetRing *ring = calloc(1, sizeof(NetRing));
+    if (!ring) return NULL;
+
+    // multishot requests complete many times each: the completion queue is made bigger, and
+    // completions that still don't fit wait in the kernel (IORING_FEAT_NODROP), never lost
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // kernels before 6.1 don't know the task work flags
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring->fd = sys_io_uring_setup(entries, &params);
+    }
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    // net_ring_wait() passes its timeout with IORING_ENTER_EXT_ARG
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+        !map_rings(ring, &params) || !provide_buffers(ring, buffers, buffer_size)) {
+        free_net_ring(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void free_net_ring(NetRing *ring) {
+    if (ring == NULL) return;
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    // closing the ring cancels whatever is in flight, then the buffers are ours again
+    close(ring->fd);
+    if (ring->buffer_ring) munmap(ring->buffer_ring, ring->buffer_ring_size);
+    free(ring->buffer_memory);
+    free(ring);
+}
+
+/*
+ * Publishes the entries written and submits them, waiting for `min_complete` completions
+ * for up to `timeout_ms` (-1 for no limit). Returns the entries submitted, or -errno.
+ */
+static int enter(NetRing *ring, unsigned min_complete, int timeout_ms) {
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int n = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags,
+                         (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                         (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : _NSIG / 8);
+    ring->stats.enters++;
+    if (n < 0) return -errno;
+    ring->to_submit -= (unsigned)n < ring->to_submit ? (unsigned)n : ring->to_submit;
+    ring->stats.submitted += n;
+    return n;
+}
+
+// the next free submission entry, zeroed; a full queue is submitted first
+static struct io_uring_sqe *get_sqe(NetRing *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->tail - head >= ring->sq_entries) {
+        enter(ring, 0, -1);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->tail - head >= ring->sq_entries) return NULL;
+    }
+
+    unsigned index = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+// multishot accept on a listening socket, the connections are non blocking and close on exec
+bool net_ring_accept(NetRing *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+    return true;
+}
+
+// multishot recv into the provided buffers
+bool net_ring_recv(NetRing *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+    return true;
+}
+
+// the message and the memory it points to must stay valid until the completion
+bool net_ring_sendmsg(NetRing *ring, int fd, const struct msghdr *message, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return true;
+}
+
+// one shot poll, completes with the events ready (POLLIN, POLLOUT...)
+bool net_ring_poll(NetRing *ring, int fd, unsigned events, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+    return true;
+}
+
+// cancels the request submitted with user_data `target`; cancellations complete with user_data 0
+bool net_ring_cancel(NetRing *ring, uint64_t target) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = target;
+    sqe->user_data = 0;
+    return true;
+}
+
+// cancels every request on `fd`, to be done before it's closed
+bool net_ring_cancel_fd(NetRing *ring, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = 0;
+    return true;
+}
+
+static unsigned ready(const NetRing *ring) {
+    return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+/*
+ * Submits what is queued and waits up to `timeout_ms` for a completion, in a single
+ * io_uring_enter(); none at all if nothing is queued and completions are ready. Returns
+ * the completions ready, or -1 on errors.
+ */
+int net_ring_wait(NetRing *ring, int timeout_ms) {
+    if (ready(ring) == 0 || ring->to_submit > 0) {
+        int n = enter(ring, ready(ring) == 0 ? 1 : 0, timeout_ms);
+        if (n < 0 && n != -ETIME && n != -EINTR && n != -EBUSY && n != -EAGAIN) return -1;
+    }
+    return (int)ready(ring);
+}
+
+// runs `handler` on every completion ready, returns how many
+int net_ring_reap(NetRing *ring, NetCompletionHandler handler, void *arg) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int reaped = 0;
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        NetCompletion completion = {cqe->user_data, cqe->res, (cqe->flags & IORING_CQE_F_MORE) != 0,
+                                    NET_RING_NO_BUFFER};
+        if (cqe->flags & IORING_CQE_F_BUFFER) completion.buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        // the slot is released before the handler runs, it may submit more requests
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        ring->stats.completions++;
+        handler(&completion, arg);
+        reaped++;
+
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return reaped;
+}
+
+// the data of a completion, valid until the buffer is recycled
+const char *net_ring_buffer(const NetRing *ring, int buffer) {
+    return ring->buffer_memory + (size_t)buffer * ring->buffer_size;
+}
+
+// gives a buffer back to the kernel
+void net_ring_recycle(NetRing *ring, int buffer) {
+    // the ring's tail sits over the reserved field of the first entry, left untouched
+    struct io_uring_buf *entry = &ring->buffer_ring->bufs[ring->buffer_tail & (ring->buffer_count - 1)];
+    entry->addr = (unsigned long long)(uintptr_t)(ring->buffer_memory + (size_t)buffer * ring->buffer_size);
+    entry->len = ring->buffer_size;
+    entry->bid = buffer;
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+NetRingStats net_ring_stats(const NetRing *ring) {
+    return ring->stats;
+}
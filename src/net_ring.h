@@ -0,0 +1,52 @@
+#ifndef NET_RING_H
+#define NET_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define NET_RING_ENTRIES 1024          // submission queue, the completion queue is 4 times bigger
+#define NET_RING_BUFFERS 512           // receive buffers provided to the kernel, a power of two
+#define NET_RING_BUFFER_SIZE (4 << 10)
+#define NET_RING_NO_BUFFER -1
+
+/* Data Structures */
+
+typedef struct NetRing NetRing;
+
+typedef struct {
+    uint64_t user_data;
+    int result;         // what the system call would return, or -errno
+    bool more;          // a multishot request stays armed and completes again
+    int buffer;         // provided buffer holding the data received, NET_RING_NO_BUFFER if none
+} NetCompletion;
+
+typedef void (*NetCompletionHandler)(const NetCompletion *completion, void *arg);
+
+typedef struct {
+    unsigned long enters;       // io_uring_enter() calls
+    unsigned long submitted;    // requests passed to the kernel
+    unsigned long completions;
+} NetRingStats;
+
+/* Functions */
+
+NetRing *create_net_ring(unsigned entries, unsigned buffers, unsigned buffer_size);
+void free_net_ring(NetRing *ring);
+
+bool net_ring_accept(NetRing *ring, int fd, uint64_t user_data);
+bool net_ring_recv(NetRing *ring, int fd, uint64_t user_data);
+bool net_ring_sendmsg(NetRing *ring, int fd, const struct msghdr *message, uint64_t user_data);
+bool net_ring_poll(NetRing *ring, int fd, unsigned events, uint64_t user_data);
+bool net_ring_cancel(NetRing *ring, uint64_t target);
+bool net_ring_cancel_fd(NetRing *ring, int fd);
+
+int net_ring_wait(NetRing *ring, int timeout_ms);
+int net_ring_reap(NetRing *ring, NetCompletionHandler handler, void *arg);
+
+const char *net_ring_buffer(const NetRing *ring, int buffer);
+void net_ring_recycle(NetRing *ring, int buffer);
+NetRingStats net_ring_stats(const NetRing *ring);
+
+#endif // NET_RING_H
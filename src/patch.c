@@ -0,0 +1,1013 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "db_manager.h"
+#include "eviction.h"
+#include "json_util.h"
+#include "patch.h"
+
+/*
+
+PARTIAL UPDATES
+
+Changing one field of a document used to mean rewriting the whole file. A patch is applied
+to the document text in memory instead: the text is tokenized, the byte range of the
+field is found and only that range is replaced, everything else is moved as it is.
+Supported operations are RFC 7386 merge patches and set / unset / increment of a field
+given by a dotted path ("stats.views").
+
+Only a small delta record is persisted, appended to <id>.log. read_document(), the
+asynchronous reads and the recovery replay the log over the <id>.json image, so every
+reader sees the patched document. After PATCH_MAX_DELTAS records, or once the records
+outweigh the document (and PATCH_MIN_LOG_BYTES, below which a replay costs next to
+nothing), the document is consolidated: the full image is written to a new file, renamed
+over the old one, and an empty log is started for it. The body in memory is the image just
+written, so the next delta is a plain append, nothing is read back.
+
+Collections stored in an LSMTree have no log: the patched body is put whole, the tree
+turns it into an append.
+
+The log header records the inode, size and mtime of the image it applies to. A crash
+between the rename and the removal of the log leaves a log whose header doesn't match the
+new image: it is ignored instead of being applied twice.
+
+*/
+
+typedef struct {
+    const char *key;
+    size_t length;
+} PathSegment;
+
+// replaces `removed` bytes at `offset` with `insert`, the content stays NUL terminated
+static bool splice(char **content, size_t *length, size_t offset, size_t removed,
+                   const char *insert, size_t insert_length) {
+    size_t new_length = *length - removed + insert_length;
+    if (insert_length > removed) {
+        char *grown = realloc(*content, new_length + 1);
+        if (!grown) return false;
+        *content = grown;
+    }
+
+    memmove(*content + offset + insert_length, *content + offset + removed, *length - offset - removed + 1);
+    memcpy(*content + offset, insert, insert_length);
+    *length = new_length;
+    return true;
+}
+
+// key token of a member of `object`, -1 if missing. *previous is the value before it, if any
+static int find_member(const char *content, const jsmntok_t *tokens, int count, int object,
+                       PathSegment segment, int *previous) {
+    if (previous) *previous = -1;
+    if (tokens[object].type != JSMN_OBJECT) return -1;
+
+    for (int i = object + 1; i + 1 < count && tokens[i].start < tokens[object].end;
+         i = json_skip_subtree(tokens, count, i + 1)) {
+        if ((size_t)(tokens[i].end - tokens[i].start) == segment.length &&
+            memcmp(content + tokens[i].start, segment.key, segment.length) == 0) {
+            return i;
+        }
+        if (previous) *previous = i + 1;
+    }
+    return -1;
+}
+
+// value token at the end of a path, -1 if the path doesn't exist
+static int find_path(const char *content, const jsmntok_t *tokens, int count, const PathSegment *path,
+                     int depth) {
+    int value = 0;
+    for (int d = 0; d < depth; d++) {
+        int key = find_member(content, tokens, count, value, path[d], NULL);
+        if (key < 0) return -1;
+        value = key + 1;
+    }
+    return value;
+}
+
+// {"a": {"b": value}} for the path a.b, just the value for an empty path
+static char *nest(const PathSegment *path, int depth, const char *value, size_t value_length, size_t *length) {
+    size_t size = value_length + 1;
+    for (int d = 0; d < depth; d++) size += path[d].length + 6;
+
+    char *text = malloc(size);
+    if (!text) return NULL;
+
+    size_t used = 0;
+    for (int d = 0; d < depth; d++) {
+        text[used++] = '{';
+        text[used++] = '"';
+        memcpy(text + used, path[d].key, path[d].length);
+        used += path[d].length;
+        memcpy(text + used, "\": ", 3);
+        used += 3;
+    }
+    memcpy(text + used, value, value_length);
+    used += value_length;
+    for (int d = 0; d < depth; d++) text[used++] = '}';
+
+    text[used] = '\0';
+    *length = used;
+    return text;
+}
+
+static bool set_path(char **content, size_t *length, const PathSegment *path, int depth,
+                     const char *value, size_t value_length) {
+    int count = 0;
+    jsmntok_t *tokens = json_tokenize(*content, *length, &count);
+    if (!tokens) return false;
+
+    bool ok = false;
+    int object = 0;
+    for (int d = 0; d < depth && tokens[object].type == JSMN_OBJECT; d++) {
+        int key = find_member(*content, tokens, count, object, path[d], NULL);
+        size_t nested_length;
+
+        if (key < 0) {
+            // a new member before the closing brace, objects are created for the rest of the path
+            char *nested = nest(path + d + 1, depth - d - 1, value, value_length, &nested_length);
+            char *member = nested ? malloc(path[d].length + nested_length + 8) : NULL;
+            if (member) {
+                size_t used = 0;
+                if (tokens[object].size > 0) {
+                    memcpy(member, ", ", 2);
+                    used = 2;
+                }
+                member[used++] = '"';
+                memcpy(member + used, path[d].key, path[d].length);
+                used += path[d].length;
+                memcpy(member + used, "\": ", 3);
+                used += 3;
+                memcpy(member + used, nested, nested_length);
+                used += nested_length;
+                ok = splice(content, length, tokens[object].end - 1, 0, member, used);
+            }
+            free(member);
+            free(nested);
+            break;
+        }
+
+        object = key + 1;
+        if (d == depth - 1 || tokens[object].type != JSMN_OBJECT) {
+            // the value is replaced, by a chain of objects if the path goes on through a non object
+            char *nested = nest(path + d + 1, depth - d - 1, value, value_length, &nested_length);
+            size_t offset, removed;
+            json_value_range(&tokens[object], &offset, &removed);
+            ok = nested && splice(content, length, offset, removed, nested, nested_length);
+            free(nested);
+            break;
+        }
+    }
+
+    free(tokens);
+    return ok;
+}
+
+// removing a missing field is not an error, the result is the same
+static bool unset_path(char **content, size_t *length, const PathSegment *path, int depth) {
+    int count = 0;
+    jsmntok_t *tokens = json_tokenize(*content, *length, &count);
+    if (!tokens) return false;
+
+    int object = find_path(*content, tokens, count, path, depth - 1);
+    int previous;
+    int key = object < 0 ? -1 : find_member(*content, tokens, count, object, path[depth - 1], &previous);
+    if (key < 0) {
+        free(tokens);
+        return true;
+    }
+
+    size_t value_offset, value_length;
+    json_value_range(&tokens[key + 1], &value_offset, &value_length);
+    int next = json_skip_subtree(tokens, count, key + 1);
+
+    // the member goes away with one of the commas around it
+    size_t start, end;
+    if (next < count && tokens[next].start < tokens[object].end) {
+        start = tokens[key].start - 1;
+        end = tokens[next].start - 1;
+    } else if (previous >= 0) {
+        size_t previous_offset, previous_length;
+        json_value_range(&tokens[previous], &previous_offset, &previous_length);
+        start = previous_offset + previous_length;
+        end = value_offset + value_length;
+    } else {
+        start = tokens[key].start - 1;
+        end = value_offset + value_length;
+    }
+
+    free(tokens);
+    return splice(content, length, start, end - start, "", 0);
+}
+
+static bool is_integer(const char *text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '.' || text[i] == 'e' || text[i] == 'E') return false;
+    }
+    return true;
+}
+
+/*
+ * Adds `by` (a JSON number) to the number at path. Integers stay integers as long as
+ * they don't overflow, anything else is computed as a double.
+ */
+static bool increment_path(char **content, size_t *length, const PathSegment *path, int depth,
+                           const char *by, size_t by_length) {
+    int count = 0;
+    jsmntok_t *tokens = json_tokenize(*content, *length, &count);
+    if (!tokens) return false;
+
+    int value = find_path(*content, tokens, count, path, depth);
+    if (value < 0) {
+        free(tokens);
+        return set_path(content, length, path, depth, by, by_length);
+    }
+
+    // the increment may come straight from the log, where it isn't NUL terminated
+    char delta_text[64];
+    if (by_length >= sizeof(delta_text)) {
+        free(tokens);
+        return false;
+    }
+    memcpy(delta_text, by, by_length);
+    delta_text[by_length] = '\0';
+
+    const char *number = *content + tokens[value].start;
+    size_t number_length = tokens[value].end - tokens[value].start;
+    if (tokens[value].type != JSMN_PRIMITIVE || !(number[0] == '-' || (number[0] >= '0' && number[0] <= '9'))) {
+        free(tokens);
+        return false;
+    }
+
+    char result[32];
+    int result_length;
+    char *end;
+    errno = 0;
+
+    if (is_integer(number, number_length) && is_integer(by, by_length)) {
+        long long current = strtoll(number, &end, 10);
+        long long delta = strtoll(delta_text, NULL, 10);
+        long long sum;
+        if (errno || end != number + number_length || __builtin_add_overflow(current, delta, &sum)) {
+            free(tokens);
+            return false;
+        }
+        result_length = snprintf(result, sizeof(result), "%lld", sum);
+    } else {
+        double sum = strtod(number, &end) + strtod(delta_text, NULL);
+        if (end != number + number_length || !isfinite(sum)) {
+            free(tokens);
+            return false;
+        }
+        result_length = snprintf(result, sizeof(result), "%.17g", sum);
+    }
+
+    size_t offset = tokens[value].start;
+    free(tokens);
+    return splice(content, length, offset, number_length, result, result_length);
+}
+
+static bool is_object_at(const char *content, size_t length, const PathSegment *path, int depth) {
+    int count = 0;
+    jsmntok_t *tokens = json_tokenize(content, length, &count);
+    if (!tokens) return false;
+
+    int value = find_path(content, tokens, count, path, depth);
+    bool object = value >= 0 && tokens[value].type == JSMN_OBJECT;
+    free(tokens);
+    return object;
+}
+
+// merges the members of the patch object `patch_object` into the object at path
+static bool merge_at(char **content, size_t *length, PathSegment *path, int depth, const char *patch,
+                     const jsmntok_t *patch_tokens, int patch_count, int patch_object) {
+    for (int i = patch_object + 1; i + 1 < patch_count && patch_tokens[i].start < patch_tokens[patch_object].end;
+         i = json_skip_subtree(patch_tokens, patch_count, i + 1)) {
+        if (depth == PATCH_MAX_DEPTH) return false;
+        path[depth].key = patch + patch_tokens[i].start;
+        path[depth].length = patch_tokens[i].end - patch_tokens[i].start;
+
+        const jsmntok_t *value = &patch_tokens[i + 1];
+        size_t offset, value_length;
+        json_value_range(value, &offset, &value_length);
+
+        bool ok;
+        if (value->type == JSMN_PRIMITIVE && value_length == 4 && memcmp(patch + offset, "null", 4) == 0) {
+            ok = unset_path(content, length, path, depth + 1);
+        } else if (value->type == JSMN_OBJECT) {
+            // objects are merged recursively, into an empty object if the target isn't one
+            ok = is_object_at(*content, *length, path, depth + 1) ||
+                 set_path(content, length, path, depth + 1, "{}", 2);
+            ok = ok && merge_at(content, length, path, depth + 1, patch, patch_tokens, patch_count, i + 1);
+        } else {
+            ok = set_path(content, length, path, depth + 1, patch + offset, value_length);
+        }
+
+        if (!ok) return false;
+    }
+    return true;
+}
+
+static bool merge_patch(char **content, size_t *length, const char *patch, size_t patch_length) {
+    int count = 0;
+    jsmntok_t *tokens = json_tokenize(patch, patch_length, &count);
+    if (!tokens) return false;
+
+    bool ok;
+    if (tokens[0].type != JSMN_OBJECT) {
+        // a patch that isn't an object replaces the whole document
+        ok = splice(content, length, 0, *length, patch, patch_length);
+    } else {
+        ok = is_object_at(*content, *length, NULL, 0) || splice(content, length, 0, *length, "{}", 2);
+
+        PathSegment path[PATCH_MAX_DEPTH];
+        ok = ok && merge_at(content, length, path, 0, patch, tokens, count, 0);
+    }
+
+    free(tokens);
+    return ok;
+}
+
+static int parse_path(const char *path, PathSegment *segments) {
+    int depth = 0;
+    while (path && *path) {
+        const char *dot = strchr(path, '.');
+        size_t length = dot ? (size_t)(dot - path) : strlen(path);
+        if (length == 0 || depth == PATCH_MAX_DEPTH) return -1;
+
+        segments[depth].key = path;
+        segments[depth].length = length;
+        depth++;
+        path = dot ? dot + 1 : NULL;
+    }
+    return depth > 0 ? depth : -1;
+}
+
+/*
+ * Applies an operation to a NUL terminated document text, which may be reallocated. The
+ * result is not validated: a value that isn't valid JSON gives an invalid document.
+ */
+bool apply_patch(char **content, size_t *length, PatchOp op, const char *path, const char *value,
+                 size_t value_length) {
+    if (op == PATCH_MERGE) return merge_patch(content, length, value, value_length);
+
+    PathSegment segments[PATCH_MAX_DEPTH];
+    int depth = parse_path(path, segments);
+    if (depth < 0 || !is_object_at(*content, *length, NULL, 0)) return false;
+
+    switch (op) {
+        case PATCH_SET:
+            return set_path(content, length, segments, depth, value, value_length);
+        case PATCH_UNSET:
+            return unset_path(content, length, segments, depth);
+        case PATCH_INCREMENT:
+            return increment_path(content, length, segments, depth, value, value_length);
+        default:
+            return false;
+    }
+}
+
+static bool stat_image(int dirfd, const char *id, struct stat *st) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+    return fstatat(dirfd, filename, st, 0) == 0;
+}
+
+static bool header_matches(const PatchLogHeader *header, const struct stat *image) {
+    return header->magic == PATCH_LOG_MAGIC && header->base_inode == (uint64_t)image->st_ino &&
+           header->base_size == (uint64_t)image->st_size && header->base_mtime_s == image->st_mtim.tv_sec &&
+           header->base_mtime_ns == image->st_mtim.tv_nsec;
+}
+
+static char *build_record(PatchOp op, const char *path, const char *value, size_t value_length, size_t *size) {
+    size_t path_length = path ? strlen(path) : 0;
+    PatchRecord record = {op, path_length, value_length};
+    *size = sizeof(record) + path_length + value_length;
+
+    char *buffer = malloc(*size);
+    if (!buffer) return NULL;
+
+    memcpy(buffer, &record, sizeof(record));
+    if (path_length) memcpy(buffer + sizeof(record), path, path_length);
+    memcpy(buffer + sizeof(record) + path_length, value, value_length);
+    return buffer;
+}
+
+/*
+ * Appends a delta record to the document's log, starting a new log if there is none or it's
+ * stale. Once this process has started or appended to the log of the current image
+ * (doc->log_open) the header was already checked: the record is just appended, three
+ * syscalls in total.
+ */
+static bool append_record(Document *doc, PatchOp op, const char *path, const char *value,
+                          size_t value_length) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, doc->id);
+
+    // deltas apply to the image on disk, a pending update must get there first
+    if (!flush_pending_update(doc->id)) return false;
+
+    size_t size;
+    char *buffer = build_record(op, path, value, value_length, &size);
+    if (!buffer) return false;
+
+    // a single write per record, a crash can only leave the last one incomplete
+    if (doc->log_open) {
+        int fd = open(filename, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd >= 0) {
+            bool written = write(fd, buffer, size) == (ssize_t)size;
+            if (close(fd) < 0) written = false;
+            free(buffer);
+            if (written) doc->log_bytes += size;
+            return written;
+        }
+        // the log went away (the document was rewritten), a new one is started
+    }
+
+    struct stat image;
+    int fd = stat_image(AT_FDCWD, doc->id, &image) ? open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    if (fd < 0) {
+        free(buffer);
+        return false;
+    }
+
+    PatchLogHeader header;
+    bool written = true;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || !header_matches(&header, &image)) {
+        header = (PatchLogHeader){PATCH_LOG_MAGIC, 0, image.st_ino, image.st_size,
+                                  image.st_mtim.tv_sec, image.st_mtim.tv_nsec};
+        written = ftruncate(fd, 0) == 0 && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+
+    off_t end = lseek(fd, 0, SEEK_END);
+    written = written && end >= 0 && pwrite(fd, buffer, size, end) == (ssize_t)size;
+    free(buffer);
+
+    if (close(fd) < 0) written = false;
+    if (written) {
+        doc->log_open = true;
+        doc->log_bytes = end + size - sizeof(header);
+    }
+    return written;
+}
+
+/*
+ * Starts an empty log for the image just written, a crash halfway leaves a log without
+ * records. The old log is unlinked rather than truncated: appends still in flight through
+ * an engine hold it open, they must land in it and not in the new one.
+ */
+static bool start_log(const char *id) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, id);
+
+    struct stat image;
+    unlink(filename);
+    int fd = stat_image(AT_FDCWD, id, &image) ? open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644) : -1;
+    if (fd < 0) return false;
+
+    PatchLogHeader header = {PATCH_LOG_MAGIC, 0, image.st_ino, image.st_size,
+                             image.st_mtim.tv_sec, image.st_mtim.tv_nsec};
+    bool written = ftruncate(fd, 0) == 0 && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    if (close(fd) < 0) written = false;
+    return written;
+}
+
+/*
+ * Applies the delta log of a document, if there is a valid one, to its image just read
+ * from `dirfd`. An incomplete record (a crash in the middle of an append) ends the log.
+ */
+bool replay_document_log(int dirfd, const char *id, char **content, size_t *length) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, id);
+
+    int fd = openat(dirfd, filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return true; // the common case, nothing to replay
+
+    struct stat st, image;
+    char *log = NULL;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(PatchLogHeader) && (log = malloc(st.st_size)) != NULL) {
+        while (size < (size_t)st.st_size) {
+            ssize_t n = pread(fd, log + size, st.st_size - size, size);
+            if (n <= 0) break;
+            size += n;
+        }
+    }
+    close(fd);
+
+    PatchLogHeader header;
+    if (!log || size < sizeof(header) || !stat_image(dirfd, id, &image)) {
+        free(log);
+        return log == NULL;
+    }
+    memcpy(&header, log, sizeof(header));
+    if (!header_matches(&header, &image)) {
+        free(log);
+        return true; // left over from an older image
+    }
+
+    bool ok = true;
+    size_t position = sizeof(header);
+    while (ok && position + sizeof(PatchRecord) <= size) {
+        PatchRecord record;
+        memcpy(&record, log + position, sizeof(record));
+        size_t payload = (size_t)record.path_length + record.value_length;
+        if (payload > size - position - sizeof(record)) break;
+
+        char *path = strndup(log + position + sizeof(record), record.path_length);
+        ok = path && apply_patch(content, length, record.op, path,
+                                 log + position + sizeof(record) + record.path_length, record.value_length);
+        free(path);
+        position += sizeof(record) + payload;
+    }
+
+    free(log);
+    return ok;
+}
+
+// true if the document has deltas to replay, a log holding just its header changes nothing
+bool has_document_log(const char *id) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, id);
+
+    struct stat st;
+    return stat(filename, &st) == 0 && (size_t)st.st_size > sizeof(PatchLogHeader);
+}
+
+// an empty log still counts here: a full rewrite of the image removes it
+static bool log_exists(const char *id) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, id);
+    return access(filename, F_OK) == 0;
+}
+
+void remove_document_log(const char *id) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, id);
+    unlink(filename);
+}
+
+// writes the body as the new image, with `restart` its next log is started right away
+static bool consolidate(Collection *collection, Document *doc, bool restart) {
+    const char *content = get_document_content(collection, doc);
+    if (!content) return false;
+
+    if (!replace_document(doc->id, content, doc->length)) return false;
+    doc->deltas = 0;
+    doc->log_bytes = 0;
+    doc->log_open = restart && start_log(doc->id);
+    if (!doc->log_open) remove_document_log(doc->id);
+    return true;
+}
+
+// writes the current image of a document and drops its log
+bool consolidate_document(Collection *collection, const char *id) {
+    pthread_mutex_lock(&collection->write_lock);
+    Document *doc = find_document(collection, id);
+    bool consolidated = collection->lsm ? doc != NULL : consolidate(collection, doc, false);
+    pthread_mutex_unlock(&collection->write_lock);
+    return consolidated;
+}
+
+// a delta was logged, the document is rewritten whole once replaying would cost more than that
+static void logged_delta(Collection *collection, Document *doc) {
+    if (++doc->deltas >= PATCH_MAX_DELTAS ||
+        (doc->log_bytes >= PATCH_MIN_LOG_BYTES && doc->log_bytes >= doc->length)) {
+        consolidate(collection, doc, true);
+    }
+}
+
+/*
+ * update_document() rewrites an image without going through the collection, so the body in
+ * memory is trusted as it is only while this process holds the log of its image: the log
+ * started or appended to here, nothing pending in the write buffer and the log still there.
+ * Otherwise it is checked against the image, replaced if that changed, and the delta
+ * counters start over. The bodies of an LSM collection have no file to be rewritten behind
+ * its back.
+ */
+static const char *current_content(Collection *collection, Document *doc) {
+    if (doc == NULL) return NULL;
+    if (collection->lsm) return get_document_content(collection, doc); // only changed through it
+    if (doc->log_open && !has_pending_update(doc->id) && log_exists(doc->id)) {
+        return get_document_content(collection, doc);
+    }
+
+    doc->deltas = 0;
+    doc->log_open = false;
+    doc->log_bytes = 0;
+    if (doc->content) {
+        char *image = read_document(doc->id);
+        if (image == NULL) return NULL;
+
+        size_t length = strlen(image);
+        if (length == doc->length && memcmp(image, doc->content, length) == 0) {
+            free(image); // unchanged, the body keeps its place
+        } else {
+            collection->used_memory = collection->used_memory - doc->length + length;
+            free(doc->content);
+            doc->content = image;
+            doc->length = length;
+        }
+    }
+    return get_document_content(collection, doc);
+}
+
+// applies an operation to a document of the collection, the write lock is held by the caller
+static bool patch_locked(Collection *collection, const char *id, PatchOp op, const char *path,
+                         const char *value, size_t value_length) {
+    Document *doc = find_document(collection, id);
+    const char *current = current_content(collection, doc);
+
+    // increments commute, anything else must not be replayed before those still on their
+    // way to the log: they are folded in a new image first
+    if (current && doc->appending > 0 && op != PATCH_INCREMENT && !consolidate(collection, doc, true)) return false;
+
+    char *content = current ? malloc(doc->length + 1) : NULL;
+    if (!content) return false;
+
+    // the operation works on a copy, the document is untouched if it fails
+    size_t length = doc->length;
+    memcpy(content, current, length + 1);
+
+    if (!apply_patch(&content, &length, op, path, value, value_length) || !validate_json(content, length) ||
+        !(collection->lsm ? lsm_put(collection->lsm, id, content, length)
+                          : append_record(doc, op, path, value, value_length))) {
+        free(content);
+        return false;
+    }
+
+    collection->used_memory = collection->used_memory - doc->length + length;
+    free(doc->content);
+    doc->content = content;
+    doc->length = length;
+    if (!collection->lsm) logged_delta(collection, doc);
+    return true;
+}
+
+static bool patch_collection_document(Collection *collection, const char *id, PatchOp op, const char *path,
+                                      const char *value, size_t value_length) {
+    pthread_mutex_lock(&collection->write_lock);
+    bool patched = patch_locked(collection, id, op, path, value, value_length);
+    pthread_mutex_unlock(&collection->write_lock);
+    return patched;
+}
+
+bool patch_document(Collection *collection, const char *id, const char *patch) {
+    return patch_collection_document(collection, id, PATCH_MERGE, NULL, patch, strlen(patch));
+}
+
+bool set_document_field(Collection *collection, const char *id, const char *path, const char *value) {
+    return patch_collection_document(collection, id, PATCH_SET, path, value, strlen(value));
+}
+
+bool unset_document_field(Collection *collection, const char *id, const char *path) {
+    return patch_collection_document(collection, id, PATCH_UNSET, path, "", 0);
+}
+
+bool increment_document_field(Collection *collection, const char *id, const char *path, double by) {
+    char number[32];
+    if (!isfinite(by)) return false;
+
+    if (fabs(by) < 9007199254740992.0 && by == (long long)by) {
+        snprintf(number, sizeof(number), "%lld", (long long)by);
+    } else {
+        snprintf(number, sizeof(number), "%.17g", by);
+    }
+    return patch_collection_document(collection, id, PATCH_INCREMENT, path, number, strlen(number));
+}
+
+/*
+
+INCR
+
+Counters are the hottest writes, so they get their own path. The number is found by a
+scan that stops at it, skipping the members before it (strings with memchr) instead of
+tokenizing the whole document. Nothing is copied and nothing is validated (a number
+replaced by a number is still valid JSON): the digits are overwritten in place,
+and the document moves only when their count changes (9 -> 10). The delta appended to
+the log is a dozen bytes, in a single write() once the log of the image is known.
+
+The whole read-modify-write happens under the collection's write lock, so concurrent
+increments are never lost.
+
+*/
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+// p is on the opening quote, returns the byte after the closing one
+static const char *skip_string(const char *p, const char *end) {
+    p++;
+    while (p < end) {
+        const char *quote = memchr(p, '"', end - p);
+        if (!quote) return NULL;
+
+        // a quote preceded by an odd number of backslashes is escaped
+        const char *backslash = quote;
+        while (backslash > p && backslash[-1] == '\\') backslash--;
+        if ((quote - backslash) % 2 == 0) return quote + 1;
+        p = quote + 1;
+    }
+    return NULL;
+}
+
+static const char *skip_value(const char *p, const char *end) {
+    if (p >= end) return NULL;
+    if (*p == '"') return skip_string(p, end);
+
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            if (*p == '"') {
+                p = skip_string(p, end);
+                if (!p) return NULL;
+                continue;
+            }
+            if (*p == '{' || *p == '[') depth++;
+            else if ((*p == '}' || *p == ']') && --depth == 0) return p + 1;
+            p++;
+        }
+        return NULL;
+    }
+
+    while (p < end && !strchr(",}] \t\r\n", *p)) p++;
+    return p;
+}
+
+/*
+ * Finds the byte range of the value at path scanning the text, without tokenizing it:
+ * members before the path are skipped (strings with memchr), nothing after it is read.
+ * The document is assumed to be valid JSON, it was validated when it was written.
+ */
+static bool locate_value(const char *content, size_t length, const PathSegment *path, int depth,
+                         size_t *start, size_t *value_end) {
+    const char *end = content + length;
+    const char *p = skip_space(content, end);
+
+    for (int d = 0; d < depth; d++) {
+        if (p >= end || *p != '{') return false;
+        p++;
+
+        while (1) {
+            p = skip_space(p, end);
+            if (p >= end || *p != '"') return false;
+
+            const char *key = p + 1;
+            p = skip_string(p, end);
+            if (!p) return false;
+            bool match = (size_t)(p - 1 - key) == path[d].length && memcmp(key, path[d].key, path[d].length) == 0;
+
+            p = skip_space(p, end);
+            if (p >= end || *p != ':') return false;
+            p = skip_space(p + 1, end);
+            if (match) break;
+
+            p = skip_value(p, end);
+            if (!p) return false;
+            p = skip_space(p, end);
+            if (p >= end || *p != ',') return false;
+            p++;
+        }
+    }
+
+    const char *after = skip_value(p, end);
+    if (!after) return false;
+    *start = p - content;
+    *value_end = after - content;
+    return true;
+}
+
+// the integer at `number` plus `by`, false if it isn't an integer or the sum overflows
+static bool counter_sum(const char *number, size_t number_length, long long by, long long *sum) {
+    bool integer = (number[0] == '-' || (number[0] >= '0' && number[0] <= '9')) &&
+                   is_integer(number, number_length);
+    if (!integer) return false;
+
+    char *end;
+    errno = 0;
+    long long current = strtoll(number, &end, 10);
+    return !errno && end == number + number_length && !__builtin_add_overflow(current, by, sum);
+}
+
+// overwrites the digits of a counter in the body, which moves only when their count changes
+static bool store_counter(Collection *collection, Document *doc, size_t offset, size_t number_length,
+                          const char *digits, size_t digits_length) {
+    if (digits_length == number_length) {
+        memcpy(doc->content + offset, digits, digits_length);
+        return true;
+    }
+
+    size_t old_length = doc->length;
+    if (!splice(&doc->content, &doc->length, offset, number_length, digits, digits_length)) return false;
+    collection->used_memory = collection->used_memory - old_length + doc->length;
+    return true;
+}
+
+bool incr_document_field(Collection *collection, const char *id, const char *path, long long by,
+                         long long *value) {
+    PathSegment segments[PATCH_MAX_DEPTH];
+    int depth = parse_path(path, segments);
+    if (depth < 0) return false;
+
+    char delta[24];
+    int delta_length = snprintf(delta, sizeof(delta), "%lld", by);
+
+    pthread_mutex_lock(&collection->write_lock);
+
+    Document *doc = find_document(collection, id);
+    if (!current_content(collection, doc)) {
+        pthread_mutex_unlock(&collection->write_lock);
+        return false;
+    }
+
+    size_t offset, value_end;
+    if (!locate_value(doc->content, doc->length, segments, depth, &offset, &value_end)) {
+        // a missing counter starts from 0, the general path creates it
+        bool created = patch_locked(collection, id, PATCH_INCREMENT, path, delta, delta_length);
+        pthread_mutex_unlock(&collection->write_lock);
+
+        if (created && value) *value = by;
+        return created;
+    }
+
+    size_t number_length = value_end - offset;
+    long long sum;
+    if (!counter_sum(doc->content + offset, number_length, by, &sum)) {
+        pthread_mutex_unlock(&collection->write_lock);
+        return false;
+    }
+
+    char digits[24];
+    int digits_length = snprintf(digits, sizeof(digits), "%lld", sum);
+
+    // an LSM collection puts the whole body, the general path does that with the new number
+    if (collection->lsm) {
+        bool stored = patch_locked(collection, id, PATCH_SET, path, digits, digits_length);
+        pthread_mutex_unlock(&collection->write_lock);
+
+        if (stored && value) *value = sum;
+        return stored;
+    }
+
+    // logged first: if the log can't be written the document doesn't change
+    if (!append_record(doc, PATCH_INCREMENT, path, delta, delta_length)) {
+        pthread_mutex_unlock(&collection->write_lock);
+        return false;
+    }
+
+    if (!store_counter(collection, doc, offset, number_length, digits, digits_length)) {
+        // the delta is in the log already, the image on disk will be right once replayed
+        pthread_mutex_unlock(&collection->write_lock);
+        return false;
+    }
+
+    logged_delta(collection, doc);
+    pthread_mutex_unlock(&collection->write_lock);
+
+    if (value) *value = sum;
+    return true;
+}
+
+/*
+
+ASYNCHRONOUS INCR
+
+incr_document_field_async() hands the append of the delta to an IOEngine, so the thread
+serving the counters doesn't wait for the disk: the body in memory is updated at once,
+under the write lock as usual, and the callback reports the increment once its record is
+in the log. Only the common case takes this path, a counter already in a document whose
+log is open (see current_content()); anything else returns false and goes through
+incr_document_field().
+
+The log is opened before the request is submitted, and never through the engine: a
+consolidation may start a new log before the write completes, and the record must land
+in the one the fd was opened on, whose image doesn't hold the increment yet. start_log()
+unlinks the old log instead of truncating it for the same reason.
+
+Appends in flight are counted in the document (appending). Increments commute, so a
+synchronous one may overtake them; any other operation consolidates first (patch_locked()).
+A failed append leaves the body ahead of the disk: log_open is cleared, and the next
+operation reads the document back.
+
+*/
+
+typedef struct {
+    IORequest request;  // the write, then the close of the log
+    IOEngine *engine;
+    Collection *collection;
+    char *id;
+    char *record;
+    size_t size;
+    long long value;
+    IncrCallback callback;
+    void *arg;
+} LogAppend;
+
+static void log_append_step(IORequest *request, int result, void *arg) {
+    LogAppend *append = arg;
+
+    if (request->opcode == IO_OP_CLOSE) {
+        free(append->id);
+        free(append->record);
+        free(append);
+        return;
+    }
+
+    bool written = result == (int)append->size;
+    Collection *collection = append->collection;
+    pthread_mutex_lock(&collection->write_lock);
+    Document *doc = find_document(collection, append->id);
+    if (doc && doc->appending > 0) doc->appending--;
+    if (doc && !written) doc->log_open = false;
+    pthread_mutex_unlock(&collection->write_lock);
+
+    append->callback(written, append->value, append->arg);
+
+    // the fd goes once the write is done, append is released when the close completes
+    request->opcode = IO_OP_CLOSE;
+    io_engine_submit(append->engine, request);
+}
+
+/*
+ * Adds `by` to the integer counter at `path` like incr_document_field(), writing its delta
+ * through `engine`: the callback receives the new value once the record is in the log, or
+ * false if it couldn't be written. Returns false, without calling it, when the increment
+ * can't take this path; the caller then runs incr_document_field().
+ */
+bool incr_document_field_async(IOEngine *engine, Collection *collection, const char *id, const char *path,
+                               long long by, IncrCallback callback, void *arg) {
+    PathSegment segments[PATCH_MAX_DEPTH];
+    int depth = parse_path(path, segments);
+    if (engine == NULL || callback == NULL || collection->lsm || depth < 0) return false;
+
+    char delta[24];
+    int delta_length = snprintf(delta, sizeof(delta), "%lld", by);
+
+    pthread_mutex_lock(&collection->write_lock);
+
+    // a document without an open log, or with a pending image, takes the synchronous path
+    Document *doc = find_document(collection, id);
+    size_t offset, value_end;
+    long long sum;
+    if (!current_content(collection, doc) || !doc->log_open ||
+        !locate_value(doc->content, doc->length, segments, depth, &offset, &value_end) ||
+        !counter_sum(doc->content + offset, value_end - offset, by, &sum)) {
+        pthread_mutex_unlock(&collection->write_lock);
+        return false;
+    }
+
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, doc->id);
+
+    LogAppend *append = calloc(1, sizeof(LogAppend));
+    if (append) {
+        append->id = strdup(id);
+        append->record = build_record(PATCH_INCREMENT, path, delta, delta_length, &append->size);
+    }
+    int fd = append && append->id && append->record ? open(filename, O_WRONLY | O_APPEND | O_CLOEXEC) : -1;
+
+    char digits[24];
+    int digits_length = snprintf(digits, sizeof(digits), "%lld", sum);
+    if (fd < 0 || !store_counter(collection, doc, offset, value_end - offset, digits, digits_length)) {
+        pthread_mutex_unlock(&collection->write_lock);
+        if (fd >= 0) close(fd);
+        if (append) {
+            free(append->id);
+            free(append->record);
+            free(append);
+        }
+        return false;
+    }
+
+    append->engine = engine;
+    append->collection = collection;
+    append->value = sum;
+    append->callback = callback;
+    append->arg = arg;
+    append->request.opcode = IO_OP_WRITE;
+    append->request.fd = fd;
+    append->request.buffer = append->record;
+    append->request.length = append->size;
+    append->request.offset = -1;
+    append->request.callback = log_append_step;
+    append->request.arg = append;
+    io_engine_submit(engine, &append->request);
+
+    // counted as written: a consolidation now puts the increment in the image
+    doc->appending++;
+    doc->log_bytes += append->size;
+    logged_delta(collection, doc);
+    pthread_mutex_unlock(&collection->write_lock);
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "db_manager.h"
+
+#define PATCH_LOG_SUFFIX ".log"
+#define PATCH_LOG_MAGIC 0x474f4c50 // "PLOG"
+#define PATCH_MAX_DELTAS 64 // deltas logged before the document is rewritten whole
+#define PATCH_MIN_LOG_BYTES (4 << 10) // smaller logs are replayed for next to nothing
+#define PATCH_MAX_DEPTH 32  // path segments of a field operation
+
+/* Data Structures */
+
+typedef enum {
+    PATCH_MERGE = 1, // RFC 7386 merge patch, the value is the patch document
+    PATCH_SET,       // sets the field at path to the value, creating the objects on the way
+    PATCH_UNSET,     // removes the field at path
+    PATCH_INCREMENT  // adds the value (a number) to the number at path, missing counts as 0
+} PatchOp;
+
+// the log of a document starts with this header, then a sequence of records
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t base_inode; // identity of the <id>.json image the deltas apply to,
+    uint64_t base_size;  // the log is stale (and ignored) once the image is rewritten
+    int64_t base_mtime_s;
+    int64_t base_mtime_ns;
+} PatchLogHeader;
+
+// completion of incr_document_field_async(), with the new value when `done`
+typedef void (*IncrCallback)(bool done, long long value, void *arg);
+
+typedef struct {
+    uint32_t op;
+    uint32_t path_length;
+    uint32_t value_length;
+} PatchRecord;
+
+/* Functions */
+
+bool apply_patch(char **content, size_t *length, PatchOp op, const char *path, const char *value,
+                 size_t value_length);
+bool patch_document(Collection *collection, const char *id, const char *patch);
+bool set_document_field(Collection *collection, const char *id, const char *path, const char *value);
+bool unset_document_field(Collection *collection, const char *id, const char *path);
+bool increment_document_field(Collection *collection, const char *id, const char *path, double by);
+bool incr_document_field(Collection *collection, const char *id, const char *path, long long by,
+                         long long *value);
+bool incr_document_field_async(IOEngine *engine, Collection *collection, const char *id, const char *path,
+                               long long by, IncrCallback callback, void *arg);
+bool consolidate_document(Collection *collection, const char *id);
+bool replay_document_log(int dirfd, const char *id, char **content, size_t *length);
+bool has_document_log(const char *id);
+void remove_document_log(const char *id);
+
+#endif // PATCH_H
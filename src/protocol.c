@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <string.h>
+#include <endian.h>
+
+#include "protocol.h"
+
+/*
+
+WIRE PROTOCOL
+
+Requests and responses are frames: a fixed 24 byte header in network byte order followed
+by variable parts whose lengths are in the header, so a frame is complete as soon as the
+buffer holds header + lengths, without scanning for a delimiter.
+
+    request:  magic u8 | opcode u8 | flags u16 | id u32 | key length u32 | body length u32
+              | argument i64 | key | NUL | body | NUL
+    response: magic u8 | status u8 | reserved u16 | id u32 | body length u32 | reserved u32
+              | value i64 | body
+
+The NUL after key and body isn't counted in their lengths. It costs two bytes and lets
+the parser hand out pointers into the receive buffer that db_manager can use as C strings
+as they are: parsing a request copies nothing, it checks the header and computes two
+pointers. A buffer holding a partial frame parses as "incomplete" (0), the caller reads
+more and tries again from the same position.
+
+The id is chosen by the client and echoed in the response, so a client with several
+requests in flight can match replies without counting them.
+
+*/
+
+static uint64_t read_u64(const char *p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return be64toh(value);
+}
+
+static uint32_t read_u32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return be32toh(value);
+}
+
+static void write_u64(char *p, uint64_t value) {
+    value = htobe64(value);
+    memcpy(p, &value, 8);
+}
+
+static void write_u32(char *p, uint32_t value) {
+    value = htobe32(value);
+    memcpy(p, &value, 4);
+}
+
+size_t request_frame_size(size_t key_length, size_t body_length) {
+    return PROTOCOL_HEADER_SIZE + key_length + 1 + body_length + 1;
+}
+
+// writes a request frame, returns its size or 0 if it doesn't fit in `size` bytes
+size_t encode_request(char *buffer, size_t size, uint8_t opcode, uint32_t id, const char *key, size_t key_length,
+                      const char *body, size_t body_length, int64_t argument) {
+    size_t frame = request_frame_size(key_length, body_length);
+    if (frame > size || key_length > PROTOCOL_MAX_KEY || body_length > PROTOCOL_MAX_FIELD) return 0;
+
+    buffer[0] = (char)PROTOCOL_MAGIC;
+    buffer[1] = opcode;
+    buffer[2] = buffer[3] = 0;
+    write_u32(buffer + 4, id);
+    write_u32(buffer + 8, key_length);
+    write_u32(buffer + 12, body_length);
+    write_u64(buffer + 16, argument);
+
+    char *p = buffer + PROTOCOL_HEADER_SIZE;
+    if (key_length) memcpy(p, key, key_length);
+    p[key_length] = '\0';
+    p += key_length + 1;
+    if (body_length) memcpy(p, body, body_length);
+    p[body_length] = '\0';
+    return frame;
+}
+
+/*
+ * Parses the request at the start of `buffer`. Returns the size of the frame, 0 if the
+ * buffer doesn't hold all of it yet, -1 if it isn't a valid frame (the connection can't
+ * be resynchronized and should be closed).
+ */
+ssize_t parse_request(const char *buffer, size_t length, ProtocolRequest *request) {
+    if (length >= 1 && (uint8_t)buffer[0] != PROTOCOL_MAGIC) return -1;
+    if (length < PROTOCOL_HEADER_SIZE) return 0;
+
+    uint32_t key_length = read_u32(buffer + 8);
+    uint32_t body_length = read_u32(buffer + 12);
+    if (key_length > PROTOCOL_MAX_KEY || body_length > PROTOCOL_MAX_FIELD) return -1;
+
+    size_t frame = request_frame_size(key_length, body_length);
+    if (length < frame) return 0;
+
+    const char *key = buffer + PROTOCOL_HEADER_SIZE;
+    const char *body = key + key_length + 1;
+    if (key[key_length] != '\0' || body[body_length] != '\0') return -1;
+
+    request->opcode = buffer[1];
+    request->flags = (uint16_t)((uint8_t)buffer[2] << 8 | (uint8_t)buffer[3]);
+    request->id = read_u32(buffer + 4);
+    request->key = key;
+    request->key_length = key_length;
+    request->body = body;
+    request->body_length = body_length;
+    request->argument = (int64_t)read_u64(buffer + 16);
+    return frame;
+}
+
+// writes the PROTOCOL_HEADER_SIZE bytes of a response, `body_length` bytes are to follow
+void encode_response_header(char *header, uint8_t status, uint32_t id, uint32_t body_length, int64_t value) {
+    header[0] = (char)PROTOCOL_MAGIC;
+    header[1] = status;
+    header[2] = header[3] = 0;
+    write_u32(header + 4, id);
+    write_u32(header + 8, body_length);
+    write_u32(header + 12, 0);
+    write_u64(header + 16, value);
+}
+
+// same contract as parse_request()
+ssize_t parse_response(const char *buffer, size_t length, ProtocolResponse *response) {
+    if (length >= 1 && (uint8_t)buffer[0] != PROTOCOL_MAGIC) return -1;
+    if (length < PROTOCOL_HEADER_SIZE) return 0;
+
+    uint32_t body_length = read_u32(buffer + 8);
+    if (body_length > PROTOCOL_MAX_BODY) return -1;
+    if (length < PROTOCOL_HEADER_SIZE + (size_t)body_length) return 0;
+
+    response->status = buffer[1];
+    response->id = read_u32(buffer + 4);
+    response->body = buffer + PROTOCOL_HEADER_SIZE;
+    response->body_length = body_length;
+    response->value = (int64_t)read_u64(buffer + 16);
+    return PROTOCOL_HEADER_SIZE + body_length;
+}
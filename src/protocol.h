@@ -0,0 +1,67 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PROTOCOL_MAGIC 0xFA             // first byte of every frame, never the start of a text command
+#define PROTOCOL_HEADER_SIZE 24
+#define PROTOCOL_MAX_KEY 255
+#define PROTOCOL_MAX_FIELD 255          // longest request body, the only one read is INCR's field path
+#define PROTOCOL_MAX_BODY (64 << 20)    // longest response body
+
+/* Data Structures */
+
+typedef enum {
+    OP_PING = 1,     // replies OK
+    OP_GET,          // key: document ID, replies with the document as body
+    OP_INCR,         // key: document ID, body: field path, argument: increment, replies the new value
+    OP_DEL,          // key: document ID
+    OP_EXPIRE,       // key: document ID, argument: TTL in milliseconds, value 1 if set
+    OP_TTL,          // key: document ID, value: milliseconds left, -1 without a TTL, -2 without a document
+    OP_TRUNCATE,     // value: documents removed
+    OP_QUIT,         // replies OK, then the server closes the connection
+    OP_STATS,        // body: the server counters, one "name:value" per field separated by spaces
+    OP_ATTACH        // Unix socket only, sent with a shared memory region and two eventfds (SCM_RIGHTS):
+                     // this response and all the following go through the region (see shm_ring.c)
+} Opcode;
+
+typedef enum {
+    STATUS_OK = 0,
+    STATUS_NOT_FOUND,
+    STATUS_ERROR,    // refused, e.g. INCR of a field that isn't a counter
+    STATUS_UNKNOWN   // opcode the server doesn't know
+} Status;
+
+// a parsed request, key and body point into the buffer it was parsed from
+typedef struct {
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t id;          // chosen by the client, echoed in the response
+    const char *key;      // NUL terminated in the frame
+    uint32_t key_length;
+    const char *body;     // NUL terminated in the frame
+    uint32_t body_length;
+    int64_t argument;
+} ProtocolRequest;
+
+typedef struct {
+    uint8_t status;
+    uint32_t id;
+    const char *body;     // not NUL terminated
+    uint32_t body_length;
+    int64_t value;
+} ProtocolResponse;
+
+/* Functions */
+
+size_t request_frame_size(size_t key_length, size_t body_length);
+size_t encode_request(char *buffer, size_t size, uint8_t opcode, uint32_t id, const char *key, size_t key_length,
+                      const char *body, size_t body_length, int64_t argument);
+ssize_t parse_request(const char *buffer, size_t length, ProtocolRequest *request);
+void encode_response_header(char *header, uint8_t status, uint32_t id, uint32_t body_length, int64_t value);
+ssize_t parse_response(const char *buffer, size_t length, ProtocolResponse *response);
+
+#endif // PROTOCOL_H
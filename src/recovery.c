@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "expiry.h"
+#include "patch.h"
+#include "recovery.h"
+
+#define RECOVERY_SUFFIX ".json"
+#define RECOVERY_SUFFIX_LEN 5
+#define RECOVERY_FIRST_READ 4096 // most documents fit in a single read of this size
+
+/*
+
+RECOVERY
+
+Loading millions of <id>.json files is dominated by syscalls and by directory traversal,
+not by parsing. The recovery works in two stages:
+
+1. The directory is enumerated with getdents64 asking for 1MB of entries per call, so a
+   directory of millions of files costs a few thousand syscalls instead of one per file
+   like readdir() on small buffers. Names are packed in a single arena and sorted by
+   inode number, which on most filesystems approximates the on-disk order of the files.
+
+2. Reader threads claim chunks of files from a shared atomic cursor, read each one with
+   openat/read/close (fstat only when the file is bigger than the first read), validate
+   the JSON and build the Document. The collection is pre-sized once, then each chunk is
+   inserted under a single lock acquisition, so contention stays negligible.
+
+A sharded collection (one per worker of the server, see document_shard()) is recovered in
+the same pass: each document goes to the shard owning its ID. The TTLs are re-armed last,
+from the expiry journal (see expiry.c).
+
+*/
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    uint64_t inode;
+    size_t name; // offset of the file name in the names arena
+} RecoveryFile;
+
+typedef struct {
+    int dirfd;
+    Collection **shards;
+    int shard_count;
+    const RecoveryOptions *options;
+
+    RecoveryFile *files;
+    size_t count;
+    char *names;
+    size_t next; // next file to claim, only accessed atomically
+
+    pthread_mutex_t lock; // protects the collection, stats and next_report
+    RecoveryStats stats;
+    size_t next_report;
+    struct timespec start;
+} RecoveryState;
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int compare_inodes(const void *a, const void *b) {
+    const RecoveryFile *fa = a, *fb = b;
+    return (fa->inode > fb->inode) - (fa->inode < fb->inode);
+}
+
+static bool is_document_file(const char *name, size_t length) {
+    return length > RECOVERY_SUFFIX_LEN &&
+           memcmp(name + length - RECOVERY_SUFFIX_LEN, RECOVERY_SUFFIX, RECOVERY_SUFFIX_LEN) == 0;
+}
+
+// deleted documents whose file was renamed but not yet unlinked when the process stopped
+static bool is_tombstone(const char *name, size_t length) {
+    size_t suffix = strlen(DOCUMENT_TOMBSTONE_SUFFIX);
+    return length > suffix && memcmp(name + length - suffix, DOCUMENT_TOMBSTONE_SUFFIX, suffix) == 0;
+}
+
+// fills state->files and state->names with every <id>.json entry of the directory,
+// tombstones are unlinked on the way
+static bool enumerate_directory(RecoveryState *state) {
+    char *buffer = malloc(RECOVERY_DIRENT_BUFFER);
+    if (!buffer) return false;
+
+    size_t files_capacity = 0, names_size = 0, names_capacity = 0;
+
+    while (1) {
+        long n = syscall(SYS_getdents64, state->dirfd, buffer, RECOVERY_DIRENT_BUFFER);
+        if (n < 0) {
+            free(buffer);
+            return false;
+        }
+        if (n == 0) break;
+
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+
+            if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) continue;
+
+            size_t length = strlen(entry->d_name);
+            if (is_tombstone(entry->d_name, length)) {
+                unlinkat(state->dirfd, entry->d_name, 0);
+                continue;
+            }
+            if (!is_document_file(entry->d_name, length)) continue;
+
+            if (state->count == files_capacity) {
+                files_capacity = files_capacity ? files_capacity * 2 : 1024;
+                RecoveryFile *files = realloc(state->files, sizeof(RecoveryFile) * files_capacity);
+                if (!files) goto fail;
+                state->files = files;
+            }
+
+            if (names_size + length + 1 > names_capacity) {
+                names_capacity = names_capacity ? names_capacity * 2 : 64 * 1024;
+                while (names_size + length + 1 > names_capacity) names_capacity *= 2;
+                char *names = realloc(state->names, names_capacity);
+                if (!names) goto fail;
+                state->names = names;
+            }
+
+            memcpy(state->names + names_size, entry->d_name, length + 1);
+            state->files[state->count].inode = entry->d_ino;
+            state->files[state->count].name = names_size;
+            state->count++;
+            names_size += length + 1;
+        }
+    }
+
+    free(buffer);
+    qsort(state->files, state->count, sizeof(RecoveryFile), compare_inodes);
+    return true;
+
+fail:
+    free(buffer);
+    return false;
+}
+
+// reads a whole file relative to the data directory, NULL if it can't be read
+static char *read_file_at(int dirfd, const char *name, size_t *length) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    size_t capacity = RECOVERY_FIRST_READ;
+    size_t size = 0;
+    char *content = malloc(capacity + 1);
+    if (!content) goto fail;
+
+    while (1) {
+        ssize_t n = read(fd, content + size, capacity - size);
+        if (n < 0) goto fail;
+        if (n == 0) break;
+        size += n;
+
+        if (size == capacity) {
+            // the file didn't fit in the first read: ask for its real size once
+            struct stat st;
+            if (fstat(fd, &st) < 0) goto fail;
+            capacity = (size_t)st.st_size > capacity ? (size_t)st.st_size : capacity * 2;
+
+            char *bigger = realloc(content, capacity + 1);
+            if (!bigger) goto fail;
+            content = bigger;
+        }
+    }
+
+    close(fd);
+    content[size] = '\0';
+    *length = size;
+    return content;
+
+fail:
+    free(content);
+    close(fd);
+    return NULL;
+}
+
+static void report_progress(RecoveryState *state) {
+    const RecoveryOptions *options = state->options;
+    if (!options || !options->progress) return;
+
+    size_t processed = state->stats.files_loaded + state->stats.files_invalid;
+    if (processed < state->next_report && processed < state->count) return;
+
+    state->stats.elapsed = elapsed_since(&state->start);
+    options->progress(&state->stats, options->progress_arg);
+
+    size_t interval = options->progress_interval ? options->progress_interval : RECOVERY_DEFAULT_PROGRESS;
+    while (state->next_report <= processed) state->next_report += interval;
+}
+
+static void *recovery_worker(void *arg) {
+    RecoveryState *state = arg;
+    Document *batch[RECOVERY_CHUNK_SIZE];
+
+    while (1) {
+        size_t first = __atomic_fetch_add(&state->next, RECOVERY_CHUNK_SIZE, __ATOMIC_RELAXED);
+        if (first >= state->count) break;
+
+        size_t last = first + RECOVERY_CHUNK_SIZE;
+        if (last > state->count) last = state->count;
+
+        int loaded = 0;
+        size_t invalid = 0, bytes = 0;
+
+        for (size_t i = first; i < last; i++) {
+            const char *name = state->names + state->files[i].name;
+            size_t length;
+
+            char *content = read_file_at(state->dirfd, name, &length);
+            if (!content) {
+                invalid++;
+                continue;
+            }
+            bytes += length;
+
+            char *id = strndup(name, strlen(name) - RECOVERY_SUFFIX_LEN);
+            Document *doc = NULL;
+            if (id && replay_document_log(state->dirfd, id, &content, &length) &&
+                validate_json(content, length)) {
+                doc = load_document(id, content);
+            }
+
+            if (!doc) {
+                free(id);
+                free(content);
+                invalid++;
+                continue;
+            }
+            batch[loaded++] = doc;
+        }
+
+        pthread_mutex_lock(&state->lock);
+        for (int i = 0; i < loaded; i++) {
+            Document *doc = batch[i];
+
+            // documents already in memory win over their copy on disk
+            Collection *collection = state->shards[document_shard(doc->id, state->shard_count)];
+            if (find_document(collection, doc->id) || !insert_document(collection, doc)) {
+                free_hash_entry(doc->hash_id);
+                free_document(doc);
+                invalid++;
+                continue;
+            }
+            state->stats.files_loaded++;
+        }
+        state->stats.files_invalid += invalid;
+        state->stats.bytes_read += bytes;
+        report_progress(state);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Loads every <id>.json document found in `dir` into the `count` shards of a collection,
+ * each into shards[document_shard(id, count)].
+ * Returns the number of documents loaded, -1 if the directory can't be enumerated.
+ */
+int recover_shards(Collection **shards, int count, const char *dir,
+                   const RecoveryOptions *options, RecoveryStats *stats) {
+    if (shards == NULL || count < 1 || dir == NULL) return -1;
+    for (int i = 0; i < count; i++) {
+        if (shards[i] == NULL) return -1;
+    }
+
+    RecoveryState state;
+    memset(&state, 0, sizeof(state));
+    state.shards = shards;
+    state.shard_count = count;
+    state.options = options;
+    clock_gettime(CLOCK_MONOTONIC, &state.start);
+
+    state.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (state.dirfd < 0) return -1;
+
+    // hashing spreads the documents evenly, a shard that gets more than its share grows
+    bool reserved = enumerate_directory(&state);
+    for (int i = 0; reserved && i < count; i++) {
+        reserved = reserve_collection(shards[i], shards[i]->size + (int)(state.count / count) + 1);
+    }
+    if (!reserved) {
+        free(state.files);
+        free(state.names);
+        close(state.dirfd);
+        return -1;
+    }
+    state.stats.files_found = state.count;
+    state.next_report = options && options->progress_interval ? options->progress_interval : RECOVERY_DEFAULT_PROGRESS;
+
+    int threads = options && options->threads > 0 ? options->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+
+    pthread_mutex_init(&state.lock, NULL);
+
+    // the calling thread is one of the readers
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    int started = 0;
+    if (workers) {
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&workers[started], NULL, recovery_worker, &state) != 0) break;
+        }
+    }
+    recovery_worker(&state);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    recover_expiries(shards, count, state.dirfd);
+
+    pthread_mutex_destroy(&state.lock);
+    free(state.files);
+    free(state.names);
+    close(state.dirfd);
+
+    state.stats.elapsed = elapsed_since(&state.start);
+    if (stats) *stats = state.stats;
+
+    return (int)state.stats.files_loaded;
+}
+
+/*
+ * Loads every <id>.json document found in `dir` into `collection`.
+ * Returns the number of documents loaded, -1 if the directory can't be enumerated.
+ */
+int recover_collection(Collection *collection, const char *dir,
+                       const RecoveryOptions *options, RecoveryStats *stats) {
+    if (collection == NULL) return -1;
+    return recover_shards(&collection, 1, dir, options, stats);
+}
@@ -0,0 +1,37 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <stddef.h>
+#include "db_manager.h"
+
+#define RECOVERY_DIRENT_BUFFER (1 << 20) // bytes requested to each getdents64 call
+#define RECOVERY_CHUNK_SIZE 256 // files claimed by a reader thread at a time
+#define RECOVERY_DEFAULT_PROGRESS 100000 // files between two progress reports
+
+/* Data Structures */
+
+typedef struct {
+    size_t files_found;   // <id>.json entries enumerated in the directory
+    size_t files_loaded;  // documents inserted in the collection
+    size_t files_invalid; // unreadable files or invalid JSON, skipped
+    size_t bytes_read;
+    double elapsed;       // seconds since the recovery started
+} RecoveryStats;
+
+typedef void (*RecoveryProgress)(const RecoveryStats *stats, void *arg);
+
+typedef struct {
+    int threads;              // reader threads, 0 means one per online CPU
+    size_t progress_interval; // files between two progress callbacks, 0 for the default
+    RecoveryProgress progress; // optional, called from the reader threads
+    void *progress_arg;
+} RecoveryOptions;
+
+/* Functions */
+
+int recover_collection(Collection *collection, const char *dir,
+                       const RecoveryOptions *options, RecoveryStats *stats);
+int recover_shards(Collection **shards, int count, const char *dir,
+                   const RecoveryOptions *options, RecoveryStats *stats);
+
+#endif // RECOVERY_H
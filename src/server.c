@@ -3,29 +3,398 @@
  * All rights reserved.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
+#include "db_manager.h"
+#include "event_loop.h"
+#include "expiry.h"
+#include "net_buffer.h"
+#include "net_ring.h"
+#include "patch.h"
+#include "protocol.h"
+#include "recovery.h"
+#include "shm_ring.h"
+#include "spsc_queue.h"
+#include "transfer.h"
+
+/*
+
+CONNECTIONS
+
+A worker serves its connections from one event loop: its listening socket and every
+connection are non blocking, and a connection stays open for as many requests as the
+client sends, until it says "exit" (or QUIT), closes it or stays idle for
+SERVER_IDLE_TIMEOUT_MS.
+
+Each connection is a small state machine driven by serve_connection() whenever its socket
+becomes readable or writable:
+
+    input:   bytes read so far, consumed one command (or frame) at a time
+    output:  responses not sent yet, as a list of pieces
+    transfer: a GET being sent from its file (see transfer.c)
+
+Input, replies and the list of pieces live in buffers of the pool shared by the workers
+(see net_buffer.c), taken when there is something to hold and given back as soon as they
+are empty: an idle connection holds no buffer at all.
+
+Clients may pipeline: send many commands without waiting for the replies. Every complete
+command in the input is executed in one pass and its response queued; then all of them
+leave with one sendmsg(). Small replies are copied into one buffer, documents are queued
+as pieces of their own pointing to the content read for the GET, so a batch of GETs is
+gathered into one system call without copying the documents again.
+
+Documents big enough for sendfile() are the exception: they are sent from their file
+after the responses queued before them, and the commands that follow wait for the
+transfer to complete, so responses always come back in the order of the requests. When
+the socket can't take more the connection just returns, the next EPOLLOUT edge resumes it
+where it stopped.
+
+Two protocols are spoken on the same port, told apart by the first byte a client sends:
+PROTOCOL_MAGIC starts a binary session (framed requests, see protocol.c), anything else a
+text session (one command per line, for humans and scripts).
+
+*/
+
+/*
+
+REACTORS
+
+One loop is one core. With -t N the server runs N workers, each with its own listening
+socket bound to the same port with SO_REUSEPORT and its own epoll instance: the kernel
+spreads incoming connections across the sockets, and a connection lives on the worker that
+accepted it, so workers share no connection state and no queue. With -p each worker is
+pinned to a CPU, which keeps its loop, its sockets and their cache lines on one core.
+
+Reading, parsing and sending run in parallel, and so do the commands: the collection is
+split in shards, one per worker (see SHARDS below).
+
+*/
+
+/*
+
+SHARDS
+
+Each worker owns a shard of the collection, a Collection of its own with the documents
+whose ID hashes to it (document_shard()): its own index, cuckoo filter, memory accounting
+and expiry wheel, touched by that worker alone. The documents are stored one file (and
+one delta log) per ID, so the shards never share a file either.
+
+A command runs on the shard owning its key. When that is the worker of the connection it
+runs at once; otherwise it is copied into a ShardMessage and pushed on the SPSC queue from
+this worker to the owner (one queue per ordered pair of workers, see spsc_queue.c), and
+the owner's inbox eventfd is written, unless a write is already pending. The owner runs
+it and pushes the message back the same way with the result, which is then replied on
+the connection. A full queue doesn't block the worker: the message waits in an outbox,
+flushed after each drain of the inbox and at each tick.
+
+A connection has at most one command out at a time: nothing else is executed until its
+answers are back, so responses stay in order. Meanwhile its input is read up to
+SERVER_READ_BUDGET, then reading pauses like it does for backed up output.
+
+Commands on many keys are scattered: MDEL groups its keys by shard, TRUNCATE goes to every
+shard, and the results are gathered (summed) before the reply. A GET is forwarded as
+well, so it is ordered with the updates of its shard; the file of a big one is sent by the
+worker of the connection.
+
+The disk doesn't hold a worker either: each has an IOEngine (see io_engine.c), and a GET
+reads its document, an INCR appends its delta, through it (start_command()). The command
+then lives in a ShardMessage until the engine completes it, a local one when the shard is
+ours: the connection waits for it like for another worker, and the completion answers
+it the same way, back to the worker of the connection. With epoll the engine is attached
+to the loop; with io_uring its eventfd is polled on the ring of the worker. What can't
+go through the engine (big documents sent from their file, counters to be created, the
+other commands) runs at once as before.
+
+*/
+
+/*
+
+LOCAL CLIENTS
+
+Clients on the same host can skip TCP altogether: with -u <path> the server also listens on
+a Unix domain stream socket (permissions set with -m, 0660 by default), speaking the same
+protocols. A request over it costs a copy between two socket buffers, with no TCP state,
+checksums or loopback device in the way.
+
+Unix sockets have no SO_REUSEPORT balancing, so there is one listener for all the workers:
+each watches it from its own loop, the first to accept() a connection serves it and the
+others find the backlog empty. A stale socket file left by a previous run is replaced,
+anything else at the path is an error.
+
+A binary client on the Unix socket can go one step further and attach a shared memory
+channel (OP_ATTACH, see shm_ring.c): it passes a memory region and two eventfds with the
+frame, and from the response to OP_ATTACH on the connection reads its requests from the
+region and writes its responses there, woken by the eventfd only when it has gone idle.
+The socket stays open to tell when the client is gone. Everything else (parsing,
+pipelining, output limits) is the same, only the two ends of the connection change;
+documents are always copied, sendfile() has no way into the region.
+
+*/
+
+/*
+
+OUTPUT LIMITS
+
+A client that pipelines faster than it reads its responses, or asks for big documents
+over a slow link, makes responses pile up in memory. Three thresholds keep that in check,
+on the bytes a connection has queued and not sent yet (files sent with sendfile() don't
+count, they are never in memory):
+
+    pause (SERVER_OUTPUT_PAUSE):  the connection stops executing commands and its socket
+        stops being read. The requests wait in the kernel socket buffer, TCP flow control
+        slows the client down, and reading resumes as soon as the output drains below
+        the mark.
+    soft (-o, default 4 MB for 10 s): a connection may stay above it for a while, e.g. for
+        one big response, but is closed if it is still above it after soft_seconds.
+    hard (-o, default 32 MB): a response that would take the output above it closes the
+        connection at once.
+
+Reads are also bounded per pass (SERVER_READ_BUDGET), so a client flooding requests can't
+grow its input buffer without limit either. STATS reports the counters of all this.
+
+*/
+
+/*
+
+IO_URING BACKEND
+
+With -b uring a worker drives its sockets through an io_uring instance (see net_ring.c)
+instead of epoll: a multishot accept on each listener, a multishot recv on each connection
+and a sendmsg per batch of responses, all submitted together by the one io_uring_enter()
+that also waits for the next completions. The connections are the same state machines:
+the data of a recv completion is copied into the input, then serve_connection() executes
+it and queues the responses as usual, only flush_output() becomes a submission.
+
+Differences with epoll follow from the kernel owning a request until it completes:
+
+- one sendmsg per connection is in flight at a time, and no command is executed while it
+  is, since a new reply could move the buffer it is sending from: the requests that arrive
+  meanwhile pile up in the input and go in the next batch, and the reply of a command whose
+  results come back from other shards is queued once the send completes
+- a connection backed up with output cancels its recv, and arms it again once drained
+- a closed connection is freed only after the completions of all its requests
+- big documents are still sent with sendfile(), a poll for POLLOUT resumes a transfer
+- descriptors can't come with the data of a multishot recv, so OP_ATTACH is refused: shared
+  memory channels need the epoll backend
+
+*/
+
+#define SERVER_MAX_QUERY 4096                  // longest command accepted
+#define SERVER_READ_CHUNK 1024                 // free space ensured before each read
+#define SERVER_IDLE_TIMEOUT_MS (300 * 1000)
+#define SERVER_MAX_THREADS 256
+#define SERVER_MAX_IOV 64                      // pieces gathered by one sendmsg()
+#define SERVER_UNIX_MODE 0660                  // permissions of the Unix socket
+#define SERVER_PASSED_FDS 3                    // descriptors of OP_ATTACH: region, wakeup, notify
+#define SERVER_READ_BUDGET (256 << 10)         // bytes read in one pass before executing them
+#define SERVER_OUTPUT_PAUSE (256 << 10)        // queued bytes that pause reading and executing
+#define SERVER_OUTPUT_SOFT_LIMIT (4 << 20)
+#define SERVER_OUTPUT_SOFT_SECONDS 10
+#define SERVER_OUTPUT_HARD_LIMIT (32 << 20)
+#define SERVER_RING_KIND_MASK 7                // low bits of the user_data of a ring request
+#define SERVER_SHARD_QUEUE 1024                // messages in flight from one worker to another
+
+/* Data Structures */
+
+typedef enum {
+    BACKEND_EPOLL,
+    BACKEND_URING
+} ServerBackend;
+
+// what a request on the ring is, in the low bits of its user_data; the rest is its connection
+typedef enum {
+    RING_ACCEPT = 1,    // the rest is the listening socket, shifted
+    RING_RECV,
+    RING_SEND,
+    RING_POLL,
+    RING_INBOX,         // the poll on the inbox eventfd of the worker
+    RING_DISK           // the poll on the eventfd of its IOEngine
+} RingRequest;
+
+typedef enum {
+    WIRE_UNKNOWN,   // nothing received yet
+    WIRE_TEXT,
+    WIRE_BINARY
+} WireProtocol;
+
+// a piece of the output: a range of the reply buffer, or a document owned by the piece
+typedef struct {
+    char *data;         // NULL for a range of the reply buffer
+    size_t offset;
+    size_t length;
+} OutputPiece;
+
+typedef struct {
+    size_t hard;                // queued bytes that close a connection at once, 0 for none
+    size_t soft;                // queued bytes tolerated for soft_seconds, 0 for none
+    unsigned int soft_seconds;
+} OutputLimits;
+
+// counters of all the workers, updated with atomic operations
+typedef struct {
+    unsigned long accepted;
+    unsigned long active;           // connections open
+    unsigned long paused;           // times a connection stopped being read for backed up output
+    unsigned long soft_disconnects; // closed above the soft limit for too long
+    unsigned long hard_disconnects; // closed for going above the hard limit
+    unsigned long output_bytes;     // responses queued in memory, all connections
+    unsigned long channels;         // connections switched to shared memory
+    unsigned long ring_enters;      // io_uring_enter() calls of the io_uring backend
+    unsigned long forwarded;        // commands sent to the shard of another worker
+} ServerStats;
+
+// a command on the documents of one shard, from either wire
+typedef struct {
+    uint8_t opcode;         // OP_GET, OP_INCR, OP_DEL (with any number of keys), OP_EXPIRE, OP_TTL, OP_TRUNCATE
+    uint32_t id;            // of the binary request, for its response
+    bool multi;             // MDEL: the reply is the number of documents deleted
+    const char *keys;       // key_count IDs, each NUL terminated, one after the other
+    size_t keys_length;     // bytes of keys, the terminators included
+    int key_count;
+    const char *field;      // OP_INCR: the counter
+    long long argument;     // OP_INCR: the increment, OP_EXPIRE: the TTL in milliseconds
+    size_t threshold;       // OP_GET: zero copy threshold of the connection
+} ShardCommand;
+
+typedef struct {
+    bool done;                  // found, deleted, set
+    long long value;
+    DocumentTransfer transfer;  // OP_GET
+} ShardResult;
+
+// a command forwarded to another worker, or waiting for the disk, and back with its result
+typedef struct ShardMessage {
+    struct ShardMessage *next;  // in an outbox
+    void *origin;               // the connection, only used by its own worker
+    int from;                   // the worker of the connection
+    struct Worker *owner;       // the worker running it, while its disk I/O is in flight
+    bool answered;
+    ShardCommand command;
+    ShardResult result;
+    char strings[];             // the keys and the field of the command
+} ShardMessage;
+
+// messages waiting for room in the queue to a worker
+typedef struct {
+    ShardMessage *head;
+    ShardMessage *tail;
+} Outbox;
+
+struct Worker;
+
+typedef struct {
+    int fd;
+    EventLoop *loop;
+    struct Worker *worker;
+    WireProtocol wire;
+    NetBuffer input;
+    NetBuffer output;       // bytes of the small replies
+    OutputPiece *pieces;    // what is to be sent, in order
+    size_t pieces_size;     // bytes of the block holding them
+    int piece_count;
+    int piece_capacity;
+    int piece_sent;         // pieces sent whole
+    size_t piece_offset;    // bytes sent of the next one
+    size_t output_bytes;    // queued and not sent yet
+    DocumentTransfer transfer;
+    bool transferring;
+    bool closing;           // close once the output is sent
+    bool overflow;          // a response didn't fit under the hard limit
+    bool unread;            // the socket may have data we haven't read yet
+    bool paused;            // not read because the output is backed up
+    EventTimer idle;
+    EventTimer soft_limit;  // running while the output is above the soft limit
+    int passed[SERVER_PASSED_FDS];  // descriptors received with the input, for OP_ATTACH
+    int passed_count;
+    ShmChannel *channel;    // requests and responses go through shared memory, NULL for the socket
+    int wake_fd;            // eventfd the client writes when it sent requests or made room
+    int notify_fd;          // eventfd we write when we sent responses or made room
+    NetRing *ring;          // the worker's ring with the io_uring backend, NULL with epoll
+    int ring_requests;      // requests of the connection in flight on the ring
+    bool receiving;         // the multishot recv is armed
+    bool pausing;           // its cancellation is on the way, reading is paused
+    bool sending;           // a sendmsg is in flight, the output must stay where it is
+    bool polling;           // waiting for room in the socket to go on with a transfer
+    bool hangup;            // the peer is gone, what it sent is served and the connection closed
+    bool closed;            // closed, freed once its requests complete
+    struct msghdr message;  // of the sendmsg in flight
+    struct iovec *iov;      // its pieces, a block of the pool
+    size_t iov_size;
+    int shard_requests;     // messages out to other shards for the current command
+    ShardCommand waiting;   // that command, its strings are gone from the input
+    ShardResult gathered;   // the results back so far, merged
+    bool replying;          // all of them are back, the reply waits for the sendmsg in flight
+} Connection;
+
+typedef struct Worker {
+    int index;
+    int cpu;            // CPU the worker is pinned to, -1 if it isn't
+    int sockfd;         // its own listening socket
+    int unix_fd;        // the Unix socket listener, shared by all the workers, -1 if none
+    EventLoop *loop;
+    NetRing *ring;      // with the io_uring backend
+    Collection *shard;  // the documents whose ID hashes to this worker
+    IOEngine *engine;   // disk reads of the GETs and log appends of the INCRs on the shard
+    int inbox_fd;       // eventfd written when messages are queued for this worker
+    int signalled;      // inbox_fd was written and not read yet
+    Outbox *outboxes;   // one per worker
+    pthread_t thread;
+} Worker;
+
+static Worker *workers;
+static int worker_count;
+static SpscQueue **queues;         // queues[from * worker_count + to], none from a worker to itself
+static NetBufferPool *buffers;     // connection buffers, shared by the workers
+static OutputLimits limits = {SERVER_OUTPUT_HARD_LIMIT, SERVER_OUTPUT_SOFT_LIMIT, SERVER_OUTPUT_SOFT_SECONDS};
+static ServerStats stats;
+static ServerBackend backend = BACKEND_EPOLL;
+
+static void connection_event(EventLoop *loop, int fd, int events, void *arg);
+static void drive_connection(EventLoop *loop, Connection *conn);
+static bool start_command(struct Worker *worker, ShardMessage *message);
+
 // function to handle errors with custom messages
 void error(const char *msg){
     perror(msg);
     exit(1);
 }
 
-// function to initialize and return a server socket
-int init_server(int port){
+// function to initialize and return a server socket, with `reuse_port` more than one can bind the port
+int init_server(int port, bool reuse_port){
     int sockfd;
     struct sockaddr_in serv_addr;
 
     // creates a socket. AF_INET indicates the use of IPv4, SOCK_STREAM of TCP
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    // non blocking: accept() returns at once when no connection is waiting
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if(sockfd < 0) error("ERROR opening socket");
 
+    // a restarted server can bind again while old connections are in TIME_WAIT
+    int enable = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    // every worker binds its own socket, the kernel balances new connections among them
+    if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+        error("ERROR setting SO_REUSEPORT");
+
     // resets the serv_addr structure, to avoid residual data
     bzero((char *) &serv_addr, sizeof(serv_addr));
 
@@ -42,56 +411,1494 @@ int init_server(int port){
     return sockfd; // returns the descriptor of the new configured socket
 }
 
-// function to start listening for clients
+// function to initialize and return a Unix domain socket bound to `path`, for clients on this host
+int init_unix_server(const char *path, mode_t mode){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR, socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) error("ERROR opening the Unix socket");
+
+    // the socket of a previous run is replaced, a regular file is never removed, nor the
+    // socket of a server still listening on it
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "ERROR, %s exists and isn't a socket\n", path);
+            exit(1);
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0) error("ERROR opening the Unix socket");
+        bool live = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(probe);
+        if (live) {
+            fprintf(stderr, "ERROR, a server is already listening on %s\n", path);
+            exit(1);
+        }
+        unlink(path);
+    }
+
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) error("ERROR binding the Unix socket");
+    if (chmod(path, mode) < 0) error("ERROR setting the permissions of the Unix socket");
+    return sockfd;
+}
+
+// function to start listening for clients, the backlog absorbs bursts of connections
 void start_listening(int sockfd){
-    listen(sockfd, 5);
+    if (listen(sockfd, SOMAXCONN) < 0) error("ERROR on listen");
 }
 
-// function to accept connection from a client
-int accept_client(int sockfd, struct sockaddr_in *cli_addr){
+// function to accept connection from a client, -1 when none is waiting
+int accept_client(int sockfd, struct sockaddr_storage *cli_addr){
     socklen_t clilen = sizeof(*cli_addr); // determines the client address length
 
-    // accepts a client connection. stops the execution until a connection arrives
-    int newsockfd = accept(sockfd, (struct sockaddr *) cli_addr, &clilen);
-    if (newsockfd < 0) error("ERROR on accept");
+    // the accepted socket is non blocking too
+    int newsockfd = accept4(sockfd, (struct sockaddr *) cli_addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (newsockfd < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+        errno != ECONNABORTED) {
+        perror("ERROR on accept");
+    }
 
     return newsockfd; // returns the descriptor of the accepted configured connection's socket
 }
 
+static void close_passed(Connection *conn) {
+    for (int i = 0; i < conn->passed_count; i++) close(conn->passed[i]);
+    conn->passed_count = 0;
+}
+
+// requests on the ring or messages to other shards are out, they still refer to the connection
+static bool connection_busy(const Connection *conn) {
+    return conn->ring_requests > 0 || conn->shard_requests > 0;
+}
+
+static void close_connection(EventLoop *loop, Connection *conn) {
+    // the kernel may still use what the requests on the ring point to: they are cancelled,
+    // the completion of the last one (or the last answer of a shard) comes back here
+    if (connection_busy(conn)) {
+        if (!conn->closed) {
+            if (conn->ring_requests > 0) net_ring_cancel_fd(conn->ring, conn->fd);
+            event_loop_remove(loop, conn->fd);
+            if (conn->channel) event_loop_remove(loop, conn->wake_fd);
+        }
+        conn->closed = true;
+        event_loop_cancel(loop, &conn->idle);
+        event_loop_cancel(loop, &conn->soft_limit);
+        return;
+    }
+
+    event_loop_remove(loop, conn->fd);
+    if (conn->channel) {
+        event_loop_remove(loop, conn->wake_fd);
+        close(conn->wake_fd);
+        close(conn->notify_fd);
+        free_shm_channel(conn->channel);
+        __atomic_sub_fetch(&stats.channels, 1, __ATOMIC_RELAXED);
+    }
+    close_passed(conn);
+    event_loop_cancel(loop, &conn->idle);
+    event_loop_cancel(loop, &conn->soft_limit);
+    __atomic_sub_fetch(&stats.output_bytes, conn->output_bytes, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+    if (conn->transferring) end_document_transfer(&conn->transfer);
+    if (conn->replying && conn->waiting.opcode == OP_GET) end_document_transfer(&conn->gathered.transfer);
+    close(conn->fd);
+    for (int i = conn->piece_sent; i < conn->piece_count; i++) free(conn->pieces[i].data);
+    net_buffer_pool_put(buffers, (char *)conn->pieces, conn->pieces_size);
+    net_buffer_pool_put(buffers, (char *)conn->iov, conn->iov_size);
+    net_buffer_release(buffers, &conn->input);
+    net_buffer_release(buffers, &conn->output);
+    free(conn);
+}
+
+static OutputPiece *add_piece(Connection *conn) {
+    if (conn->piece_count == conn->piece_capacity) {
+        size_t size;
+        OutputPiece *pieces = (OutputPiece *)net_buffer_pool_get(buffers, sizeof(OutputPiece) * (conn->piece_count + 1), &size);
+        if (!pieces) return NULL;
+        if (conn->piece_count > 0) memcpy(pieces, conn->pieces, sizeof(OutputPiece) * conn->piece_count);
+        net_buffer_pool_put(buffers, (char *)conn->pieces, conn->pieces_size);
+        conn->pieces = pieces;
+        conn->pieces_size = size;
+        conn->piece_capacity = size / sizeof(OutputPiece);
+    }
+    return &conn->pieces[conn->piece_count++];
+}
+
+static bool output_backed_up(const Connection *conn) {
+    return conn->output_bytes >= SERVER_OUTPUT_PAUSE;
+}
+
+// not read while the output is backed up, nor while a command waits for other shards and
+// a read budget of input already waits behind it
+static bool reading_paused(const Connection *conn) {
+    return output_backed_up(conn) ||
+           (conn->shard_requests > 0 && net_buffer_length(&conn->input) >= SERVER_READ_BUDGET);
+}
+
+// accounts `length` more bytes of output, false if they would take it above the hard limit
+static bool charge_output(Connection *conn, size_t length) {
+    if (conn->overflow || (limits.hard && conn->output_bytes + length > limits.hard)) {
+        conn->overflow = true;
+        return false;
+    }
+    conn->output_bytes += length;
+    __atomic_add_fetch(&stats.output_bytes, length, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void discharge_output(Connection *conn, size_t length) {
+    conn->output_bytes -= length;
+    __atomic_sub_fetch(&stats.output_bytes, length, __ATOMIC_RELAXED);
+}
+
+static bool add_reply(Connection *conn, const char *reply, size_t length) {
+    if (!charge_output(conn, length)) return false;
+    // pieces refer to replies by offset, the buffer may move when it grows
+    NetBuffer *output = &conn->output;
+    if (!net_buffer_reserve(buffers, output, length)) {
+        discharge_output(conn, length);
+        return false;
+    }
+
+    // consecutive replies make a single piece
+    OutputPiece *last = conn->piece_count > conn->piece_sent ? &conn->pieces[conn->piece_count - 1] : NULL;
+    if (last && !last->data && last->offset + last->length == output->end) {
+        last->length += length;
+    } else {
+        OutputPiece *piece = add_piece(conn);
+        if (!piece) {
+            discharge_output(conn, length);
+            return false;
+        }
+        *piece = (OutputPiece){NULL, output->end, length};
+    }
+    memcpy(output->data + output->end, reply, length);
+    output->end += length;
+    return true;
+}
+
+// queues a document without copying it, the connection frees it once sent
+static bool add_reply_buffer(Connection *conn, char *data, size_t length) {
+    OutputPiece *piece = charge_output(conn, length) ? add_piece(conn) : NULL;
+    if (!piece) {
+        if (!conn->overflow) discharge_output(conn, length);
+        free(data);
+        return false;
+    }
+    *piece = (OutputPiece){data, 0, length};
+    return true;
+}
+
+// documents from this size on are sent with sendfile(), which can't write to a channel
+static size_t zero_copy_threshold(const Connection *conn) {
+    return conn->channel ? SIZE_MAX : TRANSFER_ZERO_COPY_THRESHOLD;
+}
+
+// queues the response of a GET prepared in conn->transfer
+static void queue_transfer(Connection *conn) {
+    // big documents go from their file with sendfile(), after what is queued before them
+    if (conn->transfer.zero_copy) {
+        conn->transferring = true;
+        return;
+    }
+
+    add_reply(conn, conn->transfer.header, conn->transfer.header_length);
+    if (conn->transfer.buffer && conn->transfer.length > 0) {
+        add_reply_buffer(conn, conn->transfer.buffer, conn->transfer.length);
+        conn->transfer.buffer = NULL;
+    }
+    end_document_transfer(&conn->transfer);
+}
+
+static bool add_reply_string(Connection *conn, const char *reply) {
+    return add_reply(conn, reply, strlen(reply));
+}
+
+// the counters of STATS, "name:value" pairs separated by spaces
+static int format_stats(char *buffer, size_t size) {
+    NetBufferPoolStats pool = net_buffer_pool_stats(buffers);
+    return snprintf(buffer, size,
+                    "connections:%lu accepted:%lu paused:%lu soft_disconnects:%lu hard_disconnects:%lu "
+                    "output_bytes:%lu channels:%lu ring_enters:%lu forwarded:%lu buffers_in_use:%zu buffers_pooled:%zu",
+                    __atomic_load_n(&stats.active, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.accepted, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.paused, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.soft_disconnects, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.hard_disconnects, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.output_bytes, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.channels, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.ring_enters, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats.forwarded, __ATOMIC_RELAXED), pool.in_use, pool.pooled);
+}
+
+// runs a command on `shard`, owned by the calling worker
+static void run_command(Collection *shard, const ShardCommand *command, ShardResult *result) {
+    // the transfer is only used, and prepared, by a GET
+    result->done = false;
+    result->value = 0;
+    const char *key = command->keys;
+
+    switch (command->opcode) {
+    case OP_GET:
+        // find_document() deletes an expired document and reports it as absent
+        if (find_document(shard, key)) {
+            result->done = start_document_transfer(&result->transfer, key, command->threshold);
+        } else {
+            missing_document_transfer(&result->transfer);
+        }
+        break;
+    case OP_INCR:
+        result->done = incr_document_field(shard, key, command->field, command->argument, &result->value);
+        break;
+    case OP_DEL:
+        for (int i = 0; i < command->key_count; i++, key += strlen(key) + 1) {
+            if (remove_document(shard, key)) result->value++;
+        }
+        result->done = result->value > 0;
+        break;
+    case OP_EXPIRE:
+        result->done = expire_document(shard, key, command->argument);
+        result->value = result->done;
+        break;
+    case OP_TTL:
+        result->value = document_ttl(shard, key);
+        break;
+    case OP_TRUNCATE:
+        result->value = truncate_collection(shard);
+        break;
+    }
+}
+
+// adds the result of one shard to those of the others
+static void merge_result(Connection *conn, ShardResult *result) {
+    ShardResult *gathered = &conn->gathered;
+    if (conn->waiting.opcode == OP_DEL || conn->waiting.opcode == OP_TRUNCATE) {
+        gathered->done = gathered->done || result->done;
+        gathered->value += result->value;
+    } else {
+        *gathered = *result;
+    }
+}
+
+// queues the reply of the command whose results are all gathered
+static void reply_command(Connection *conn) {
+    const ShardCommand *command = &conn->waiting;
+    ShardResult *result = &conn->gathered;
+    char reply[64];
+
+    if (command->opcode == OP_GET) {
+        conn->transfer = result->transfer;
+        if (conn->wire == WIRE_BINARY) {
+            // the text header prepared by the transfer is replaced by a response header
+            encode_response_header(conn->transfer.header, result->done ? STATUS_OK : STATUS_NOT_FOUND, command->id,
+                                   conn->transfer.length, 0);
+            conn->transfer.header_length = PROTOCOL_HEADER_SIZE;
+        }
+        queue_transfer(conn);
+        return;
+    }
+
+    if (conn->wire == WIRE_BINARY) {
+        uint8_t status = STATUS_OK;
+        long long value = result->value;
+        if (command->opcode == OP_INCR && !result->done) status = STATUS_ERROR;
+        if (command->opcode == OP_DEL) {
+            if (!result->done) status = STATUS_NOT_FOUND;
+            value = 0;
+        }
+        encode_response_header(reply, status, command->id, 0, value);
+        add_reply(conn, reply, PROTOCOL_HEADER_SIZE);
+        return;
+    }
+
+    switch (command->opcode) {
+    case OP_INCR:
+        if (result->done) snprintf(reply, sizeof(reply), ":%lld\n", result->value);
+        else snprintf(reply, sizeof(reply), "ERR not a counter\n");
+        break;
+    case OP_DEL:
+        if (command->multi) snprintf(reply, sizeof(reply), ":%lld\n", result->value);
+        else snprintf(reply, sizeof(reply), result->done ? "OK\n" : "ERR not found\n");
+        break;
+    case OP_EXPIRE:
+        snprintf(reply, sizeof(reply), result->done ? ":1\n" : ":0\n");
+        break;
+    case OP_TTL:
+        // in seconds, rounded up
+        snprintf(reply, sizeof(reply), ":%lld\n", result->value < 0 ? result->value : (result->value + 999) / 1000);
+        break;
+    default:
+        snprintf(reply, sizeof(reply), ":%lld\n", result->value);
+    }
+    add_reply_string(conn, reply);
+}
+
+// writes the inbox of a worker, unless it was written already and not read yet
+static void wake_worker(Worker *worker) {
+    if (__atomic_exchange_n(&worker->signalled, 1, __ATOMIC_ACQ_REL)) return;
+    uint64_t one = 1;
+    if (write(worker->inbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("ERROR waking a worker");
+}
+
+// hands a message to worker `to`: through the queue, or the outbox while the queue is full
+static void send_message(Worker *worker, int to, ShardMessage *message) {
+    Outbox *outbox = &worker->outboxes[to];
+    message->next = NULL;
+    if (!outbox->head && spsc_queue_push(queues[worker->index * worker_count + to], message)) {
+        wake_worker(&workers[to]);
+        return;
+    }
+
+    // the outbox keeps the order of the messages
+    if (outbox->tail) outbox->tail->next = message;
+    else outbox->head = message;
+    outbox->tail = message;
+}
+
+// moves the messages of the outboxes into the queues, as far as they have room
+static void flush_outboxes(Worker *worker) {
+    for (int to = 0; to < worker_count; to++) {
+        Outbox *outbox = &worker->outboxes[to];
+        if (!outbox->head) continue;
+
+        SpscQueue *queue = queues[worker->index * worker_count + to];
+        while (outbox->head) {
+            ShardMessage *next = outbox->head->next;
+            if (!spsc_queue_push(queue, outbox->head)) break;
+            outbox->head = next;
+        }
+        if (!outbox->head) outbox->tail = NULL;
+        wake_worker(&workers[to]);
+    }
+}
+
+// the strings of the command are in the input, which moves on: the message has a copy
+static ShardMessage *create_message(Connection *conn, const ShardCommand *command) {
+    size_t field_length = command->field ? strlen(command->field) + 1 : 0;
+    ShardMessage *message = malloc(sizeof(ShardMessage) + command->keys_length + field_length);
+    if (!message) return NULL;
+
+    message->origin = conn;
+    message->from = conn->worker->index;
+    message->answered = false;
+    message->command = *command;
+    message->command.keys = message->strings;
+    if (command->keys_length > 0) memcpy(message->strings, command->keys, command->keys_length);
+    if (command->field) message->command.field = memcpy(message->strings + command->keys_length, command->field, field_length);
+    return message;
+}
+
+// a command on our own shard waits for the engine in a message, if it can
+static bool start_local(Connection *conn, const ShardCommand *command) {
+    if (command->opcode != OP_GET && command->opcode != OP_INCR) return false;
+
+    ShardMessage *message = create_message(conn, command);
+    if (!message) return false;
+    if (!start_command(conn->worker, message)) {
+        free(message);
+        return false;
+    }
+    conn->shard_requests++;
+    return true;
+}
+
+// runs the command on `shard` if it is ours, else sends it there in a message
+static void submit_to_shard(Connection *conn, const ShardCommand *command, int shard) {
+    Worker *worker = conn->worker;
+    if (shard == worker->index) {
+        ShardResult result = {0};
+        run_command(worker->shard, command, &result);
+        merge_result(conn, &result);
+        return;
+    }
+
+    ShardMessage *message = create_message(conn, command);
+    if (!message) {
+        conn->closing = true;
+        return;
+    }
+
+    conn->shard_requests++;
+    __atomic_add_fetch(&stats.forwarded, 1, __ATOMIC_RELAXED);
+    send_message(worker, shard, message);
+}
+
+// sends the keys of a command to their shards, a command with the keys of each
+static void scatter_command(Connection *conn, const ShardCommand *command) {
+    int *owners = malloc(sizeof(int) * command->key_count);
+    char *keys = malloc(command->keys_length);
+    if (!owners || !keys) {
+        free(owners);
+        free(keys);
+        conn->closing = true;
+        return;
+    }
+
+    const char *key = command->keys;
+    for (int i = 0; i < command->key_count; i++, key += strlen(key) + 1) owners[i] = document_shard(key, worker_count);
+
+    for (int shard = 0; shard < worker_count; shard++) {
+        ShardCommand part = *command;
+        part.keys = keys;
+        part.keys_length = 0;
+        part.key_count = 0;
+
+        key = command->keys;
+        for (int i = 0; i < command->key_count; i++, key += strlen(key) + 1) {
+            if (owners[i] != shard) continue;
+            size_t length = strlen(key) + 1;
+            memcpy(keys + part.keys_length, key, length);
+            part.keys_length += length;
+            part.key_count++;
+        }
+        if (part.key_count > 0) submit_to_shard(conn, &part, shard);
+    }
+    free(owners);
+    free(keys);
+}
+
+/*
+ * Runs a command on the shards owning its keys. The reply is queued once all of them
+ * answered: at once if they are all ours, else when the last message comes back (or the
+ * disk I/O of our own shard completes).
+ */
+static void submit_command(Connection *conn, const ShardCommand *command) {
+    conn->waiting = *command;
+
+    // most commands are for one key of our own shard, there is nothing to gather
+    Worker *worker = conn->worker;
+    if (command->opcode != OP_TRUNCATE && (worker_count == 1 || (command->key_count == 1 &&
+        document_shard(command->keys, worker_count) == worker->index))) {
+        if (start_local(conn, command)) return;
+        run_command(worker->shard, command, &conn->gathered);
+        reply_command(conn);
+        return;
+    }
+
+    memset(&conn->gathered, 0, sizeof(ShardResult));
+    if (command->opcode == OP_TRUNCATE) {
+        for (int shard = 0; shard < worker_count; shard++) submit_to_shard(conn, command, shard);
+    } else if (command->key_count > 1 && worker_count > 1) {
+        scatter_command(conn, command);
+    } else {
+        submit_to_shard(conn, command, document_shard(command->keys, worker_count));
+    }
+
+    if (conn->shard_requests == 0 && !conn->closing) reply_command(conn);
+}
+
+// a command on the key at `id` (NUL terminated), on the shard owning it
+static void submit_key_command(Connection *conn, uint8_t opcode, const char *id) {
+    ShardCommand command = {.opcode = opcode, .keys = id, .keys_length = strlen(id) + 1, .key_count = 1,
+                            .threshold = zero_copy_threshold(conn)};
+    submit_command(conn, &command);
+}
+
+// executes one command, its reply is queued on the connection once it has run on its shards
+static void execute_command(Connection *conn, char *buffer) {
+    // "GET <id>" sends the document back, big ones straight from the file (zero copy)
+    if (strncmp(buffer, "GET ", 4) == 0) {
+        char *id = buffer + 4;
+        id[strcspn(id, "\r\n ")] = '\0';
+        submit_key_command(conn, OP_GET, id);
+    } else if (strncmp(buffer, "INCR ", 5) == 0) {
+        // "INCR <id> <field> [n]" adds n (default 1) to a counter and replies with its new value
+        char id[128], field[128];
+        long long by = 1;
+        if (sscanf(buffer + 5, "%127s %127s %lld", id, field, &by) >= 2) {
+            ShardCommand command = {.opcode = OP_INCR, .keys = id, .keys_length = strlen(id) + 1, .key_count = 1,
+                                    .field = field, .argument = by};
+            submit_command(conn, &command);
+        } else {
+            add_reply_string(conn, "ERR not a counter\n");
+        }
+    } else if (strncmp(buffer, "DEL ", 4) == 0) {
+        // "DEL <id>" hides the document at once, its file is reclaimed in the background
+        char *id = buffer + 4;
+        id[strcspn(id, "\r\n ")] = '\0';
+        submit_key_command(conn, OP_DEL, id);
+    } else if (strncmp(buffer, "MDEL ", 5) == 0) {
+        // "MDEL <id> <id> ..." deletes the documents on all the shards, replies with how many there were
+        ShardCommand command = {.opcode = OP_DEL, .multi = true, .keys = buffer + 5};
+        char *end = buffer + 5, *save;
+        for (char *id = strtok_r(buffer + 5, " \r", &save); id; id = strtok_r(NULL, " \r", &save)) {
+            size_t length = strlen(id) + 1;
+            memmove(end, id, length);
+            end += length;
+            command.key_count++;
+        }
+        command.keys_length = end - command.keys;
+        if (command.key_count > 0) submit_command(conn, &command);
+        else add_reply_string(conn, ":0\n");
+    } else if (strncmp(buffer, "EXPIRE ", 7) == 0) {
+        // "EXPIRE <id> <seconds>" replies :1 if the TTL was set, :0 if there is no such document
+        char id[128];
+        long long seconds;
+        int fields = sscanf(buffer + 7, "%127s %lld", id, &seconds);
+        if (fields == 2 && (seconds < 0 || seconds > INT64_MAX / 1000)) {
+            // a negative or overflowing TTL would land in the past and delete the document
+            add_reply_string(conn, "ERR invalid TTL\n");
+        } else if (fields == 2) {
+            ShardCommand command = {.opcode = OP_EXPIRE, .keys = id, .keys_length = strlen(id) + 1, .key_count = 1,
+                                    .argument = seconds * 1000};
+            submit_command(conn, &command);
+        } else {
+            add_reply_string(conn, ":0\n");
+        }
+    } else if (strncmp(buffer, "TTL ", 4) == 0) {
+        // "TTL <id>" replies with the seconds left, -1 without a TTL, -2 without a document
+        char *id = buffer + 4;
+        id[strcspn(id, "\r\n ")] = '\0';
+        submit_key_command(conn, OP_TTL, id);
+    } else if (strncmp(buffer, "TRUNCATE", 8) == 0) {
+        // "TRUNCATE" empties the collection and replies with the number of documents removed
+        ShardCommand command = {.opcode = OP_TRUNCATE};
+        submit_command(conn, &command);
+    } else if (strncmp(buffer, "STATS", 5) == 0) {
+        // "STATS" replies with the connection and output counters on one line
+        char line[512];
+        int length = format_stats(line, sizeof(line) - 1);
+        line[length++] = '\n';
+        add_reply(conn, line, length);
+    } else if (strncmp(buffer, "exit", 4) == 0 || strncmp(buffer, "QUIT", 4) == 0) {
+        // the client stops reading when the reply starts with "exit"
+        add_reply_string(conn, "exit\n");
+        conn->closing = true;
+    } else if (buffer[0] != '\0') {
+        add_reply_string(conn, "ERR unknown command\n");
+    }
+}
+
+/*
+ * Switches a connection to the shared memory channel whose region and eventfds came with
+ * the OP_ATTACH frame. Nothing may be waiting to be sent on the socket: the response to
+ * OP_ATTACH is the first to go through the region.
+ */
+static bool attach_channel(Connection *conn) {
+    if (conn->channel || conn->passed_count != SERVER_PASSED_FDS || conn->piece_count > 0 ||
+        conn->transferring) {
+        close_passed(conn);
+        return false;
+    }
+
+    // the eventfds are the client's too, we never want to block on them
+    int wake_fd = conn->passed[1], notify_fd = conn->passed[2];
+    ShmChannel *channel = attach_shm_channel(conn->passed[0]);
+    if (!channel || fcntl(wake_fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(notify_fd, F_SETFL, O_NONBLOCK) < 0 ||
+        !event_loop_add(conn->loop, wake_fd, EVENT_READABLE, connection_event, conn)) {
+        free_shm_channel(channel);
+        close_passed(conn);
+        return false;
+    }
+
+    // the region stays mapped without its fd
+    close(conn->passed[0]);
+    conn->passed_count = 0;
+    conn->channel = channel;
+    conn->wake_fd = wake_fd;
+    conn->notify_fd = notify_fd;
+    conn->unread = true;
+    __atomic_add_fetch(&stats.channels, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// executes one binary request, its response is queued on the connection once it has run on its shards
+static void execute_request(Connection *conn, const ProtocolRequest *request) {
+    char header[PROTOCOL_HEADER_SIZE];
+    uint8_t status = STATUS_OK;
+
+    // key and body are NUL terminated in the input buffer, they are used where they are
+    ShardCommand command = {.opcode = request->opcode, .id = request->id, .keys = request->key,
+                            .keys_length = request->key_length + 1, .key_count = 1,
+                            .field = request->opcode == OP_INCR ? request->body : NULL, .argument = request->argument, .threshold = zero_copy_threshold(conn)};
+    switch (request->opcode) {
+    case OP_PING:
+        break;
+    case OP_EXPIRE:
+        if (request->argument < 0) {
+            status = STATUS_ERROR;
+            break;
+        }
+        submit_command(conn, &command);
+        return;
+    case OP_GET:
+    case OP_INCR:
+    case OP_DEL:
+    case OP_TTL:
+        submit_command(conn, &command);
+        return;
+    case OP_TRUNCATE:
+        command = (ShardCommand){.opcode = OP_TRUNCATE, .id = request->id};
+        submit_command(conn, &command);
+        return;
+    case OP_QUIT:
+        conn->closing = true;
+        break;
+    case OP_ATTACH:
+        if (!attach_channel(conn)) status = STATUS_ERROR;
+        break;
+    case OP_STATS: {
+        char body[512];
+        int length = format_stats(body, sizeof(body));
+        encode_response_header(header, STATUS_OK, request->id, length, 0);
+        if (add_reply(conn, header, PROTOCOL_HEADER_SIZE)) add_reply(conn, body, length);
+        return;
+    }
+    default:
+        status = STATUS_UNKNOWN;
+    }
+
+    encode_response_header(header, status, request->id, 0, 0);
+    add_reply(conn, header, PROTOCOL_HEADER_SIZE);
+}
+
+// `n` bytes of the queued pieces were sent: pieces sent whole are released, the last one may be sent in part
+static void advance_output(Connection *conn, size_t n) {
+    discharge_output(conn, n);
+    while (n > 0) {
+        OutputPiece *piece = &conn->pieces[conn->piece_sent];
+        size_t left = piece->length - conn->piece_offset;
+        if (n < left) {
+            conn->piece_offset += n;
+            break;
+        }
+        n -= left;
+        free(piece->data);
+        conn->piece_sent++;
+        conn->piece_offset = 0;
+    }
+}
+
+// everything is sent, the buffers go back to the pool
+static void release_output(Connection *conn) {
+    net_buffer_pool_put(buffers, (char *)conn->pieces, conn->pieces_size);
+    conn->pieces = NULL;
+    conn->pieces_size = 0;
+    conn->piece_sent = conn->piece_count = conn->piece_capacity = 0;
+    net_buffer_pool_put(buffers, (char *)conn->iov, conn->iov_size);
+    conn->iov = NULL;
+    conn->iov_size = 0;
+    net_buffer_release(buffers, &conn->output);
+}
+
+static void notify_client(Connection *conn) {
+    uint64_t one = 1;
+    if (write(conn->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("ERROR notifying a client");
+}
+
+// copies the queued pieces into the response ring, as far as it has room
+static bool flush_channel(Connection *conn) {
+    ShmRing *ring = &conn->channel->responses;
+    bool written = false;
+
+    while (conn->piece_sent < conn->piece_count) {
+        OutputPiece *piece = &conn->pieces[conn->piece_sent];
+        char *base = piece->data ? piece->data : conn->output.data + piece->offset;
+        size_t n = shm_ring_write(ring, base + conn->piece_offset, piece->length - conn->piece_offset);
+        if (n > 0) {
+            advance_output(conn, n);
+            written = true;
+            continue;
+        }
+        // full: the client writes wake_fd once it makes room
+        if (shm_ring_arm_writable(ring)) break;
+    }
+
+    if (written && shm_ring_wake_consumer(ring)) notify_client(conn);
+    if (conn->piece_sent == conn->piece_count) release_output(conn);
+    return true;
+}
+
+// the next pieces to send, up to SERVER_MAX_IOV of them
+static int gather_output(Connection *conn, struct iovec *iov) {
+    int count = 0;
+    for (int i = conn->piece_sent; i < conn->piece_count && count < SERVER_MAX_IOV; i++, count++) {
+        OutputPiece *piece = &conn->pieces[i];
+        size_t skip = i == conn->piece_sent ? conn->piece_offset : 0;
+        char *base = piece->data ? piece->data : conn->output.data + piece->offset;
+        iov[count] = (struct iovec){base + skip, piece->length - skip};
+    }
+    return count;
+}
+
+// queues a sendmsg of the pieces on the ring, unless one is in flight; send_completed() goes on
+static bool submit_output(Connection *conn) {
+    if (conn->sending) return true;
+    if (conn->piece_sent == conn->piece_count) {
+        release_output(conn);
+        return true;
+    }
+
+    if (!conn->iov) {
+        conn->iov = (struct iovec *)net_buffer_pool_get(buffers, sizeof(struct iovec) * SERVER_MAX_IOV, &conn->iov_size);
+        if (!conn->iov) return false;
+    }
+    conn->message = (struct msghdr){.msg_iov = conn->iov, .msg_iovlen = gather_output(conn, conn->iov)};
+    if (!net_ring_sendmsg(conn->ring, conn->fd, &conn->message, (uintptr_t)conn | RING_SEND)) return false;
+    conn->sending = true;
+    conn->ring_requests++;
+    return true;
+}
+
+// sends the queued pieces, gathered in as few sendmsg() as possible, false on errors
+static bool flush_output(Connection *conn) {
+    if (conn->channel) return flush_channel(conn);
+    if (conn->ring) return submit_output(conn);
+
+    while (conn->piece_sent < conn->piece_count) {
+        struct iovec iov[SERVER_MAX_IOV];
+        int count = gather_output(conn, iov);
+
+        struct msghdr message = {.msg_iov = iov, .msg_iovlen = count};
+        ssize_t n = sendmsg(conn->fd, &message, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        advance_output(conn, n);
+    }
+
+    release_output(conn);
+    return true;
+}
+
+// keeps the descriptors passed with the input (SCM_RIGHTS), they replace the previous ones
+static void keep_passed(Connection *conn, struct msghdr *message) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(message); cmsg; cmsg = CMSG_NXTHDR(message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        close_passed(conn);
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (conn->passed_count < SERVER_PASSED_FDS) conn->passed[conn->passed_count++] = fd;
+            else close(fd);
+        }
+    }
+}
+
+// moves the requests of the ring into the input, like read_input() does from the socket
+static bool read_channel(Connection *conn) {
+    ShmRing *ring = &conn->channel->requests;
+
+    for (size_t budget = SERVER_READ_BUDGET; budget > 0; ) {
+        NetBuffer *input = &conn->input;
+        if (!net_buffer_reserve(buffers, input, SERVER_READ_CHUNK)) return false;
+
+        size_t room = input->capacity - input->end;
+        size_t n = shm_ring_read(ring, input->data + input->end, room < budget ? room : budget);
+        if (n == 0) {
+            // drained: the client writes wake_fd with its next requests, unless they just came
+            if (shm_ring_arm_readable(ring)) {
+                conn->unread = false;
+                return true;
+            }
+            continue;
+        }
+        input->end += n;
+        budget -= n;
+        if (shm_ring_wake_producer(ring)) notify_client(conn);
+    }
+    return true;
+}
+
+// a client that sends no newline can't make us buffer without limit (frames are bounded
+// by their header, see parse_request())
+static bool input_too_long(const Connection *conn) {
+    const NetBuffer *input = &conn->input;
+    return conn->wire != WIRE_BINARY && net_buffer_length(input) > SERVER_MAX_QUERY &&
+           memchr(input->data + input->start, '\n', net_buffer_length(input)) == NULL;
+}
+
+/*
+ * Reads what the socket has, up to SERVER_READ_BUDGET bytes: if there may be more,
+ * conn->unread stays set. False if the peer is gone or sent a text command too long.
+ */
+static bool read_input(Connection *conn) {
+    if (conn->channel) return read_channel(conn);
+
+    for (size_t budget = SERVER_READ_BUDGET; ; ) {
+        if (budget == 0) return true;
+
+        // a full buffer moves up to the next size class
+        NetBuffer *input = &conn->input;
+        if (!net_buffer_reserve(buffers, input, SERVER_READ_CHUNK)) return false;
+
+        // edge triggered: the socket must be drained, or we wouldn't hear from it again;
+        // on a Unix socket descriptors may come with the bytes, for OP_ATTACH
+        char control[CMSG_SPACE(sizeof(int) * SERVER_PASSED_FDS)];
+        struct iovec iov = {input->data + input->end, input->capacity - input->end};
+        struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                                 .msg_controllen = sizeof(control)};
+        ssize_t n = recvmsg(conn->fd, &message, MSG_CMSG_CLOEXEC);
+        if (n >= 0) keep_passed(conn, &message);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            conn->unread = false;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        input->end += n;
+        budget -= (size_t)n < budget ? (size_t)n : budget;
+
+        if (input_too_long(conn)) return false;
+    }
+}
+
+/*
+ * Executes the next complete command (or frame) of the input. Returns 1 if it did, 0 if
+ * the input holds none, -1 if the input can't be parsed.
+ */
+static int execute_next(Connection *conn) {
+    size_t length = net_buffer_length(&conn->input);
+    if (length == 0) return 0;
+    char *start = conn->input.data + conn->input.start;
+    if (conn->wire == WIRE_UNKNOWN) conn->wire = (uint8_t)start[0] == PROTOCOL_MAGIC ? WIRE_BINARY : WIRE_TEXT;
+
+    if (conn->wire == WIRE_BINARY) {
+        // a partial frame waits for the rest, a malformed one can't be skipped
+        ProtocolRequest request;
+        ssize_t frame = parse_request(start, length, &request);
+        if (frame <= 0) return frame;
+
+        execute_request(conn, &request);
+        net_buffer_consume(&conn->input, frame);
+    } else {
+        char *end = memchr(start, '\n', length);
+        if (!end) return 0;
+
+        *end = '\0';
+        execute_command(conn, start);
+        net_buffer_consume(&conn->input, end - start + 1);
+    }
+    return 1;
+}
+
+/*
+ * Advances a connection as far as its socket allows: executes the commands received,
+ * sends their responses, then the file of a big GET if one is in progress, and so on.
+ * Returns false once the connection must be closed.
+ */
+static bool serve_connection(Connection *conn) {
+    bool alive = true;
+
+    while (alive) {
+        // every complete command of the input, up to a file transfer, too much output or a
+        // command out to other shards
+        int result = 1;
+        while (!conn->transferring && !conn->closing && !conn->sending && conn->shard_requests == 0 &&
+               !output_backed_up(conn) && (result = execute_next(conn)) > 0);
+        bool backed_up = output_backed_up(conn);
+        if (result < 0 || conn->overflow) {
+            if (conn->overflow) __atomic_add_fetch(&stats.hard_disconnects, 1, __ATOMIC_RELAXED);
+            alive = false;
+            break;
+        }
+
+        // their responses in one go
+        if (!flush_output(conn)) {
+            alive = false;
+            break;
+        }
+        if (conn->piece_count > 0) break; // the socket is full (or a send in flight), EPOLLOUT will resume us
+
+        if (conn->closing) {
+            alive = false;
+            break;
+        }
+        if (!conn->transferring) {
+            // the output drained, the commands left waiting for it can go on
+            if (backed_up) continue;
+            break;
+        }
+
+        result = continue_document_transfer(&conn->transfer, conn->fd);
+        if (result == 0) break;
+        end_document_transfer(&conn->transfer);
+        conn->transferring = false;
+        if (result < 0) alive = false;
+    }
+
+    // commands not complete yet stay in the buffer, an empty one goes back to the pool
+    if (net_buffer_length(&conn->input) == 0) net_buffer_release(buffers, &conn->input);
+    return alive;
+}
+
+static void idle_timeout(EventLoop *loop, void *arg) {
+    close_connection(loop, arg);
+}
+
+static void soft_limit_timeout(EventLoop *loop, void *arg) {
+    __atomic_add_fetch(&stats.soft_disconnects, 1, __ATOMIC_RELAXED);
+    close_connection(loop, arg);
+}
+
+// starts the soft limit clock when the output goes above the limit, stops it when it's back under
+static void update_soft_limit(EventLoop *loop, Connection *conn) {
+    bool above = limits.soft && conn->output_bytes > limits.soft;
+    if (above && !timing_wheel_pending(&conn->soft_limit.node)) {
+        event_loop_schedule(loop, &conn->soft_limit, limits.soft_seconds * 1000ULL, soft_limit_timeout, conn);
+    } else if (!above) {
+        event_loop_cancel(loop, &conn->soft_limit);
+    }
+}
+
+// false once the socket of a connection attached to a channel is closed by the client
+static bool socket_open(Connection *conn) {
+    char discard[256];
+    ssize_t n;
+    while ((n = read(conn->fd, discard, sizeof(discard))) > 0 || (n < 0 && errno == EINTR));
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void connection_event(EventLoop *loop, int fd, int events, void *arg) {
+    Connection *conn = arg;
+    if (conn->channel && fd == conn->fd) {
+        // once attached the socket only tells us when the client is gone
+        if (!socket_open(conn)) close_connection(loop, conn);
+        return;
+    }
+    if (conn->channel) {
+        // wake_fd: new requests, or room for responses
+        uint64_t count;
+        if (read(conn->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            close_connection(loop, conn);
+            return;
+        }
+        conn->unread = true;
+    } else if (events & EVENT_READABLE) {
+        conn->unread = true;
+    }
+    drive_connection(loop, conn);
+}
+
+// reads and serves a connection of the epoll backend until it waits for the socket or the shards
+static void drive_connection(EventLoop *loop, Connection *conn) {
+    // with the output backed up the socket isn't read: the requests wait in the kernel,
+    // and the client is slowed down by TCP until we catch up
+    do {
+        if (conn->unread && !reading_paused(conn) && !read_input(conn)) {
+            conn->hangup = true;
+            conn->unread = false;
+        }
+
+        // what was read before the peer hung up is still served, as far as the socket allows
+        if (!serve_connection(conn) || (conn->hangup && conn->shard_requests == 0)) {
+            close_connection(loop, conn);
+            return;
+        }
+    } while (conn->unread && !reading_paused(conn));
+
+    bool paused = conn->unread && output_backed_up(conn);
+    if (paused && !conn->paused) __atomic_add_fetch(&stats.paused, 1, __ATOMIC_RELAXED);
+    conn->paused = paused;
+
+    update_soft_limit(loop, conn);
+    event_loop_schedule(loop, &conn->idle, SERVER_IDLE_TIMEOUT_MS, idle_timeout, conn);
+}
+
+static Connection *create_connection(Worker *worker, int fd) {
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (!conn) return NULL;
+    conn->fd = fd;
+    conn->loop = worker->loop;
+    conn->worker = worker;
+    conn->wake_fd = conn->notify_fd = -1;
+    return conn;
+}
+
+// the connection is served from now on, until close_connection()
+static void open_connection(EventLoop *loop, Connection *conn) {
+    event_loop_schedule(loop, &conn->idle, SERVER_IDLE_TIMEOUT_MS, idle_timeout, conn);
+    __atomic_add_fetch(&stats.accepted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+}
+
+static void accept_event(EventLoop *loop, int sockfd, int events, void *arg) {
+    (void)events;
+    struct sockaddr_storage cli_addr;
+    int newsockfd;
+
+    // one edge may stand for many connections waiting in the backlog
+    while ((newsockfd = accept_client(sockfd, &cli_addr)) >= 0) {
+        Connection *conn = create_connection(arg, newsockfd);
+
+        // registered once for both directions, edge triggered it costs nothing while idle
+        if (!conn || !event_loop_add(loop, newsockfd, EVENT_READABLE | EVENT_WRITABLE, connection_event, conn)) {
+            close(newsockfd);
+            free(conn);
+            continue;
+        }
+        open_connection(loop, conn);
+    }
+}
+
+// arms the multishot recv of a connection, which completes in received()
+static bool arm_recv(Connection *conn) {
+    if (!net_ring_recv(conn->ring, conn->fd, (uintptr_t)conn | RING_RECV)) return false;
+    conn->receiving = true;
+    conn->ring_requests++;
+    return true;
+}
+
+// data received, or the end of a multishot recv
+static void received(Connection *conn, const NetCompletion *completion) {
+    if (!completion->more) conn->receiving = conn->pausing = false;
+
+    if (completion->buffer != NET_RING_NO_BUFFER) {
+        // copied out at once, the buffer goes back to the kernel for the next recv
+        size_t length = completion->result > 0 ? completion->result : 0;
+        NetBuffer *input = &conn->input;
+        if (!conn->closed && !conn->hangup) {
+            if (net_buffer_reserve(buffers, input, length)) {
+                memcpy(input->data + input->end, net_ring_buffer(conn->ring, completion->buffer), length);
+                input->end += length;
+                if (input_too_long(conn)) conn->hangup = true;
+            } else {
+                conn->hangup = true;
+            }
+        }
+        net_ring_recycle(conn->ring, completion->buffer);
+    }
+
+    // no buffer left, or cancelled because the output backed up: armed again when there is room
+    if (completion->result == 0 || (completion->result < 0 && completion->result != -ENOBUFS &&
+                                    completion->result != -ECANCELED && completion->result != -EAGAIN)) {
+        conn->hangup = true;
+    }
+}
+
+static void send_completed(Connection *conn, int result) {
+    conn->sending = false;
+    if (conn->closed) return;
+    if (result >= 0) advance_output(conn, result);
+    else if (result != -EAGAIN) conn->hangup = true;  // -EAGAIN: nothing sent, submitted again below
+
+    // the output may move again, the reply that waited for the send is queued
+    if (conn->replying) {
+        conn->replying = false;
+        reply_command(conn);
+    }
+}
+
+/*
+ * The connection_event() of the io_uring backend, after each completion of a connection:
+ * serves it, then arms what it waits for next.
+ */
+static void ring_event(EventLoop *loop, Connection *conn) {
+    if (conn->closed) {
+        close_connection(loop, conn);
+        return;
+    }
+    if (!serve_connection(conn) || (conn->hangup && conn->shard_requests == 0)) {
+        close_connection(loop, conn);
+        return;
+    }
+
+    // a backed up connection stops receiving, like it stops reading with epoll
+    bool paused = reading_paused(conn);
+    if (paused && conn->receiving && !conn->pausing) {
+        net_ring_cancel(conn->ring, (uintptr_t)conn | RING_RECV);
+        conn->pausing = true;
+        if (output_backed_up(conn)) __atomic_add_fetch(&stats.paused, 1, __ATOMIC_RELAXED);
+    } else if (!paused && !conn->receiving && !conn->hangup && !arm_recv(conn)) {
+        close_connection(loop, conn);
+        return;
+    }
+
+    // a transfer stopped by a full socket waits for room
+    if (conn->transferring && conn->piece_count == 0 && !conn->polling) {
+        if (!net_ring_poll(conn->ring, conn->fd, POLLOUT, (uintptr_t)conn | RING_POLL)) {
+            close_connection(loop, conn);
+            return;
+        }
+        conn->polling = true;
+        conn->ring_requests++;
+    }
+
+    update_soft_limit(loop, conn);
+    event_loop_schedule(loop, &conn->idle, SERVER_IDLE_TIMEOUT_MS, idle_timeout, conn);
+}
+
+/*
+ * A message came back with a result for `conn`: once all of them are back the reply is
+ * queued and the connection goes on, with what it received meanwhile.
+ */
+static void shard_answered(Worker *worker, ShardMessage *message) {
+    Connection *conn = message->origin;
+    conn->shard_requests--;
+    if (conn->closed) {
+        if (message->command.opcode == OP_GET) end_document_transfer(&message->result.transfer);
+        free(message);
+        close_connection(worker->loop, conn);
+        return;
+    }
+
+    merge_result(conn, &message->result);
+    free(message);
+    if (conn->shard_requests > 0) return;
+
+    // a new reply could move the output the kernel is sending from, send_completed() queues it
+    if (conn->sending) {
+        conn->replying = true;
+        return;
+    }
+    reply_command(conn);
+    if (conn->ring) ring_event(worker->loop, conn);
+    else drive_connection(worker->loop, conn);
+}
+
+// a command on our shard has its result: back to the connection, on this worker or another
+static void command_done(Worker *worker, ShardMessage *message) {
+    message->answered = true;
+    if (message->from == worker->index) shard_answered(worker, message);
+    else send_message(worker, message->from, message);
+}
+
+static void transfer_ready(DocumentTransfer *transfer, bool found, void *arg) {
+    (void)transfer;
+    ShardMessage *message = arg;
+    message->result.done = found;
+    command_done(message->owner, message);
+}
+
+static void incr_done(bool done, long long value, void *arg) {
+    ShardMessage *message = arg;
+    message->result.done = done;
+    message->result.value = done ? value : 0;
+    command_done(message->owner, message);
+}
+
+/*
+ * Starts a command of our shard whose disk I/O goes through the engine of the worker: the
+ * message is answered when it completes, never before this returns. False if the command
+ * must run at once instead, with run_command().
+ */
+static bool start_command(Worker *worker, ShardMessage *message) {
+    const ShardCommand *command = &message->command;
+    ShardResult *result = &message->result;
+    result->done = false;
+    result->value = 0;
+    message->owner = worker;
+
+    switch (command->opcode) {
+    case OP_GET:
+        // find_document() deletes an expired document, a missing one is answered at once
+        return find_document(worker->shard, command->keys) &&
+               start_document_transfer_async(worker->engine, &result->transfer, command->keys, command->threshold,
+                                             transfer_ready, message);
+    case OP_INCR:
+        return incr_document_field_async(worker->engine, worker->shard, command->keys, command->field,
+                                         command->argument, incr_done, message);
+    default:
+        return false;
+    }
+}
+
+// runs the commands the other workers sent to our shard, and takes back the results of ours
+static void drain_inbox(Worker *worker) {
+    uint64_t count;
+    if (read(worker->inbox_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("ERROR reading the inbox");
+    // from here on a new message writes the inbox again
+    __atomic_exchange_n(&worker->signalled, 0, __ATOMIC_ACQ_REL);
+
+    for (int from = 0; from < worker_count; from++) {
+        if (from == worker->index) continue;
+
+        // a worker that keeps sending can't hold us here: what's left waits for the next drain
+        SpscQueue *queue = queues[from * worker_count + worker->index];
+        ShardMessage *message;
+        int n = 0;
+        for (; n < SERVER_SHARD_QUEUE && (message = spsc_queue_pop(queue)) != NULL; n++) {
+            if (message->answered) {
+                shard_answered(worker, message);
+                continue;
+            }
+            if (start_command(worker, message)) continue;
+            run_command(worker->shard, &message->command, &message->result);
+            command_done(worker, message);
+        }
+        if (n == SERVER_SHARD_QUEUE) wake_worker(worker);
+    }
+    flush_outboxes(worker);
+}
+
+static void inbox_event(EventLoop *loop, int fd, int events, void *arg) {
+    (void)loop;
+    (void)fd;
+    (void)events;
+    drain_inbox(arg);
+}
+
+// user_data of the multishot accept on a listening socket, below the kind are 3 bits
+static uint64_t accept_request(int sockfd) {
+    return ((uint64_t)sockfd << 3) | RING_ACCEPT;
+}
+
+static void ring_accepted(Worker *worker, int sockfd, const NetCompletion *completion) {
+    // a multishot accept stops on errors, e.g. out of descriptors: it is armed again
+    if (!completion->more && !net_ring_accept(worker->ring, sockfd, accept_request(sockfd)))
+        error("ERROR accepting on the io_uring instance");
+    if (completion->result < 0) return;
+
+    Connection *conn = create_connection(worker, completion->result);
+    if (conn) conn->ring = worker->ring;
+    if (!conn || !arm_recv(conn)) {
+        close(completion->result);
+        free(conn);
+        return;
+    }
+    open_connection(worker->loop, conn);
+}
+
+static void ring_completion(const NetCompletion *completion, void *arg) {
+    Worker *worker = arg;
+    RingRequest kind = completion->user_data & SERVER_RING_KIND_MASK;
+
+    if (kind == RING_ACCEPT) {
+        ring_accepted(worker, (int)(completion->user_data >> 3), completion);
+        return;
+    }
+    if (kind == RING_INBOX) {
+        if (!net_ring_poll(worker->ring, worker->inbox_fd, POLLIN, RING_INBOX))
+            error("ERROR polling the inbox on the io_uring instance");
+        drain_inbox(worker);
+        return;
+    }
+    if (kind == RING_DISK) {
+        if (!net_ring_poll(worker->ring, io_engine_event_fd(worker->engine), POLLIN, RING_DISK))
+            error("ERROR polling the IO engine on the io_uring instance");
+        io_engine_poll(worker->engine, 0);
+        return;
+    }
+    if (completion->user_data == 0) return; // a cancellation
+
+    Connection *conn = (Connection *)(uintptr_t)(completion->user_data & ~(uint64_t)SERVER_RING_KIND_MASK);
+    if (!completion->more) conn->ring_requests--;
+    if (kind == RING_RECV) received(conn, completion);
+    else if (kind == RING_SEND) send_completed(conn, completion->result);
+    else conn->polling = false;
+    ring_event(worker->loop, conn);
+}
+
+// the worker loop of the io_uring backend: one io_uring_enter() submits and waits, then the
+// completions and the timers run
+static void run_ring(Worker *worker) {
+    NetRing *ring = create_net_ring(0, 0, 0);
+    if (!ring) error("ERROR creating the io_uring instance (Linux 6.0 or later is needed)");
+    worker->ring = ring;
+
+    if (!net_ring_accept(ring, worker->sockfd, accept_request(worker->sockfd)) ||
+        (worker->unix_fd >= 0 && !net_ring_accept(ring, worker->unix_fd, accept_request(worker->unix_fd))))
+        error("ERROR accepting on the io_uring instance");
+    if (!net_ring_poll(ring, worker->inbox_fd, POLLIN, RING_INBOX) ||
+        !net_ring_poll(ring, io_engine_event_fd(worker->engine), POLLIN, RING_DISK))
+        error("ERROR polling the inbox and the IO engine on the io_uring instance");
+
+    unsigned long enters = 0;
+    while (!worker->loop->stop) {
+        // the disk requests of the last completions leave before we wait
+        io_engine_flush(worker->engine);
+        if (net_ring_wait(ring, EVENT_LOOP_TICK_MS) < 0) error("ERROR waiting on the io_uring instance");
+        net_ring_reap(ring, ring_completion, worker);
+        event_loop_expire(worker->loop);
+
+        NetRingStats ring_stats = net_ring_stats(ring);
+        __atomic_add_fetch(&stats.ring_enters, ring_stats.enters - enters, __ATOMIC_RELAXED);
+        enters = ring_stats.enters;
+    }
+    free_net_ring(ring);
+}
+
+// documents whose TTL ran out are deleted a little at a time, between two batches of events;
+// messages that found a queue full are sent again
+static void server_tick(EventLoop *loop, void *arg) {
+    (void)loop;
+    Worker *worker = arg;
+    active_expire_cycle(worker->shard);
+    flush_outboxes(worker);
+}
+
+static void *worker_thread(void *arg) {
+    Worker *worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            fprintf(stderr, "WARNING: worker %d not pinned to CPU %d\n", worker->index, worker->cpu);
+    }
+
+    // each worker expires the documents of its own shard
+    event_loop_set_tick(worker->loop, server_tick, worker);
+
+    // serves the connections of this worker until its loop is stopped
+    if (backend == BACKEND_URING) {
+        run_ring(worker);
+        return NULL;
+    }
+
+    if (!event_loop_add(worker->loop, worker->sockfd, EVENT_READABLE, accept_event, worker))
+        error("ERROR watching the server socket");
+    if (worker->unix_fd >= 0 && !event_loop_add(worker->loop, worker->unix_fd, EVENT_READABLE, accept_event, worker))
+        error("ERROR watching the Unix socket");
+    if (!event_loop_add(worker->loop, worker->inbox_fd, EVENT_READABLE, inbox_event, worker))
+        error("ERROR watching the inbox");
+    if (!event_loop_attach_engine(worker->loop, worker->engine))
+        error("ERROR watching the IO engine");
+    event_loop_run(worker->loop);
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage %s port [-t threads] [-p] [-b epoll|uring] [-o hard:soft:seconds] [-u path [-m mode]]\n"
+                    "  -t  worker threads, each with its own listener and event loop (default: one per CPU)\n"
+                    "  -p  pin each worker to a CPU\n"
+                    "  -b  how the workers drive their sockets: epoll (default) or io_uring\n"
+                    "  -u  also listen on a Unix domain socket at path, for clients on this host\n"
+                    "  -m  permissions of the Unix socket, in octal (default: 660)\n"
+                    "  -o  output limits of a connection, sizes in bytes or with a k or m suffix, 0 for none\n"
+                    "      (default: 32m:4m:10)\n", name);
+    exit(1);
+}
+
+static bool parse_size(const char *text, char **end, size_t *size) {
+    unsigned long long value = strtoull(text, end, 10);
+    if (*end == text) return false;
+    if (**end == 'k' || **end == 'K') {
+        value <<= 10;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        value <<= 20;
+        (*end)++;
+    }
+    *size = value;
+    return true;
+}
+
+// "hard:soft:seconds", e.g. "32m:4m:10"
+static bool parse_limits(const char *text, OutputLimits *parsed) {
+    char *end;
+    if (!parse_size(text, &end, &parsed->hard) || *end != ':') return false;
+    if (!parse_size(end + 1, &end, &parsed->soft) || *end != ':') return false;
+    text = end + 1;
+    unsigned long seconds = strtoul(text, &end, 10);
+    if (end == text || *end != '\0') return false;
+    parsed->soft_seconds = seconds;
+    return true;
+}
+
 // main function
 int main(int argc, char *argv[]){
-    int sockfd, newsockfd, portno;
-    struct sockaddr_in cli_addr;
-    char buffer[256];
-    int n;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus : 1;
+    bool pin = false;
+    const char *unix_path = NULL;
+    mode_t unix_mode = SERVER_UNIX_MODE;
+    int option;
 
-    if (argc < 2){
+    while ((option = getopt(argc, argv, "t:pb:o:u:m:")) != -1) {
+        if (option == 't') threads = atoi(optarg);
+        else if (option == 'p') pin = true;
+        else if (option == 'b' && strcmp(optarg, "epoll") == 0) backend = BACKEND_EPOLL;
+        else if (option == 'b' && strcmp(optarg, "uring") == 0) backend = BACKEND_URING;
+        else if (option == 'o' && parse_limits(optarg, &limits)) continue;
+        else if (option == 'u') unix_path = optarg;
+        else if (option == 'm') unix_mode = strtoul(optarg, NULL, 8);
+        else usage(argv[0]);
+    }
+    if (optind >= argc){
         fprintf(stderr, "ERROR, no port provided\n");
-        exit(1);
+        usage(argv[0]);
     }
+    if (threads < 1 || threads > SERVER_MAX_THREADS) usage(argv[0]);
 
-    portno = atoi(argv[1]);
-    sockfd = init_server(portno);
+    int portno = atoi(argv[optind]);
 
-    listen(sockfd, 5);
+    // sendfile() has no MSG_NOSIGNAL, a client closing during a transfer must not kill us
+    signal(SIGPIPE, SIG_IGN);
 
-    // loop to accept multiple connections
-    while(1) {
-        // accepts a connection from a client
-        newsockfd = accept_client(sockfd, &cli_addr);
+    // deleted files are unlinked and big collections freed on a background thread
+    LazyFree *lazy = create_lazy_free();
+    if (!lazy) error("ERROR starting the lazy free thread");
+    use_lazy_free(lazy);
 
-        // resets the buffer and reads data from client
-        bzero(buffer, 256);
-        n = read(newsockfd, buffer, 255);
-        if (n < 0) error("ERROR reading from socket");
+    workers = calloc(threads, sizeof(Worker));
+    queues = calloc((size_t)threads * threads, sizeof(SpscQueue *));
+    if (!workers || !queues) error("ERROR allocating the workers");
+    worker_count = threads;
 
-        // prints the message received from the client
-        printf("Here's the message: %s\n", buffer);
+    // the documents of the data directory (the current one) are loaded in memory, each in
+    // the shard of the worker owning it
+    Collection *shards[SERVER_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        shards[i] = workers[i].shard = create_collection();
+        if (!shards[i]) error("ERROR creating the collection");
+    }
+    if (recover_shards(shards, threads, ".", NULL, NULL) < 0) error("ERROR loading the documents");
 
-        // close the socket of a specific connection, but the server remains in listening for other connections
-        close(newsockfd);
+    // a queue from every worker to every other, and their inboxes
+    for (int i = 0; i < threads; i++) {
+        for (int j = 0; j < threads; j++) {
+            if (i != j && !(queues[i * threads + j] = create_spsc_queue(SERVER_SHARD_QUEUE)))
+                error("ERROR creating the queues between the workers");
+        }
+        workers[i].inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        workers[i].outboxes = calloc(threads, sizeof(Outbox));
+        if (workers[i].inbox_fd < 0 || !workers[i].outboxes) error("ERROR creating the inboxes of the workers");
     }
 
-    close(sockfd);
+    buffers = create_net_buffer_pool(0);
+    if (!buffers) error("ERROR creating the buffer pool");
+
+    // all the sockets are bound before any worker starts, a bind error stops the server at once
+    int unix_fd = -1;
+    if (unix_path) {
+        unix_fd = init_unix_server(unix_path, unix_mode);
+        start_listening(unix_fd);
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].unix_fd = unix_fd;
+        workers[i].cpu = pin ? i % (cpus > 0 ? (int)cpus : 1) : -1;
+        workers[i].sockfd = init_server(portno, threads > 1);
+        start_listening(workers[i].sockfd);
+        workers[i].loop = create_event_loop();
+        if (!workers[i].loop) error("ERROR creating the event loop");
+        workers[i].engine = io_engine_create(NULL);
+        if (!workers[i].engine) error("ERROR creating the IO engine");
+    }
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0)
+            error("ERROR starting a worker");
+    }
+    for (int i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+
+    // the completions left run while the loops and the shards are still there
+    for (int i = 0; i < threads; i++) io_engine_destroy(workers[i].engine);
+    for (int i = 0; i < threads; i++) {
+        free_event_loop(workers[i].loop);
+        close(workers[i].sockfd);
+        close(workers[i].inbox_fd);
+        free(workers[i].outboxes);
+        free_collection(workers[i].shard);
+    }
+    for (int i = 0; i < threads * threads; i++) free_spsc_queue(queues[i]);
+    free(queues);
+    free(workers);
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path);
+    }
+    free_net_buffer_pool(buffers);
+    free_lazy_free(lazy);
     return 0;
 }
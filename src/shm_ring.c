@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_ring.h"
+
+/*
+
+SHARED MEMORY CHANNEL
+
+A client on the same host as the server can skip sockets altogether: it creates a memory
+region (a memfd), hands it to the server over the Unix socket (see OP_ATTACH) and from then
+on both sides exchange the frames of the binary protocol through two rings in it, requests
+one way and responses the other. Sending a request is a memcpy() and a store; no system
+call, no copy into the kernel and out of it.
+
+Each ring has a single producer and a single consumer, so it needs no lock: the producer
+copies bytes in and then publishes the new head with a release store, the consumer loads
+the head with acquire semantics, copies the bytes out and publishes the new tail. Head and
+tail are byte counts that only grow, masked with the capacity (a power of two) to find the
+position, and sit on separate cache lines so the two sides don't fight over one line.
+
+A side with nothing to do sleeps on an eventfd, and is woken only if it said it sleeps:
+
+    consumer: finds the ring empty, sets consumer_waiting, then checks again (a request
+              may have arrived in between) before it sleeps
+    producer: publishes the head, then if consumer_waiting is set clears it and writes
+              the consumer's eventfd
+
+The flag is set before the second check and tested after the head is published, with a
+full barrier on both sides, so one of the two always sees the other: a busy peer costs no
+system call at all, an idle one a single eventfd write. A producer that finds the ring full
+sleeps the same way with producer_waiting, woken by the consumer when it frees space.
+
+The region is shared with another process, which may be buggy or hostile: every index read
+from it is checked against the capacity this side knows, and positions are always masked,
+so a corrupted ring can make a channel fail but never make us touch memory outside it.
+The region is sealed against resizing before it is handed over (a file shrunk under a
+mapping turns accesses into SIGBUS), and a region without the seals is refused.
+
+*/
+
+static uint64_t round_up_power_of_two(uint64_t size) {
+    uint64_t power = SHM_RING_MIN_SIZE;
+    while (power < size) power <<= 1;
+    return power;
+}
+
+static size_t region_size(uint64_t ring_size) {
+    return sizeof(ShmChannelHeader) + 2 * ring_size;
+}
+
+static bool map_channel(ShmChannel *channel, int fd, size_t size, uint64_t ring_size) {
+    channel->memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (channel->memory == MAP_FAILED) return false;
+
+    ShmChannelHeader *header = channel->memory;
+    char *data = (char *)channel->memory + sizeof(ShmChannelHeader);
+    channel->size = size;
+    channel->requests = (ShmRing){&header->requests, data, ring_size};
+    channel->responses = (ShmRing){&header->responses, data + ring_size, ring_size};
+    return true;
+}
+
+/*
+ * Creates a region for a channel with rings of `ring_size` bytes (rounded up to a power of
+ * two, 0 for the default), to be sent to the server with its fd.
+ */
+ShmChannel *create_shm_channel(size_t ring_size) {
+    if (ring_size == 0) ring_size = SHM_RING_DEFAULT_SIZE;
+    if (ring_size > SHM_RING_MAX_SIZE) return NULL;
+    ring_size = round_up_power_of_two(ring_size);
+
+    ShmChannel *channel = calloc(1, sizeof(ShmChannel));
+    if (!channel) return NULL;
+
+    size_t size = region_size(ring_size);
+    channel->fd = memfd_create("fada-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (channel->fd < 0 || ftruncate(channel->fd, size) < 0 ||
+        fcntl(channel->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+        !map_channel(channel, channel->fd, size, ring_size)) {
+        if (channel->fd >= 0) close(channel->fd);
+        free(channel);
+        return NULL;
+    }
+
+    // a new memfd is zero filled: indices and flags start at 0
+    ShmChannelHeader *header = channel->memory;
+    header->ring_size = ring_size;
+    __atomic_store_n(&header->magic, SHM_CHANNEL_MAGIC, __ATOMIC_RELEASE);
+    return channel;
+}
+
+/*
+ * Maps a region created by create_shm_channel() in another process. The fd stays the
+ * caller's. Returns NULL if it doesn't hold a valid channel.
+ */
+ShmChannel *attach_shm_channel(int fd) {
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ShmChannelHeader)) return NULL;
+
+    ShmChannel *channel = calloc(1, sizeof(ShmChannel));
+    if (!channel) return NULL;
+    channel->fd = -1;
+
+    // the ring size is read once and checked against the size of the file, then kept here
+    ShmChannelHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != SHM_CHANNEL_MAGIC ||
+        header.ring_size < SHM_RING_MIN_SIZE || header.ring_size > SHM_RING_MAX_SIZE ||
+        (header.ring_size & (header.ring_size - 1)) != 0 || (size_t)st.st_size != region_size(header.ring_size) ||
+        !map_channel(channel, fd, st.st_size, header.ring_size)) {
+        free(channel);
+        return NULL;
+    }
+    return channel;
+}
+
+void free_shm_channel(ShmChannel *channel) {
+    if (channel == NULL) return;
+    munmap(channel->memory, channel->size);
+    if (channel->fd >= 0) close(channel->fd);
+    free(channel);
+}
+
+// bytes in the ring, 0 if the peer left its indices in a state that can't be
+static uint64_t used(const ShmRing *ring) {
+    uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&ring->shared->tail, __ATOMIC_ACQUIRE);
+    uint64_t count = head - tail;
+    return count <= ring->capacity ? count : 0;
+}
+
+size_t shm_ring_readable(const ShmRing *ring) {
+    return used(ring);
+}
+
+size_t shm_ring_writable(const ShmRing *ring) {
+    uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&ring->shared->tail, __ATOMIC_ACQUIRE);
+    uint64_t count = head - tail;
+    return count <= ring->capacity ? ring->capacity - count : 0;
+}
+
+// copies as much of `data` as fits, returns the bytes written; producer side
+size_t shm_ring_write(ShmRing *ring, const void *data, size_t length) {
+    size_t room = shm_ring_writable(ring);
+    if (length > room) length = room;
+    if (length == 0) return 0;
+
+    uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_RELAXED);
+    size_t position = head & (ring->capacity - 1);
+    size_t first = length < ring->capacity - position ? length : ring->capacity - position;
+    memcpy(ring->data + position, data, first);
+    memcpy(ring->data, (const char *)data + first, length - first);
+
+    __atomic_store_n(&ring->shared->head, head + length, __ATOMIC_RELEASE);
+    return length;
+}
+
+// copies up to `length` bytes out, returns the bytes read; consumer side
+size_t shm_ring_read(ShmRing *ring, void *buffer, size_t length) {
+    size_t available = used(ring);
+    if (length > available) length = available;
+    if (length == 0) return 0;
+
+    uint64_t tail = __atomic_load_n(&ring->shared->tail, __ATOMIC_RELAXED);
+    size_t position = tail & (ring->capacity - 1);
+    size_t first = length < ring->capacity - position ? length : ring->capacity - position;
+    memcpy(buffer, ring->data + position, first);
+    memcpy((char *)buffer + first, ring->data, length - first);
+
+    __atomic_store_n(&ring->shared->tail, tail + length, __ATOMIC_RELEASE);
+    return length;
+}
+
+/*
+ * Consumer about to sleep: asks to be woken by the next write. Returns true if the ring is
+ * still empty (sleep), false if data arrived meanwhile (don't, the request is withdrawn).
+ */
+bool shm_ring_arm_readable(ShmRing *ring) {
+    __atomic_store_n(&ring->shared->consumer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (used(ring) == 0) return true;
+    __atomic_store_n(&ring->shared->consumer_waiting, 0, __ATOMIC_RELAXED);
+    return false;
+}
+
+// producer about to sleep on a full ring, same as shm_ring_arm_readable()
+bool shm_ring_arm_writable(ShmRing *ring) {
+    __atomic_store_n(&ring->shared->producer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shm_ring_writable(ring) == 0) return true;
+    __atomic_store_n(&ring->shared->producer_waiting, 0, __ATOMIC_RELAXED);
+    return false;
+}
+
+// after a write: true if the consumer sleeps and must be woken (once, the flag is cleared)
+bool shm_ring_wake_consumer(ShmRing *ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->shared->consumer_waiting, __ATOMIC_RELAXED) &&
+           __atomic_exchange_n(&ring->shared->consumer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+// after a read: true if the producer sleeps waiting for room and must be woken
+bool shm_ring_wake_producer(ShmRing *ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->shared->producer_waiting, __ATOMIC_RELAXED) &&
+           __atomic_exchange_n(&ring->shared->producer_waiting, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_CHANNEL_MAGIC 0x46414441534d31ULL  // "FADASM1"
+#define SHM_RING_MIN_SIZE (4 << 10)
+#define SHM_RING_MAX_SIZE (64 << 20)
+#define SHM_RING_DEFAULT_SIZE (1 << 20)         // bytes of each direction
+#define SHM_CACHE_LINE 64
+
+/* Data Structures */
+
+// indices of a ring, in the shared region; each side writes its own cache line
+typedef struct {
+    uint64_t head __attribute__((aligned(SHM_CACHE_LINE)));  // bytes written, by the producer
+    uint32_t producer_waiting;                               // the producer sleeps until there is room
+    uint64_t tail __attribute__((aligned(SHM_CACHE_LINE)));  // bytes read, by the consumer
+    uint32_t consumer_waiting;                               // the consumer sleeps until there is data
+} ShmRingHeader;
+
+// start of the shared region, followed by the data of the request ring, then the response ring
+typedef struct {
+    uint64_t magic;
+    uint32_t ring_size;
+    ShmRingHeader requests __attribute__((aligned(SHM_CACHE_LINE)));
+    ShmRingHeader responses;
+} ShmChannelHeader;
+
+// one side's view of a ring: the capacity is kept out of the peer's reach
+typedef struct {
+    ShmRingHeader *shared;
+    char *data;
+    uint64_t capacity;
+} ShmRing;
+
+typedef struct {
+    int fd;              // memfd of the region, -1 once attached by the peer
+    void *memory;
+    size_t size;
+    ShmRing requests;    // client to server
+    ShmRing responses;   // server to client
+} ShmChannel;
+
+/* Functions */
+
+ShmChannel *create_shm_channel(size_t ring_size);
+ShmChannel *attach_shm_channel(int fd);
+void free_shm_channel(ShmChannel *channel);
+
+size_t shm_ring_readable(const ShmRing *ring);
+size_t shm_ring_writable(const ShmRing *ring);
+size_t shm_ring_write(ShmRing *ring, const void *data, size_t length);
+size_t shm_ring_read(ShmRing *ring, void *buffer, size_t length);
+
+bool shm_ring_arm_readable(ShmRing *ring);
+bool shm_ring_arm_writable(ShmRing *ring);
+bool shm_ring_wake_consumer(ShmRing *ring);
+bool shm_ring_wake_producer(ShmRing *ring);
+
+#endif // SHM_RING_H
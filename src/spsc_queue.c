@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc_queue.h"
+
+/*
+
+SPSC QUEUE
+
+A bounded queue of pointers between exactly two threads, one pushing and one popping,
+with no lock: the workers of the server pass commands for each other's shards through a
+queue per ordered pair of workers.
+
+The producer stores the item in its slot and then publishes the new head with a release
+store, the consumer loads the head with acquire semantics before it reads the slot and
+publishes the tail the same way, so a slot is never read before it is written nor written
+again before it is read. Head and tail are counts that only grow, masked with the capacity
+(a power of two) to find the slot.
+
+Each side keeps the last value it saw of the other side's index and looks again only when
+that one says the queue is full (or empty): a producer far ahead of the consumer pushes
+without touching the consumer's cache line at all, and the other way round.
+
+*/
+
+/*
+ * Creates a queue holding up to `capacity` items, rounded up to a power of two.
+ * Returns NULL on allocation failure.
+ */
+SpscQueue *create_spsc_queue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+
+    SpscQueue *queue = aligned_alloc(SPSC_QUEUE_CACHE_LINE, sizeof(SpscQueue));
+    if (!queue) return NULL;
+    memset(queue, 0, sizeof(SpscQueue));
+
+    queue->items = calloc(size, sizeof(void *));
+    if (!queue->items) {
+        free(queue);
+        return NULL;
+    }
+    queue->mask = size - 1;
+    return queue;
+}
+
+// producer side, false if the queue is full
+bool spsc_queue_push(SpscQueue *queue, void *item) {
+    size_t head = queue->head;
+    if (head - queue->cached_tail > queue->mask) {
+        queue->cached_tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (head - queue->cached_tail > queue->mask) return false;
+    }
+    queue->items[head & queue->mask] = item;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// consumer side, NULL if the queue is empty
+void *spsc_queue_pop(SpscQueue *queue) {
+    size_t tail = queue->tail;
+    if (tail == queue->cached_head) {
+        queue->cached_head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (tail == queue->cached_head) return NULL;
+    }
+    void *item = queue->items[tail & queue->mask];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// items in the queue, from either side; exact only when the other side is idle
+size_t spsc_queue_length(SpscQueue *queue) {
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+void free_spsc_queue(SpscQueue *queue) {
+    if (queue == NULL) return;
+    free(queue->items);
+    free(queue);
+}
@@ -0,0 +1,29 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SPSC_QUEUE_CACHE_LINE 64
+
+/* Data Structures */
+
+// each side writes only its own cache line, the first one is never written after creation
+typedef struct {
+    void **items;
+    size_t mask;                                                      // capacity - 1, a power of two
+    size_t head __attribute__((aligned(SPSC_QUEUE_CACHE_LINE)));      // items pushed, by the producer
+    size_t cached_tail;                                               // the producer's last look at tail
+    size_t tail __attribute__((aligned(SPSC_QUEUE_CACHE_LINE)));      // items popped, by the consumer
+    size_t cached_head;                                               // the consumer's last look at head
+} SpscQueue;
+
+/* Functions */
+
+SpscQueue *create_spsc_queue(size_t capacity);
+bool spsc_queue_push(SpscQueue *queue, void *item);
+void *spsc_queue_pop(SpscQueue *queue);
+size_t spsc_queue_length(SpscQueue *queue);
+void free_spsc_queue(SpscQueue *queue);
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,761 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#define JSMN_HEADER
+#include <jsmn.h>
+
+#include "db_manager.h"
+#include "timeseries.h"
+
+/*
+
+TIME SERIES COLLECTIONS
+
+Metrics are small documents of the same shape, {"ts": 1700000000000, "host": "a", "cpu": 0.4},
+arriving by the million. As one Document each they cost more in pointers, IDs and JSON text
+than in data. A time series collection stores them by column instead:
+
+- the samples of a series (same value of the meta field) within a time span go in a bucket;
+- a bucket keeps the timestamps in one bit stream and each numeric field in another.
+
+Timestamps are delta-of-delta encoded: metrics arrive at a steady rate, so the difference
+between two consecutive deltas is almost always 0 and takes 1 bit ('0'), small jitters take
+9 to 16 bits ('10' + 7, '110' + 9, '1110' + 12) and anything else '1111' + 64.
+
+Values are XOR compressed (Gorilla, Facebook 2015): each one is XORed with the previous one.
+Equal values give 0 and take 1 bit ('0'). Otherwise the XOR has a run of meaningful bits
+between leading and trailing zeros: if it fits in the window of the previous XOR it's written
+as '10' + the bits of that window, else as '11' + 5 bits of leading zeros + 6 bits of length
++ the meaningful bits, and this becomes the window. Slowly changing gauges take a few bits per
+sample.
+
+Queries read the compressed streams directly. A range scan decodes only the buckets whose time
+range intersects the query, a downsampling query decodes only the timestamps and the one
+column it aggregates, and a bucket that falls entirely in one window and in the range is
+answered from its min/max/sum without decoding at all.
+
+A bucket takes TS_BUCKET_MAX_SAMPLES samples at most. Its streams grow by doubling, and are
+trimmed to their exact size when it's full or when its series moves on to another bucket.
+ts_save() writes the collection to <id>.ts, it's loaded back when the collection is opened.
+
+*/
+
+/* Bit streams */
+
+static bool write_bits(BitStream *stream, uint64_t value, int n) {
+    if (n == 0) return true;
+
+    size_t needed = (stream->bits + n + 63) / 64;
+    if (needed > stream->capacity) {
+        size_t capacity = stream->capacity ? stream->capacity * 2 : 2;
+        while (capacity < needed) capacity *= 2;
+        uint64_t *words = realloc(stream->words, capacity * sizeof(uint64_t));
+        if (!words) return false;
+        memset(words + stream->capacity, 0, (capacity - stream->capacity) * sizeof(uint64_t));
+        stream->words = words;
+        stream->capacity = capacity;
+    }
+
+    // most significant bit first, a value may straddle two words
+    if (n < 64) value &= (1ULL << n) - 1;
+    size_t word = stream->bits / 64;
+    int room = 64 - stream->bits % 64;
+    if (n <= room) {
+        stream->words[word] |= value << (room - n);
+    } else {
+        stream->words[word] |= value >> (n - room);
+        stream->words[word + 1] |= value << (64 - (n - room));
+    }
+    stream->bits += n;
+    return true;
+}
+
+// gives back the slack of a stream that won't grow anymore
+static void trim_stream(BitStream *stream) {
+    size_t used = (stream->bits + 63) / 64;
+    if (used == 0 || used == stream->capacity) return;
+
+    uint64_t *words = realloc(stream->words, used * sizeof(uint64_t));
+    if (words) {
+        stream->words = words;
+        stream->capacity = used;
+    }
+}
+
+static void trim_bucket(TsBucket *bucket) {
+    trim_stream(&bucket->timestamps);
+    for (int i = 0; i < bucket->field_count; i++) trim_stream(&bucket->columns[i].stream);
+}
+
+typedef struct {
+    const BitStream *stream;
+    size_t position;
+} BitReader;
+
+static uint64_t read_bits(BitReader *reader, int n) {
+    if (n == 0) return 0;
+
+    const uint64_t *words = reader->stream->words;
+    size_t word = reader->position / 64;
+    int offset = reader->position % 64, room = 64 - offset;
+    uint64_t value = (words[word] << offset) >> (64 - n);
+    if (n > room) value |= words[word + 1] >> (64 - (n - room));
+
+    reader->position += n;
+    return value;
+}
+
+static int64_t sign_extend(uint64_t value, int n) {
+    if (n < 64 && (value >> (n - 1)) & 1) value |= ~0ULL << n;
+    return (int64_t)value;
+}
+
+/* Encoding */
+
+static bool put_timestamp(TsBucket *bucket, int64_t ts) {
+    if (bucket->count == 0) {
+        bucket->first_ts = bucket->last_ts = bucket->min_ts = bucket->max_ts = ts;
+        bucket->last_delta = 0;
+        return true;
+    }
+
+    int64_t delta = ts - bucket->last_ts;
+    int64_t dod = delta - bucket->last_delta;
+    BitStream *stream = &bucket->timestamps;
+    bool written;
+
+    if (dod == 0) written = write_bits(stream, 0, 1);
+    else if (dod >= -64 && dod <= 63) written = write_bits(stream, 2, 2) && write_bits(stream, dod, 7);
+    else if (dod >= -256 && dod <= 255) written = write_bits(stream, 6, 3) && write_bits(stream, dod, 9);
+    else if (dod >= -2048 && dod <= 2047) written = write_bits(stream, 14, 4) && write_bits(stream, dod, 12);
+    else written = write_bits(stream, 15, 4) && write_bits(stream, dod, 64);
+    if (!written) return false;
+
+    bucket->last_delta = delta;
+    bucket->last_ts = ts;
+    if (ts < bucket->min_ts) bucket->min_ts = ts;
+    if (ts > bucket->max_ts) bucket->max_ts = ts;
+    return true;
+}
+
+static bool put_value(TsColumn *column, double value, bool first) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    BitStream *stream = &column->stream;
+
+    if (first) {
+        column->last = bits;
+        column->leading = 65; // no window yet
+        column->min = column->max = column->sum = value;
+        return write_bits(stream, bits, 64);
+    }
+
+    if (value < column->min) column->min = value;
+    if (value > column->max) column->max = value;
+    column->sum += value;
+
+    uint64_t xor = bits ^ column->last;
+    column->last = bits;
+    if (xor == 0) return write_bits(stream, 0, 1);
+
+    int leading = __builtin_clzll(xor), trailing = __builtin_ctzll(xor);
+    if (leading > 31) leading = 31;
+
+    if (column->leading <= 64 && leading >= column->leading && trailing >= column->trailing) {
+        int meaningful = 64 - column->leading - column->trailing;
+        return write_bits(stream, 2, 2) && write_bits(stream, xor >> column->trailing, meaningful);
+    }
+
+    int meaningful = 64 - leading - trailing;
+    column->leading = leading;
+    column->trailing = trailing;
+    return write_bits(stream, 3, 2) && write_bits(stream, leading, 5) &&
+           write_bits(stream, meaningful & 63, 6) && write_bits(stream, xor >> trailing, meaningful);
+}
+
+/* Decoding */
+
+typedef struct {
+    BitReader bits;
+    int64_t ts, delta;
+    uint32_t index;
+} TimestampReader;
+
+typedef struct {
+    BitReader bits;
+    uint64_t value;
+    int leading, trailing;
+    uint32_t index;
+} ValueReader;
+
+static int64_t next_timestamp(const TsBucket *bucket, TimestampReader *reader) {
+    if (reader->index++ == 0) {
+        reader->bits = (BitReader){&bucket->timestamps, 0};
+        reader->ts = bucket->first_ts;
+        reader->delta = 0;
+        return reader->ts;
+    }
+
+    int64_t dod;
+    if (read_bits(&reader->bits, 1) == 0) dod = 0;
+    else if (read_bits(&reader->bits, 1) == 0) dod = sign_extend(read_bits(&reader->bits, 7), 7);
+    else if (read_bits(&reader->bits, 1) == 0) dod = sign_extend(read_bits(&reader->bits, 9), 9);
+    else if (read_bits(&reader->bits, 1) == 0) dod = sign_extend(read_bits(&reader->bits, 12), 12);
+    else dod = (int64_t)read_bits(&reader->bits, 64);
+
+    reader->delta += dod;
+    reader->ts += reader->delta;
+    return reader->ts;
+}
+
+static double next_value(const TsColumn *column, ValueReader *reader) {
+    if (reader->index++ == 0) {
+        reader->bits = (BitReader){&column->stream, 0};
+        reader->value = read_bits(&reader->bits, 64);
+    } else if (read_bits(&reader->bits, 1) == 1) {
+        if (read_bits(&reader->bits, 1) == 1) {
+            reader->leading = read_bits(&reader->bits, 5);
+            int meaningful = read_bits(&reader->bits, 6);
+            if (meaningful == 0) meaningful = 64;
+            reader->trailing = 64 - reader->leading - meaningful;
+        }
+        int meaningful = 64 - reader->leading - reader->trailing;
+        reader->value ^= read_bits(&reader->bits, meaningful) << reader->trailing;
+    }
+
+    double value;
+    memcpy(&value, &reader->value, sizeof(value));
+    return value;
+}
+
+/* Collections */
+
+static TsSeries *find_series(TimeSeriesCollection *tsc, const char *key, size_t length, bool create) {
+    // keys are short, the lookup copies them on the stack to terminate them
+    char local[256];
+    char *name = length < sizeof(local) ? local : malloc(length + 1);
+    if (!name) return NULL;
+    memcpy(name, key, length);
+    name[length] = '\0';
+
+    TsSeries **link = &tsc->series[hash_function(name) % TS_SERIES_BUCKETS];
+    while (*link && strcmp((*link)->key, name) != 0) link = &(*link)->next;
+
+    TsSeries *series = *link;
+    if (!series && create && (series = calloc(1, sizeof(TsSeries))) != NULL) {
+        series->key = strdup(name);
+        if (series->key) {
+            *link = series;
+            tsc->series_count++;
+        } else {
+            free(series);
+            series = NULL;
+        }
+    }
+
+    if (name != local) free(name);
+    return series;
+}
+
+static void free_bucket(TsBucket *bucket) {
+    for (int i = 0; i < bucket->field_count; i++) {
+        free(bucket->columns[i].name);
+        free(bucket->columns[i].stream.words);
+    }
+    free(bucket->columns);
+    free(bucket->timestamps.words);
+    free(bucket);
+}
+
+// a new bucket, linked after the buckets of the series starting at or before it
+static TsBucket *add_bucket(TsSeries *series, int64_t start, const char **names, const size_t *lengths,
+                            int count) {
+    TsBucket *bucket = calloc(1, sizeof(TsBucket));
+    if (!bucket) return NULL;
+
+    bucket->start = start;
+    bucket->columns = calloc(count ? count : 1, sizeof(TsColumn));
+    if (!bucket->columns) {
+        free(bucket);
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        bucket->columns[i].name = strndup(names[i], lengths[i]);
+        bucket->field_count++;
+        if (!bucket->columns[i].name) {
+            free_bucket(bucket);
+            return NULL;
+        }
+    }
+
+    TsBucket **link = &series->buckets;
+    while (*link && (*link)->start <= start) link = &(*link)->next;
+    bucket->next = *link;
+    *link = bucket;
+    return bucket;
+}
+
+// columns of the bucket in the order of the sample's fields, false if the fields differ
+static bool match_columns(const TsBucket *bucket, const char **names, const size_t *lengths, int count,
+                          int *order) {
+    if (bucket->field_count != count) return false;
+
+    for (int i = 0; i < count; i++) {
+        order[i] = -1;
+        for (int c = 0; c < count; c++) {
+            if (strlen(bucket->columns[c].name) == lengths[i] &&
+                memcmp(bucket->columns[c].name, names[i], lengths[i]) == 0) {
+                order[i] = c;
+                break;
+            }
+        }
+        if (order[i] < 0) return false;
+    }
+    return true;
+}
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+static bool token_is(const char *content, const jsmntok_t *token, const char *text) {
+    size_t length = token->end - token->start;
+    return strlen(text) == length && memcmp(content + token->start, text, length) == 0;
+}
+
+/*
+ * Adds a sample: a flat object with an integer timestamp in the time field, optionally a
+ * string in the meta field naming its series, and numbers in every other field.
+ */
+bool ts_insert(TimeSeriesCollection *tsc, const char *content, size_t length) {
+    jsmntok_t tokens[2 * TS_MAX_FIELDS + 8];
+    jsmn_parser parser;
+    jsmn_init(&parser);
+
+    int count = jsmn_parse(&parser, content, length, tokens, sizeof(tokens) / sizeof(tokens[0]));
+    if (count <= 0 || tokens[0].type != JSMN_OBJECT || count != 2 * tokens[0].size + 1) return false;
+
+    const char *names[TS_MAX_FIELDS], *key = "";
+    size_t lengths[TS_MAX_FIELDS], key_length = 0;
+    double values[TS_MAX_FIELDS];
+    int fields = 0;
+    bool has_time = false;
+    int64_t ts = 0;
+
+    for (int i = 1; i + 1 < count; i += 2) {
+        const jsmntok_t *name = &tokens[i], *value = &tokens[i + 1];
+        const char *text = content + value->start;
+        char *end;
+
+        if (token_is(content, name, tsc->time_field)) {
+            if (value->type != JSMN_PRIMITIVE) return false;
+            ts = strtoll(text, &end, 10);
+            if (end != content + value->end) return false;
+            has_time = true;
+        } else if (tsc->meta_field && token_is(content, name, tsc->meta_field)) {
+            if (value->type != JSMN_STRING) return false;
+            key = text;
+            key_length = value->end - value->start;
+        } else {
+            if (value->type != JSMN_PRIMITIVE || fields == TS_MAX_FIELDS) return false;
+            values[fields] = strtod(text, &end);
+            if (end != content + value->end) return false; // true, false, null
+            names[fields] = content + name->start;
+            lengths[fields] = name->end - name->start;
+            fields++;
+        }
+    }
+    if (!has_time) return false;
+
+    TsSeries *series = find_series(tsc, key, key_length, true);
+    if (!series) return false;
+
+    // the bucket of the span with the same fields and room left: usually the one of the last
+    // insert, else the last one matching in the list
+    int64_t start = floor_div(ts, tsc->bucket_span) * tsc->bucket_span;
+    int order[TS_MAX_FIELDS];
+    TsBucket *bucket = series->current;
+    if (!bucket || bucket->start != start || bucket->count >= TS_BUCKET_MAX_SAMPLES ||
+        !match_columns(bucket, names, lengths, fields, order)) {
+        bucket = NULL;
+        for (TsBucket *candidate = series->buckets; candidate && candidate->start <= start;
+             candidate = candidate->next) {
+            if (candidate->start == start && candidate->count < TS_BUCKET_MAX_SAMPLES &&
+                match_columns(candidate, names, lengths, fields, order)) {
+                bucket = candidate;
+            }
+        }
+    }
+    if (!bucket) {
+        bucket = add_bucket(series, start, names, lengths, fields);
+        if (!bucket) return false;
+        for (int i = 0; i < fields; i++) order[i] = i;
+    }
+
+    bool first = bucket->count == 0;
+    if (!put_timestamp(bucket, ts)) return false;
+    for (int i = 0; i < fields; i++) {
+        if (!put_value(&bucket->columns[order[i]], values[i], first)) return false;
+    }
+    bucket->count++;
+
+    // a full bucket won't grow anymore, nor, most likely, the one the series moved away from
+    if (bucket->count == TS_BUCKET_MAX_SAMPLES) trim_bucket(bucket);
+    if (series->current && series->current != bucket) trim_bucket(series->current);
+    series->current = bucket;
+
+    series->samples++;
+    tsc->samples++;
+    return true;
+}
+
+/*
+ * Calls `callback` on the samples of a series with from <= ts < to, bucket by bucket.
+ * Returns the number of samples visited.
+ */
+size_t ts_scan(TimeSeriesCollection *tsc, const char *series_key, int64_t from, int64_t to,
+               TsSampleCallback callback, void *arg) {
+    TsSeries *series = find_series(tsc, series_key, strlen(series_key), false);
+    if (!series) return 0;
+
+    size_t visited = 0;
+    for (TsBucket *bucket = series->buckets; bucket && bucket->start < to; bucket = bucket->next) {
+        if (bucket->count == 0 || bucket->max_ts < from || bucket->min_ts >= to) continue;
+
+        const char *names[TS_MAX_FIELDS];
+        double values[TS_MAX_FIELDS];
+        ValueReader readers[TS_MAX_FIELDS];
+        TimestampReader timestamps = {0};
+        memset(readers, 0, sizeof(readers));
+        for (int c = 0; c < bucket->field_count; c++) names[c] = bucket->columns[c].name;
+
+        for (uint32_t i = 0; i < bucket->count; i++) {
+            int64_t ts = next_timestamp(bucket, &timestamps);
+            for (int c = 0; c < bucket->field_count; c++) values[c] = next_value(&bucket->columns[c], &readers[c]);
+            if (ts < from || ts >= to) continue;
+
+            visited++;
+            if (!callback(ts, names, values, bucket->field_count, arg)) return visited;
+        }
+    }
+    return visited;
+}
+
+typedef struct {
+    double min, max, sum;
+    size_t count;
+} TsWindow;
+
+static void add_to_window(TsWindow *window, double min, double max, double sum, size_t count) {
+    if (window->count == 0 || min < window->min) window->min = min;
+    if (window->count == 0 || max > window->max) window->max = max;
+    window->sum += sum;
+    window->count += count;
+}
+
+/*
+ * Aggregates a field of a series over windows of `interval` milliseconds aligned on
+ * multiples of it, for from <= ts < to. `callback` gets the non empty windows in time order.
+ */
+bool ts_downsample(TimeSeriesCollection *tsc, const char *series_key, const char *field, int64_t from,
+                   int64_t to, int64_t interval, TsAggregate aggregate, TsWindowCallback callback, void *arg) {
+    if (interval <= 0 || to <= from) return false;
+
+    int64_t first_window = floor_div(from, interval), last_window = floor_div(to - 1, interval);
+    if (last_window - first_window >= TS_MAX_WINDOWS) return false;
+
+    TsSeries *series = find_series(tsc, series_key, strlen(series_key), false);
+    if (!series) return true;
+
+    TsWindow *windows = calloc(last_window - first_window + 1, sizeof(TsWindow));
+    if (!windows) return false;
+
+    for (TsBucket *bucket = series->buckets; bucket && bucket->start < to; bucket = bucket->next) {
+        if (bucket->count == 0 || bucket->max_ts < from || bucket->min_ts >= to) continue;
+
+        const TsColumn *column = NULL;
+        for (int c = 0; c < bucket->field_count && !column; c++) {
+            if (strcmp(bucket->columns[c].name, field) == 0) column = &bucket->columns[c];
+        }
+        if (!column) continue;
+
+        // the whole bucket falls in one window: its statistics are the answer
+        int64_t window = floor_div(bucket->min_ts, interval);
+        if (bucket->min_ts >= from && bucket->max_ts < to && window == floor_div(bucket->max_ts, interval)) {
+            add_to_window(&windows[window - first_window], column->min, column->max, column->sum, bucket->count);
+            continue;
+        }
+
+        // only the timestamps and this column are decoded
+        TimestampReader timestamps = {0};
+        ValueReader values = {0};
+        for (uint32_t i = 0; i < bucket->count; i++) {
+            int64_t ts = next_timestamp(bucket, &timestamps);
+            double value = next_value(column, &values);
+            if (ts < from || ts >= to) continue;
+            add_to_window(&windows[floor_div(ts, interval) - first_window], value, value, value, 1);
+        }
+    }
+
+    for (int64_t w = 0; w <= last_window - first_window; w++) {
+        const TsWindow *window = &windows[w];
+        if (window->count == 0) continue;
+
+        double value = 0;
+        switch (aggregate) {
+            case TS_COUNT: value = window->count; break;
+            case TS_SUM: value = window->sum; break;
+            case TS_MIN: value = window->min; break;
+            case TS_MAX: value = window->max; break;
+            case TS_AVG: value = window->sum / window->count; break;
+        }
+        callback((first_window + w) * interval, value, window->count, arg);
+    }
+
+    free(windows);
+    return true;
+}
+
+// bytes allocated for the collection, streams included
+size_t ts_memory_usage(TimeSeriesCollection *tsc) {
+    size_t bytes = sizeof(TimeSeriesCollection);
+
+    for (int i = 0; i < TS_SERIES_BUCKETS; i++) {
+        for (TsSeries *series = tsc->series[i]; series; series = series->next) {
+            bytes += sizeof(TsSeries) + strlen(series->key) + 1;
+            for (TsBucket *bucket = series->buckets; bucket; bucket = bucket->next) {
+                bytes += sizeof(TsBucket) + bucket->timestamps.capacity * sizeof(uint64_t);
+                for (int c = 0; c < bucket->field_count; c++) {
+                    bytes += sizeof(TsColumn) + strlen(bucket->columns[c].name) + 1 +
+                             bucket->columns[c].stream.capacity * sizeof(uint64_t);
+                }
+            }
+        }
+    }
+    return bytes;
+}
+
+/* Persistence */
+
+static bool write_string(FILE *file, const char *text) {
+    uint32_t length = strlen(text);
+    return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(text, 1, length, file) == length;
+}
+
+static char *read_string(FILE *file) {
+    uint32_t length;
+    if (fread(&length, sizeof(length), 1, file) != 1 || length > 65536) return NULL;
+
+    char *text = malloc(length + 1);
+    if (text && fread(text, 1, length, file) != length) {
+        free(text);
+        return NULL;
+    }
+    if (text) text[length] = '\0';
+    return text;
+}
+
+static bool write_stream(FILE *file, const BitStream *stream) {
+    uint64_t bits = stream->bits;
+    size_t words = (stream->bits + 63) / 64;
+    return fwrite(&bits, sizeof(bits), 1, file) == 1 && fwrite(stream->words, sizeof(uint64_t), words, file) == words;
+}
+
+static bool read_stream(FILE *file, BitStream *stream) {
+    uint64_t bits;
+    if (fread(&bits, sizeof(bits), 1, file) != 1 || bits > (1ULL << 40)) return false;
+
+    size_t words = (bits + 63) / 64;
+    stream->words = calloc(words ? words : 1, sizeof(uint64_t));
+    stream->capacity = words ? words : 1;
+    stream->bits = bits;
+    return stream->words && fread(stream->words, sizeof(uint64_t), words, file) == words;
+}
+
+// the state fields of a bucket and of its columns, written as they are in memory
+#define BUCKET_STATE_SIZE offsetof(TsBucket, field_count)
+
+static bool save_bucket(FILE *file, const TsBucket *bucket) {
+    int32_t fields = bucket->field_count;
+    if (fwrite(bucket, BUCKET_STATE_SIZE, 1, file) != 1 || fwrite(&fields, sizeof(fields), 1, file) != 1 ||
+        !write_stream(file, &bucket->timestamps)) {
+        return false;
+    }
+
+    for (int c = 0; c < bucket->field_count; c++) {
+        const TsColumn *column = &bucket->columns[c];
+        int32_t window[2] = {column->leading, column->trailing};
+        double stats[3] = {column->min, column->max, column->sum};
+        if (!write_string(file, column->name) || fwrite(stats, sizeof(stats), 1, file) != 1 ||
+            fwrite(&column->last, sizeof(column->last), 1, file) != 1 ||
+            fwrite(window, sizeof(window), 1, file) != 1 || !write_stream(file, &column->stream)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static TsBucket *load_bucket(FILE *file) {
+    TsBucket *bucket = calloc(1, sizeof(TsBucket));
+    int32_t fields;
+    if (!bucket) return NULL;
+
+    if (fread(bucket, BUCKET_STATE_SIZE, 1, file) != 1 || fread(&fields, sizeof(fields), 1, file) != 1 ||
+        fields < 0 || fields > TS_MAX_FIELDS || !(bucket->columns = calloc(fields ? fields : 1, sizeof(TsColumn))) ||
+        !read_stream(file, &bucket->timestamps)) {
+        free(bucket->columns);
+        free(bucket->timestamps.words);
+        free(bucket);
+        return NULL;
+    }
+
+    for (int c = 0; c < fields; c++) {
+        TsColumn *column = &bucket->columns[c];
+        int32_t window[2];
+        double stats[3];
+        column->name = read_string(file);
+        bucket->field_count++;
+        if (!column->name || fread(stats, sizeof(stats), 1, file) != 1 ||
+            fread(&column->last, sizeof(column->last), 1, file) != 1 ||
+            fread(window, sizeof(window), 1, file) != 1 || !read_stream(file, &column->stream)) {
+            free_bucket(bucket);
+            return NULL;
+        }
+        column->min = stats[0];
+        column->max = stats[1];
+        column->sum = stats[2];
+        column->leading = window[0];
+        column->trailing = window[1];
+    }
+    return bucket;
+}
+
+// rewrites <id>.ts with the whole collection, aside and renamed over the old one
+bool ts_save(TimeSeriesCollection *tsc) {
+    if (!tsc->id) return true;
+
+    char filename[256], temporary[272];
+    snprintf(filename, sizeof(filename), "%s" TS_SUFFIX, tsc->id);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+
+    FILE *file = fopen(temporary, "wb");
+    if (!file) return false;
+
+    uint32_t header[2] = {TS_MAGIC, 0};
+    uint64_t series_count = tsc->series_count;
+    bool written = fwrite(header, sizeof(header), 1, file) == 1 &&
+                   fwrite(&series_count, sizeof(series_count), 1, file) == 1;
+
+    for (int i = 0; written && i < TS_SERIES_BUCKETS; i++) {
+        for (TsSeries *series = tsc->series[i]; written && series; series = series->next) {
+            uint64_t buckets = 0;
+            for (TsBucket *bucket = series->buckets; bucket; bucket = bucket->next) buckets++;
+
+            written = write_string(file, series->key) && fwrite(&buckets, sizeof(buckets), 1, file) == 1;
+            for (TsBucket *bucket = series->buckets; written && bucket; bucket = bucket->next) {
+                written = save_bucket(file, bucket);
+            }
+        }
+    }
+
+    if (fclose(file) != 0) written = false;
+    if (written && rename(temporary, filename) == 0) return true;
+    unlink(temporary);
+    return false;
+}
+
+static bool load_collection(TimeSeriesCollection *tsc, FILE *file) {
+    uint32_t header[2];
+    uint64_t series_count;
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != TS_MAGIC ||
+        fread(&series_count, sizeof(series_count), 1, file) != 1) {
+        return false;
+    }
+
+    for (uint64_t s = 0; s < series_count; s++) {
+        char *key = read_string(file);
+        uint64_t buckets;
+        TsSeries *series = key ? find_series(tsc, key, strlen(key), true) : NULL;
+        free(key);
+        if (!series || fread(&buckets, sizeof(buckets), 1, file) != 1) return false;
+
+        // saved in order, each one goes at the end
+        TsBucket **tail = &series->buckets;
+        while (*tail) tail = &(*tail)->next;
+        for (uint64_t b = 0; b < buckets; b++) {
+            TsBucket *bucket = load_bucket(file);
+            if (!bucket) return false;
+            *tail = bucket;
+            tail = &bucket->next;
+            series->samples += bucket->count;
+            tsc->samples += bucket->count;
+        }
+    }
+    return true;
+}
+
+/*
+ * Opens a time series collection, loading <id>.ts if it exists. A NULL ID makes a collection
+ * that only lives in memory, a NULL meta field puts every sample in the series "".
+ */
+TimeSeriesCollection *open_timeseries_collection(const char *id, const char *time_field, const char *meta_field,
+                                                 int64_t bucket_span) {
+    TimeSeriesCollection *tsc = calloc(1, sizeof(TimeSeriesCollection));
+    if (!tsc) return NULL;
+
+    tsc->bucket_span = bucket_span > 0 ? bucket_span : TS_BUCKET_SPAN_MS;
+    tsc->time_field = strdup(time_field);
+    tsc->meta_field = meta_field ? strdup(meta_field) : NULL;
+    tsc->id = id ? strdup(id) : NULL;
+    if (!tsc->time_field || (meta_field && !tsc->meta_field) || (id && !tsc->id)) {
+        free_timeseries_collection(tsc);
+        return NULL;
+    }
+
+    if (id) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s" TS_SUFFIX, id);
+        FILE *file = fopen(filename, "rb");
+        if (file) {
+            bool loaded = load_collection(tsc, file);
+            fclose(file);
+            if (!loaded) {
+                free_timeseries_collection(tsc);
+                return NULL;
+            }
+        }
+    }
+    return tsc;
+}
+
+void free_timeseries_collection(TimeSeriesCollection *tsc) {
+    if (tsc == NULL) return;
+
+    for (int i = 0; i < TS_SERIES_BUCKETS; i++) {
+        TsSeries *series = tsc->series[i];
+        while (series) {
+            TsSeries *next = series->next;
+            TsBucket *bucket = series->buckets;
+            while (bucket) {
+                TsBucket *following = bucket->next;
+                free_bucket(bucket);
+                bucket = following;
+            }
+            free(series->key);
+            free(series);
+            series = next;
+        }
+    }
+    free(tsc->id);
+    free(tsc->time_field);
+    free(tsc->meta_field);
+    free(tsc);
+}
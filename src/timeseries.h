@@ -0,0 +1,85 @@
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TS_SUFFIX ".ts"
+#define TS_MAGIC 0x53455254 // "TRES"
+#define TS_BUCKET_SPAN_MS 3600000  // default time span of a bucket
+#define TS_BUCKET_MAX_SAMPLES 1024 // samples in a bucket before the next one is started
+#define TS_MAX_FIELDS 32           // numeric fields of a sample
+#define TS_SERIES_BUCKETS 1024     // slots of the series index
+#define TS_MAX_WINDOWS (1 << 20)   // windows of a downsampling query
+
+/* Data Structures */
+
+typedef struct {
+    uint64_t *words;
+    size_t bits;     // bits written
+    size_t capacity; // words allocated
+} BitStream;
+
+// a numeric field of a bucket, XOR compressed
+typedef struct {
+    char *name;
+    BitStream stream;
+    double min, max, sum; // answer aggregates over whole buckets without decoding them
+    uint64_t last;        // encoder state: previous value and meaningful bits window
+    int leading, trailing;
+} TsColumn;
+
+// the samples of a series within one time span, all with the same fields
+typedef struct TsBucket {
+    int64_t start;       // start of the span, a multiple of the collection's bucket_span
+    int64_t first_ts;    // timestamps are delta-of-delta encoded from this one
+    int64_t last_ts, last_delta;
+    int64_t min_ts, max_ts;
+    uint32_t count;
+    int field_count;
+    TsColumn *columns;
+    BitStream timestamps;
+    struct TsBucket *next; // buckets of a series, by start
+} TsBucket;
+
+typedef struct TsSeries {
+    char *key;           // value of the meta field of its samples
+    TsBucket *buckets;
+    TsBucket *current;   // bucket of the last insert, where the next one most likely goes
+    size_t samples;
+    struct TsSeries *next;
+} TsSeries;
+
+typedef struct {
+    char *id;            // NULL for a collection that only lives in memory
+    char *time_field;    // integer timestamp of a sample, in milliseconds
+    char *meta_field;    // string naming the series of a sample
+    int64_t bucket_span;
+    TsSeries *series[TS_SERIES_BUCKETS];
+    size_t series_count;
+    size_t samples;
+} TimeSeriesCollection;
+
+typedef enum { TS_COUNT, TS_SUM, TS_MIN, TS_MAX, TS_AVG } TsAggregate;
+
+// a sample of a scan, returning false stops it
+typedef bool (*TsSampleCallback)(int64_t ts, const char *const *fields, const double *values, int count,
+                                 void *arg);
+// a window of a downsampling query, in time order
+typedef void (*TsWindowCallback)(int64_t start, double value, size_t count, void *arg);
+
+/* Functions */
+
+TimeSeriesCollection *open_timeseries_collection(const char *id, const char *time_field, const char *meta_field,
+                                                 int64_t bucket_span);
+bool ts_insert(TimeSeriesCollection *tsc, const char *content, size_t length);
+size_t ts_scan(TimeSeriesCollection *tsc, const char *series, int64_t from, int64_t to,
+               TsSampleCallback callback, void *arg);
+bool ts_downsample(TimeSeriesCollection *tsc, const char *series, const char *field, int64_t from, int64_t to,
+                   int64_t interval, TsAggregate aggregate, TsWindowCallback callback, void *arg);
+size_t ts_memory_usage(TimeSeriesCollection *tsc);
+bool ts_save(TimeSeriesCollection *tsc);
+void free_timeseries_collection(TimeSeriesCollection *tsc);
+
+#endif // TIMESERIES_H
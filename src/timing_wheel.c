@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing_wheel.h"
+
+/*
+
+HIERARCHICAL TIMING WHEEL
+
+A sorted structure of timers costs O(log n) per insert and per cancel, and most timers are
+cancelled or moved before they fire. A timing wheel costs O(1) for both: a timer is linked
+in the list of the slot its expiry tick falls in, and cancelling it is unlinking it.
+
+One level of 256 slots only covers 256 ticks, so there are 4 levels, each slot of level L
+spanning 256^L ticks. A timer goes in the lowest level that covers its distance from now.
+When the current tick enters a new period of level L, the slot of that period is emptied
+and its timers are re-added: they now fall in a lower level ("cascading"), and eventually
+in level 0, whose slots are visited one per tick. Every timer is moved at most once per
+level. Timers beyond 2^32 ticks wait in the last slot of the top level and are re-added
+each time it cascades. Ticks that can't fire or cascade anything (the levels below the first
+one holding timers are empty) are skipped, a long jump costs a few cascades, not one step
+per tick.
+
+Timers that fire are moved to the `expired` list, timing_wheel_pop() hands them out, so the
+owner can process them at its own pace (and cancel those it hasn't reached yet).
+
+*/
+
+#define SLOT_MASK (TIMING_WHEEL_SLOTS - 1)
+
+static void list_init(TimerNode *head) {
+    head->prev = head->next = head;
+}
+
+static void list_append(TimerNode *head, TimerNode *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(TimerNode *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+TimingWheel *create_timing_wheel(uint64_t now) {
+    TimingWheel *wheel = malloc(sizeof(TimingWheel));
+    if (!wheel) return NULL;
+
+    for (int level = 0; level < TIMING_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMING_WHEEL_SLOTS; slot++) list_init(&wheel->slots[level][slot]);
+    }
+    list_init(&wheel->expired);
+    wheel->now = now;
+    memset(wheel->levels, 0, sizeof(wheel->levels));
+    wheel->count = 0;
+    wheel->due = 0;
+    return wheel;
+}
+
+// links a timer in the slot of the lowest level that covers its distance from now
+static void place(TimingWheel *wheel, TimerNode *timer) {
+    if (timer->expires <= wheel->now) {
+        list_append(&wheel->expired, timer);
+        timer->level = -1;
+        wheel->due++;
+        return;
+    }
+
+    uint64_t distance = timer->expires - wheel->now;
+    uint64_t expires = timer->expires;
+    int level = 0;
+    while (level < TIMING_WHEEL_LEVELS - 1 && distance >= (1ULL << (TIMING_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    // too far for the wheel, the last slot of the top level re-adds it when it cascades
+    if (distance >= (1ULL << (TIMING_WHEEL_BITS * TIMING_WHEEL_LEVELS))) {
+        expires = wheel->now + (1ULL << (TIMING_WHEEL_BITS * TIMING_WHEEL_LEVELS)) - 1;
+    }
+
+    int slot = (expires >> (TIMING_WHEEL_BITS * level)) & SLOT_MASK;
+    list_append(&wheel->slots[level][slot], timer);
+    timer->level = level;
+    wheel->levels[level]++;
+    wheel->count++;
+}
+
+void timing_wheel_add(TimingWheel *wheel, TimerNode *timer, uint64_t expires) {
+    if (timing_wheel_pending(timer)) timing_wheel_cancel(wheel, timer);
+    timer->expires = expires;
+    place(wheel, timer);
+}
+
+bool timing_wheel_pending(const TimerNode *timer) {
+    return timer->next != NULL;
+}
+
+// works both for timers waiting in the wheel and for expired ones not popped yet
+void timing_wheel_cancel(TimingWheel *wheel, TimerNode *timer) {
+    if (!timing_wheel_pending(timer)) return;
+    if (timer->level >= 0) {
+        wheel->levels[timer->level]--;
+        wheel->count--;
+    } else {
+        wheel->due--;
+    }
+    list_unlink(timer);
+}
+
+// re-adds the timers of a slot, they land in lower levels
+static void cascade(TimingWheel *wheel, int level, int slot) {
+    TimerNode *head = &wheel->slots[level][slot];
+    TimerNode pending;
+    list_init(&pending);
+
+    // moved aside first: a timer may be placed back in this very slot
+    while (head->next != head) {
+        TimerNode *timer = head->next;
+        list_unlink(timer);
+        list_append(&pending, timer);
+        wheel->levels[level]--;
+        wheel->count--;
+    }
+    while (pending.next != &pending) {
+        TimerNode *timer = pending.next;
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
+
+static void tick(TimingWheel *wheel) {
+    uint64_t now = ++wheel->now;
+
+    // entering a new period of a level pulls down its slot, the highest levels first
+    int top = 0;
+    while (top + 1 < TIMING_WHEEL_LEVELS && (now & ((1ULL << (TIMING_WHEEL_BITS * (top + 1))) - 1)) == 0) {
+        top++;
+    }
+    for (int level = top; level > 0; level--) {
+        cascade(wheel, level, (now >> (TIMING_WHEEL_BITS * level)) & SLOT_MASK);
+    }
+
+    TimerNode *head = &wheel->slots[0][now & SLOT_MASK];
+    while (head->next != head) {
+        TimerNode *timer = head->next;
+        list_unlink(timer);
+        list_append(&wheel->expired, timer);
+        timer->level = -1;
+        wheel->levels[0]--;
+        wheel->count--;
+        wheel->due++;
+    }
+}
+
+/*
+ * Moves the wheel forward to `now`, timers that fire on the way go to the expired list.
+ * Returns the number of timers waiting there.
+ */
+size_t timing_wheel_advance(TimingWheel *wheel, uint64_t now) {
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            wheel->now = now;
+            break;
+        }
+
+        // the ticks of empty levels do nothing: jump to the end of the current period of
+        // the lowest level holding timers, the next tick cascades it
+        int level = 0;
+        while (wheel->levels[level] == 0) level++;
+        if (level > 0) {
+            uint64_t last = wheel->now | ((1ULL << (TIMING_WHEEL_BITS * level)) - 1);
+            if (last >= now) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = last;
+        }
+        tick(wheel);
+    }
+
+    return wheel->due;
+}
+
+// next expired timer, NULL when there are none
+TimerNode *timing_wheel_pop(TimingWheel *wheel) {
+    TimerNode *timer = wheel->expired.next;
+    if (timer == &wheel->expired) return NULL;
+
+    list_unlink(timer);
+    wheel->due--;
+    return timer;
+}
+
+// the timers are owned by their users, they are not freed
+void free_timing_wheel(TimingWheel *wheel) {
+    free(wheel);
+}
@@ -0,0 +1,42 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMING_WHEEL_BITS 8                         // slots per level, as a power of two
+#define TIMING_WHEEL_SLOTS (1 << TIMING_WHEEL_BITS)
+#define TIMING_WHEEL_LEVELS 4                       // 2^32 ticks ahead before clamping
+
+/* Data Structures */
+
+// embedded or allocated by the owner of the timer, the wheel only links it
+typedef struct TimerNode {
+    uint64_t expires;       // tick at which the timer fires
+    int level;              // level of the slot it's linked in, -1 once expired
+    struct TimerNode *prev;
+    struct TimerNode *next;
+    void *data;
+} TimerNode;
+
+typedef struct {
+    TimerNode slots[TIMING_WHEEL_LEVELS][TIMING_WHEEL_SLOTS]; // list heads
+    TimerNode expired;      // timers due, waiting for timing_wheel_pop()
+    uint64_t now;           // current tick
+    size_t count;           // timers still in the slots
+    size_t levels[TIMING_WHEEL_LEVELS]; // the same, per level
+    size_t due;             // timers in the expired list
+} TimingWheel;
+
+/* Functions */
+
+TimingWheel *create_timing_wheel(uint64_t now);
+void timing_wheel_add(TimingWheel *wheel, TimerNode *timer, uint64_t expires);
+void timing_wheel_cancel(TimingWheel *wheel, TimerNode *timer);
+bool timing_wheel_pending(const TimerNode *timer);
+size_t timing_wheel_advance(TimingWheel *wheel, uint64_t now);
+TimerNode *timing_wheel_pop(TimingWheel *wheel);
+void free_timing_wheel(TimingWheel *wheel);
+
+#endif // TIMING_WHEEL_H
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "db_manager.h"
+#include "patch.h"
+#include "transfer.h"
+
+/*
+
+ZERO COPY RESPONSES
+
+Sending a document the plain way copies it twice: from the page cache into a malloc'd
+buffer (read_document) and from that buffer into the socket buffers (write). For big
+documents sendfile() moves the bytes from the page cache to the socket inside the kernel,
+so they never reach user space and nothing is allocated for them.
+
+Below TRANSFER_ZERO_COPY_THRESHOLD the copy costs less than the extra syscalls (open, fstat,
+close around the sendfile), and read_document() may serve the document from the buffer pool
+without any syscall at all, so small documents keep the buffered path.
+
+The buffered path can also read through an IOEngine (start_document_transfer_async()), so
+the thread preparing the response doesn't wait for the disk: the transfer is completed by
+a callback once the document is read, its log replayed. Only the small reads go there,
+a zero copy transfer reads nothing before it is sent.
+
+A transfer is resumable: on a non blocking socket continue_document_transfer() returns 0
+when the socket is full and picks up from the same offset on the next call.
+
+*/
+
+static void set_header(DocumentTransfer *transfer, const char *header) {
+    transfer->header_length = snprintf(transfer->header, TRANSFER_HEADER_SIZE, "%s", header);
+}
+
+// prepares the response for a document known not to exist, e.g. one that has expired
+void missing_document_transfer(DocumentTransfer *transfer) {
+    memset(transfer, 0, sizeof(DocumentTransfer));
+    transfer->file_fd = -1;
+    set_header(transfer, "ERR not found\n");
+}
+
+/*
+ * Prepares the response for a document. Returns false if the document doesn't exist, the
+ * transfer then carries an "ERR not found" response: either way it is ready to be sent.
+ */
+bool start_document_transfer(DocumentTransfer *transfer, const char *id, size_t threshold) {
+    // IDs come from the network, they must not escape the data directory
+    if (strchr(id, '/') != NULL || id[0] == '\0') {
+        missing_document_transfer(transfer);
+        return false;
+    }
+
+    memset(transfer, 0, sizeof(DocumentTransfer));
+    transfer->file_fd = -1;
+
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+
+    // the file alone is the document only when nothing is pending in its log or the write buffer
+    struct stat st;
+    if (stat(filename, &st) == 0 && (size_t)st.st_size >= threshold && !has_document_log(id) &&
+        !has_pending_update(id)) {
+        transfer->file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+        // the size that counts is the one of the file we are going to send
+        if (transfer->file_fd >= 0 && fstat(transfer->file_fd, &st) == 0) {
+            transfer->length = st.st_size;
+            transfer->zero_copy = true;
+        } else if (transfer->file_fd >= 0) {
+            close(transfer->file_fd);
+            transfer->file_fd = -1;
+        }
+    }
+
+    if (!transfer->zero_copy) {
+        transfer->buffer = read_document(id);
+        if (transfer->buffer) transfer->length = strlen(transfer->buffer);
+    }
+
+    if (!transfer->zero_copy && !transfer->buffer) {
+        set_header(transfer, "ERR not found\n");
+        return false;
+    }
+
+    transfer->header_length = snprintf(transfer->header, TRANSFER_HEADER_SIZE, "OK %zu\n", transfer->length);
+    return true;
+}
+
+typedef struct {
+    DocumentTransfer *transfer;
+    TransferCallback callback;
+    void *arg;
+} TransferRead;
+
+static void transfer_read(const char *id, char *content, size_t length, int error, void *arg) {
+    (void)id;
+    TransferRead *op = arg;
+    DocumentTransfer *transfer = op->transfer;
+
+    bool found = error == 0 && content != NULL;
+    if (found) {
+        memset(transfer, 0, sizeof(DocumentTransfer));
+        transfer->file_fd = -1;
+        transfer->buffer = content;
+        transfer->length = length;
+        transfer->header_length = snprintf(transfer->header, TRANSFER_HEADER_SIZE, "OK %zu\n", length);
+    } else {
+        free(content);
+        missing_document_transfer(transfer);
+    }
+
+    op->callback(transfer, found, op->arg);
+    free(op);
+}
+
+/*
+ * Prepares the response of a document like start_document_transfer(), reading it through
+ * `engine`: the callback gets the transfer, which must stay valid until then, once the read
+ * completed. Returns false, without calling it, for the documents that don't take this path
+ * (big ones sent from their file, a pending image in the write buffer, missing files): the
+ * caller then uses start_document_transfer().
+ */
+bool start_document_transfer_async(IOEngine *engine, DocumentTransfer *transfer, const char *id, size_t threshold,
+                                   TransferCallback callback, void *arg) {
+    if (strchr(id, '/') != NULL || id[0] == '\0') return false;
+
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+
+    struct stat st;
+    if (stat(filename, &st) < 0 || (size_t)st.st_size >= threshold || has_pending_update(id)) return false;
+
+    TransferRead *op = malloc(sizeof(TransferRead));
+    if (!op) return false;
+    op->transfer = transfer;
+    op->callback = callback;
+    op->arg = arg;
+
+    if (!read_document_async(engine, id, transfer_read, op)) {
+        free(op);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Sends as much of the response as the socket accepts. Returns 1 once everything was sent,
+ * 0 if the socket is non blocking and full, -1 on errors (the peer went away, the file shrank).
+ */
+int continue_document_transfer(DocumentTransfer *transfer, int sockfd) {
+    while (transfer->header_sent < transfer->header_length) {
+        // MSG_MORE holds the header back so that it leaves in the same segment as the body
+        int flags = MSG_NOSIGNAL | (transfer->length ? MSG_MORE : 0);
+        ssize_t n = send(sockfd, transfer->header + transfer->header_sent,
+                         transfer->header_length - transfer->header_sent, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        transfer->header_sent += n;
+    }
+
+    while (transfer->sent < transfer->length) {
+        ssize_t n;
+        if (transfer->zero_copy) {
+            n = sendfile(sockfd, transfer->file_fd, &transfer->offset, transfer->length - transfer->sent);
+        } else {
+            n = send(sockfd, transfer->buffer + transfer->sent, transfer->length - transfer->sent, MSG_NOSIGNAL);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) return -1; // truncated while we were sending it
+        transfer->sent += n;
+    }
+
+    return 1;
+}
+
+void end_document_transfer(DocumentTransfer *transfer) {
+    if (transfer->file_fd >= 0) close(transfer->file_fd);
+    free(transfer->buffer);
+    transfer->file_fd = -1;
+    transfer->buffer = NULL;
+}
+
+// sends a whole response on a socket, waiting for it to drain if it's non blocking
+bool send_document(int sockfd, const char *id) {
+    DocumentTransfer transfer;
+    start_document_transfer(&transfer, id, TRANSFER_ZERO_COPY_THRESHOLD);
+
+    int result;
+    while ((result = continue_document_transfer(&transfer, sockfd)) == 0) {
+        struct pollfd pfd = {sockfd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+    }
+
+    end_document_transfer(&transfer);
+    return result == 1;
+}
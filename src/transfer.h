@@ -0,0 +1,40 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "io_engine.h"
+
+#define TRANSFER_ZERO_COPY_THRESHOLD (16 << 10) // smaller documents are copied, it's cheaper
+#define TRANSFER_HEADER_SIZE 32
+
+/* Data Structures */
+
+// a response being sent: "OK <length>\n" followed by the document, or "ERR not found\n"
+typedef struct {
+    char header[TRANSFER_HEADER_SIZE];
+    size_t header_length;
+    size_t header_sent;
+    int file_fd;      // zero copy: the document file, sent with sendfile()
+    off_t offset;
+    char *buffer;     // buffered: the document content
+    size_t length;    // document bytes to send
+    size_t sent;
+    bool zero_copy;
+} DocumentTransfer;
+
+// completion of start_document_transfer_async(), the transfer is ready to be sent
+typedef void (*TransferCallback)(DocumentTransfer *transfer, bool found, void *arg);
+
+/* Functions */
+
+void missing_document_transfer(DocumentTransfer *transfer);
+bool start_document_transfer(DocumentTransfer *transfer, const char *id, size_t threshold);
+bool start_document_transfer_async(IOEngine *engine, DocumentTransfer *transfer, const char *id, size_t threshold,
+                                   TransferCallback callback, void *arg);
+int continue_document_transfer(DocumentTransfer *transfer, int sockfd);
+void end_document_transfer(DocumentTransfer *transfer);
+bool send_document(int sockfd, const char *id);
+
+#endif // TRANSFER_H
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2023, Simone Bellavia <simone.bellavia@live.it>.
+ * All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "db_manager.h"
+#include "write_buffer.h"
+
+/*
+
+WRITE COALESCING
+
+A document updated thousands of times per second doesn't need thousands of writes: only
+its last image matters. With a write buffer in use (use_write_buffer()), update_document()
+just stores the new image in memory, replacing any pending one, and a background thread
+writes the pending images every `window` milliseconds. N updates to the same document
+within a window cost one write.
+
+Reads look in the buffer first, so they always see the newest image. Writes that must be on
+disk when they return go through update_document_durable(), which drops the pending image,
+writes and syncs the new one synchronously.
+
+Two locks: `lock` protects the table and is only held for memory operations, so updates
+and reads never wait for the disk; `flush_lock` is held while images are being written, so
+a durable write or a delete can't be overtaken by an older image still being flushed.
+
+*/
+
+typedef struct WriteEntry {
+    char *id;
+    char *content;          // newest image
+    size_t length;
+    unsigned long version;  // bumped by every update
+    char *writing;          // image being written by the flusher, NULL if none
+    size_t writing_length;
+    unsigned long written;  // version of that image
+    struct WriteEntry *next;
+} WriteEntry;
+
+struct WriteBuffer {
+    WriteEntry *buckets[WRITE_BUFFER_BUCKETS];
+    size_t count;
+    unsigned int window_ms;
+    WriteBufferStats stats;
+    pthread_mutex_t lock;
+    pthread_mutex_t flush_lock;
+    pthread_cond_t wakeup;
+    pthread_t flusher;
+    bool stop;
+};
+
+static WriteEntry **find_entry(WriteBuffer *buffer, const char *id) {
+    WriteEntry **link = &buffer->buckets[hash_function(id) % WRITE_BUFFER_BUCKETS];
+    while (*link && strcmp((*link)->id, id) != 0) link = &(*link)->next;
+    return link;
+}
+
+// unlinks an entry and hands back its newest image, lock held and no flush running
+static char *detach_entry(WriteBuffer *buffer, WriteEntry **link, size_t *length) {
+    WriteEntry *entry = *link;
+    char *content = entry->content;
+    if (length) *length = entry->length;
+
+    *link = entry->next;
+    buffer->count--;
+    free(entry->id);
+    free(entry);
+    return content;
+}
+
+static void flush_entries(WriteBuffer *buffer) {
+    pthread_mutex_lock(&buffer->flush_lock);
+    pthread_mutex_lock(&buffer->lock);
+
+    size_t count = 0;
+    WriteEntry **batch = buffer->count ? malloc(sizeof(WriteEntry *) * buffer->count) : NULL;
+    for (int i = 0; batch && i < WRITE_BUFFER_BUCKETS; i++) {
+        for (WriteEntry *entry = buffer->buckets[i]; entry; entry = entry->next) {
+            entry->writing = entry->content;
+            entry->writing_length = entry->length;
+            entry->written = entry->version;
+            batch[count++] = entry;
+        }
+    }
+    pthread_mutex_unlock(&buffer->lock);
+
+    // entries are only removed under flush_lock, the batch stays valid while we write
+    unsigned long flushed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (store_document(batch[i]->id, batch[i]->writing, batch[i]->writing_length, false)) {
+            flushed++;
+        } else {
+            batch[i]->written = 0; // versions start at 1: the entry stays, the write is retried
+        }
+    }
+
+    pthread_mutex_lock(&buffer->lock);
+    for (size_t i = 0; i < count; i++) {
+        WriteEntry *entry = batch[i];
+        if (entry->version == entry->written) {
+            free(detach_entry(buffer, find_entry(buffer, entry->id), NULL));
+        } else {
+            // updated while it was written (or not written), it goes with the next flush
+            if (entry->writing != entry->content) free(entry->writing);
+            entry->writing = NULL;
+        }
+    }
+    buffer->stats.flushed += flushed;
+    pthread_mutex_unlock(&buffer->lock);
+
+    pthread_mutex_unlock(&buffer->flush_lock);
+    free(batch);
+}
+
+static void *flusher_thread(void *arg) {
+    WriteBuffer *buffer = arg;
+
+    pthread_mutex_lock(&buffer->lock);
+    while (!buffer->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)buffer->window_ms * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&buffer->wakeup, &buffer->lock, &deadline);
+
+        if (buffer->count == 0) continue;
+        pthread_mutex_unlock(&buffer->lock);
+        flush_entries(buffer);
+        pthread_mutex_lock(&buffer->lock);
+    }
+    pthread_mutex_unlock(&buffer->lock);
+    return NULL;
+}
+
+WriteBuffer *create_write_buffer(unsigned int window_ms) {
+    WriteBuffer *buffer = calloc(1, sizeof(WriteBuffer));
+    if (!buffer) return NULL;
+
+    buffer->window_ms = window_ms ? window_ms : WRITE_BUFFER_WINDOW_MS;
+    pthread_mutex_init(&buffer->lock, NULL);
+    pthread_mutex_init(&buffer->flush_lock, NULL);
+    pthread_cond_init(&buffer->wakeup, NULL);
+
+    if (pthread_create(&buffer->flusher, NULL, flusher_thread, buffer) != 0) {
+        pthread_cond_destroy(&buffer->wakeup);
+        pthread_mutex_destroy(&buffer->flush_lock);
+        pthread_mutex_destroy(&buffer->lock);
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+// stores a new image of a document, replacing the pending one if any
+bool write_buffer_put(WriteBuffer *buffer, const char *id, const char *content, size_t length) {
+    char *copy = malloc(length + 1);
+    if (!copy) return false;
+    memcpy(copy, content, length);
+    copy[length] = '\0';
+
+    pthread_mutex_lock(&buffer->lock);
+    WriteEntry **link = find_entry(buffer, id);
+    WriteEntry *entry = *link;
+
+    if (entry) {
+        // the flusher owns the image it is writing, it frees it when it's done
+        if (entry->content != entry->writing) free(entry->content);
+        buffer->stats.coalesced++;
+    } else {
+        entry = calloc(1, sizeof(WriteEntry));
+        if (entry) entry->id = strdup(id);
+        if (!entry || !entry->id) {
+            pthread_mutex_unlock(&buffer->lock);
+            if (entry) free(entry);
+            free(copy);
+            return false;
+        }
+        *link = entry;
+        buffer->count++;
+    }
+
+    entry->content = copy;
+    entry->length = length;
+    entry->version++;
+    buffer->stats.updates++;
+    pthread_mutex_unlock(&buffer->lock);
+    return true;
+}
+
+// copy of the pending image of a document, NULL if it has none
+char *write_buffer_get(WriteBuffer *buffer, const char *id, size_t *length) {
+    char *copy = NULL;
+
+    pthread_mutex_lock(&buffer->lock);
+    WriteEntry *entry = *find_entry(buffer, id);
+    if (entry && (copy = malloc(entry->length + 1)) != NULL) {
+        memcpy(copy, entry->content, entry->length + 1);
+        if (length) *length = entry->length;
+    }
+    pthread_mutex_unlock(&buffer->lock);
+
+    return copy;
+}
+
+bool write_buffer_contains(WriteBuffer *buffer, const char *id) {
+    pthread_mutex_lock(&buffer->lock);
+    bool found = *find_entry(buffer, id) != NULL;
+    pthread_mutex_unlock(&buffer->lock);
+    return found;
+}
+
+// writes and syncs an image now, the pending one (older) is dropped
+bool write_buffer_write_through(WriteBuffer *buffer, const char *id, const char *content, size_t length) {
+    pthread_mutex_lock(&buffer->flush_lock);
+
+    pthread_mutex_lock(&buffer->lock);
+    WriteEntry **link = find_entry(buffer, id);
+    if (*link) {
+        free(detach_entry(buffer, link, NULL));
+        buffer->stats.coalesced++;
+    }
+    buffer->stats.durable++;
+    pthread_mutex_unlock(&buffer->lock);
+
+    bool written = store_document(id, content, length, true);
+    pthread_mutex_unlock(&buffer->flush_lock);
+    return written;
+}
+
+// writes the pending image of a document now, if it has one
+bool write_buffer_flush_document(WriteBuffer *buffer, const char *id) {
+    pthread_mutex_lock(&buffer->flush_lock);
+
+    pthread_mutex_lock(&buffer->lock);
+    WriteEntry **link = find_entry(buffer, id);
+    size_t length = 0;
+    char *content = *link ? detach_entry(buffer, link, &length) : NULL;
+    if (content) buffer->stats.flushed++;
+    pthread_mutex_unlock(&buffer->lock);
+
+    bool written = content == NULL || store_document(id, content, length, false);
+    pthread_mutex_unlock(&buffer->flush_lock);
+
+    free(content);
+    return written;
+}
+
+// forgets the pending image of a document, e.g. because it's being deleted
+void write_buffer_discard(WriteBuffer *buffer, const char *id) {
+    pthread_mutex_lock(&buffer->flush_lock);
+    pthread_mutex_lock(&buffer->lock);
+
+    WriteEntry **link = find_entry(buffer, id);
+    if (*link) free(detach_entry(buffer, link, NULL));
+
+    pthread_mutex_unlock(&buffer->lock);
+    pthread_mutex_unlock(&buffer->flush_lock);
+}
+
+// writes every pending image now
+void write_buffer_flush(WriteBuffer *buffer) {
+    flush_entries(buffer);
+}
+
+WriteBufferStats write_buffer_stats(WriteBuffer *buffer) {
+    pthread_mutex_lock(&buffer->lock);
+    WriteBufferStats stats = buffer->stats;
+    stats.pending = buffer->count;
+    pthread_mutex_unlock(&buffer->lock);
+    return stats;
+}
+
+// flushes what is pending and stops the flusher
+void free_write_buffer(WriteBuffer *buffer) {
+    if (buffer == NULL) return;
+
+    pthread_mutex_lock(&buffer->lock);
+    buffer->stop = true;
+    pthread_cond_signal(&buffer->wakeup);
+    pthread_mutex_unlock(&buffer->lock);
+    pthread_join(buffer->flusher, NULL);
+
+    flush_entries(buffer);
+
+    pthread_cond_destroy(&buffer->wakeup);
+    pthread_mutex_destroy(&buffer->flush_lock);
+    pthread_mutex_destroy(&buffer->lock);
+    free(buffer);
+}
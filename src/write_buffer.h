@@ -0,0 +1,35 @@
+#ifndef WRITE_BUFFER_H
+#define WRITE_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define WRITE_BUFFER_WINDOW_MS 10  // default flush window
+#define WRITE_BUFFER_BUCKETS 1024
+
+/* Data Structures */
+
+typedef struct WriteBuffer WriteBuffer;
+
+typedef struct {
+    unsigned long updates;   // writes accepted in the buffer
+    unsigned long coalesced; // writes replaced by a newer one before reaching the disk
+    unsigned long flushed;   // images written by the flusher
+    unsigned long durable;   // writes that bypassed the buffer
+    size_t pending;          // documents waiting for the next flush
+} WriteBufferStats;
+
+/* Functions */
+
+WriteBuffer *create_write_buffer(unsigned int window_ms);
+bool write_buffer_put(WriteBuffer *buffer, const char *id, const char *content, size_t length);
+char *write_buffer_get(WriteBuffer *buffer, const char *id, size_t *length);
+bool write_buffer_contains(WriteBuffer *buffer, const char *id);
+bool write_buffer_write_through(WriteBuffer *buffer, const char *id, const char *content, size_t length);
+bool write_buffer_flush_document(WriteBuffer *buffer, const char *id);
+void write_buffer_discard(WriteBuffer *buffer, const char *id);
+void write_buffer_flush(WriteBuffer *buffer);
+WriteBufferStats write_buffer_stats(WriteBuffer *buffer);
+void free_write_buffer(WriteBuffer *buffer);
+
+#endif // WRITE_BUFFER_H
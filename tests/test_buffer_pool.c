@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+
+static char big_content[BUFFER_PAGE_SIZE * 2 + 100];
+
+void setUp(void) {
+    // three pages: two full and a short one
+    memset(big_content, 'x', sizeof(big_content) - 1);
+    big_content[sizeof(big_content) - 1] = '\0';
+
+    FILE *file = fopen("pool_a.json", "w");
+    fputs(big_content, file);
+    fclose(file);
+
+    file = fopen("pool_b.json", "w");
+    fputs(big_content, file);
+    fclose(file);
+}
+
+void tearDown(void) {
+    remove("pool_a.json");
+    remove("pool_b.json");
+}
+
+/* The second read of the same file is served entirely from the frames */
+void test_buffer_pool_hits_after_first_read(void) {
+    BufferPool *pool = create_buffer_pool(BUFFER_PAGE_SIZE * 8, false);
+    size_t length;
+
+    char *first = buffer_pool_read(pool, "pool_a.json", &length);
+    TEST_ASSERT_EQUAL_UINT(strlen(big_content), length);
+    TEST_ASSERT_EQUAL_STRING(big_content, first);
+
+    char *second = buffer_pool_read(pool, "pool_a.json", NULL);
+    TEST_ASSERT_EQUAL_STRING(big_content, second);
+
+    BufferPoolStats stats = buffer_pool_stats(pool);
+    TEST_ASSERT_EQUAL_UINT(3, stats.misses);
+    TEST_ASSERT_EQUAL_UINT(3, stats.hits);
+    TEST_ASSERT_EQUAL_FLOAT(0.5, stats.hit_ratio);
+
+    free(first);
+    free(second);
+    free_buffer_pool(pool);
+}
+
+/* With 4 frames, loading a second 3-page file evicts unpinned pages only */
+void test_buffer_pool_evicts_unpinned_frames(void) {
+    BufferPool *pool = create_buffer_pool(BUFFER_PAGE_SIZE * 4, false);
+    const char *data;
+    size_t length;
+
+    int pinned = buffer_pool_pin(pool, "pool_a.json", 0, &data, &length);
+    TEST_ASSERT_TRUE(pinned >= 0);
+    TEST_ASSERT_EQUAL_UINT(BUFFER_PAGE_SIZE, length);
+
+    free(buffer_pool_read(pool, "pool_a.json", NULL));
+    free(buffer_pool_read(pool, "pool_b.json", NULL));
+
+    BufferPoolStats stats = buffer_pool_stats(pool);
+    TEST_ASSERT_TRUE(stats.evictions >= 2);
+    TEST_ASSERT_EQUAL_INT(1, stats.pinned);
+    TEST_ASSERT_EQUAL_CHAR('x', data[0]); // still in place
+
+    buffer_pool_unpin(pool, pinned);
+    TEST_ASSERT_EQUAL_INT(0, buffer_pool_stats(pool).pinned);
+    free_buffer_pool(pool);
+}
+
+/* Invalidating a file drops all of its pages, a small file next to it keeps its own */
+void test_buffer_pool_invalidate_drops_every_page(void) {
+    BufferPool *pool = create_buffer_pool(BUFFER_PAGE_SIZE * 8, false);
+    FILE *file = fopen("pool_b.json", "w");
+    fputs("{}", file);
+    fclose(file);
+
+    free(buffer_pool_read(pool, "pool_a.json", NULL));
+    free(buffer_pool_read(pool, "pool_b.json", NULL));
+
+    memset(big_content, 'y', sizeof(big_content) - 1);
+    file = fopen("pool_a.json", "w");
+    fputs(big_content, file);
+    fclose(file);
+    buffer_pool_invalidate(pool, "pool_a.json");
+
+    const char *data;
+    size_t length;
+    int frame = buffer_pool_pin(pool, "pool_a.json", 2, &data, &length);
+    TEST_ASSERT_TRUE(frame >= 0);
+    TEST_ASSERT_EQUAL_UINT(100 - 1, length);
+    TEST_ASSERT_EQUAL_CHAR('y', data[0]);
+    buffer_pool_unpin(pool, frame);
+
+    char *content = buffer_pool_read(pool, "pool_a.json", NULL);
+    TEST_ASSERT_EQUAL_STRING(big_content, content);
+    free(content);
+
+    unsigned long hits = buffer_pool_stats(pool).hits;
+    free(buffer_pool_read(pool, "pool_b.json", NULL));
+    TEST_ASSERT_EQUAL_UINT(hits + 1, buffer_pool_stats(pool).hits);
+
+    free_buffer_pool(pool);
+}
+
+/* Updates through db_manager invalidate the cached pages */
+void test_read_document_through_buffer_pool(void) {
+    BufferPool *pool = create_buffer_pool(BUFFER_PAGE_SIZE * 8, false);
+    use_buffer_pool(pool);
+
+    TEST_ASSERT_TRUE(update_document("pool_doc", "{\"v\": 1}"));
+    char *content = read_document("pool_doc");
+    TEST_ASSERT_EQUAL_STRING("{\"v\": 1}", content);
+    free(content);
+
+    TEST_ASSERT_TRUE(update_document("pool_doc", "{\"v\": 2}"));
+    content = read_document("pool_doc");
+    TEST_ASSERT_EQUAL_STRING("{\"v\": 2}", content);
+    free(content);
+
+    delete_document("pool_doc");
+    TEST_ASSERT_NULL(read_document("pool_doc"));
+
+    use_buffer_pool(NULL);
+    free_buffer_pool(pool);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_buffer_pool_hits_after_first_read);
+    RUN_TEST(test_buffer_pool_evicts_unpinned_frames);
+    RUN_TEST(test_buffer_pool_invalidate_drops_every_page);
+    RUN_TEST(test_read_document_through_buffer_pool);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/capped.h"
+
+static CappedCollection *capped;
+
+static uint64_t insert(int n) {
+    char content[64];
+    snprintf(content, sizeof(content), "{\"event\": %d}", n);
+    return capped_insert(capped, content, strlen(content));
+}
+
+static bool collect(uint64_t seq, const char *content, size_t length, void *arg) {
+    (void)seq;
+    int *events = arg;
+    int event;
+    TEST_ASSERT_EQUAL_UINT(strlen(content), length);
+    TEST_ASSERT_EQUAL_INT(1, sscanf(content, "{\"event\": %d}", &event));
+    events[events[0]++ + 1] = event;
+    return true;
+}
+
+// checks a scan returns exactly the events first..last, in order
+static void assert_scan(int first, int last) {
+    int events[1024] = {0};
+    size_t visited = capped_scan(capped, 0, collect, events);
+    TEST_ASSERT_EQUAL_UINT(last - first + 1, visited);
+    for (int i = 0; i < events[0]; i++) TEST_ASSERT_EQUAL_INT(first + i, events[i + 1]);
+}
+
+void setUp(void) {
+    capped = NULL;
+}
+
+void tearDown(void) {
+    free_capped_collection(capped);
+    drop_capped_collection("events");
+}
+
+/* Past the document cap every insert overwrites the oldest document */
+void test_document_cap(void) {
+    capped = open_capped_collection(NULL, 64 * 1024, 10);
+    TEST_ASSERT_NOT_NULL(capped);
+
+    for (int i = 1; i <= 25; i++) TEST_ASSERT_EQUAL_UINT64(i, insert(i));
+    TEST_ASSERT_EQUAL_UINT(10, capped_count(capped));
+    assert_scan(16, 25);
+
+    TEST_ASSERT_NULL(capped_find(capped, 15, NULL));
+    size_t length = 0;
+    char *content = capped_find(capped, 16, &length);
+    TEST_ASSERT_EQUAL_STRING("{\"event\": 16}", content);
+    TEST_ASSERT_EQUAL_UINT(13, length);
+    free(content);
+}
+
+/* Past the byte cap the ring wraps, scans still go from the oldest to the newest */
+void test_byte_cap_wraps(void) {
+    capped = open_capped_collection(NULL, 1000, 0);
+    for (int i = 1; i <= 500; i++) TEST_ASSERT_NOT_EQUAL(0, insert(i));
+
+    size_t count = capped_count(capped);
+    TEST_ASSERT_TRUE(count > 20 && count < 40);
+    TEST_ASSERT_TRUE(capped->header->used <= 1000);
+    assert_scan(500 - count + 1, 500);
+
+    // from a given sequence number on
+    int events[64] = {0};
+    TEST_ASSERT_EQUAL_UINT(3, capped_scan(capped, 498, collect, events));
+    TEST_ASSERT_EQUAL_INT(498, events[1]);
+
+    // invalid or oversized documents are refused
+    TEST_ASSERT_EQUAL_UINT64(0, capped_insert(capped, "{oops", 5));
+    char big[2000];
+    memset(big, ' ', sizeof(big));
+    big[0] = '{';
+    big[sizeof(big) - 1] = '}';
+    TEST_ASSERT_EQUAL_UINT64(0, capped_insert(capped, big, sizeof(big)));
+}
+
+/* The ring is a file: the documents and the order survive a reopen */
+void test_reopen(void) {
+    capped = open_capped_collection("events", 4096, 0);
+    TEST_ASSERT_NOT_NULL(capped);
+    for (int i = 1; i <= 300; i++) insert(i);
+    size_t count = capped_count(capped);
+    TEST_ASSERT_TRUE(capped_sync(capped));
+    free_capped_collection(capped);
+
+    TEST_ASSERT_EQUAL_INT(0, access("events" CAPPED_SUFFIX, F_OK));
+    capped = open_capped_collection("events", 1, 1); // the caps it was created with win
+    TEST_ASSERT_NOT_NULL(capped);
+    TEST_ASSERT_EQUAL_UINT(count, capped_count(capped));
+    assert_scan(300 - count + 1, 300);
+    TEST_ASSERT_EQUAL_UINT64(301, insert(301));
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_document_cap);
+    RUN_TEST(test_byte_cap_wraps);
+    RUN_TEST(test_reopen);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/cuckoo_filter.h"
+
+static CuckooFilter *filter;
+
+void setUp(void) {
+    filter = create_cuckoo_filter(10000);
+}
+
+void tearDown(void) {
+    free_cuckoo_filter(filter);
+}
+
+void test_inserted_keys_are_found(void) {
+    char key[32];
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, "key_%d", i);
+        TEST_ASSERT_TRUE(cuckoo_filter_insert(filter, key));
+    }
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, "key_%d", i);
+        TEST_ASSERT_TRUE(cuckoo_filter_contains(filter, key));
+    }
+    TEST_ASSERT_EQUAL_UINT(10000, filter->count);
+}
+
+void test_removed_keys_are_not_found(void) {
+    TEST_ASSERT_TRUE(cuckoo_filter_insert(filter, "a"));
+    TEST_ASSERT_TRUE(cuckoo_filter_insert(filter, "b"));
+    TEST_ASSERT_TRUE(cuckoo_filter_remove(filter, "a"));
+
+    TEST_ASSERT_FALSE(cuckoo_filter_contains(filter, "a"));
+    TEST_ASSERT_TRUE(cuckoo_filter_contains(filter, "b"));
+    TEST_ASSERT_FALSE(cuckoo_filter_remove(filter, "a"));
+}
+
+/* Absent keys are rejected at about the expected false positive rate */
+void test_false_positive_rate(void) {
+    char key[32];
+    for (int i = 0; i < 10000; i++) {
+        sprintf(key, "key_%d", i);
+        cuckoo_filter_insert(filter, key);
+    }
+
+    int false_positives = 0;
+    for (int i = 0; i < 100000; i++) {
+        sprintf(key, "absent_%d", i);
+        if (cuckoo_filter_contains(filter, key)) false_positives++;
+    }
+
+    TEST_ASSERT_TRUE(cuckoo_filter_fpr(filter) < 0.001);
+    TEST_ASSERT_TRUE(false_positives < 100); // 0.1%
+}
+
+/* The collection keeps its filter in sync with inserts and removals */
+void test_collection_filter_integration(void) {
+    Collection *collection = create_collection();
+    Document *docs[2000];
+
+    for (int i = 0; i < 2000; i++) {
+        docs[i] = load_document(generate_unique_id(), strdup("{}"));
+        TEST_ASSERT_TRUE(insert_document(collection, docs[i]));
+    }
+    TEST_ASSERT_TRUE(cuckoo_filter_capacity(collection->filter) >= 2000);
+
+    for (int i = 0; i < 2000; i++) {
+        TEST_ASSERT_EQUAL_PTR(docs[i], find_document(collection, docs[i]->id));
+    }
+
+    TEST_ASSERT_NULL(find_document(collection, "not-a-document"));
+    TEST_ASSERT_NULL(get_document(collection, "not-a-document"));
+    TEST_ASSERT_TRUE(collection->filter->negatives + collection->filter->false_positives == 2);
+
+    char *id = strdup(docs[0]->id);
+    remove_document(collection, id); // no file on disk, only the in-memory removal matters
+    TEST_ASSERT_NULL(find_document(collection, id));
+    TEST_ASSERT_EQUAL_INT(1999, collection->size);
+    TEST_ASSERT_EQUAL_PTR(docs[1999], find_document(collection, docs[1999]->id));
+    TEST_ASSERT_EQUAL_INT(0, docs[1999]->slot);
+    free(id);
+
+    free_collection(collection);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_inserted_keys_are_found);
+    RUN_TEST(test_removed_keys_are_not_found);
+    RUN_TEST(test_false_positive_rate);
+    RUN_TEST(test_collection_filter_integration);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "unity.h"
 #include "../src/db_manager.h"
 
@@ -183,6 +184,43 @@ void test_create_collection_should_initialize_properly(void) {
     free(collection);
 }
 
+void test_insert_and_find_document(void) {
+    Collection *collection = create_collection();
+    Document *doc = create_document("{\"name\": \"fada\"}");
+    TEST_ASSERT_NOT_NULL(doc);
+
+    TEST_ASSERT_TRUE(insert_document(collection, doc));
+    TEST_ASSERT_EQUAL_INT(1, collection->size);
+    TEST_ASSERT_EQUAL_PTR(doc, find_document(collection, doc->id));
+    TEST_ASSERT_NULL(find_document(collection, "missing"));
+
+    delete_document(doc->id);
+    free_collection(collection);
+}
+
+void test_insert_document_grows_hash_table(void) {
+    Collection *collection = create_collection();
+
+    for (int i = 0; i < 100; i++) {
+        char id[32];
+        sprintf(id, "doc_%d", i);
+        TEST_ASSERT_TRUE(insert_document(collection, load_document(strdup(id), strdup("{}"))));
+    }
+
+    TEST_ASSERT_EQUAL_INT(100, collection->size);
+    TEST_ASSERT_TRUE(collection->hashTable->size >= 100);
+    TEST_ASSERT_EQUAL_STRING("doc_42", find_document(collection, "doc_42")->id);
+
+    free_collection(collection);
+}
+
+void test_validate_json(void) {
+    TEST_ASSERT_TRUE(validate_json("{\"a\": [1, 2]}", 13));
+    TEST_ASSERT_TRUE(validate_json("[]", 2));
+    TEST_ASSERT_FALSE(validate_json("testContent", 11));
+    TEST_ASSERT_FALSE(validate_json("{\"a\": [1, 2", 11)); // truncated
+}
+
 int main(void){
     printf("Starting tests...\n");
     UNITY_BEGIN();
@@ -199,6 +237,9 @@ int main(void){
     RUN_TEST(test_create_hash_entry_collision_handling);
     RUN_TEST(test_create_hash_entry_edge_cases);
     RUN_TEST(test_hash_entry_multiple_collisions);
+    RUN_TEST(test_insert_and_find_document);
+    RUN_TEST(test_insert_document_grows_hash_table);
+    RUN_TEST(test_validate_json);
 
     printf("Tests completed...\n");
     return UNITY_END();
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "unity.h"
+#include "../src/event_loop.h"
+
+static EventLoop *loop;
+static int pair[2];
+
+// what the handlers saw
+static int calls;
+static int last_events;
+static char received[256];
+static size_t received_length;
+
+void setUp(void) {
+    loop = create_event_loop();
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair);
+    calls = 0;
+    last_events = 0;
+    received_length = 0;
+}
+
+void tearDown(void) {
+    free_event_loop(loop);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+// edge triggered: reads until EAGAIN
+static void drain_handler(EventLoop *l, int fd, int events, void *arg) {
+    (void)l;
+    (void)arg;
+    calls++;
+    last_events = events;
+    if (!(events & EVENT_READABLE)) return;
+
+    ssize_t n;
+    while ((n = read(fd, received + received_length, sizeof(received) - received_length - 1)) > 0) {
+        received_length += n;
+    }
+    received[received_length] = '\0';
+}
+
+static void count_handler(EventLoop *l, void *arg) {
+    (void)l;
+    (*(int *)arg)++;
+}
+
+void test_readable_event(void) {
+    TEST_ASSERT_TRUE(event_loop_add(loop, pair[0], EVENT_READABLE, drain_handler, NULL));
+
+    // nothing to read, nothing happens
+    TEST_ASSERT_EQUAL_INT(0, event_loop_process(loop, 0));
+    TEST_ASSERT_EQUAL_INT(0, calls);
+
+    TEST_ASSERT_EQUAL_INT(5, write(pair[1], "hello", 5));
+    TEST_ASSERT_EQUAL_INT(1, event_loop_process(loop, 100));
+    TEST_ASSERT_EQUAL_INT(1, calls);
+    TEST_ASSERT_TRUE(last_events & EVENT_READABLE);
+    TEST_ASSERT_EQUAL_STRING("hello", received);
+
+    // the socket was drained, there is no new edge until new data arrives
+    TEST_ASSERT_EQUAL_INT(0, event_loop_process(loop, 0));
+    TEST_ASSERT_EQUAL_INT(1, calls);
+
+    TEST_ASSERT_EQUAL_INT(6, write(pair[1], " world", 6));
+    event_loop_process(loop, 100);
+    TEST_ASSERT_EQUAL_STRING("hello world", received);
+}
+
+void test_writable_and_hangup(void) {
+    TEST_ASSERT_TRUE(event_loop_add(loop, pair[0], EVENT_READABLE | EVENT_WRITABLE, drain_handler, NULL));
+
+    // a fresh socket is writable at once
+    TEST_ASSERT_EQUAL_INT(1, event_loop_process(loop, 100));
+    TEST_ASSERT_TRUE(last_events & EVENT_WRITABLE);
+
+    close(pair[1]);
+    pair[1] = -1;
+    event_loop_process(loop, 100);
+    TEST_ASSERT_TRUE(last_events & EVENT_HANGUP);
+    TEST_ASSERT_TRUE(last_events & EVENT_READABLE);
+}
+
+void test_remove(void) {
+    TEST_ASSERT_TRUE(event_loop_add(loop, pair[0], EVENT_READABLE, drain_handler, NULL));
+    event_loop_remove(loop, pair[0]);
+
+    TEST_ASSERT_EQUAL_INT(5, write(pair[1], "hello", 5));
+    TEST_ASSERT_EQUAL_INT(0, event_loop_process(loop, 0));
+    TEST_ASSERT_EQUAL_INT(0, calls);
+
+    // registering twice fails, a removed fd can be registered again
+    TEST_ASSERT_TRUE(event_loop_add(loop, pair[0], EVENT_READABLE, drain_handler, NULL));
+    TEST_ASSERT_FALSE(event_loop_add(loop, pair[0], EVENT_READABLE, drain_handler, NULL));
+    TEST_ASSERT_FALSE(event_loop_modify(loop, pair[1], EVENT_READABLE));
+}
+
+void test_timers(void) {
+    int fired = 0, cancelled = 0;
+    EventTimer soon = {0}, later = {0};
+
+    event_loop_schedule(loop, &soon, 20, count_handler, &fired);
+    event_loop_schedule(loop, &later, 30, count_handler, &cancelled);
+    event_loop_cancel(loop, &later);
+
+    uint64_t start = event_loop_now();
+    while (fired == 0 && event_loop_now() - start < 1000) event_loop_process(loop, 5);
+
+    TEST_ASSERT_EQUAL_INT(1, fired);
+    TEST_ASSERT_TRUE(event_loop_now() - start >= 20);
+
+    // cancelled timers never fire, fired ones don't fire again
+    start = event_loop_now();
+    while (event_loop_now() - start < 60) event_loop_process(loop, 5);
+    TEST_ASSERT_EQUAL_INT(1, fired);
+    TEST_ASSERT_EQUAL_INT(0, cancelled);
+}
+
+/* Rescheduling pushes a timer back, e.g. an idle timeout on every request */
+void test_reschedule(void) {
+    int fired = 0;
+    EventTimer timer = {0};
+
+    event_loop_schedule(loop, &timer, 30, count_handler, &fired);
+    uint64_t start = event_loop_now();
+    while (event_loop_now() - start < 20) event_loop_process(loop, 5);
+    event_loop_schedule(loop, &timer, 30, count_handler, &fired);
+    while (event_loop_now() - start < 40) event_loop_process(loop, 5);
+    TEST_ASSERT_EQUAL_INT(0, fired);
+
+    while (fired == 0 && event_loop_now() - start < 1000) event_loop_process(loop, 5);
+    TEST_ASSERT_EQUAL_INT(1, fired);
+}
+
+static void stop_handler(EventLoop *l, void *arg) {
+    (*(int *)arg)++;
+    event_loop_stop(l);
+}
+
+void test_tick_and_stop(void) {
+    int ticks = 0, stops = 0;
+    EventTimer timer = {0};
+
+    event_loop_set_tick(loop, count_handler, &ticks);
+    event_loop_schedule(loop, &timer, 100, stop_handler, &stops);
+    event_loop_run(loop);
+
+    TEST_ASSERT_EQUAL_INT(1, stops);
+    TEST_ASSERT_TRUE(ticks >= 100 / EVENT_LOOP_TICK_MS / 2);
+}
+
+/* Descriptors beyond the initial table grow it */
+void test_many_descriptors(void) {
+    int fds[2048];
+    int count = 0;
+    while (count < 2048) {
+        fds[count] = dup(pair[0]);
+        if (fds[count] < 0) break;
+        count++;
+    }
+    if (count < 1100) {
+        for (int i = 0; i < count; i++) close(fds[i]);
+        TEST_IGNORE_MESSAGE("not enough descriptors");
+    }
+
+    int last = fds[count - 1];
+    for (int i = 0; i < count - 1; i++) close(fds[i]);
+
+    // a dup shares the socket, writes to the peer make it readable
+    TEST_ASSERT_TRUE(event_loop_add(loop, last, EVENT_READABLE, drain_handler, NULL));
+    TEST_ASSERT_EQUAL_INT(2, write(pair[1], "ok", 2));
+    TEST_ASSERT_EQUAL_INT(1, event_loop_process(loop, 100));
+    TEST_ASSERT_EQUAL_STRING("ok", received);
+
+    event_loop_remove(loop, last);
+    close(last);
+}
+
+static void write_done(IORequest *request, int result, void *arg) {
+    (void)request;
+    *(int *)arg = result;
+}
+
+/* The callbacks of an attached engine run in the loop, its requests are submitted before it waits */
+void test_engine_completions(void) {
+    IOEngine *engine = io_engine_create(NULL);
+    TEST_ASSERT_NOT_NULL(engine);
+    TEST_ASSERT_TRUE(event_loop_attach_engine(loop, engine));
+    TEST_ASSERT_FALSE(event_loop_attach_engine(loop, engine));
+
+    int fd = open("event_loop_engine.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    TEST_ASSERT_TRUE(fd >= 0);
+
+    int result = -1;
+    IORequest request = {.opcode = IO_OP_WRITE, .fd = fd, .buffer = "ok", .length = 2, .offset = 0,
+                         .callback = write_done, .arg = &result};
+    TEST_ASSERT_TRUE(io_engine_submit(engine, &request));
+
+    for (int i = 0; i < 100 && result < 0; i++) event_loop_process(loop, 100);
+    TEST_ASSERT_EQUAL_INT(2, result);
+    TEST_ASSERT_EQUAL_INT(0, io_engine_pending(engine));
+
+    event_loop_remove(loop, io_engine_event_fd(engine));
+    io_engine_destroy(engine);
+    close(fd);
+    unlink("event_loop_engine.tmp");
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_readable_event);
+    RUN_TEST(test_writable_and_hangup);
+    RUN_TEST(test_remove);
+    RUN_TEST(test_timers);
+    RUN_TEST(test_reschedule);
+    RUN_TEST(test_tick_and_stop);
+    RUN_TEST(test_many_descriptors);
+    RUN_TEST(test_engine_completions);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "../src/eviction.h"
+
+#define DOCUMENTS 20
+
+static Collection *collection;
+static Document *docs[DOCUMENTS];
+
+void setUp(void) {
+    collection = create_collection();
+    for (int i = 0; i < DOCUMENTS; i++) {
+        docs[i] = create_document("{\"payload\": \"0123456789\"}"); // 25 bytes + NUL
+        insert_document(collection, docs[i]);
+    }
+}
+
+void tearDown(void) {
+    for (int i = 0; i < DOCUMENTS; i++) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s.json", docs[i]->id);
+        remove(filename);
+    }
+    free_collection(collection);
+}
+
+void test_used_memory_accounts_resident_bodies(void) {
+    TEST_ASSERT_EQUAL_UINT(DOCUMENTS * 26, collection->used_memory);
+}
+
+/* Setting a maxmemory evicts bodies but keeps every document in the index */
+void test_maxmemory_evicts_bodies(void) {
+    set_collection_maxmemory(collection, 5 * 26, EVICT_LRU);
+
+    TEST_ASSERT_TRUE(collection->used_memory <= 5 * 26);
+    TEST_ASSERT_EQUAL_INT(DOCUMENTS, collection->size);
+
+    int resident = 0;
+    for (int i = 0; i < DOCUMENTS; i++) {
+        if (docs[i]->content) resident++;
+        TEST_ASSERT_EQUAL_PTR(docs[i], find_document(collection, docs[i]->id));
+    }
+    TEST_ASSERT_EQUAL_INT(5, resident);
+}
+
+/* An evicted body is transparently reloaded from disk on access */
+void test_get_document_content_reloads_evicted_body(void) {
+    set_collection_maxmemory(collection, 2 * 26, EVICT_LFU);
+
+    Document *cold = NULL;
+    for (int i = 0; i < DOCUMENTS && !cold; i++) {
+        if (docs[i]->content == NULL) cold = docs[i];
+    }
+    TEST_ASSERT_NOT_NULL(cold);
+
+    TEST_ASSERT_EQUAL_STRING("{\"payload\": \"0123456789\"}", get_document_content(collection, cold));
+    TEST_ASSERT_NOT_NULL(cold->content);
+    TEST_ASSERT_TRUE(collection->used_memory <= 2 * 26);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_used_memory_accounts_resident_bodies);
+    RUN_TEST(test_maxmemory_evicts_bodies);
+    RUN_TEST(test_get_document_content_reloads_evicted_body);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/expiry.h"
+#include "../src/recovery.h"
+
+static Collection *collection;
+
+static Document *add_session(void) {
+    return add_document(collection, "{\"session\": true}");
+}
+
+static bool file_exists(const char *id) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+    return access(filename, F_OK) == 0;
+}
+
+void setUp(void) {
+    collection = create_collection();
+}
+
+void tearDown(void) {
+    truncate_collection(collection);
+    free_collection(collection);
+}
+
+void test_ttl_set_and_persist(void) {
+    Document *doc = add_session();
+    TEST_ASSERT_EQUAL_INT64(-1, document_ttl(collection, doc->id));
+    TEST_ASSERT_EQUAL_INT64(-2, document_ttl(collection, "missing"));
+    TEST_ASSERT_FALSE(expire_document(collection, "missing", 1000));
+
+    TEST_ASSERT_TRUE(expire_document(collection, doc->id, 60000));
+    long long ttl = document_ttl(collection, doc->id);
+    TEST_ASSERT_TRUE(ttl > 59000 && ttl <= 60000);
+
+    TEST_ASSERT_TRUE(persist_document(collection, doc->id));
+    TEST_ASSERT_EQUAL_INT64(-1, document_ttl(collection, doc->id));
+    TEST_ASSERT_FALSE(persist_document(collection, doc->id));
+    TEST_ASSERT_EQUAL_UINT(0, collection->expiry->wheel->count);
+}
+
+/* An expired document is gone for reads even before the active cycle runs */
+void test_lazy_expiry(void) {
+    Document *doc = add_session();
+    char *id = strdup(doc->id);
+
+    TEST_ASSERT_TRUE(expire_document_at(collection, id, expiry_now_ms() - 1));
+    TEST_ASSERT_NULL(find_document(collection, id));
+    TEST_ASSERT_FALSE(file_exists(id));
+    TEST_ASSERT_EQUAL_INT(0, collection->size);
+    TEST_ASSERT_EQUAL_UINT(1, collection->expiry->expired_lazy);
+
+    // its timer went with it, the active cycle has nothing to do
+    TEST_ASSERT_EQUAL_UINT(0, active_expire_cycle(collection));
+    free(id);
+}
+
+void test_active_expiry(void) {
+    Document *keep = add_session();
+    for (int i = 0; i < 50; i++) {
+        Document *doc = add_session();
+        TEST_ASSERT_TRUE(expire_document(collection, doc->id, 20));
+    }
+    TEST_ASSERT_TRUE(expire_document(collection, keep->id, 60000));
+
+    TEST_ASSERT_EQUAL_UINT(0, active_expire_cycle(collection));
+    usleep(50000);
+
+    TEST_ASSERT_EQUAL_UINT(50, active_expire_cycle(collection));
+    TEST_ASSERT_EQUAL_INT(1, collection->size);
+    TEST_ASSERT_EQUAL_PTR(keep, find_document(collection, keep->id));
+    TEST_ASSERT_EQUAL_UINT(50, collection->expiry->expired_active);
+}
+
+/* The expiry times are kept next to the documents, the recovery re-arms them */
+void test_recovery_rearms_the_ttl(void) {
+    Document *expiring = add_session();
+    Document *expired = add_session();
+    Document *persisted = add_session();
+    char *expired_id = strdup(expired->id);
+
+    TEST_ASSERT_TRUE(expire_document(collection, expiring->id, 60000));
+    TEST_ASSERT_TRUE(expire_document(collection, persisted->id, 60000));
+    TEST_ASSERT_TRUE(persist_document(collection, persisted->id));
+
+    // runs out while nobody looks, as if the process were down
+    TEST_ASSERT_TRUE(expire_document(collection, expired_id, 20));
+    usleep(50000);
+
+    Collection *recovered = create_collection();
+    TEST_ASSERT_TRUE(recover_collection(recovered, ".", NULL, NULL) >= 3);
+    long long ttl = document_ttl(recovered, expiring->id);
+    TEST_ASSERT_TRUE(ttl > 59000 && ttl <= 60000);
+    TEST_ASSERT_EQUAL_INT64(-1, document_ttl(recovered, persisted->id));
+    TEST_ASSERT_NULL(find_document(recovered, expired_id));
+    TEST_ASSERT_FALSE(file_exists(expired_id));
+    free_collection(recovered);
+    free(expired_id);
+}
+
+/* The journal follows the directory recovered, whatever the working one */
+void test_journal_lives_in_the_recovered_directory(void) {
+    mkdir("expiry_data", 0755);
+    FILE *file = fopen("expiry_data/remote.json", "w");
+    fputs("{\"a\": 1}", file);
+    fclose(file);
+
+    Collection *recovered = create_collection();
+    TEST_ASSERT_EQUAL_INT(1, recover_collection(recovered, "expiry_data", NULL, NULL));
+    TEST_ASSERT_TRUE(expire_document(recovered, "remote", 60000));
+    free_collection(recovered);
+    TEST_ASSERT_EQUAL_INT(0, access("expiry_data/" EXPIRY_JOURNAL, F_OK));
+
+    recovered = create_collection();
+    TEST_ASSERT_EQUAL_INT(1, recover_collection(recovered, "expiry_data", NULL, NULL));
+    TEST_ASSERT_TRUE(document_ttl(recovered, "remote") > 59000);
+    free_collection(recovered);
+
+    unlink("expiry_data/remote.json");
+    unlink("expiry_data/" EXPIRY_JOURNAL);
+    rmdir("expiry_data");
+
+    // back to the working directory for the other tests
+    recovered = create_collection();
+    recover_collection(recovered, ".", NULL, NULL);
+    free_collection(recovered);
+}
+
+/* A mass expiry is spread over several cycles, each one bounded by the budget */
+void test_budget_adapts_to_the_backlog(void) {
+    for (int i = 0; i < 3000; i++) {
+        Document *doc = add_session();
+        expire_document_at(collection, doc->id, expiry_now_ms() - 1 - i % 5);
+    }
+
+    Expiry *expiry = collection->expiry;
+    expiry->budget_us = 1; // a budget no cycle can meet
+    size_t removed = active_expire_cycle(collection);
+    TEST_ASSERT_EQUAL_UINT(EXPIRY_CLOCK_CHECK, removed);
+    TEST_ASSERT_EQUAL_UINT(2, expiry->budget_us);
+    TEST_ASSERT_EQUAL_UINT(1, expiry->cycles_over_budget);
+
+    while (collection->size > 0) removed += active_expire_cycle(collection);
+    TEST_ASSERT_EQUAL_UINT(3000, removed);
+    TEST_ASSERT_TRUE(expiry->budget_us <= EXPIRY_CYCLE_MAX_BUDGET_US);
+
+    // with no backlog the budget goes back down
+    for (int i = 0; i < 20; i++) active_expire_cycle(collection);
+    TEST_ASSERT_EQUAL_UINT(EXPIRY_CYCLE_BUDGET_US, expiry->budget_us);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_ttl_set_and_persist);
+    RUN_TEST(test_lazy_expiry);
+    RUN_TEST(test_active_expiry);
+    RUN_TEST(test_recovery_rearms_the_ttl);
+    RUN_TEST(test_journal_lives_in_the_recovered_directory);
+    RUN_TEST(test_budget_adapts_to_the_backlog);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
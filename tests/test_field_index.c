@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/field_index.h"
+
+static char *big;
+
+// a document bigger than FIELD_INDEX_MIN_SIZE with a small field after a large one
+static char *make_big_document(const char *tail) {
+    size_t padding = FIELD_INDEX_MIN_SIZE * 2;
+    char *content = malloc(padding + 256);
+    int n = sprintf(content, "{\"name\": \"big\", \"blob\": \"");
+    memset(content + n, 'x', padding);
+    sprintf(content + n + padding, "\", \"nested\": {\"a\": [1, 2]}, \"tail\": %s}", tail);
+    return content;
+}
+
+void setUp(void) {
+    big = make_big_document("42");
+}
+
+void tearDown(void) {
+    free(big);
+    delete_document("big");
+    delete_document("small");
+}
+
+void test_read_document_range(void) {
+    update_document("small", "{\"a\": 1, \"b\": 2}");
+
+    size_t read = 0;
+    char *range = read_document_range("small", 1, 6, &read);
+    TEST_ASSERT_EQUAL_STRING("\"a\": 1", range);
+    TEST_ASSERT_EQUAL_UINT(6, read);
+    free(range);
+
+    // the range is cut at the end of the document
+    range = read_document_range("small", 13, 100, &read);
+    TEST_ASSERT_EQUAL_STRING(" 2}", range);
+    free(range);
+
+    TEST_ASSERT_NULL(read_document_range("missing", 0, 10, NULL));
+}
+
+void test_small_documents_are_parsed_whole(void) {
+    update_document("small", "{\"a\": 1, \"s\": \"text\", \"o\": {\"a\": 3}}");
+
+    char *value = read_document_field("small", "s", NULL);
+    TEST_ASSERT_EQUAL_STRING("\"text\"", value);
+    free(value);
+
+    value = read_document_field("small", "o", NULL);
+    TEST_ASSERT_EQUAL_STRING("{\"a\": 3}", value);
+    free(value);
+
+    TEST_ASSERT_NULL(read_document_field("small", "missing", NULL));
+    TEST_ASSERT_EQUAL_INT(-1, access("small" FIELD_INDEX_SUFFIX, F_OK));
+}
+
+/* Big documents get an offset table, fields are read with a single pread */
+void test_big_documents_use_the_offset_table(void) {
+    TEST_ASSERT_TRUE(update_document("big", big));
+    TEST_ASSERT_EQUAL_INT(0, access("big" FIELD_INDEX_SUFFIX, F_OK));
+
+    size_t offset = 0, length = 0;
+    TEST_ASSERT_TRUE(lookup_field("big", "tail", &offset, &length));
+    TEST_ASSERT_EQUAL_UINT(2, length);
+    TEST_ASSERT_EQUAL_MEMORY("42", big + offset, 2);
+
+    char *value = read_document_field("big", "nested", &length);
+    TEST_ASSERT_EQUAL_STRING("{\"a\": [1, 2]}", value);
+    TEST_ASSERT_EQUAL_UINT(strlen(value), length);
+    free(value);
+
+    // nested keys aren't top level fields
+    TEST_ASSERT_FALSE(lookup_field("big", "a", &offset, &length));
+
+    TEST_ASSERT_TRUE(delete_document("big"));
+    TEST_ASSERT_EQUAL_INT(-1, access("big" FIELD_INDEX_SUFFIX, F_OK));
+}
+
+/* A table older than its document is rebuilt instead of being trusted */
+void test_stale_table_is_rebuilt(void) {
+    update_document("big", big);
+
+    // rewritten behind the table's back, the tail moves by a few bytes
+    char *changed = make_big_document("\"forty-two\"");
+    FILE *file = fopen("big.json", "w");
+    fputs(changed, file);
+    fclose(file);
+
+    char *value = read_document_field("big", "tail", NULL);
+    TEST_ASSERT_EQUAL_STRING("\"forty-two\"", value);
+    free(value);
+
+    value = read_document_field("big", "name", NULL);
+    TEST_ASSERT_EQUAL_STRING("\"big\"", value);
+    free(value);
+    free(changed);
+}
+
+static void on_document_written(const char *id, char *content, size_t length, int error, void *arg) {
+    (void)id;
+    (void)content;
+    (void)length;
+    *(int *)arg = error + 1; // 1 once written
+}
+
+/* An asynchronous write refreshes the table instead of leaving the old one behind */
+void test_async_write_refreshes_the_table(void) {
+    update_document("big", big);
+
+    char *changed = make_big_document("\"forty-two\"");
+    IOConfig config = { IO_BACKEND_THREADS, 32, 2, false, 0 };
+    IOEngine *engine = io_engine_create(&config);
+    int written = 0;
+
+    TEST_ASSERT_TRUE(write_document_async(engine, "big", changed, strlen(changed), on_document_written,
+                                          &written));
+    while (io_engine_pending(engine) > 0) io_engine_poll(engine, 1);
+    TEST_ASSERT_EQUAL_INT(1, written);
+
+    FieldIndexHeader header;
+    FILE *file = fopen("big" FIELD_INDEX_SUFFIX, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_UINT(1, fread(&header, sizeof(header), 1, file));
+    fclose(file);
+    TEST_ASSERT_EQUAL_UINT(strlen(changed), header.document_size);
+
+    char *value = read_document_field("big", "tail", NULL);
+    TEST_ASSERT_EQUAL_STRING("\"forty-two\"", value);
+    free(value);
+
+    io_engine_destroy(engine);
+    free(changed);
+}
+
+/* A file renamed over the document is caught even with the same size and mtime */
+void test_replaced_file_makes_the_table_stale(void) {
+    update_document("big", big);
+
+    // same size, "nested" loses a byte and "tail" gains it, so the offsets move
+    char *changed = strdup(big);
+    char *nested = strstr(changed, "{\"a\": [1, 2]}, \"tail\": 42}");
+    strcpy(nested, "{\"a\": [1,2]}, \"tail\": 420}");
+    TEST_ASSERT_EQUAL_UINT(strlen(big), strlen(changed));
+
+    FILE *file = fopen("big.json.new", "w");
+    fputs(changed, file);
+    fclose(file);
+
+    struct stat st;
+    stat("big.json", &st);
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    TEST_ASSERT_EQUAL_INT(0, utimensat(AT_FDCWD, "big.json.new", times, 0));
+    TEST_ASSERT_EQUAL_INT(0, rename("big.json.new", "big.json"));
+
+    char *value = read_document_field("big", "tail", NULL);
+    TEST_ASSERT_EQUAL_STRING("420", value);
+    free(value);
+    free(changed);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_read_document_range);
+    RUN_TEST(test_small_documents_are_parsed_whole);
+    RUN_TEST(test_big_documents_use_the_offset_table);
+    RUN_TEST(test_stale_table_is_rebuilt);
+    RUN_TEST(test_async_write_refreshes_the_table);
+    RUN_TEST(test_replaced_file_makes_the_table_stale);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
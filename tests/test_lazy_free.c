@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/lazy_free.h"
+#include "../src/recovery.h"
+
+static LazyFree *lazy;
+
+static int order[16];
+static int completed;
+
+static void record_job(void *arg) {
+    order[completed++] = *(int *)arg;
+    free(arg);
+}
+
+// tombstones still in the directory
+static int count_tombstones(void) {
+    DIR *dir = opendir(".");
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length > 5 && strcmp(entry->d_name + length - 5, DOCUMENT_TOMBSTONE_SUFFIX) == 0) count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+static bool file_exists(const char *id) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+    return access(filename, F_OK) == 0;
+}
+
+// keeps the background thread busy until released
+static bool held;
+
+static void hold_job(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&held, __ATOMIC_ACQUIRE)) usleep(1000);
+}
+
+void setUp(void) {
+    lazy = create_lazy_free();
+    use_lazy_free(lazy);
+}
+
+void tearDown(void) {
+    use_lazy_free(NULL);
+    free_lazy_free(lazy);
+}
+
+void test_jobs_run_in_order(void) {
+    completed = 0;
+    for (int i = 0; i < 16; i++) {
+        int *arg = malloc(sizeof(int));
+        *arg = i;
+        TEST_ASSERT_TRUE(lazy_free_submit(lazy, record_job, arg));
+    }
+    lazy_free_drain(lazy);
+
+    TEST_ASSERT_EQUAL_INT(16, completed);
+    for (int i = 0; i < 16; i++) TEST_ASSERT_EQUAL_INT(i, order[i]);
+
+    LazyFreeStats stats = lazy_free_stats(lazy);
+    TEST_ASSERT_EQUAL_UINT(16, stats.submitted);
+    TEST_ASSERT_EQUAL_UINT(16, stats.completed);
+    TEST_ASSERT_EQUAL_UINT(0, stats.pending);
+}
+
+/* The document disappears when delete_document() returns, the file is unlinked later */
+void test_delete_writes_a_tombstone(void) {
+    Document *doc = create_document("{\"a\": 1}");
+    TEST_ASSERT_NOT_NULL(doc);
+
+    TEST_ASSERT_TRUE(delete_document(doc->id));
+    TEST_ASSERT_FALSE(file_exists(doc->id));
+    TEST_ASSERT_NULL(read_document(doc->id));
+    TEST_ASSERT_FALSE(delete_document(doc->id));
+
+    lazy_free_drain(lazy);
+    TEST_ASSERT_EQUAL_INT(0, count_tombstones());
+    free_hash_entry(doc->hash_id);
+    free_document(doc);
+}
+
+void test_truncate_collection(void) {
+    Collection *collection = create_collection();
+    char *ids[100];
+    for (int i = 0; i < 100; i++) {
+        Document *doc = create_document("{\"n\": 1}");
+        ids[i] = strdup(doc->id);
+        insert_document(collection, doc);
+    }
+
+    TEST_ASSERT_EQUAL_INT(100, truncate_collection(collection));
+    TEST_ASSERT_EQUAL_INT(0, collection->size);
+    TEST_ASSERT_NULL(find_document(collection, ids[0]));
+
+    // the emptied collection is usable at once
+    Document *doc = create_document("{\"n\": 2}");
+    TEST_ASSERT_TRUE(insert_document(collection, doc));
+    TEST_ASSERT_EQUAL_PTR(doc, find_document(collection, doc->id));
+
+    lazy_free_drain(lazy);
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_FALSE(file_exists(ids[i]));
+        free(ids[i]);
+    }
+    TEST_ASSERT_TRUE(file_exists(doc->id));
+
+    drop_collection(collection);
+    lazy_free_drain(lazy);
+    TEST_ASSERT_EQUAL_UINT(2, lazy_free_stats(lazy).completed);
+}
+
+/* TRUNCATE and DROP make the files disappear before returning, a crash can't bring them back */
+void test_truncate_and_drop_remove_the_files_at_once(void) {
+    Collection *collection = create_collection();
+    Document *truncated = create_document("{\"n\": 1}");
+    char *truncated_id = strdup(truncated->id);
+    insert_document(collection, truncated);
+
+    held = true;
+    TEST_ASSERT_TRUE(lazy_free_submit(lazy, hold_job, NULL));
+
+    TEST_ASSERT_EQUAL_INT(1, truncate_collection(collection));
+    TEST_ASSERT_FALSE(file_exists(truncated_id));
+    TEST_ASSERT_NULL(read_document(truncated_id));
+
+    Document *dropped = create_document("{\"n\": 2}");
+    char *dropped_id = strdup(dropped->id);
+    insert_document(collection, dropped);
+    drop_collection(collection);
+    TEST_ASSERT_FALSE(file_exists(dropped_id));
+
+    Collection *recovered = create_collection();
+    TEST_ASSERT_TRUE(recover_collection(recovered, ".", NULL, NULL) >= 0);
+    TEST_ASSERT_NULL(find_document(recovered, truncated_id));
+    TEST_ASSERT_NULL(find_document(recovered, dropped_id));
+    free_collection(recovered);
+
+    __atomic_store_n(&held, false, __ATOMIC_RELEASE);
+    lazy_free_drain(lazy);
+    TEST_ASSERT_EQUAL_INT(0, count_tombstones());
+    free(truncated_id);
+    free(dropped_id);
+}
+
+/* Big collections are freed by the background thread, small ones on the spot */
+void test_free_collection_in_background(void) {
+    Collection *collection = create_collection();
+    char id[32];
+    for (int i = 0; i < LAZY_FREE_THRESHOLD; i++) {
+        sprintf(id, "memory_%d", i);
+        insert_document(collection, load_document(strdup(id), strdup("{}")));
+    }
+
+    free_collection(collection);
+    free_collection(create_collection());
+    lazy_free_drain(lazy);
+    TEST_ASSERT_EQUAL_UINT(1, lazy_free_stats(lazy).submitted);
+}
+
+void test_recovery_removes_tombstones(void) {
+    FILE *file = fopen("crashed.json.7" DOCUMENT_TOMBSTONE_SUFFIX, "w");
+    fputs("{}", file);
+    fclose(file);
+
+    Collection *collection = create_collection();
+    TEST_ASSERT_TRUE(recover_collection(collection, ".", NULL, NULL) >= 0);
+    TEST_ASSERT_NULL(find_document(collection, "crashed"));
+    TEST_ASSERT_EQUAL_INT(0, count_tombstones());
+    free_collection(collection);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_jobs_run_in_order);
+    RUN_TEST(test_delete_writes_a_tombstone);
+    RUN_TEST(test_truncate_collection);
+    RUN_TEST(test_truncate_and_drop_remove_the_files_at_once);
+    RUN_TEST(test_free_collection_in_background);
+    RUN_TEST(test_recovery_removes_tombstones);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
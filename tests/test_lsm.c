@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "unity.h"
+#include "../src/lsm.h"
+#include "../src/db_manager.h"
+#include "../src/eviction.h"
+#include "../src/patch.h"
+
+static char lsm_dir[] = "/tmp/fada_lsm_XXXXXX";
+
+static void clear_dir(void) {
+    DIR *dir = opendir(lsm_dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", lsm_dir, entry->d_name);
+        unlink(path);
+    }
+    if (dir) closedir(dir);
+}
+
+static void assert_value(LSMTree *tree, const char *key, const char *expected) {
+    size_t length = 0;
+    char *value = lsm_get(tree, key, &length);
+    if (expected == NULL) {
+        TEST_ASSERT_NULL(value);
+        return;
+    }
+    TEST_ASSERT_NOT_NULL(value);
+    TEST_ASSERT_EQUAL_STRING(expected, value);
+    TEST_ASSERT_EQUAL_UINT(strlen(expected), length);
+    free(value);
+}
+
+void setUp(void) {
+    clear_dir();
+}
+
+void tearDown(void) {
+    clear_dir();
+}
+
+void test_lsm_put_get_delete_in_memtable(void) {
+    LSMTree *tree = lsm_open(lsm_dir);
+    TEST_ASSERT_NOT_NULL(tree);
+
+    TEST_ASSERT_TRUE(lsm_put(tree, "a", "{\"v\": 1}", 8));
+    TEST_ASSERT_TRUE(lsm_put(tree, "a", "{\"v\": 2}", 8));
+    assert_value(tree, "a", "{\"v\": 2}");
+
+    TEST_ASSERT_TRUE(lsm_delete(tree, "a"));
+    assert_value(tree, "a", NULL);
+    assert_value(tree, "missing", NULL);
+
+    lsm_close(tree);
+}
+
+/* Values are found in the SSTs after a flush, and the Bloom filters skip the others */
+void test_lsm_reads_from_flushed_files(void) {
+    LSMTree *tree = lsm_open(lsm_dir);
+    char key[32], value[64];
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(key, "key_%04d", i);
+        sprintf(value, "{\"n\": %d}", i);
+        lsm_put(tree, key, value, strlen(value));
+    }
+    TEST_ASSERT_TRUE(lsm_flush(tree));
+    TEST_ASSERT_EQUAL_INT(1, lsm_stats(tree).files[0]);
+
+    assert_value(tree, "key_0000", "{\"n\": 0}");
+    assert_value(tree, "key_0999", "{\"n\": 999}");
+    assert_value(tree, "key_0500x", NULL);
+    TEST_ASSERT_TRUE(lsm_stats(tree).bloom_negatives > 0);
+
+    lsm_close(tree);
+}
+
+/* L0 files are merged into L1 once there are enough, newest versions win and deletes are applied */
+void test_lsm_compaction_keeps_newest_versions(void) {
+    LSMTree *tree = lsm_open(lsm_dir);
+    char key[32], value[64];
+
+    for (int round = 0; round < LSM_L0_COMPACTION_TRIGGER; round++) {
+        for (int i = 0; i < 200; i++) {
+            sprintf(key, "key_%04d", i);
+            sprintf(value, "{\"round\": %d}", round);
+            lsm_put(tree, key, value, strlen(value));
+        }
+        if (round == 2) lsm_delete(tree, "key_0007");
+        lsm_flush(tree);
+    }
+
+    // the compaction runs in background, wait for it
+    for (int i = 0; i < 500 && lsm_stats(tree).compactions == 0; i++) usleep(10000);
+
+    LSMStats stats = lsm_stats(tree);
+    TEST_ASSERT_EQUAL_UINT(1, stats.compactions);
+    TEST_ASSERT_EQUAL_INT(0, stats.files[0]);
+    TEST_ASSERT_EQUAL_INT(1, stats.files[1]);
+    TEST_ASSERT_TRUE(stats.write_amplification > 1.0);
+
+    assert_value(tree, "key_0042", "{\"round\": 3}");
+    assert_value(tree, "key_0007", "{\"round\": 3}"); // rewritten after the delete
+
+    lsm_close(tree);
+}
+
+/* Writes only in the write-ahead log survive a reopen */
+void test_lsm_recovers_from_wal(void) {
+    LSMTree *tree = lsm_open(lsm_dir);
+    lsm_put(tree, "flushed", "{}", 2);
+    lsm_flush(tree);
+    lsm_put(tree, "logged", "[1]", 3);
+    lsm_delete(tree, "flushed");
+    lsm_close(tree);
+
+    tree = lsm_open(lsm_dir);
+    TEST_ASSERT_NOT_NULL(tree);
+    assert_value(tree, "logged", "[1]");
+    assert_value(tree, "flushed", NULL);
+    lsm_close(tree);
+}
+
+/* A collection in LSM mode keeps its bodies in the tree, through the same collection API */
+void test_collection_in_lsm_storage(void) {
+    LSMTree *tree = lsm_open(lsm_dir);
+    Collection *collection = create_collection();
+    TEST_ASSERT_TRUE(set_collection_storage(collection, tree));
+
+    Document *doc = add_document(collection, "{\"n\": 1}");
+    TEST_ASSERT_NOT_NULL(doc);
+    char *id = strdup(doc->id);
+    char filename[300];
+    snprintf(filename, sizeof(filename), "%s.json", id);
+    TEST_ASSERT_EQUAL_INT(-1, access(filename, F_OK));
+    assert_value(tree, id, "{\"n\": 1}");
+    TEST_ASSERT_FALSE(set_collection_storage(collection, NULL)); // only while empty
+
+    TEST_ASSERT_TRUE(set_document(collection, id, "{\"n\": 2}"));
+    assert_value(tree, id, "{\"n\": 2}");
+    TEST_ASSERT_FALSE(set_document(collection, "missing", "{}"));
+
+    // an evicted body comes back from the tree
+    TEST_ASSERT_TRUE(evict_document(collection, doc));
+    char *content = get_document(collection, id);
+    TEST_ASSERT_EQUAL_STRING("{\"n\": 2}", content);
+    free(content);
+
+    long long value = 0;
+    TEST_ASSERT_TRUE(incr_document_field(collection, id, "n", 5, &value));
+    TEST_ASSERT_EQUAL_INT64(7, value);
+    TEST_ASSERT_TRUE(set_document_field(collection, id, "s", "\"x\""));
+    assert_value(tree, id, "{\"n\": 7, \"s\": \"x\"}");
+    snprintf(filename, sizeof(filename), "%s" PATCH_LOG_SUFFIX, id);
+    TEST_ASSERT_EQUAL_INT(-1, access(filename, F_OK));
+
+    TEST_ASSERT_TRUE(remove_document(collection, id));
+    TEST_ASSERT_NULL(find_document(collection, id));
+    assert_value(tree, id, NULL);
+
+    free(id);
+    free_collection(collection);
+    lsm_close(tree);
+}
+
+int main(void){
+    if (!mkdtemp(lsm_dir)) return 1;
+
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_lsm_put_get_delete_in_memtable);
+    RUN_TEST(test_lsm_reads_from_flushed_files);
+    RUN_TEST(test_lsm_compaction_keeps_newest_versions);
+    RUN_TEST(test_lsm_recovers_from_wal);
+    RUN_TEST(test_collection_in_lsm_storage);
+    printf("Tests completed...\n");
+
+    rmdir(lsm_dir);
+    return UNITY_END();
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "../src/net_buffer.h"
+
+static NetBufferPool *pool;
+
+void setUp(void) {
+    pool = create_net_buffer_pool(0);
+}
+
+void tearDown(void) {
+    free_net_buffer_pool(pool);
+}
+
+/* Sizes are rounded up to their class, released blocks are reused */
+void test_size_classes(void) {
+    size_t capacity;
+    char *block = net_buffer_pool_get(pool, 1, &capacity);
+    TEST_ASSERT_NOT_NULL(block);
+    TEST_ASSERT_EQUAL_UINT(1 << NET_BUFFER_MIN_SHIFT, capacity);
+
+    char *bigger = net_buffer_pool_get(pool, 3000, &capacity);
+    TEST_ASSERT_EQUAL_UINT(4096, capacity);
+    TEST_ASSERT_EQUAL_UINT(1024 + 4096, net_buffer_pool_stats(pool).in_use);
+
+    net_buffer_pool_put(pool, bigger, 4096);
+    TEST_ASSERT_EQUAL_PTR(bigger, net_buffer_pool_get(pool, 2049, &capacity));
+    net_buffer_pool_put(pool, bigger, capacity);
+    net_buffer_pool_put(pool, block, 1024);
+
+    NetBufferPoolStats stats = net_buffer_pool_stats(pool);
+    TEST_ASSERT_EQUAL_UINT(1, stats.hits);
+    TEST_ASSERT_EQUAL_UINT(2, stats.misses);
+    TEST_ASSERT_EQUAL_UINT(0, stats.in_use);
+    TEST_ASSERT_EQUAL_UINT(1024 + 4096, stats.pooled);
+}
+
+/* Blocks beyond the biggest class, and beyond the limit of a class, go back to malloc */
+void test_limits(void) {
+    free_net_buffer_pool(pool);
+    pool = create_net_buffer_pool(2048);
+
+    size_t capacity;
+    char *huge = net_buffer_pool_get(pool, 3 << 20, &capacity);
+    TEST_ASSERT_EQUAL_UINT(3 << 20, capacity);
+    net_buffer_pool_put(pool, huge, capacity);
+    TEST_ASSERT_EQUAL_UINT(1, net_buffer_pool_stats(pool).oversized);
+    TEST_ASSERT_EQUAL_UINT(0, net_buffer_pool_stats(pool).pooled);
+
+    char *blocks[3];
+    for (int i = 0; i < 3; i++) blocks[i] = net_buffer_pool_get(pool, 1024, &capacity);
+    for (int i = 0; i < 3; i++) net_buffer_pool_put(pool, blocks[i], capacity);
+    TEST_ASSERT_EQUAL_UINT(2048, net_buffer_pool_stats(pool).pooled);
+}
+
+/* A buffer grows through the classes and keeps its bytes */
+void test_buffer_grows(void) {
+    NetBuffer buffer = {0};
+    char expected[10000];
+
+    for (int i = 0; i < 10000; i++) {
+        expected[i] = 'a' + i % 26;
+        TEST_ASSERT_TRUE(net_buffer_reserve(pool, &buffer, 1));
+        buffer.data[buffer.end++] = expected[i];
+    }
+    TEST_ASSERT_EQUAL_UINT(10000, net_buffer_length(&buffer));
+    TEST_ASSERT_EQUAL_UINT(16384, buffer.capacity);
+    TEST_ASSERT_EQUAL_MEMORY(expected, buffer.data, 10000);
+
+    // the smaller blocks it went through are on the free lists
+    TEST_ASSERT_EQUAL_UINT(1024 + 2048 + 4096 + 8192, net_buffer_pool_stats(pool).pooled);
+
+    net_buffer_release(pool, &buffer);
+    TEST_ASSERT_NULL(buffer.data);
+    TEST_ASSERT_EQUAL_UINT(0, net_buffer_pool_stats(pool).in_use);
+}
+
+/* Consumed bytes make room at the front, used before growing */
+void test_buffer_compacts(void) {
+    NetBuffer buffer = {0};
+    TEST_ASSERT_TRUE(net_buffer_reserve(pool, &buffer, 1000));
+    char *data = buffer.data;
+    memset(buffer.data, 'x', 1000);
+    memcpy(buffer.data + 990, "0123456789", 10);
+    buffer.end = 1000;
+
+    net_buffer_consume(&buffer, 990);
+    TEST_ASSERT_EQUAL_UINT(10, net_buffer_length(&buffer));
+    TEST_ASSERT_TRUE(net_buffer_reserve(pool, &buffer, 500));
+    TEST_ASSERT_EQUAL_PTR(data, buffer.data);
+    TEST_ASSERT_EQUAL_UINT(0, buffer.start);
+    TEST_ASSERT_EQUAL_MEMORY("0123456789", buffer.data, 10);
+
+    // consuming everything rewinds the buffer
+    net_buffer_consume(&buffer, 10);
+    TEST_ASSERT_EQUAL_UINT(0, buffer.start);
+    TEST_ASSERT_EQUAL_UINT(0, buffer.end);
+    net_buffer_release(pool, &buffer);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_size_classes);
+    RUN_TEST(test_limits);
+    RUN_TEST(test_buffer_grows);
+    RUN_TEST(test_buffer_compacts);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "unity.h"
+#include "../src/net_ring.h"
+
+#define MAX_COMPLETIONS 64
+
+static NetRing *ring;
+static int listener;
+static struct sockaddr_in address;
+static NetCompletion completions[MAX_COMPLETIONS];
+static int completed;
+
+static void collect(const NetCompletion *completion, void *arg) {
+    (void)arg;
+    if (completed < MAX_COMPLETIONS) completions[completed++] = *completion;
+}
+
+// waits until `count` completions were collected, or a second went by
+static void wait_for(int count) {
+    for (int i = 0; i < 100 && completed < count; i++) {
+        net_ring_wait(ring, 10);
+        net_ring_reap(ring, collect, NULL);
+    }
+}
+
+// a connection to the listener, and its other end accepted through the ring
+static int connect_pair(int *accepted) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL_INT(0, connect(fd, (struct sockaddr *)&address, sizeof(address)));
+
+    completed = 0;
+    TEST_ASSERT_TRUE(net_ring_accept(ring, listener, 1));
+    wait_for(1);
+    TEST_ASSERT_EQUAL_INT(1, completed);
+    TEST_ASSERT_EQUAL_UINT64(1, completions[0].user_data);
+    TEST_ASSERT_TRUE(completions[0].result >= 0);
+    TEST_ASSERT_TRUE(completions[0].more);
+    *accepted = completions[0].result;
+    return fd;
+}
+
+void setUp(void) {
+    ring = create_net_ring(64, 4, 64);
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(listener, (struct sockaddr *)&address, sizeof(address));
+    getsockname(listener, (struct sockaddr *)&address, &length);
+    listen(listener, 16);
+    completed = 0;
+}
+
+void tearDown(void) {
+    free_net_ring(ring);
+    close(listener);
+}
+
+/* Data sent by the peer arrives in a provided buffer, and a reply goes out with sendmsg */
+void test_recv_and_send(void) {
+    TEST_ASSERT_NOT_NULL(ring);
+    int accepted, fd = connect_pair(&accepted);
+
+    completed = 0;
+    TEST_ASSERT_TRUE(net_ring_recv(ring, accepted, 2));
+    TEST_ASSERT_EQUAL_INT(5, write(fd, "hello", 5));
+    wait_for(1);
+    TEST_ASSERT_EQUAL_INT(1, completed);
+    TEST_ASSERT_EQUAL_INT(5, completions[0].result);
+    TEST_ASSERT_TRUE(completions[0].more);
+    TEST_ASSERT_NOT_EQUAL(NET_RING_NO_BUFFER, completions[0].buffer);
+    TEST_ASSERT_EQUAL_MEMORY("hello", net_ring_buffer(ring, completions[0].buffer), 5);
+    net_ring_recycle(ring, completions[0].buffer);
+
+    // two pieces gathered in one message
+    struct iovec iov[2] = {{"wor", 3}, {"ld", 2}};
+    struct msghdr message = {.msg_iov = iov, .msg_iovlen = 2};
+    completed = 0;
+    TEST_ASSERT_TRUE(net_ring_sendmsg(ring, accepted, &message, 3));
+    wait_for(1);
+    TEST_ASSERT_EQUAL_INT(1, completed);
+    TEST_ASSERT_EQUAL_UINT64(3, completions[0].user_data);
+    TEST_ASSERT_EQUAL_INT(5, completions[0].result);
+
+    char reply[8] = {0};
+    TEST_ASSERT_EQUAL_INT(5, read(fd, reply, sizeof(reply)));
+    TEST_ASSERT_EQUAL_STRING("world", reply);
+
+    // the peer closing ends the multishot recv
+    close(fd);
+    completed = 0;
+    wait_for(1);
+    TEST_ASSERT_EQUAL_INT(0, completions[0].result);
+    TEST_ASSERT_FALSE(completions[0].more);
+    close(accepted);
+}
+
+/* A recv stops when no buffer is left, and works again once they are recycled */
+void test_buffers_run_out(void) {
+    int accepted, fd = connect_pair(&accepted);
+    char data[1000];
+    memset(data, 'x', sizeof(data));
+    TEST_ASSERT_EQUAL_INT(sizeof(data), write(fd, data, sizeof(data)));
+
+    // 4 buffers of 64 bytes, none given back
+    completed = 0;
+    TEST_ASSERT_TRUE(net_ring_recv(ring, accepted, 2));
+    wait_for(5);
+    TEST_ASSERT_EQUAL_INT(5, completed);
+    for (int i = 0; i < 4; i++) TEST_ASSERT_EQUAL_INT(64, completions[i].result);
+    TEST_ASSERT_EQUAL_INT(-ENOBUFS, completions[4].result);
+    TEST_ASSERT_FALSE(completions[4].more);
+
+    for (int i = 0; i < 4; i++) net_ring_recycle(ring, completions[i].buffer);
+    completed = 0;
+    TEST_ASSERT_TRUE(net_ring_recv(ring, accepted, 2));
+    wait_for(5);
+    TEST_ASSERT_EQUAL_INT(5, completed);
+    TEST_ASSERT_EQUAL_INT(64, completions[3].result);
+    TEST_ASSERT_EQUAL_INT(-ENOBUFS, completions[4].result);
+    close(fd);
+    close(accepted);
+}
+
+/* A cancelled recv completes one last time, without IORING_CQE_F_MORE */
+void test_cancel(void) {
+    int accepted, fd = connect_pair(&accepted);
+
+    completed = 0;
+    TEST_ASSERT_TRUE(net_ring_recv(ring, accepted, 2));
+    TEST_ASSERT_TRUE(net_ring_cancel(ring, 2));
+    wait_for(2);
+    TEST_ASSERT_EQUAL_INT(2, completed);
+
+    // the cancellation itself and the request it cancelled, in either order
+    int cancelled = completions[0].user_data == 2 ? 0 : 1;
+    TEST_ASSERT_EQUAL_UINT64(2, completions[cancelled].user_data);
+    TEST_ASSERT_EQUAL_INT(-ECANCELED, completions[cancelled].result);
+    TEST_ASSERT_FALSE(completions[cancelled].more);
+    TEST_ASSERT_EQUAL_UINT64(0, completions[1 - cancelled].user_data);
+    close(fd);
+    close(accepted);
+}
+
+/* Waiting with nothing in flight returns after the timeout, with one enter */
+void test_wait_timeout(void) {
+    NetRingStats before = net_ring_stats(ring);
+    TEST_ASSERT_EQUAL_INT(0, net_ring_wait(ring, 5));
+    NetRingStats after = net_ring_stats(ring);
+    TEST_ASSERT_EQUAL_UINT(before.enters + 1, after.enters);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_recv_and_send);
+    RUN_TEST(test_buffers_run_out);
+    RUN_TEST(test_cancel);
+    RUN_TEST(test_wait_timeout);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
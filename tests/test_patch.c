@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/patch.h"
+#include "../src/recovery.h"
+
+static Collection *collection;
+static Document *doc;
+
+// big enough for deltas to be worth logging instead of rewriting the document
+#define PAD "{\"pad\": \"%0256d\", "
+static char expected_text[1024];
+
+static const char *padded(const char *members) {
+    snprintf(expected_text, sizeof(expected_text), PAD "%s", 0, members);
+    return expected_text;
+}
+
+// applies an operation to a copy of `document` and checks the resulting text
+static void assert_patch(const char *document, PatchOp op, const char *path, const char *value,
+                         const char *expected) {
+    char *content = strdup(document);
+    size_t length = strlen(content);
+
+    TEST_ASSERT_TRUE(apply_patch(&content, &length, op, path, value, value ? strlen(value) : 0));
+    TEST_ASSERT_EQUAL_STRING(expected, content);
+    TEST_ASSERT_EQUAL_UINT(strlen(expected), length);
+    free(content);
+}
+
+static void assert_document(const char *expected) {
+    char *content = read_document(doc->id);
+    TEST_ASSERT_EQUAL_STRING(expected, content);
+    TEST_ASSERT_EQUAL_STRING(expected, doc->content);
+    free(content);
+}
+
+void setUp(void) {
+    collection = create_collection();
+    doc = create_document(padded("\"name\": \"fada\", \"stats\": {\"views\": 1}}"));
+    insert_document(collection, doc);
+}
+
+void tearDown(void) {
+    delete_document(doc->id);
+    free_collection(collection);
+}
+
+/* The examples of RFC 7386 */
+void test_merge_patch(void) {
+    assert_patch("{\"a\": \"b\"}", PATCH_MERGE, NULL, "{\"a\": \"c\"}", "{\"a\": \"c\"}");
+    assert_patch("{\"a\": \"b\"}", PATCH_MERGE, NULL, "{\"b\": \"c\"}", "{\"a\": \"b\", \"b\": \"c\"}");
+    assert_patch("{\"a\": \"b\"}", PATCH_MERGE, NULL, "{\"a\": null}", "{}");
+    assert_patch("{\"a\": \"b\", \"b\": \"c\"}", PATCH_MERGE, NULL, "{\"a\": null}", "{\"b\": \"c\"}");
+    assert_patch("{\"a\": [\"b\"]}", PATCH_MERGE, NULL, "{\"a\": \"c\"}", "{\"a\": \"c\"}");
+    assert_patch("{\"a\": {\"b\": \"c\"}}", PATCH_MERGE, NULL, "{\"a\": {\"b\": \"d\", \"c\": null}}",
+                 "{\"a\": {\"b\": \"d\"}}");
+    assert_patch("{\"a\": [{\"b\": \"c\"}]}", PATCH_MERGE, NULL, "{\"a\": [1]}", "{\"a\": [1]}");
+    assert_patch("{\"e\": null}", PATCH_MERGE, NULL, "{\"a\": 1}", "{\"e\": null, \"a\": 1}");
+    assert_patch("[1, 2]", PATCH_MERGE, NULL, "{\"a\": \"b\", \"c\": null}", "{\"a\": \"b\"}");
+    assert_patch("{}", PATCH_MERGE, NULL, "{\"a\": {\"bb\": {\"ccc\": null}}}", "{\"a\": {\"bb\": {}}}");
+}
+
+void test_set_unset_increment(void) {
+    assert_patch("{\"a\": 1}", PATCH_SET, "a", "\"x\"", "{\"a\": \"x\"}");
+    assert_patch("{\"a\": 1}", PATCH_SET, "b.c", "[]", "{\"a\": 1, \"b\": {\"c\": []}}");
+    assert_patch("{\"a\": 1}", PATCH_SET, "a.c", "true", "{\"a\": {\"c\": true}}");
+
+    assert_patch("{\"a\": 1, \"b\": 2, \"c\": 3}", PATCH_UNSET, "b", NULL, "{\"a\": 1, \"c\": 3}");
+    assert_patch("{\"a\": 1, \"b\": 2}", PATCH_UNSET, "b", NULL, "{\"a\": 1}");
+    assert_patch("{\"a\": {\"b\": \"x\"}}", PATCH_UNSET, "a.b", NULL, "{\"a\": {}}");
+    assert_patch("{\"a\": 1}", PATCH_UNSET, "missing.path", NULL, "{\"a\": 1}");
+
+    assert_patch("{\"n\": 9}", PATCH_INCREMENT, "n", "1", "{\"n\": 10}");
+    assert_patch("{\"n\": -3}", PATCH_INCREMENT, "n", "5", "{\"n\": 2}");
+    assert_patch("{\"n\": 1.5}", PATCH_INCREMENT, "n", "1", "{\"n\": 2.5}");
+    assert_patch("{}", PATCH_INCREMENT, "a.n", "7", "{\"a\": {\"n\": 7}}");
+
+    char *content = strdup("{\"s\": \"text\", \"n\": 9223372036854775807}");
+    size_t length = strlen(content);
+    TEST_ASSERT_FALSE(apply_patch(&content, &length, PATCH_INCREMENT, "s", "1", 1));
+    TEST_ASSERT_FALSE(apply_patch(&content, &length, PATCH_INCREMENT, "n", "1", 1));
+    TEST_ASSERT_FALSE(apply_patch(&content, &length, PATCH_SET, "a..b", "1", 1));
+    free(content);
+}
+
+/* Patches change the document in memory and only append a delta to its log */
+void test_patch_logs_deltas(void) {
+    TEST_ASSERT_TRUE(increment_document_field(collection, doc->id, "stats.views", 2));
+    TEST_ASSERT_TRUE(set_document_field(collection, doc->id, "tags", "[\"db\"]"));
+    TEST_ASSERT_TRUE(patch_document(collection, doc->id, "{\"name\": null, \"stats\": {\"likes\": 0}}"));
+    TEST_ASSERT_EQUAL_UINT(3, doc->deltas);
+    TEST_ASSERT_TRUE(has_document_log(doc->id));
+
+    // read_document() replays the log over the image on disk
+    assert_document(padded("\"stats\": {\"views\": 3, \"likes\": 0}, \"tags\": [\"db\"]}"));
+
+    // invalid results are refused, the document stays as it was
+    TEST_ASSERT_FALSE(set_document_field(collection, doc->id, "tags", "[oops"));
+    TEST_ASSERT_FALSE(increment_document_field(collection, doc->id, "tags", 1));
+    TEST_ASSERT_EQUAL_UINT(3, doc->deltas);
+}
+
+void test_consolidation_drops_the_log(void) {
+    for (int i = 0; i < PATCH_MAX_DELTAS; i++) {
+        TEST_ASSERT_TRUE(increment_document_field(collection, doc->id, "stats.views", 1));
+    }
+
+    // the log was rewritten into the image at least once on the way
+    TEST_ASSERT_TRUE(doc->deltas < PATCH_MAX_DELTAS);
+    assert_document(padded("\"name\": \"fada\", \"stats\": {\"views\": 65}}"));
+
+    TEST_ASSERT_TRUE(consolidate_document(collection, doc->id));
+    TEST_ASSERT_EQUAL_UINT(0, doc->deltas);
+    TEST_ASSERT_FALSE(has_document_log(doc->id));
+    assert_document(padded("\"name\": \"fada\", \"stats\": {\"views\": 65}}"));
+}
+
+/* Small counters log their deltas too, a consolidation keeps the body and starts a new log */
+void test_small_counter_keeps_logging(void) {
+    Document *small = create_document("{\"n\": 0}");
+    insert_document(collection, small);
+
+    long long value = 0;
+    TEST_ASSERT_TRUE(incr_document_field(collection, small->id, "n", 1, &value));
+    TEST_ASSERT_TRUE(incr_document_field(collection, small->id, "n", 1, &value));
+    TEST_ASSERT_EQUAL_UINT(2, small->deltas);
+
+    for (int i = 2; i < PATCH_MAX_DELTAS; i++) incr_document_field(collection, small->id, "n", 1, &value);
+    TEST_ASSERT_EQUAL_UINT(0, small->deltas);
+    TEST_ASSERT_TRUE(small->log_open);
+    TEST_ASSERT_FALSE(has_document_log(small->id)); // just the header of the new image
+
+    TEST_ASSERT_TRUE(incr_document_field(collection, small->id, "n", 1, &value));
+    TEST_ASSERT_EQUAL_INT64(PATCH_MAX_DELTAS + 1, value);
+    TEST_ASSERT_EQUAL_UINT(1, small->deltas);
+    char *content = read_document(small->id);
+    TEST_ASSERT_EQUAL_STRING("{\"n\": 65}", content);
+    free(content);
+
+    // a full rewrite after the consolidation is still seen
+    update_document(small->id, "{\"n\": 100}");
+    TEST_ASSERT_TRUE(incr_document_field(collection, small->id, "n", 1, &value));
+    TEST_ASSERT_EQUAL_INT64(101, value);
+    delete_document(small->id);
+}
+
+/* A full rewrite makes the log of the previous image irrelevant */
+void test_update_discards_the_log(void) {
+    TEST_ASSERT_TRUE(unset_document_field(collection, doc->id, "name"));
+    TEST_ASSERT_TRUE(has_document_log(doc->id));
+
+    update_document(doc->id, "{\"fresh\": true}");
+    TEST_ASSERT_FALSE(has_document_log(doc->id));
+
+    char *content = read_document(doc->id);
+    TEST_ASSERT_EQUAL_STRING("{\"fresh\": true}", content);
+    free(content);
+}
+
+/* Operations after a full rewrite apply to the new image, not to the body in memory */
+void test_patch_after_update_sees_the_new_image(void) {
+    TEST_ASSERT_TRUE(increment_document_field(collection, doc->id, "stats.views", 1));
+    update_document(doc->id, "{\"fresh\": true, \"stats\": {\"views\": 10}}");
+
+    long long value = 0;
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "stats.views", 1, &value));
+    TEST_ASSERT_EQUAL_INT64(11, value);
+    TEST_ASSERT_TRUE(set_document_field(collection, doc->id, "name", "\"fada\""));
+    assert_document("{\"fresh\": true, \"stats\": {\"views\": 11}, \"name\": \"fada\"}");
+}
+
+void test_recovery_replays_the_log(void) {
+    TEST_ASSERT_TRUE(increment_document_field(collection, doc->id, "stats.views", 41));
+
+    Collection *recovered = create_collection();
+    TEST_ASSERT_TRUE(recover_collection(recovered, ".", NULL, NULL) >= 1);
+
+    Document *copy = find_document(recovered, doc->id);
+    TEST_ASSERT_NOT_NULL(copy);
+    TEST_ASSERT_EQUAL_STRING(padded("\"name\": \"fada\", \"stats\": {\"views\": 42}}"), copy->content);
+    free_collection(recovered);
+}
+
+/* INCR rewrites the digits in place, the body only moves when their count changes */
+void test_incr_in_place(void) {
+    long long value = 0;
+    char *content = doc->content;
+
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "stats.views", 7, &value));
+    TEST_ASSERT_EQUAL_INT64(8, value);
+    TEST_ASSERT_EQUAL_PTR(content, doc->content);
+
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "stats.views", 2, &value));
+    TEST_ASSERT_EQUAL_INT64(10, value);
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "stats.likes", -1, &value));
+    TEST_ASSERT_EQUAL_INT64(-1, value);
+    assert_document(padded("\"name\": \"fada\", \"stats\": {\"views\": 10, \"likes\": -1}}"));
+
+    // the scan skips escaped quotes and nested values before the counter
+    TEST_ASSERT_TRUE(set_document_field(collection, doc->id, "note", "{\"q\": \"a \\\"}\\\\\", \"n\": [1]}"));
+    TEST_ASSERT_TRUE(set_document_field(collection, doc->id, "hits", "41"));
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "hits", 1, &value));
+    TEST_ASSERT_EQUAL_INT64(42, value);
+
+    TEST_ASSERT_FALSE(incr_document_field(collection, doc->id, "name", 1, &value));
+    TEST_ASSERT_FALSE(incr_document_field(collection, "missing", "stats.views", 1, &value));
+}
+
+static void *incr_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 500; i++) incr_document_field(collection, doc->id, "stats.views", 1, NULL);
+    return NULL;
+}
+
+/* Concurrent increments are serialized, none of them is lost */
+void test_incr_is_atomic(void) {
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) pthread_create(&threads[i], NULL, incr_worker, NULL);
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+
+    long long value = 0;
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "stats.views", 0, &value));
+    TEST_ASSERT_EQUAL_INT64(2001, value);
+    assert_document(padded("\"name\": \"fada\", \"stats\": {\"views\": 2001}}"));
+}
+
+typedef struct {
+    int calls;
+    bool done;
+    long long value;
+} IncrResult;
+
+static void incr_callback(bool done, long long value, void *arg) {
+    IncrResult *result = arg;
+    result->calls++;
+    result->done = done;
+    result->value = value;
+}
+
+/* The asynchronous INCR updates the body at once and completes once its delta is logged */
+void test_incr_through_engine(void) {
+    IOEngine *engine = io_engine_create(NULL);
+    TEST_ASSERT_NOT_NULL(engine);
+    IncrResult result = {0};
+
+    // no log open yet: the synchronous path starts it
+    TEST_ASSERT_FALSE(incr_document_field_async(engine, collection, doc->id, "stats.views", 1, incr_callback, &result));
+    long long value = 0;
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "stats.views", 1, &value));
+
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(incr_document_field_async(engine, collection, doc->id, "stats.views", 10, incr_callback, &result));
+    }
+    TEST_ASSERT_EQUAL_UINT(3, doc->appending);
+    TEST_ASSERT_EQUAL_INT(0, result.calls);
+    while (io_engine_pending(engine) > 0) io_engine_poll(engine, 1);
+
+    TEST_ASSERT_EQUAL_INT(3, result.calls);
+    TEST_ASSERT_TRUE(result.done);
+    TEST_ASSERT_EQUAL_UINT(0, doc->appending);
+    assert_document(padded("\"name\": \"fada\", \"stats\": {\"views\": 32}}"));
+
+    // a counter to create, or a value that isn't one, goes through incr_document_field()
+    TEST_ASSERT_FALSE(incr_document_field_async(engine, collection, doc->id, "stats.likes", 1, incr_callback, &result));
+    TEST_ASSERT_FALSE(incr_document_field_async(engine, collection, doc->id, "name", 1, incr_callback, &result));
+    TEST_ASSERT_FALSE(incr_document_field_async(engine, collection, "missing", "stats.views", 1, incr_callback, &result));
+    io_engine_destroy(engine);
+}
+
+/* A consolidation while appends are in flight doesn't apply them twice, nor lose them */
+void test_incr_in_flight_across_consolidation(void) {
+    IOEngine *engine = io_engine_create(NULL);
+    TEST_ASSERT_NOT_NULL(engine);
+    IncrResult result = {0};
+    long long value = 0;
+    TEST_ASSERT_TRUE(incr_document_field(collection, doc->id, "stats.views", 1, &value));
+
+    // enough appends to consolidate before any of them is written
+    for (int i = 0; i < PATCH_MAX_DELTAS; i++) {
+        TEST_ASSERT_TRUE(incr_document_field_async(engine, collection, doc->id, "stats.views", 1, incr_callback, &result));
+    }
+    TEST_ASSERT_TRUE(doc->deltas < PATCH_MAX_DELTAS);
+
+    // anything but an increment waits for them in a new image
+    TEST_ASSERT_TRUE(set_document_field(collection, doc->id, "stats.views", "0"));
+    while (io_engine_pending(engine) > 0) io_engine_poll(engine, 1);
+    TEST_ASSERT_EQUAL_INT(PATCH_MAX_DELTAS, result.calls);
+    assert_document(padded("\"name\": \"fada\", \"stats\": {\"views\": 0}}"));
+    io_engine_destroy(engine);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_merge_patch);
+    RUN_TEST(test_set_unset_increment);
+    RUN_TEST(test_patch_logs_deltas);
+    RUN_TEST(test_consolidation_drops_the_log);
+    RUN_TEST(test_small_counter_keeps_logging);
+    RUN_TEST(test_update_discards_the_log);
+    RUN_TEST(test_patch_after_update_sees_the_new_image);
+    RUN_TEST(test_recovery_replays_the_log);
+    RUN_TEST(test_incr_in_place);
+    RUN_TEST(test_incr_is_atomic);
+    RUN_TEST(test_incr_through_engine);
+    RUN_TEST(test_incr_in_flight_across_consolidation);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
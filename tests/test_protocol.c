@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "../src/protocol.h"
+
+static char frame[1024];
+
+void setUp(void) {
+    memset(frame, 0xAB, sizeof(frame));
+}
+
+void tearDown(void) {
+}
+
+/* Key and body are handed out in place, as C strings */
+void test_request_round_trip(void) {
+    size_t size = encode_request(frame, sizeof(frame), OP_INCR, 42, "doc1", 4, "stats.views", 11, -7);
+    TEST_ASSERT_EQUAL_UINT(request_frame_size(4, 11), size);
+    TEST_ASSERT_EQUAL_UINT8(PROTOCOL_MAGIC, (uint8_t)frame[0]);
+
+    ProtocolRequest request;
+    TEST_ASSERT_EQUAL_INT((int)size, parse_request(frame, size, &request));
+    TEST_ASSERT_EQUAL_UINT8(OP_INCR, request.opcode);
+    TEST_ASSERT_EQUAL_UINT32(42, request.id);
+    TEST_ASSERT_EQUAL_INT64(-7, request.argument);
+    TEST_ASSERT_EQUAL_PTR(frame + PROTOCOL_HEADER_SIZE, request.key);
+    TEST_ASSERT_EQUAL_STRING("doc1", request.key);
+    TEST_ASSERT_EQUAL_UINT32(4, request.key_length);
+    TEST_ASSERT_EQUAL_STRING("stats.views", request.body);
+    TEST_ASSERT_EQUAL_UINT32(11, request.body_length);
+
+    // empty key and body are still terminated
+    size = encode_request(frame, sizeof(frame), OP_PING, 1, NULL, 0, NULL, 0, 0);
+    TEST_ASSERT_EQUAL_UINT(PROTOCOL_HEADER_SIZE + 2, size);
+    TEST_ASSERT_EQUAL_INT((int)size, parse_request(frame, size, &request));
+    TEST_ASSERT_EQUAL_STRING("", request.key);
+    TEST_ASSERT_EQUAL_STRING("", request.body);
+
+    // too small a buffer or too long a key
+    TEST_ASSERT_EQUAL_UINT(0, encode_request(frame, 29, OP_GET, 1, "doc1", 4, NULL, 0, 0));
+    TEST_ASSERT_EQUAL_UINT(0, encode_request(frame, sizeof(frame), OP_GET, 1, frame, PROTOCOL_MAX_KEY + 1, NULL, 0, 0));
+}
+
+/* Every prefix of a frame is incomplete, not invalid */
+void test_partial_frames(void) {
+    size_t size = encode_request(frame, sizeof(frame), OP_GET, 7, "document", 8, NULL, 0, 0);
+    ProtocolRequest request;
+
+    for (size_t length = 0; length < size; length++) {
+        TEST_ASSERT_EQUAL_INT(0, parse_request(frame, length, &request));
+    }
+    TEST_ASSERT_EQUAL_INT((int)size, parse_request(frame, size, &request));
+}
+
+/* Frames follow each other in the buffer, each parse starts where the previous one ended */
+void test_consecutive_frames(void) {
+    size_t first = encode_request(frame, sizeof(frame), OP_GET, 1, "a", 1, NULL, 0, 0);
+    size_t second = encode_request(frame + first, sizeof(frame) - first, OP_DEL, 2, "bb", 2, NULL, 0, 0);
+
+    ProtocolRequest request;
+    TEST_ASSERT_EQUAL_INT((int)first, parse_request(frame, first + second, &request));
+    TEST_ASSERT_EQUAL_STRING("a", request.key);
+    TEST_ASSERT_EQUAL_INT((int)second, parse_request(frame + first, second, &request));
+    TEST_ASSERT_EQUAL_UINT8(OP_DEL, request.opcode);
+    TEST_ASSERT_EQUAL_STRING("bb", request.key);
+}
+
+void test_malformed_frames(void) {
+    ProtocolRequest request;
+    size_t size = encode_request(frame, sizeof(frame), OP_GET, 1, "doc1", 4, NULL, 0, 0);
+
+    // text where a frame should start
+    TEST_ASSERT_EQUAL_INT(-1, parse_request("GET doc1\n", 9, &request));
+
+    // missing terminator
+    frame[PROTOCOL_HEADER_SIZE + 4] = 'x';
+    TEST_ASSERT_EQUAL_INT(-1, parse_request(frame, size, &request));
+
+    // a key longer than allowed is refused before waiting for it
+    encode_request(frame, sizeof(frame), OP_GET, 1, "doc1", 4, NULL, 0, 0);
+    frame[8] = 0x7F;
+    TEST_ASSERT_EQUAL_INT(-1, parse_request(frame, PROTOCOL_HEADER_SIZE, &request));
+
+    // so is a body longer than a field path, a client can't make us buffer megabytes
+    encode_request(frame, sizeof(frame), OP_INCR, 1, "doc1", 4, "views", 5, 1);
+    frame[14] = (char)((PROTOCOL_MAX_FIELD + 1) >> 8);
+    frame[15] = (char)(PROTOCOL_MAX_FIELD + 1);
+    TEST_ASSERT_EQUAL_INT(-1, parse_request(frame, PROTOCOL_HEADER_SIZE, &request));
+    TEST_ASSERT_EQUAL_UINT(0, encode_request(frame, sizeof(frame), OP_INCR, 1, "doc1", 4, frame, PROTOCOL_MAX_FIELD + 1, 1));
+}
+
+void test_response_round_trip(void) {
+    encode_response_header(frame, STATUS_OK, 99, 5, -2);
+    memcpy(frame + PROTOCOL_HEADER_SIZE, "{...}", 5);
+
+    ProtocolResponse response;
+    TEST_ASSERT_EQUAL_INT(0, parse_response(frame, PROTOCOL_HEADER_SIZE + 4, &response));
+    TEST_ASSERT_EQUAL_INT(PROTOCOL_HEADER_SIZE + 5, parse_response(frame, PROTOCOL_HEADER_SIZE + 5, &response));
+    TEST_ASSERT_EQUAL_UINT8(STATUS_OK, response.status);
+    TEST_ASSERT_EQUAL_UINT32(99, response.id);
+    TEST_ASSERT_EQUAL_INT64(-2, response.value);
+    TEST_ASSERT_EQUAL_UINT32(5, response.body_length);
+    TEST_ASSERT_EQUAL_MEMORY("{...}", response.body, 5);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_request_round_trip);
+    RUN_TEST(test_partial_frames);
+    RUN_TEST(test_consecutive_frames);
+    RUN_TEST(test_malformed_frames);
+    RUN_TEST(test_response_round_trip);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
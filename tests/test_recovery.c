@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "unity.h"
+#include "../src/recovery.h"
+
+static char data_dir[] = "/tmp/fada_recovery_XXXXXX";
+
+static void write_file(const char *name, const char *content) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", data_dir, name);
+    FILE *file = fopen(path, "w");
+    fprintf(file, "%s", content);
+    fclose(file);
+}
+
+static void remove_file(const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", data_dir, name);
+    remove(path);
+}
+
+static int progress_calls = 0;
+
+static void count_progress(const RecoveryStats *stats, void *arg) {
+    (void)stats;
+    (void)arg;
+    progress_calls++;
+}
+
+void setUp(void) {
+    write_file("a.json", "{\"name\": \"a\"}");
+    write_file("b.json", "[1, 2, 3]");
+    write_file("broken.json", "{\"name\": ");
+    write_file("notes.txt", "not a document");
+}
+
+void tearDown(void) {
+    remove_file("a.json");
+    remove_file("b.json");
+    remove_file("broken.json");
+    remove_file("notes.txt");
+}
+
+/* Only valid <id>.json files are loaded, the rest is counted as invalid or ignored */
+void test_recover_collection_loads_valid_documents(void) {
+    Collection *collection = create_collection();
+    RecoveryStats stats;
+
+    int loaded = recover_collection(collection, data_dir, NULL, &stats);
+
+    TEST_ASSERT_EQUAL_INT(2, loaded);
+    TEST_ASSERT_EQUAL_INT(2, collection->size);
+    TEST_ASSERT_EQUAL_UINT(3, stats.files_found);
+    TEST_ASSERT_EQUAL_UINT(1, stats.files_invalid);
+    TEST_ASSERT_EQUAL_STRING("{\"name\": \"a\"}", find_document(collection, "a")->content);
+    TEST_ASSERT_EQUAL_STRING("[1, 2, 3]", find_document(collection, "b")->content);
+    TEST_ASSERT_NULL(find_document(collection, "broken"));
+
+    free_collection(collection);
+}
+
+/* Documents already in the collection are not loaded twice */
+void test_recover_collection_skips_existing_documents(void) {
+    Collection *collection = create_collection();
+    RecoveryOptions options = { .threads = 4, .progress_interval = 1, .progress = count_progress };
+
+    TEST_ASSERT_EQUAL_INT(2, recover_collection(collection, data_dir, &options, NULL));
+    TEST_ASSERT_EQUAL_INT(0, recover_collection(collection, data_dir, &options, NULL));
+    TEST_ASSERT_EQUAL_INT(2, collection->size);
+    TEST_ASSERT_TRUE(progress_calls > 0);
+
+    free_collection(collection);
+}
+
+/* With shards each document goes to the one owning its ID, whatever the threads loading it */
+void test_recover_shards_routes_documents(void) {
+    Collection *shards[3] = {create_collection(), create_collection(), create_collection()};
+    RecoveryOptions options = { .threads = 4 };
+    char name[32];
+    for (int i = 0; i < 30; i++) {
+        snprintf(name, sizeof(name), "doc%d.json", i);
+        write_file(name, "{}");
+    }
+
+    TEST_ASSERT_EQUAL_INT(32, recover_shards(shards, 3, data_dir, &options, NULL));
+    TEST_ASSERT_EQUAL_INT(32, shards[0]->size + shards[1]->size + shards[2]->size);
+    for (int i = 0; i < 30; i++) {
+        snprintf(name, sizeof(name), "doc%d", i);
+        int owner = document_shard(name, 3);
+        for (int shard = 0; shard < 3; shard++) {
+            if (shard == owner) TEST_ASSERT_NOT_NULL(find_document(shards[shard], name));
+            else TEST_ASSERT_NULL(find_document(shards[shard], name));
+        }
+    }
+    TEST_ASSERT_NOT_NULL(find_document(shards[document_shard("a", 3)], "a"));
+
+    for (int i = 0; i < 30; i++) {
+        snprintf(name, sizeof(name), "doc%d.json", i);
+        remove_file(name);
+    }
+    for (int shard = 0; shard < 3; shard++) free_collection(shards[shard]);
+}
+
+void test_recover_collection_missing_directory(void) {
+    Collection *collection = create_collection();
+    TEST_ASSERT_EQUAL_INT(-1, recover_collection(collection, "/nonexistent/fada", NULL, NULL));
+    free_collection(collection);
+}
+
+int main(void){
+    if (!mkdtemp(data_dir)) return 1;
+
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_recover_collection_loads_valid_documents);
+    RUN_TEST(test_recover_collection_skips_existing_documents);
+    RUN_TEST(test_recover_shards_routes_documents);
+    RUN_TEST(test_recover_collection_missing_directory);
+    printf("Tests completed...\n");
+
+    rmdir(data_dir);
+    return UNITY_END();
+}
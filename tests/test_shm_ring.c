@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unity.h"
+#include "../src/shm_ring.h"
+
+static ShmChannel *channel;
+
+void setUp(void) {
+    channel = create_shm_channel(SHM_RING_MIN_SIZE);
+}
+
+void tearDown(void) {
+    free_shm_channel(channel);
+}
+
+/* Bytes come out in the order they went in, across the end of the ring */
+void test_wraps_around(void) {
+    TEST_ASSERT_NOT_NULL(channel);
+    ShmRing *ring = &channel->requests;
+    char in[3000], out[3000];
+    for (int i = 0; i < 3000; i++) in[i] = (char)(i * 7);
+
+    for (int round = 0; round < 5; round++) {
+        TEST_ASSERT_EQUAL_UINT(3000, shm_ring_write(ring, in, sizeof(in)));
+        TEST_ASSERT_EQUAL_UINT(3000, shm_ring_readable(ring));
+        TEST_ASSERT_EQUAL_UINT(3000, shm_ring_read(ring, out, sizeof(out)));
+        TEST_ASSERT_EQUAL_MEMORY(in, out, sizeof(in));
+    }
+    TEST_ASSERT_EQUAL_UINT(0, shm_ring_read(ring, out, sizeof(out)));
+}
+
+/* A full ring takes what fits, the rest waits for the consumer */
+void test_partial_write(void) {
+    ShmRing *ring = &channel->responses;
+    char *data = calloc(1, SHM_RING_MIN_SIZE + 100);
+
+    TEST_ASSERT_EQUAL_UINT(SHM_RING_MIN_SIZE, shm_ring_write(ring, data, SHM_RING_MIN_SIZE + 100));
+    TEST_ASSERT_EQUAL_UINT(0, shm_ring_writable(ring));
+    TEST_ASSERT_EQUAL_UINT(0, shm_ring_write(ring, data, 1));
+
+    TEST_ASSERT_EQUAL_UINT(100, shm_ring_read(ring, data, 100));
+    TEST_ASSERT_EQUAL_UINT(100, shm_ring_write(ring, data, 200));
+    free(data);
+}
+
+/* A second mapping of the region, as the server has it, sees the same rings */
+void test_attach(void) {
+    ShmChannel *peer = attach_shm_channel(channel->fd);
+    TEST_ASSERT_NOT_NULL(peer);
+    TEST_ASSERT_EQUAL_UINT(SHM_RING_MIN_SIZE, peer->requests.capacity);
+
+    char out[6];
+    TEST_ASSERT_EQUAL_UINT(6, shm_ring_write(&channel->requests, "hello", 6));
+    TEST_ASSERT_EQUAL_UINT(6, shm_ring_read(&peer->requests, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_STRING("hello", out);
+    TEST_ASSERT_EQUAL_UINT(0, shm_ring_readable(&channel->requests));
+    free_shm_channel(peer);
+
+    // anything that isn't a channel region is refused
+    FILE *file = tmpfile();
+    fwrite(out, 1, sizeof(out), file);
+    fflush(file);
+    TEST_ASSERT_NULL(attach_shm_channel(fileno(file)));
+    fclose(file);
+}
+
+/* A sleeping consumer is woken once by the next write, a busy one never */
+void test_wakeups(void) {
+    ShmRing *ring = &channel->requests;
+    char byte = 'x';
+
+    TEST_ASSERT_EQUAL_UINT(1, shm_ring_write(ring, &byte, 1));
+    TEST_ASSERT_FALSE(shm_ring_wake_consumer(ring));
+    TEST_ASSERT_FALSE(shm_ring_arm_readable(ring)); // data is there, no sleeping
+
+    TEST_ASSERT_EQUAL_UINT(1, shm_ring_read(ring, &byte, 1));
+    TEST_ASSERT_TRUE(shm_ring_arm_readable(ring));
+    TEST_ASSERT_EQUAL_UINT(1, shm_ring_write(ring, &byte, 1));
+    TEST_ASSERT_TRUE(shm_ring_wake_consumer(ring));
+    TEST_ASSERT_FALSE(shm_ring_wake_consumer(ring));
+
+    // the same for a producer waiting for room
+    char *fill = calloc(1, SHM_RING_MIN_SIZE);
+    shm_ring_write(ring, fill, SHM_RING_MIN_SIZE);
+    TEST_ASSERT_TRUE(shm_ring_arm_writable(ring));
+    TEST_ASSERT_EQUAL_UINT(10, shm_ring_read(ring, fill, 10));
+    TEST_ASSERT_TRUE(shm_ring_wake_producer(ring));
+    TEST_ASSERT_FALSE(shm_ring_wake_producer(ring));
+    free(fill);
+}
+
+/* Indices corrupted by the peer make the ring look empty and full, never out of bounds */
+void test_corrupted_indices(void) {
+    ShmRing *ring = &channel->requests;
+    ring->shared->head = 1000000;
+    ring->shared->tail = 7;
+
+    char out[16];
+    TEST_ASSERT_EQUAL_UINT(0, shm_ring_readable(ring));
+    TEST_ASSERT_EQUAL_UINT(0, shm_ring_read(ring, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_UINT(0, shm_ring_write(ring, out, sizeof(out)));
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_wraps_around);
+    RUN_TEST(test_partial_write);
+    RUN_TEST(test_attach);
+    RUN_TEST(test_wakeups);
+    RUN_TEST(test_corrupted_indices);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "unity.h"
+#include "../src/spsc_queue.h"
+
+#define TRANSFERS 200000
+
+static SpscQueue *queue;
+
+void setUp(void) {
+    queue = create_spsc_queue(8);
+}
+
+void tearDown(void) {
+    free_spsc_queue(queue);
+}
+
+/* Items come out in the order they went in, across the end of the ring */
+void test_fifo(void) {
+    TEST_ASSERT_NOT_NULL(queue);
+    for (uintptr_t round = 0; round < 10; round++) {
+        for (uintptr_t i = 1; i <= 5; i++) TEST_ASSERT_TRUE(spsc_queue_push(queue, (void *)(round * 10 + i)));
+        TEST_ASSERT_EQUAL_UINT(5, spsc_queue_length(queue));
+        for (uintptr_t i = 1; i <= 5; i++) TEST_ASSERT_EQUAL_PTR((void *)(round * 10 + i), spsc_queue_pop(queue));
+    }
+    TEST_ASSERT_NULL(spsc_queue_pop(queue));
+}
+
+/* A full queue refuses items until the consumer makes room */
+void test_full(void) {
+    for (uintptr_t i = 1; i <= 8; i++) TEST_ASSERT_TRUE(spsc_queue_push(queue, (void *)i));
+    TEST_ASSERT_FALSE(spsc_queue_push(queue, (void *)9));
+
+    TEST_ASSERT_EQUAL_PTR((void *)1, spsc_queue_pop(queue));
+    TEST_ASSERT_TRUE(spsc_queue_push(queue, (void *)9));
+    TEST_ASSERT_FALSE(spsc_queue_push(queue, (void *)10));
+}
+
+/* The capacity is rounded up to a power of two */
+void test_capacity(void) {
+    SpscQueue *odd = create_spsc_queue(5);
+    int pushed = 0;
+    while (spsc_queue_push(odd, &pushed)) pushed++;
+    TEST_ASSERT_EQUAL_INT(8, pushed);
+    free_spsc_queue(odd);
+}
+
+static void *consume(void *arg) {
+    uintptr_t expected = 1, *errors = arg;
+    while (expected <= TRANSFERS) {
+        void *item = spsc_queue_pop(queue);
+        if (!item) {
+            sched_yield();
+            continue;
+        }
+        if ((uintptr_t)item != expected) (*errors)++;
+        expected++;
+    }
+    return NULL;
+}
+
+/* Another thread sees every item once and in order */
+void test_two_threads(void) {
+    uintptr_t errors = 0;
+    pthread_t consumer;
+
+    // room for many items, the two threads may share a single CPU
+    free_spsc_queue(queue);
+    queue = create_spsc_queue(1024);
+    pthread_create(&consumer, NULL, consume, &errors);
+
+    for (uintptr_t i = 1; i <= TRANSFERS; ) {
+        if (spsc_queue_push(queue, (void *)i)) i++;
+        else sched_yield();
+    }
+    pthread_join(consumer, NULL);
+    TEST_ASSERT_EQUAL_UINT(0, errors);
+    TEST_ASSERT_EQUAL_UINT(0, spsc_queue_length(queue));
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_fifo);
+    RUN_TEST(test_full);
+    RUN_TEST(test_capacity);
+    RUN_TEST(test_two_threads);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
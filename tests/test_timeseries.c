@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "unity.h"
+#include "../src/timeseries.h"
+
+#define SAMPLES 5000
+#define START 1700000000000LL
+
+static TimeSeriesCollection *tsc;
+static int64_t timestamps[SAMPLES];
+static double cpu[SAMPLES], mem[SAMPLES];
+
+static void insert_sample(const char *host, int64_t ts, double c, double m) {
+    char content[256];
+    snprintf(content, sizeof(content), "{\"ts\": %lld, \"host\": \"%s\", \"cpu\": %.17g, \"mem\": %.17g}",
+             (long long)ts, host, c, m);
+    TEST_ASSERT_TRUE(ts_insert(tsc, content, strlen(content)));
+}
+
+// one sample every 10 s with a little jitter, a slowly moving gauge and a counter
+static void fill(void) {
+    srand(42);
+    for (int i = 0; i < SAMPLES; i++) {
+        timestamps[i] = START + i * 10000LL + (i % 7 == 0 ? rand() % 50 : 0);
+        cpu[i] = (rand() % 1000) / 10.0;
+        mem[i] = 1024.0 + i / 16;
+        insert_sample("a", timestamps[i], cpu[i], mem[i]);
+    }
+}
+
+static int scanned;
+
+static bool check_sample(int64_t ts, const char *const *fields, const double *values, int count, void *arg) {
+    int i = *(int *)arg + scanned++;
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_INT64(timestamps[i], ts);
+    for (int f = 0; f < count; f++) {
+        double expected = strcmp(fields[f], "cpu") == 0 ? cpu[i] : mem[i];
+        TEST_ASSERT_TRUE(expected == values[f]); // bit exact
+    }
+    return true;
+}
+
+void setUp(void) {
+    tsc = open_timeseries_collection(NULL, "ts", "host", 0);
+    scanned = 0;
+}
+
+void tearDown(void) {
+    free_timeseries_collection(tsc);
+    remove("metrics" TS_SUFFIX);
+}
+
+/* Samples come back exactly as inserted, in time order, within the range asked */
+void test_scan_round_trip(void) {
+    fill();
+    insert_sample("b", START, 1, 2); // another series, never part of the scans of "a"
+
+    int first = 0;
+    TEST_ASSERT_EQUAL_UINT(SAMPLES, ts_scan(tsc, "a", START, START + SAMPLES * 10000LL, check_sample, &first));
+
+    scanned = 0;
+    first = 1000;
+    TEST_ASSERT_EQUAL_UINT(500, ts_scan(tsc, "a", timestamps[1000], timestamps[1500], check_sample, &first));
+    TEST_ASSERT_EQUAL_UINT(0, ts_scan(tsc, "missing", START, START + 1, check_sample, &first));
+    TEST_ASSERT_EQUAL_UINT(2, tsc->series_count);
+}
+
+static bool check_sample_last(int64_t ts, const char *const *fields, const double *values, int count,
+                              void *arg) {
+    (void)count;
+    (void)arg;
+    TEST_ASSERT_EQUAL_INT64(START + SAMPLES * 10000LL, ts);
+    TEST_ASSERT_TRUE(values[0] == (strcmp(fields[0], "cpu") == 0 ? 3.25 : 99));
+    return true;
+}
+
+static double results[1024];
+static size_t counts[1024];
+static int windows;
+
+static void collect_window(int64_t start, double value, size_t count, void *arg) {
+    (void)start;
+    (void)arg;
+    results[windows] = value;
+    counts[windows] = count;
+    windows++;
+}
+
+/* Downsampled aggregates match a plain computation over the raw samples */
+void test_downsample(void) {
+    fill();
+
+    TsAggregate aggregates[] = {TS_COUNT, TS_SUM, TS_MIN, TS_MAX, TS_AVG};
+    int64_t intervals[] = {60000, 3600000, 86400000}; // inside, equal to and larger than a bucket
+    for (int a = 0; a < 5; a++) {
+        for (int n = 0; n < 3; n++) {
+            int64_t from = START + 123456, to = START + 40000000, interval = intervals[n];
+            windows = 0;
+            TEST_ASSERT_TRUE(ts_downsample(tsc, "a", "cpu", from, to, interval, aggregates[a], collect_window, NULL));
+
+            int w = -1;
+            int64_t current = -1;
+            double min = 0, max = 0, sum = 0;
+            size_t count = 0;
+            for (int i = 0; i <= SAMPLES; i++) {
+                bool in = i < SAMPLES && timestamps[i] >= from && timestamps[i] < to;
+                int64_t window = in ? timestamps[i] / interval : -2;
+                if ((window != current || i == SAMPLES) && count > 0) {
+                    double expected = aggregates[a] == TS_COUNT ? count : aggregates[a] == TS_SUM ? sum :
+                                      aggregates[a] == TS_MIN ? min : aggregates[a] == TS_MAX ? max : sum / count;
+                    w++;
+                    TEST_ASSERT_EQUAL_UINT(count, counts[w]);
+                    TEST_ASSERT_TRUE(fabs(expected - results[w]) < 1e-6);
+                    count = 0;
+                    sum = 0;
+                }
+                if (!in) continue;
+                if (count == 0 || cpu[i] < min) min = cpu[i];
+                if (count == 0 || cpu[i] > max) max = cpu[i];
+                sum += cpu[i];
+                count++;
+                current = window;
+            }
+            TEST_ASSERT_EQUAL_INT(w + 1, windows);
+        }
+    }
+
+    TEST_ASSERT_FALSE(ts_downsample(tsc, "a", "cpu", START, START + 1, 0, TS_AVG, collect_window, NULL));
+}
+
+void test_invalid_samples_are_refused(void) {
+    const char *invalid[] = {
+        "{\"host\": \"a\", \"cpu\": 1}",                     // no timestamp
+        "{\"ts\": 1.5, \"cpu\": 1}",                         // timestamps are integers
+        "{\"ts\": 1, \"cpu\": \"high\"}",                    // only numbers besides the series key
+        "{\"ts\": 1, \"cpu\": true}",
+        "{\"ts\": 1, \"cpu\": {\"user\": 1}}",               // flat documents
+        "[1, 2]",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        TEST_ASSERT_FALSE(ts_insert(tsc, invalid[i], strlen(invalid[i])));
+    }
+    TEST_ASSERT_EQUAL_UINT(0, tsc->samples);
+
+    // samples with other fields go in their own bucket
+    insert_sample("a", START, 1, 2);
+    TEST_ASSERT_TRUE(ts_insert(tsc, "{\"ts\": 1700000000001, \"host\": \"a\", \"disk\": 7}", 48));
+    TEST_ASSERT_EQUAL_UINT(2, tsc->samples);
+}
+
+/* Metrics take a few bytes per sample, a Document takes hundreds */
+void test_compression(void) {
+    fill();
+    double bytes_per_sample = (double)ts_memory_usage(tsc) / SAMPLES;
+    TEST_ASSERT_TRUE(bytes_per_sample < 16); // random cpu values take most of it
+
+}
+
+void test_save_and_reopen(void) {
+    free_timeseries_collection(tsc);
+    tsc = open_timeseries_collection("metrics", "ts", "host", 0);
+    fill();
+    TEST_ASSERT_TRUE(ts_save(tsc));
+    free_timeseries_collection(tsc);
+
+    tsc = open_timeseries_collection("metrics", "ts", "host", 0);
+    TEST_ASSERT_NOT_NULL(tsc);
+    TEST_ASSERT_EQUAL_UINT(SAMPLES, tsc->samples);
+    int first = 0;
+    TEST_ASSERT_EQUAL_UINT(SAMPLES, ts_scan(tsc, "a", START, START + SAMPLES * 10000LL, check_sample, &first));
+
+    // the encoders carry on where they stopped
+    insert_sample("a", START + SAMPLES * 10000LL, 3.25, 99);
+    TEST_ASSERT_EQUAL_UINT(1, ts_scan(tsc, "a", START + SAMPLES * 10000LL, START + SAMPLES * 10001LL,
+                                      check_sample_last, NULL));
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_scan_round_trip);
+    RUN_TEST(test_downsample);
+    RUN_TEST(test_invalid_samples_are_refused);
+    RUN_TEST(test_compression);
+    RUN_TEST(test_save_and_reopen);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
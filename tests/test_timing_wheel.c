@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "../src/timing_wheel.h"
+
+static TimingWheel *wheel;
+static TimerNode timers[1000];
+
+void setUp(void) {
+    memset(timers, 0, sizeof(timers));
+    wheel = create_timing_wheel(1000);
+}
+
+void tearDown(void) {
+    free_timing_wheel(wheel);
+}
+
+// advances one tick at a time and checks each timer fires exactly on its tick
+static void assert_fires_on_time(size_t count, uint64_t horizon) {
+    size_t fired = 0;
+    for (uint64_t now = wheel->now + 1; fired < count && now <= horizon; now = wheel->now + 1) {
+        timing_wheel_advance(wheel, now);
+        TimerNode *timer;
+        while ((timer = timing_wheel_pop(wheel)) != NULL) {
+            TEST_ASSERT_EQUAL_UINT64(timer->expires, now);
+            fired++;
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT(count, fired);
+    TEST_ASSERT_EQUAL_UINT(0, wheel->count);
+}
+
+/* Timers spread over the first three levels cascade down and fire on their tick */
+void test_timers_fire_on_their_tick(void) {
+    srand(7);
+    for (int i = 0; i < 1000; i++) {
+        uint64_t distance = 1 + (i % 3 == 0 ? rand() % 255 : i % 3 == 1 ? rand() % 65535 : rand() % 300000);
+        timing_wheel_add(wheel, &timers[i], wheel->now + distance);
+    }
+    TEST_ASSERT_EQUAL_UINT(1000, wheel->count);
+    assert_fires_on_time(1000, wheel->now + 300001);
+}
+
+void test_cancelled_timers_never_fire(void) {
+    for (int i = 0; i < 100; i++) timing_wheel_add(wheel, &timers[i], wheel->now + 10 + i * 700);
+    for (int i = 0; i < 100; i += 2) timing_wheel_cancel(wheel, &timers[i]);
+    TEST_ASSERT_FALSE(timing_wheel_pending(&timers[0]));
+    TEST_ASSERT_TRUE(timing_wheel_pending(&timers[1]));
+
+    // rescheduling moves a timer, it fires once at its new time
+    timing_wheel_add(wheel, &timers[1], wheel->now + 5);
+    TEST_ASSERT_EQUAL_UINT(50, timing_wheel_advance(wheel, wheel->now + 100 * 700));
+    TEST_ASSERT_EQUAL_UINT(0, wheel->count);
+}
+
+/* A jump forward fires everything on the way, past expiry times fire at once */
+void test_advance_and_past_timers(void) {
+    timing_wheel_add(wheel, &timers[0], 10);
+    TEST_ASSERT_EQUAL_UINT(1, wheel->due);
+    TEST_ASSERT_EQUAL_PTR(&timers[0], timing_wheel_pop(wheel));
+
+    timing_wheel_add(wheel, &timers[1], wheel->now + 1000000);
+    timing_wheel_add(wheel, &timers[2], wheel->now + 3);
+    TEST_ASSERT_EQUAL_UINT(1, timing_wheel_advance(wheel, wheel->now + 500));
+    TEST_ASSERT_EQUAL_PTR(&timers[2], timing_wheel_pop(wheel));
+    TEST_ASSERT_NULL(timing_wheel_pop(wheel));
+
+    // expired timers can still be cancelled before they are popped
+    TEST_ASSERT_EQUAL_UINT(1, timing_wheel_advance(wheel, timers[1].expires));
+    timing_wheel_cancel(wheel, &timers[1]);
+    TEST_ASSERT_EQUAL_UINT(0, wheel->due);
+    TEST_ASSERT_NULL(timing_wheel_pop(wheel));
+}
+
+/* Timers beyond the range of the wheel are parked and re-added until they are due */
+void test_far_timers(void) {
+    uint64_t far = wheel->now + (1ULL << 33);
+    timing_wheel_add(wheel, &timers[0], far);
+    TEST_ASSERT_EQUAL_UINT(0, timing_wheel_advance(wheel, far - 1));
+    TEST_ASSERT_EQUAL_UINT(1, timing_wheel_advance(wheel, far));
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_timers_fire_on_their_tick);
+    RUN_TEST(test_cancelled_timers_never_fire);
+    RUN_TEST(test_advance_and_past_timers);
+    RUN_TEST(test_far_timers);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/transfer.h"
+
+static int sockets[2];
+
+typedef struct {
+    char *data;
+    size_t length;
+} Received;
+
+// reads the other end of the socket pair until it's closed
+static void *receive_all(void *arg) {
+    Received *received = arg;
+    size_t capacity = 1 << 16;
+    received->data = malloc(capacity);
+    received->length = 0;
+
+    ssize_t n;
+    while ((n = read(sockets[1], received->data + received->length, capacity - received->length - 1)) > 0) {
+        received->length += n;
+        if (capacity - received->length < 4096) {
+            capacity *= 2;
+            received->data = realloc(received->data, capacity);
+        }
+    }
+    received->data[received->length] = '\0';
+    return NULL;
+}
+
+static Received send_and_receive(const char *id, bool *sent) {
+    Received received;
+    pthread_t reader;
+    pthread_create(&reader, NULL, receive_all, &received);
+
+    *sent = send_document(sockets[0], id);
+    close(sockets[0]);
+
+    pthread_join(reader, NULL);
+    return received;
+}
+
+void setUp(void) {
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+}
+
+void tearDown(void) {
+    close(sockets[1]);
+    delete_document("transfer_small");
+    delete_document("transfer_big");
+}
+
+void test_small_document_is_buffered(void) {
+    update_document("transfer_small", "{\"a\": 1}");
+
+    DocumentTransfer transfer;
+    TEST_ASSERT_TRUE(start_document_transfer(&transfer, "transfer_small", TRANSFER_ZERO_COPY_THRESHOLD));
+    TEST_ASSERT_FALSE(transfer.zero_copy);
+    end_document_transfer(&transfer);
+
+    bool sent;
+    Received received = send_and_receive("transfer_small", &sent);
+    TEST_ASSERT_TRUE(sent);
+    TEST_ASSERT_EQUAL_STRING("OK 8\n{\"a\": 1}", received.data);
+    free(received.data);
+}
+
+/* Big documents go from the file to the socket with sendfile, bigger than the socket buffers */
+void test_big_document_is_zero_copy(void) {
+    size_t size = 4 << 20;
+    char *content = malloc(size + 1);
+    memset(content, ' ', size);
+    content[0] = '[';
+    content[size - 1] = ']';
+    content[size] = '\0';
+    update_document("transfer_big", content);
+
+    DocumentTransfer transfer;
+    TEST_ASSERT_TRUE(start_document_transfer(&transfer, "transfer_big", TRANSFER_ZERO_COPY_THRESHOLD));
+    TEST_ASSERT_TRUE(transfer.zero_copy);
+    TEST_ASSERT_NULL(transfer.buffer);
+    end_document_transfer(&transfer);
+
+    bool sent;
+    Received received = send_and_receive("transfer_big", &sent);
+    TEST_ASSERT_TRUE(sent);
+
+    char header[32];
+    int header_length = sprintf(header, "OK %zu\n", size);
+    TEST_ASSERT_EQUAL_UINT(header_length + size, received.length);
+    TEST_ASSERT_EQUAL_MEMORY(header, received.data, header_length);
+    TEST_ASSERT_EQUAL_MEMORY(content, received.data + header_length, size);
+
+    free(received.data);
+    free(content);
+}
+
+void test_missing_document(void) {
+    bool sent;
+    Received received = send_and_receive("transfer_missing", &sent);
+    TEST_ASSERT_TRUE(sent);
+    TEST_ASSERT_EQUAL_STRING("ERR not found\n", received.data);
+    free(received.data);
+
+    DocumentTransfer transfer;
+    TEST_ASSERT_FALSE(start_document_transfer(&transfer, "../etc/passwd", 0));
+    end_document_transfer(&transfer);
+}
+
+static void transfer_done(DocumentTransfer *transfer, bool found, void *arg) {
+    (void)transfer;
+    *(int *)arg = found;
+}
+
+/* Small documents can be read through an engine, big ones are left to the zero copy path */
+void test_transfer_through_engine(void) {
+    IOEngine *engine = io_engine_create(NULL);
+    TEST_ASSERT_NOT_NULL(engine);
+    update_document("transfer_small", "{\"a\": 1}");
+
+    DocumentTransfer transfer;
+    int found = -1;
+    TEST_ASSERT_TRUE(start_document_transfer_async(engine, &transfer, "transfer_small", TRANSFER_ZERO_COPY_THRESHOLD,
+                                                   transfer_done, &found));
+    TEST_ASSERT_EQUAL_INT(-1, found); // never completed before a poll
+    while (found < 0) io_engine_poll(engine, 1);
+
+    TEST_ASSERT_EQUAL_INT(1, found);
+    TEST_ASSERT_FALSE(transfer.zero_copy);
+    TEST_ASSERT_EQUAL_STRING("OK 8\n", transfer.header);
+    TEST_ASSERT_EQUAL_MEMORY("{\"a\": 1}", transfer.buffer, transfer.length);
+    end_document_transfer(&transfer);
+
+    TEST_ASSERT_FALSE(start_document_transfer_async(engine, &transfer, "transfer_small", 4, transfer_done, &found));
+    TEST_ASSERT_FALSE(start_document_transfer_async(engine, &transfer, "transfer_missing", TRANSFER_ZERO_COPY_THRESHOLD,
+                                                    transfer_done, &found));
+    TEST_ASSERT_FALSE(start_document_transfer_async(engine, &transfer, "../etc/passwd", TRANSFER_ZERO_COPY_THRESHOLD,
+                                                    transfer_done, &found));
+    io_engine_destroy(engine);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_small_document_is_buffered);
+    RUN_TEST(test_big_document_is_zero_copy);
+    RUN_TEST(test_missing_document);
+    RUN_TEST(test_transfer_through_engine);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unity.h"
+#include "../src/db_manager.h"
+#include "../src/write_buffer.h"
+
+static WriteBuffer *buffer;
+
+// what is on disk, bypassing the write buffer
+static char *read_file(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) return NULL;
+
+    char *content = calloc(1, 256);
+    size_t n = fread(content, 1, 255, file);
+    content[n] = '\0';
+    fclose(file);
+    return content;
+}
+
+static void assert_file(const char *expected) {
+    char *content = read_file("hot.json");
+    if (expected == NULL) {
+        TEST_ASSERT_NULL(content);
+        return;
+    }
+    TEST_ASSERT_EQUAL_STRING(expected, content);
+    free(content);
+}
+
+void setUp(void) {
+    buffer = create_write_buffer(60000); // the flusher never runs on its own during a test
+    use_write_buffer(buffer);
+}
+
+void tearDown(void) {
+    use_write_buffer(NULL);
+    free_write_buffer(buffer);
+    remove("hot.json");
+}
+
+/* Successive updates stay in memory, reads see the newest, one write reaches the disk */
+void test_updates_are_coalesced(void) {
+    char content[64];
+    for (int i = 0; i < 100; i++) {
+        sprintf(content, "{\"n\": %d}", i);
+        TEST_ASSERT_TRUE(update_document("hot", content));
+    }
+
+    assert_file(NULL);
+    char *read = read_document("hot");
+    TEST_ASSERT_EQUAL_STRING("{\"n\": 99}", read);
+    free(read);
+
+    write_buffer_flush(buffer);
+    assert_file("{\"n\": 99}");
+
+    WriteBufferStats stats = write_buffer_stats(buffer);
+    TEST_ASSERT_EQUAL_UINT(100, stats.updates);
+    TEST_ASSERT_EQUAL_UINT(99, stats.coalesced);
+    TEST_ASSERT_EQUAL_UINT(1, stats.flushed);
+    TEST_ASSERT_EQUAL_UINT(0, stats.pending);
+}
+
+void test_flusher_writes_within_the_window(void) {
+    use_write_buffer(NULL);
+    free_write_buffer(buffer);
+    buffer = create_write_buffer(10);
+    use_write_buffer(buffer);
+
+    update_document("hot", "{\"a\": 1}");
+    for (int i = 0; i < 100 && write_buffer_stats(buffer).pending > 0; i++) usleep(10000);
+
+    TEST_ASSERT_EQUAL_UINT(0, write_buffer_stats(buffer).pending);
+    assert_file("{\"a\": 1}");
+}
+
+/* A durable write reaches the disk at once, the older pending image is dropped */
+void test_durable_writes_bypass_the_buffer(void) {
+    update_document("hot", "{\"v\": \"buffered\"}");
+    TEST_ASSERT_TRUE(update_document_durable("hot", "{\"v\": \"durable\"}"));
+    assert_file("{\"v\": \"durable\"}");
+
+    write_buffer_flush(buffer);
+    assert_file("{\"v\": \"durable\"}");
+    TEST_ASSERT_EQUAL_UINT(1, write_buffer_stats(buffer).durable);
+}
+
+void test_delete_discards_the_pending_image(void) {
+    update_document("hot", "{}");
+    TEST_ASSERT_TRUE(has_pending_update("hot"));
+
+    delete_document("hot");
+    TEST_ASSERT_FALSE(has_pending_update("hot"));
+    TEST_ASSERT_NULL(read_document("hot"));
+
+    write_buffer_flush(buffer);
+    assert_file(NULL);
+}
+
+/* A range of a document comes from the pending image, not from the older file */
+void test_range_reads_see_the_pending_image(void) {
+    TEST_ASSERT_TRUE(store_document("hot", "{\"n\": 1}", 8, false));
+    TEST_ASSERT_TRUE(update_document("hot", "{\"n\": 2345}"));
+
+    size_t read;
+    char *range = read_document_range("hot", 6, 10, &read);
+    TEST_ASSERT_EQUAL_STRING("2345}", range);
+    TEST_ASSERT_EQUAL_UINT(5, read);
+    free(range);
+
+    range = read_document_range("hot", 40, 4, &read);
+    TEST_ASSERT_EQUAL_STRING("", range);
+    TEST_ASSERT_EQUAL_UINT(0, read);
+    free(range);
+}
+
+int main(void){
+    printf("Starting tests...\n");
+    UNITY_BEGIN();
+    RUN_TEST(test_updates_are_coalesced);
+    RUN_TEST(test_flusher_writes_within_the_window);
+    RUN_TEST(test_durable_writes_bypass_the_buffer);
+    RUN_TEST(test_delete_discards_the_pending_image);
+    RUN_TEST(test_range_reads_see_the_pending_image);
+    printf("Tests completed...\n");
+    return UNITY_END();
+}